@@ -0,0 +1,94 @@
+/*
+    Bus record
+
+    ROM_dumper_16MB --record <file> writes its bus trace in this compact form
+    so a failure seen on one rig can be replayed against a reference image
+    elsewhere (TEST_ROM_dumper_16MB --replay <file> <image.z64>).
+
+    Layout:
+      struct BusRecordHeader
+      eventCount events, each the nanoseconds since the previous event as an
+      unsigned LEB128 varint, then the bus state after the transition as 3
+      little-endian bytes of BUS_STATE_* bits
+
+    The state is independent of the board's pin map: AD0-AD15 as a word, then
+    one bit per control line at its level on the cart connector.
+*/
+
+#ifndef ROM_BUS_RECORD_H
+#define ROM_BUS_RECORD_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BUS_RECORD_MAGIC "N64BUSRC"
+#define BUS_RECORD_VERSION 1
+#define BUS_RECORD_EVENT_MAX 13 // Longest encoded event: 10-byte varint + state
+
+#define BUS_STATE_AD 0xFFFF
+#define BUS_STATE_ALE_L (1u << 16)
+#define BUS_STATE_ALE_H (1u << 17)
+#define BUS_STATE_READ (1u << 18)
+#define BUS_STATE_WRITE (1u << 19)
+#define BUS_STATE_RESET (1u << 20)
+#define BUS_STATE_DRIVEN (1u << 21) // The Pi drives AD, otherwise the cart does
+#define BUS_STATE_SAMPLE (1u << 22) // The Pi sampled AD in this event
+
+struct BusRecordHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t eventCount;
+  uint64_t firstEvent; // Events the trace ring overwrote before the first one kept
+  uint64_t startNanoseconds; // Time of the first event since tracing began
+  uint32_t latchNs; // Bus timing the dump ran with
+  uint32_t strobeNs;
+  uint32_t recoveryNs;
+  char backend[12];
+};
+
+// Encodes one event. Returns the end of the encoded bytes.
+static inline uint8_t* BusRecordPutEvent(uint8_t* out, uint64_t delta, uint32_t state)
+{
+  do
+  {
+    *out++ = (delta & 0x7F) | ((delta > 0x7F) ? 0x80 : 0);
+    delta >>= 7;
+  }
+  while(delta != 0);
+
+  *out++ = state;
+  *out++ = state >> 8;
+  *out++ = state >> 16;
+  return out;
+}
+
+// Decodes one event. Returns the next event, or NULL when it is truncated.
+static inline const uint8_t* BusRecordGetEvent(const uint8_t* in, const uint8_t* end, uint64_t* delta, uint32_t* state)
+{
+  *delta = 0;
+  for(unsigned shift = 0;
+      ;
+      shift += 7)
+  {
+    if(in == end || shift > 63)
+    {
+      return NULL;
+    }
+    uint8_t byte = *in++;
+    *delta |= (uint64_t)(byte & 0x7F) << shift;
+    if(!(byte & 0x80))
+    {
+      break;
+    }
+  }
+
+  if(end - in < 3)
+  {
+    return NULL;
+  }
+  *state = in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16;
+  return in + 3;
+}
+
+#endif
@@ -39,27 +39,310 @@
 /* 
     *** TODO ***
     * Error handling
-    * Map pin #defines to raspberry pi breadboard layout
-    * Implement Bank-switching/Memory mapping to read > 16Mb
-    * Dynamic cartridge addressing to dump valid memory only
+    * Read EEPROM saves (needs the serial/joybus lines wired)
 */
 
+/*
+    *** Usage ***
+    ROM_dumper_16MB                                 Plan the dump from the header and print the ROM
+                                                    (and SRAM/FlashRAM save) as text to stdout
+        --output <rom.z64>                          Write a binary image instead of text
+        --skip-self-test                            Dump without the bus self-test (see --self-test)
+        --verify-reads                              Read every page until two reads agree (up to 8
+                                                    retries); pages that never agree fail the dump
+        --majority <reads>                          Verify reads, and rebuild pages that never agree
+                                                    by bitwise majority over this many reads (odd,
+                                                    9-15, the 9 verify reads included), reporting
+                                                    how often each AD line lost the vote
+        --access-profile <dir>                      Dump the pages an emulator touched first on earlier
+                                                    runs of this title (profiles from ROM_mapping.h,
+                                                    keyed by header CRC) before the rest, printing
+                                                    "boot-ready <pages>" and "progress <done> <total>"
+                                                    lines on stdout as the image fills in
+        --shared <name>                             Publish the image as it is read into the shared
+                                                    memory object /dev/shm/<name>, with a per-page
+                                                    ready bitmap consumers can wait on (layout in
+                                                    ROM_shared_image.h); also works with --mount.
+                                                    Without --output no text is printed
+        --save-output <file>                        Save destination (default <rom.z64>.sra/.fla)
+        --pins <board.cfg>                          GPIO assignment for this board revision: lines of
+                                                    "<signal> <gpio>" for AD0-AD15, ALE_L, ALE_H, READ,
+                                                    WRITE and RESET ('#' starts a comment); unlisted
+                                                    signals keep the defaults above
+        --adaptive-timing                           Verify reads, and keep a bus timing per 1 Mb ROM
+                                                    region: 32 clean pages in a row shorten it by 5%
+                                                    of the base timing (down to 10%), a page that
+                                                    needs a retry lengthens it by 20% and is read
+                                                    again; the settled timings are reported
+        --recalibrate <pages>                       Hold ROM pages back in windows of <pages> (8 to
+                                                    8192, e.g. 256) and re-read the header and IPL3
+                                                    after each; when they no longer match the copy
+                                                    read before the dump, lengthen the timing by 25%
+                                                    and read the window again (up to 4 times, then
+                                                    the dump fails). When they read all ones or all
+                                                    zeros the cart has hung instead: RESET is pulsed
+                                                    and the window read again. Not used by --mount
+        --trace <bus.vcd>                           Record every control and AD transition the Pi
+                                                    drives or samples, timestamped, into a ring of
+                                                    the most recent BUS_TRACE_EVENTS and write it as
+                                                    a VCD (GTKWave) on exit; wave backend strobes
+                                                    come from its DMA samples, SMI bursts are not seen
+        --record <bus.ntr>                          Write the same trace as a compact bus record
+                                                    (ROM_bus_record.h, about 4 bytes a transition)
+                                                    for replay against a reference image with
+                                                    TEST_ROM_dumper_16MB --replay
+        --trace-range <address> <length>            Only trace or record pages in this bus address
+                                                    range (hex, e.g. 10400000 8000); SIGUSR1 pauses
+                                                    and resumes tracing at the next page
+        --backend <bitbang|wave|smi>                How bus cycles are driven (default bitbang):
+                                                    wave pre-builds each page's READ strobes as a
+                                                    pigpio wave and samples the AD lines by DMA;
+                                                    smi runs 16-bit parallel reads on the Secondary
+                                                    Memory Interface (needs AD0-AD15 on GPIO8-23,
+                                                    READ on GPIO6)
+    ROM_dumper_16MB --self-test                     Only run the bus self-test every dump starts with:
+                                                    the header page must read the same twice, start
+                                                    with the .z64 magic and move every AD line both
+                                                    ways, and walking a one and a zero through the
+                                                    address bits must read the expected words and
+                                                    never alias pages; faulty lines are named with
+                                                    their GPIO and cart pin
+    ROM_dumper_16MB --daemon <dir>                  Stay running with the GPIO set up and dump every
+                                                    cart inserted: once its header reads the .z64
+                                                    magic twice in a row, self-test the bus, plan and
+                                                    dump it with the dump options above, then file it
+                                                    in <dir> as <DAT title>.z64 (by SHA-1) or <header
+                                                    name>-<CRC1>.z64, plus its save, and append
+                                                    "<sha1> <crc32> <size> <cic> <state> <file>" to
+                                                    <dir>/manifest.txt (file "-" for a cart that
+                                                    failed its self-test). Hashing and filing run on a
+                                                    thread while the next cart dumps; SIGINT or
+                                                    SIGTERM stop after the cart in the slot
+    ROM_dumper_16MB --verify-against <image.z64>    Compare the cart against a known-good image,
+                                                    stopping at the first mismatching word
+        --exhaustive                                Report every mismatching range instead
+    ROM_dumper_16MB --mount <dir>                   Serve the cart read-only as <dir>/rom.z64 (plus
+                                                    save.sra/save.fla) without waiting for a dump:
+                                                    reads fetch their pages plus a read-ahead window
+                                                    that grows while access stays sequential, and a
+                                                    background thread fills in the rest of the image
+                                                    (build with -DWITH_FUSE and libfuse3); emulators
+                                                    can map rom.z64 page by page with ROM_mapping.h
+        --output <rom.z64>                          Also write the image once it is complete
+    ROM_dumper_16MB --identify <library.fpi>        Fingerprint the cart from sampled pages and
+                                                    look it up in a dump library index
+    ROM_dumper_16MB --verify-header                 Read the header page twice and check it is stable
+                                                    and starts with the .z64 magic; print the header
+                                                    name, game code and CRCs, and the DAT index entry.
+                                                    Like --identify and --self-test on the bitbang
+                                                    backend, it skips pigpio's DMA setup and drives
+                                                    the pins through /dev/gpiomem, returning in
+                                                    milliseconds (pigpio is used when it's missing)
+    ROM_dumper_16MB --build-index <library.fpi> <dump.z64>...
+                                                    Build a library index from existing dumps
+                                                    (no cart access)
+    ROM_dumper_16MB --compile-dat <n64.ndi> <dat.xml>...
+                                                    Compile No-Intro DATs into a perfect-hash index
+                                                    (no cart access)
+    ROM_dumper_16MB --dat-lookup <crc32|md5|sha1>   Look a hash up in the DAT index (no cart access)
+        --dat-index <n64.ndi>                       DAT index to map at startup (default ./n64.ndi,
+                                                    skipped silently when missing)
+
+    Exit status: 0 on success/match, 1 on error, 2 when verification finds a mismatch,
+    3 when identify finds no library entry.
+*/
+
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 #include <pigpio.h>
+#include "ROM_shared_image.h"
+#include "ROM_bus_record.h"
+#ifdef WITH_FUSE
+#define FUSE_USE_VERSION 31
+#include <fuse.h>
+#endif
 
-// GPIO pins
+// Default GPIO pins (the table above); --pins loads a board-specific map
 #define AD_BUS 2 
-#define ALE_L 18 
-#define ALE_H 19 
-#define READ 20 
-#define WRITE 21 
-#define RESET 22
+#define DEFAULT_ALE_L 18 
+#define DEFAULT_ALE_H 19 
+#define DEFAULT_READ 20 
+#define DEFAULT_WRITE 21 
+#define DEFAULT_RESET 22
+
+// Active GPIO pins
+#define AD_PIN(bit) (pinMap.ad[bit])
+#define ALE_L (pinMap.aleLow)
+#define ALE_H (pinMap.aleHigh)
+#define READ (pinMap.read)
+#define WRITE (pinMap.write)
+#define RESET (pinMap.reset)
+
+#define MAX_GPIO 27
+
+// GPIO registers as mapped from /dev/gpiomem, byte offsets. pigpio's PI_INPUT,
+// PI_OUTPUT and PI_ALT0-5 are the hardware function select codes.
+#define GPIO_MEM_SIZE 0x1000
+#define GPIO_FSEL 0x00 // 3 bits per GPIO, 10 GPIOs per register
+#define GPIO_SET 0x1C
+#define GPIO_CLR 0x28
+#define GPIO_LEV 0x34
 
 #define LOW 0
 #define HIGH 1
 
 #define MAX_ROM_SIZE 0x4000000 // 64 Mb
 #define ROM_BANK_SIZE 0x1000000 // 16 Mb
+#define PROBE_STEP 0x100000 // 1 Mb, ROM size granularity when probing
+
+// Cart address space as seen on the AD bus (PI domains 1 and 2)
+#define CART_ROM_BASE 0x10000000
+#define CART_SRAM_BASE 0x08000000
+#define SRAM_BANK_SIZE 0x8000 // 256 Kbit
+#define SRAM_BANK_STRIDE 0x40000
+#define FLASH_SIZE 0x20000 // 1 Mbit
+#define FLASH_COMMAND_ADDRESS 0x08010000
+
+#define WAVE_SAMPLE_US 1 // DMA sampling period of the wave backend
+#define WAVE_TIMEOUT_US 100000
+
+// Secondary Memory Interface (SMI) registers, offsets from the peripheral base
+#define SMI_PERIPHERAL_BUS_BASE 0x7E000000
+#define SMI_DEFAULT_PERIPHERAL_BASE 0x3F000000
+#define SMI_OFFSET 0x600000
+#define SMI_CS 0x00
+#define SMI_L 0x04
+#define SMI_A 0x08
+#define SMI_D 0x0C
+#define SMI_DSR0 0x10
+#define SMI_DMC 0x30
+#define SMI_CS_ENABLE (1 << 0)
+#define SMI_CS_DONE (1 << 1)
+#define SMI_CS_START (1 << 3)
+#define SMI_CS_CLEAR (1 << 4)
+#define SMI_CS_PXLDAT (1 << 14) // Pack two 16-bit transfers per FIFO word
+#define SMI_CS_RXD (1u << 29)
+#define SMI_DSR_STROBE_SHIFT 0
+#define SMI_DSR_HOLD_SHIFT 16
+#define SMI_DSR_SETUP_SHIFT 24
+#define SMI_DSR_WIDTH_SHIFT 30
+#define SMI_DSR_WIDTH_16 1
+#define SMI_DSR_STROBE_MAX 127
+#define SMI_DSR_HOLD_MAX 63
+#define SMI_DMC_DMAEN (1 << 28)
+#define SMI_DMC_REQR 2
+#define SMI_DMC_PANICR 8
+#define SMI_SD0_GPIO 8 // SD0-SD17 are fixed to GPIO8-25
+#define SMI_SOE_GPIO 6 // Read strobe
+#define SMI_CLOCK_NS 10 // SMI clock period
+#define SMI_READ_SETUP 2
+#define SMI_POLL_LIMIT 1000000
+#define SMI_TIMEOUT_US 100000
+
+// Clock manager, DMA controller and VideoCore mailbox used by the SMI backend
+#define CLOCK_OFFSET 0x101000
+#define CLOCK_SMI_CTL 0xB0
+#define CLOCK_SMI_DIV 0xB4
+#define CLOCK_PASSWORD 0x5A000000
+#define CLOCK_SOURCE_PLLD 6
+#define DMA_OFFSET 0x007000
+#define DMA_CS 0x00
+#define DMA_CONBLK_AD 0x04
+#define DMA_CS_ACTIVE (1 << 0)
+#define DMA_CS_END (1 << 1)
+#define DMA_CS_INT (1 << 2)
+#define DMA_CS_PRIORITY(level) ((level) << 16)
+#define DMA_CS_WAIT_WRITES (1 << 28)
+#define DMA_CS_RESET (1u << 31)
+#define DMA_TI_WAIT_RESP (1 << 3)
+#define DMA_TI_DEST_INC (1 << 4)
+#define DMA_TI_SRC_DREQ (1 << 10)
+#define DMA_TI_PERMAP(peripheral) ((peripheral) << 16)
+#define DMA_PERMAP_SMI 4
+#define SMI_DMA_CHANNEL 10
+#define SMI_DMA_BUFFER_SIZE 0x1000
+#define SMI_DMA_DATA_OFFSET 0x100 // Burst data follows the control block
+#define MAILBOX_ALLOCATE 0x3000C
+#define MAILBOX_LOCK 0x3000D
+#define MAILBOX_UNLOCK 0x3000E
+#define MAILBOX_RELEASE 0x3000F
+#define MAILBOX_MEM_DIRECT 0x4 // Uncached alias
+#define ROM_PAGE_SIZE 0x200 // 512 bytes, the cart auto-increments its address within a page
+#define PAGE_WORDS (ROM_PAGE_SIZE / 2)
+
+#define Z64_MAGIC 0x80371240 // First word of a big-endian (.z64) image
+
+// Header CRC1/CRC2 (0x10-0x17) cover 1 Mb after the IPL3 boot code, computed
+// with a seed (and for 6103/6105/6106 a variant) chosen by the cart's CIC
+#define CHECKSUM_START 0x1000
+#define CHECKSUM_LENGTH 0x100000
+#define CHECKSUM_END (CHECKSUM_START + CHECKSUM_LENGTH)
+
+// Quick-identify samples one page per stride across the smallest retail ROM size,
+// so the same pages exist on every cart regardless of its real size.
+#define FINGERPRINT_SPAN 0x400000 // 4 Mb
+#define FINGERPRINT_SAMPLES 32
+#define FINGERPRINT_STRIDE (FINGERPRINT_SPAN / FINGERPRINT_SAMPLES)
+
+// Compiled DAT index: header, bucket displacements, slots, entries, title strings
+#define DAT_INDEX_MAGIC "N64DATIX"
+#define DAT_INDEX_VERSION 1
+#define DEFAULT_DAT_INDEX "n64.ndi"
+#define DAT_EMPTY_SLOT 0xFFFFFFFF
+#define DAT_KEY_TYPES 4
+#define DAT_MAX_SEED 0x100000
+
+// Cart mount: the image is cached whole, page by page
+#define CART_ROM_NAME "rom.z64"
+#define CACHE_READ_AHEAD_MIN 4 // Pages fetched past a random read
+#define CACHE_READ_AHEAD_MAX 256 // 128 Kb, reached after a few sequential reads
+#define CACHE_FILL_BATCH 8 // Pages the background filler reads per bus hold
+
+// Access profiles recorded by ROM_mapping.c, named from header CRC1/CRC2 (0x10-0x17)
+#define PROFILE_NAME "%08X-%08X.prof"
+#define PROGRESS_STEPS 100 // Progress lines per ordered dump
+
+#define READ_RETRIES 8 // Extra reads of a page before --verify-reads gives up on it
+#define MAJORITY_MAX_READS 15 // Vote counters are 5 bit planes deep
+#define PAGE_UNREAD 2 // ReadPageVerified: the backend never transferred the page
+
+#define TIMING_REGION_SIZE 0x100000 // 1 Mb of ROM per --adaptive-timing region
+#define TIMING_CLEAN_PAGES 32 // Pages in a row without a retry before a region speeds up
+#define TIMING_STEP_PERMILLE 50 // Of the base timing
+#define TIMING_BACKOFF_STEPS 4 // Steps back after a page needs a retry
+#define TIMING_MIN_PERMILLE 100
+
+#define REFERENCE_PAGES (CHECKSUM_START / ROM_PAGE_SIZE) // Header and IPL3, re-read at every --recalibrate checkpoint
+#define RECALIBRATE_PERMILLE 1250 // Base timing scale per recalibration
+#define RECALIBRATE_ATTEMPTS 4 // Recalibrations per checkpoint before the dump fails
+#define RECALIBRATE_MAX_PAGES 0x2000 // 4 Mb held back at most
+#define RESET_PULSE_US 100000 // RESET low time when recovering a hung cart
+#define RESET_SETTLE_US 50000 // Before the first read after RESET rises
+
+// --daemon: cart insertion is polled on the header page
+#define DAEMON_POLL_US 250000
+#define DAEMON_STABLE_POLLS 2 // Same header reads in a row before a cart counts as inserted or removed
+#define ARCHIVE_MANIFEST "manifest.txt"
+#define SHA1_SIZE 20
+
+#define BUS_TRACE_EVENTS 0x100000 // Power of two; about 1300 bit-banged pages
+
+#define EXIT_MISMATCH 2
+#define EXIT_UNKNOWN 3
 
 #define ACTIVE(signal) (((signal) == HIGH) ? HIGH : LOW)
 #define INACTIVE(signal) (((signal) == LOW) ? LOW : HIGH)
@@ -70,109 +353,5314 @@ enum addressBoundary
   UpperAddress = 1
 };
 
-int main(void)
+enum DatKeyType
+{
+  DatKeyCrc32 = 0,
+  DatKeyMd5 = 1,
+  DatKeySha1 = 2,
+  DatKeySerial = 3 // Header game code (0x3B-0x3E) + revision (0x3F)
+};
+
+enum SaveType
+{
+  SaveUnknown = 0,
+  SaveNone,
+  SaveEeprom4k,
+  SaveEeprom16k,
+  SaveSram,
+  SaveSram768k,
+  SaveFlash,
+  SaveTypeCount
+};
+
+enum RangeKind
+{
+  RangeRom = 0,
+  RangeSave = 1
+};
+
+// One contiguous bus range to read
+struct DumpRange
+{
+  uint32_t busAddress;
+  uint32_t length;
+  uint kind; // enum RangeKind
+};
+
+#define MAX_PLAN_RANGES 4
+
+// What to read for the inserted cart, decided from its header
+struct DumpPlan
+{
+  const struct DatEntry* entry; // DAT index hit, NULL when the size was probed
+  uint32_t romSize;
+  uint saveType; // enum SaveType
+  uint rangeCount;
+  struct DumpRange ranges[MAX_PLAN_RANGES];
+  uint32_t* pageOrder; // ROM pages in dump order, NULL to dump linearly
+  uint32_t bootPages; // Leading pageOrder entries that came from an access profile
+};
+
+// Bus cycle timing; bit-banged delays round up to gpioDelay microseconds above 1 us
+struct BusTiming
+{
+  uint32_t latchNs; // ALE_L/ALE_H high time
+  uint32_t strobeNs; // READ low time before sampling
+  uint32_t recoveryNs; // READ high time between words
+};
+
+static struct BusTiming busTiming = { 1000, 1000, 0 };
+
+// --adaptive-timing state of one ROM region; timings scale the base busTiming
+struct TimingRegion
+{
+  uint32_t permille; // Scale the region reads at, 0 until it is first read
+  uint32_t floorPermille; // One step slower than the fastest scale that needed a retry
+  uint32_t cleanPages; // Read in a row without a retry
+  uint64_t pages;
+  uint64_t retriedPages;
+};
+
+static int adaptiveTiming = 0;
+static struct BusTiming baseTiming;
+static uint32_t timingPermille = 1000; // Scale busTiming holds now
+static struct TimingRegion timingRegions[MAX_ROM_SIZE / TIMING_REGION_SIZE];
+
+// --recalibrate: ROM pages are held back in windows of checkpointPages until a
+// re-read of the header and IPL3 still matches the copy read before the dump
+static uint32_t checkpointPages = 0;
+static uint16_t (*checkpointWindow)[PAGE_WORDS];
+static uint16_t referenceBlock[REFERENCE_PAGES][PAGE_WORDS];
+static int referenceRead = 0;
+static uint64_t recalibrations;
+static uint64_t cartResets;
+
+// A dumped cart, handed from the --daemon dump loop to the archiver thread
+struct ArchiveJob
+{
+  char romPath[PATH_MAX]; // Staged image in the archive directory, empty when nothing was dumped
+  char savePath[PATH_MAX]; // Staged save, when the cart had one
+  const char* saveExtension;
+  char name[64]; // Archive name from the header, for dumps the DAT index doesn't know
+  uint16_t cic; // Header checksum CIC, 0 when it matched none
+  int status; // ExecutePlan's
+};
+
+struct Archiver
+{
+  const char* directory;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  struct ArchiveJob job;
+  int pending; // job is queued or being archived
+  int stopping;
+};
+
+static struct Archiver archiver = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .changed = PTHREAD_COND_INITIALIZER
+};
+static volatile sig_atomic_t daemonStopping = 0;
+
+// Running SHA-1, for the archive manifest and DAT lookups by SHA-1
+struct Sha1
+{
+  uint32_t state[5];
+  uint64_t length; // Bytes hashed so far
+  uint8_t block[64];
+};
+
+// --verify-reads: every page is read until two reads agree
+static int verifyReads = 0;
+static uint64_t readRetries;
+static uint64_t readFailures; // Pages that never read back the same twice
+
+// --majority: pages that never agree are voted over majorityReads reads
+static uint majorityReads = 0;
+static uint64_t majorityPages;
+static uint64_t lineDisagreements[16]; // Read bits that lost a vote, per AD line
+
+// Eight bus words, one 128-bit NEON (or SSE) register
+typedef uint16_t PageVector __attribute__((vector_size(16)));
+#define PAGE_VECTORS (ROM_PAGE_SIZE / sizeof(PageVector))
+
+// One bus transition: every GPIO level right after it
+struct BusTraceEvent
+{
+  uint64_t nanoseconds; // Since the trace was opened
+  uint32_t levels; // GPIO 0-31; AD lines hold the Pi's outputs or the last sample
+  uint16_t adDriven; // The Pi drives AD (address phase), otherwise the cart does
+  uint16_t sampled; // The Pi sampled AD in this event
+};
+
+// --trace: lock-free ring of bus transitions. Slots are claimed with an atomic
+// add, so the wave backend's sampling thread can record alongside the CPU
+// paths. The GPIO wrappers keep levels up to date whether or not tracing is
+// enabled, so switching it on between pages starts from the true bus state.
+struct BusTrace
 {
-    if(gpioInitialise() < 0)
+  struct BusTraceEvent* events; // NULL when not tracing
+  const char* path; // VCD, or NULL
+  const char* recordPath; // Bus record (ROM_bus_record.h), or NULL
+  uint64_t head; // Events ever recorded
+  int enabled; // Checked by every wrapper; set per page by BusTraceSelect
+  int paused; // Toggled by SIGUSR1
+  uint32_t rangeStart; // Bus addresses traced (--trace-range)
+  uint32_t rangeLength;
+  uint32_t levels;
+  uint32_t adDriven;
+  struct timespec start;
+  uint32_t startTick; // gpioTick() at start, for wave sample timestamps
+};
+
+static struct BusTrace busTrace = { .rangeLength = UINT32_MAX };
+
+// Which GPIO carries each cart signal. Data reads take a single shift when
+// AD0-AD15 are consecutive GPIOs, otherwise they gather the bits through one
+// table per byte of the GPIO level register.
+struct PinMap
+{
+  uint ad[16];
+  uint aleLow;
+  uint aleHigh;
+  uint read;
+  uint write;
+  uint reset;
+  uint32_t adMask; // All AD lines
+  int contiguous; // AD0-AD15 are ad[0] .. ad[0] + 15
+  uint16_t gather[4][256]; // GPIO level byte -> data bits it carries
+};
+
+// Cart connector pin of each AD line (the table above), for naming faulty lines
+static const uint8_t adCartPins[16] = { 28, 29, 30, 32, 36, 37, 40, 41, 16, 15, 12, 11, 7, 5, 4, 3 };
+
+static struct PinMap pinMap = {
+  .ad = { AD_BUS, AD_BUS + 1, AD_BUS + 2, AD_BUS + 3, AD_BUS + 4, AD_BUS + 5, AD_BUS + 6, AD_BUS + 7,
+          AD_BUS + 8, AD_BUS + 9, AD_BUS + 10, AD_BUS + 11, AD_BUS + 12, AD_BUS + 13, AD_BUS + 14, AD_BUS + 15 },
+  .aleLow = DEFAULT_ALE_L,
+  .aleHigh = DEFAULT_ALE_H,
+  .read = DEFAULT_READ,
+  .write = DEFAULT_WRITE,
+  .reset = DEFAULT_RESET
+};
+
+// GPIO set/clear masks that put one byte of an address half on the AD lines
+struct AddressMasks
+{
+  uint32_t set;
+  uint32_t clear;
+};
+
+// [0] drives AD0-AD7, [1] drives AD8-AD15; built by BuildAddressMasks for the active pins
+static struct AddressMasks addressMasks[2][256];
+
+// A way of driving bus cycles. Every backend fills pages the same way, so the
+// dump, verify and identify paths don't care which one is active.
+struct BusBackend
+{
+  const char* name;
+  void (*configure)(void); // Before gpioInitialise, may be NULL
+  int (*init)(void); // After pin setup, may be NULL; returns 0 on success
+  int (*readPage)(uint32_t address, uint16_t* words); // Returns 0 on success, 1 when the transfer fell short
+  void (*terminate)(void); // Before gpioTerminate, may be NULL
+  int (*retime)(void); // After busTiming changes, may be NULL; returns 0 on success
+};
+
+// Words captured by the wave backend's DMA sample callback
+struct WaveCapture
+{
+  int active;
+  int inStrobe;
+  uint32_t lastLevel;
+  uint words;
+  uint16_t page[PAGE_WORDS];
+};
+
+// Quick commands (--identify, --verify-header, --self-test) on the bit-banged
+// bus map the GPIO registers instead of calling gpioInitialise, whose DMA
+// sampler takes far longer to start than the command takes to run.
+// NULL while pigpio drives the pins.
+static volatile uint32_t* gpioRegisters;
+
+static struct WaveCapture waveCapture;
+static int waveId = -1;
+
+// Register access for the SMI backend. The hardware maps /dev/mem; the test
+// suite substitutes a software model of the same registers.
+struct SmiInterface
+{
+  uint32_t (*read)(uint reg);
+  void (*write)(uint reg, uint32_t value);
+  uint (*transfer)(uint16_t* words, uint count); // DMA out of the FIFO, NULL to drain it with the CPU
+};
+
+// BCM283x DMA control block, 32-byte aligned
+struct DmaControlBlock
+{
+  uint32_t transferInfo;
+  uint32_t source;
+  uint32_t destination;
+  uint32_t length;
+  uint32_t stride;
+  uint32_t next;
+  uint32_t reserved[2];
+};
+
+struct SmiHardware
+{
+  volatile uint32_t* smi;
+  volatile uint32_t* clock;
+  volatile uint32_t* dma;
+  volatile void* buffer; // Uncached: control block, then burst data
+  uint32_t bufferBus;
+  uint32_t bufferHandle;
+  uint32_t peripheralBus;
+  int mailbox;
+};
+
+static struct SmiHardware smiHardware = { .mailbox = -1 };
+
+// The mounted cart. busLock serializes every bus access between FUSE threads
+// and the background filler; present[] marks the pages already in image.
+struct CartCache
+{
+  struct DumpPlan plan;
+  uint8_t* image; // Big-endian ROM, romSize bytes
+  uint8_t* present; // One flag per page
+  uint32_t pageCount;
+  uint32_t presentCount;
+  uint8_t* save; // Loaded on first read
+  uint32_t saveSize;
+  pthread_mutex_t busLock;
+  pthread_mutex_t stateLock; // Guards nextPage and readAhead
+  uint32_t nextPage; // Page after the last read, for sequential detection
+  uint32_t readAhead; // Pages
+  int waiting; // Readers blocked on the bus; the filler backs off
+  int stop;
+  const char* persistPath;
+};
+
+static struct CartCache cartCache = {
+  .busLock = PTHREAD_MUTEX_INITIALIZER,
+  .stateLock = PTHREAD_MUTEX_INITIALIZER
+};
+
+// The --shared image; header is NULL when not publishing
+struct SharedImage
+{
+  struct SharedImageHeader* header;
+  uint8_t* image;
+  size_t size;
+};
+
+static struct SharedImage sharedImage;
+
+struct CicVariant
+{
+  uint16_t cic; // 6101 boot code checksums like 6102
+  uint32_t seed;
+};
+
+static const struct CicVariant cicVariants[] = { { 6102, 0xF8CA4DDC }, { 6103, 0xA3886759 },
+                                                 { 6105, 0xDF26F436 }, { 6106, 0x1FEA617A } };
+
+// Start of the ROM as dumped, for the header checksum
+static uint8_t romPrefix[CHECKSUM_END];
+static uint32_t romPrefixLength;
+
+static const char* saveTypeNames[SaveTypeCount] = { "unknown", "none", "eeprom4k", "eeprom16k", "sram", "sram768k", "flash" };
+
+struct DatIndexHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t entryCount;
+  uint32_t bucketCount;
+  uint32_t slotCount;
+  uint32_t stringsSize;
+  uint32_t reserved;
+};
+
+struct DatEntry
+{
+  uint32_t crc32;
+  uint32_t size;
+  uint8_t md5[16];
+  uint8_t sha1[20];
+  char serial[4]; // Game code, e.g. "NSME"; empty when the DAT has none
+  uint8_t revision;
+  uint8_t saveType; // enum SaveType
+  uint16_t cic; // e.g. 6102, 0 when unknown
+  uint32_t titleOffset; // Into the string pool
+};
+
+// The mapped DAT index; header is NULL when none is loaded
+struct DatIndex
+{
+  const struct DatIndexHeader* header;
+  const uint32_t* displacements;
+  const uint32_t* slots;
+  const struct DatEntry* entries;
+  const char* strings;
+  size_t size;
+};
+
+static struct DatIndex datIndex;
+
+void SetADBusPinsMode(uint mode);
+void SetupBusPins(void);
+int GpioFastInit(void);
+void BusSetMode(uint gpio, uint mode);
+void BusWrite(uint gpio, uint level);
+void BusWriteSet(uint32_t bits);
+void BusWriteClear(uint32_t bits);
+uint32_t BusReadLevels(void);
+uint64_t BusTraceNow(void);
+void BusTraceRecord(uint64_t nanoseconds, int sampled);
+uint32_t BusTracePack(const struct BusTraceEvent* event);
+int OpenBusTrace(const char* path, const char* recordPath);
+void BusTraceSelect(uint32_t address);
+void BusTraceToggle(int signalNumber);
+int WriteBusTraceVcd(uint64_t first, uint64_t head);
+int WriteBusRecord(uint64_t first, uint64_t head);
+int WriteBusTrace(void);
+int LoadPinMap(const char* path);
+int FinishPinMap(void);
+uint16_t GatherDataBus(uint32_t levels);
+void BuildAddressMasks(void);
+void SetAddress(uint64_t address, uint addressBoundary);
+void LatchAddress(uint ControlSignal);
+int ReadPage(uint32_t address, uint16_t* words);
+int ReadBackendPage(uint32_t address, uint16_t* words);
+void BitBangReadWords(uint32_t address, uint16_t* words, uint count);
+int SelfTestBus(uint16_t* suspects);
+void ReportBusLines(const char* problem, uint16_t lines);
+int ReadPageVerified(uint32_t address, uint16_t* words);
+void MajorityVote(uint16_t (*reads)[PAGE_WORDS], uint count, uint16_t* words, uint64_t* disagreements);
+void ReportMajority(void);
+int SelectTimingRegion(uint32_t address, struct TimingRegion** region);
+int SetTimingScale(uint32_t permille);
+void AdaptTiming(struct TimingRegion* region, int retried);
+void ReportAdaptiveTiming(void);
+int ReadCheckpointWindow(const uint32_t* order, uint32_t first, uint count);
+int Recalibrate(void);
+void ReportRecalibration(void);
+int BusHung(const uint16_t* words);
+int ResetCart(void);
+const uint8_t* MapImage(const char* path, size_t* size);
+int VerifyAgainst(const char* referencePath, int exhaustive);
+uint32_t FingerprintSampleAddress(uint sample);
+uint64_t FingerprintUpdate(uint64_t hash, const uint16_t* words, uint count);
+uint64_t FingerprintImage(const uint8_t* image, size_t size);
+uint64_t FingerprintCart(void);
+int BuildFingerprintIndex(const char* indexPath, char** dumpPaths, int dumpCount);
+int IdentifyCart(const char* indexPath);
+int VerifyHeader(void);
+uint32_t Crc32Update(uint32_t crc, const uint8_t* bytes, size_t length);
+void Sha1Init(struct Sha1* sha1);
+void Sha1Block(uint32_t* state, const uint8_t* block);
+void Sha1Update(struct Sha1* sha1, const uint8_t* bytes, size_t length);
+void Sha1Final(struct Sha1* sha1, uint8_t* digest);
+uint32_t DatKeyHash(uint8_t type, const uint8_t* bytes, uint length, uint32_t seed);
+uint DatEntryKey(const struct DatEntry* entry, uint type, uint8_t* key);
+const struct DatEntry* DatLookup(uint type, const uint8_t* key, uint length);
+const struct DatEntry* DatLookupHeader(const uint16_t* header);
+const char* DatTitle(const struct DatEntry* entry);
+int LoadDatIndex(const char* path, int required);
+int CompileDatIndex(const char* indexPath, char** datPaths, int datCount);
+int PrintDatLookup(const char* hash);
+void PrintDatEntry(const struct DatEntry* entry);
+uint32_t ProbeRomSize(void);
+void RomChecksum(const uint8_t* rom, uint16_t cic, uint32_t* crc1, uint32_t* crc2);
+uint16_t IdentifyCic(const uint8_t* rom);
+void KeepRomPrefix(uint32_t offset, const uint8_t* bytes);
+void ReportHeaderChecksum(const struct DumpPlan* plan);
+void PlanDump(const uint16_t* header, struct DumpPlan* plan);
+void LoadAccessProfile(const char* directory, const uint16_t* header, struct DumpPlan* plan);
+void WriteWords(uint32_t address, const uint16_t* words, uint count);
+int DumpRomOrdered(const struct DumpPlan* plan, FILE* output, uint32_t* crc);
+int DumpRange(const struct DumpRange* range, FILE* output, uint32_t* crc);
+int ExecutePlan(const struct DumpPlan* plan, const char* romPath, const char* savePath);
+void BusDelay(uint32_t nanoseconds);
+const struct BusBackend* FindBusBackend(const char* name);
+void ShutdownBus(void);
+void LatchPageAddress(uint32_t address);
+int BitBangReadPage(uint32_t address, uint16_t* words);
+void WaveConfigure(void);
+void WaveSamples(const gpioSample_t* samples, int count);
+int WaveInit(void);
+int WaveReadPage(uint32_t address, uint16_t* words);
+void WaveTerminate(void);
+int WaveRetime(void);
+void SmiSetup(const struct SmiInterface* smi);
+uint SmiFifoTransfer(const struct SmiInterface* smi, uint16_t* words, uint count);
+int SmiReadBurst(const struct SmiInterface* smi, uint16_t* words, uint count);
+uint32_t SmiHardwareRead(uint reg);
+void SmiHardwareWrite(uint reg, uint32_t value);
+uint SmiDmaTransfer(uint16_t* words, uint count);
+uint32_t MailboxCall(int mailbox, uint32_t tag, uint32_t* arguments, uint argumentCount);
+uint32_t PeripheralBase(void);
+int SmiInit(void);
+void SmiUnmapRegisters(void);
+int SmiReadPage(uint32_t address, uint16_t* words);
+void SmiTerminate(void);
+int SmiRetime(void);
+int CartCacheOpen(const struct DumpPlan* plan);
+int CartCacheFetch(uint32_t firstPage, uint32_t count);
+int CartCacheRead(uint8_t* buffer, size_t size, uint64_t offset);
+int CartCacheLoadSave(void);
+void* CartCacheFiller(void* unused);
+#ifdef WITH_FUSE
+const char* CartSaveName(void);
+int CartGetattr(const char* path, struct stat* info, struct fuse_file_info* file);
+int CartReaddir(const char* path, void* buffer, fuse_fill_dir_t fill, off_t offset,
+                struct fuse_file_info* file, enum fuse_readdir_flags flags);
+int CartOpen(const char* path, struct fuse_file_info* file);
+int CartRead(const char* path, char* buffer, size_t size, off_t offset, struct fuse_file_info* file);
+#endif
+int MountCart(const char* mountPoint, const struct DumpPlan* plan, const char* persistPath);
+int OpenSharedImage(const char* name, const uint16_t* header, uint32_t romSize);
+void PublishPage(uint32_t index, const uint8_t* bytes);
+void CloseSharedImage(int status);
+int RunDaemon(const char* directory, const char* profileDirectory, int selfTest);
+void DaemonStop(int signalNumber);
+int WaitForCart(uint16_t* header, int inserted);
+int ResetDumpState(const struct BusTiming* timing);
+void HeaderName(const uint16_t* header, char* name, size_t size);
+void QueueArchive(const struct ArchiveJob* job);
+void* ArchiverThread(void* unused);
+void ArchiveDump(const struct ArchiveJob* job);
+
+static struct SmiInterface smiInterface = { SmiHardwareRead, SmiHardwareWrite, NULL };
+
+static const struct BusBackend bitBangBackend = { "bitbang", NULL, NULL, BitBangReadPage, NULL, NULL };
+static const struct BusBackend waveBackend = { "wave", WaveConfigure, WaveInit, WaveReadPage, WaveTerminate, WaveRetime };
+static const struct BusBackend smiBackend = { "smi", NULL, SmiInit, SmiReadPage, SmiTerminate, SmiRetime };
+static const struct BusBackend* busBackends[] = { &bitBangBackend, &waveBackend, &smiBackend };
+static const struct BusBackend* bus = &bitBangBackend;
+
+int main(int argc, char** argv)
+{
+    const char* verifyPath = NULL;
+    const char* identifyPath = NULL;
+    const char* datIndexPath = DEFAULT_DAT_INDEX;
+    const char* lookupHash = NULL;
+    const char* romPath = NULL;
+    const char* savePath = NULL;
+    const char* pinsPath = NULL;
+    const char* mountPoint = NULL;
+    const char* profileDirectory = NULL;
+    const char* sharedName = NULL;
+    const char* tracePath = NULL;
+    const char* recordPath = NULL;
+    const char* daemonDirectory = NULL;
+    int datIndexRequired = 0;
+    int exhaustive = 0;
+    int selfTest = 1;
+    int selfTestOnly = 0;
+    int verifyHeader = 0;
+
+    for(int arg = 1;
+        arg < argc;
+        arg++)
+    {
+        if(strcmp(argv[arg], "--verify-against") == 0 && arg + 1 < argc)
+        {
+            verifyPath = argv[++arg];
+        }
+        else if(strcmp(argv[arg], "--exhaustive") == 0)
+        {
+            exhaustive = 1;
+        }
+        else if(strcmp(argv[arg], "--identify") == 0 && arg + 1 < argc)
+        {
+            identifyPath = argv[++arg];
+        }
+        else if(strcmp(argv[arg], "--verify-header") == 0)
+        {
+            verifyHeader = 1;
+        }
+        else if(strcmp(argv[arg], "--build-index") == 0 && arg + 2 < argc)
+        {
+            // Offline: the remaining arguments are dumps, the cart is never touched
+            return BuildFingerprintIndex(argv[arg + 1], &argv[arg + 2], argc - arg - 2);
+        }
+        else if(strcmp(argv[arg], "--compile-dat") == 0 && arg + 2 < argc)
+        {
+            return CompileDatIndex(argv[arg + 1], &argv[arg + 2], argc - arg - 2);
+        }
+        else if(strcmp(argv[arg], "--dat-index") == 0 && arg + 1 < argc)
+        {
+            datIndexPath = argv[++arg];
+            datIndexRequired = 1;
+        }
+        else if(strcmp(argv[arg], "--dat-lookup") == 0 && arg + 1 < argc)
+        {
+            lookupHash = argv[++arg];
+        }
+        else if(strcmp(argv[arg], "--output") == 0 && arg + 1 < argc)
+        {
+            romPath = argv[++arg];
+        }
+        else if(strcmp(argv[arg], "--save-output") == 0 && arg + 1 < argc)
+        {
+            savePath = argv[++arg];
+        }
+        else if(strcmp(argv[arg], "--pins") == 0 && arg + 1 < argc)
+        {
+            pinsPath = argv[++arg];
+        }
+        else if(strcmp(argv[arg], "--access-profile") == 0 && arg + 1 < argc)
+        {
+            profileDirectory = argv[++arg];
+        }
+        else if(strcmp(argv[arg], "--shared") == 0 && arg + 1 < argc)
+        {
+            sharedName = argv[++arg];
+        }
+        else if(strcmp(argv[arg], "--self-test") == 0)
+        {
+            selfTestOnly = 1;
+        }
+        else if(strcmp(argv[arg], "--skip-self-test") == 0)
+        {
+            selfTest = 0;
+        }
+        else if(strcmp(argv[arg], "--verify-reads") == 0)
+        {
+            verifyReads = 1;
+        }
+        else if(strcmp(argv[arg], "--majority") == 0 && arg + 1 < argc)
+        {
+            majorityReads = strtoul(argv[++arg], NULL, 0);
+            if(majorityReads < READ_RETRIES + 1 || majorityReads > MAJORITY_MAX_READS || majorityReads % 2 == 0)
+            {
+                fprintf(stderr, "--majority takes an odd number of reads from %u to %u.\n",
+                        READ_RETRIES + 1, MAJORITY_MAX_READS);
+                return 1;
+            }
+            verifyReads = 1;
+        }
+        else if(strcmp(argv[arg], "--adaptive-timing") == 0)
+        {
+            adaptiveTiming = 1;
+            verifyReads = 1;
+        }
+        else if(strcmp(argv[arg], "--recalibrate") == 0 && arg + 1 < argc)
+        {
+            checkpointPages = strtoul(argv[++arg], NULL, 0);
+            if(checkpointPages < REFERENCE_PAGES || checkpointPages > RECALIBRATE_MAX_PAGES)
+            {
+                fprintf(stderr, "--recalibrate takes a checkpoint interval from %u to %u pages.\n",
+                        REFERENCE_PAGES, RECALIBRATE_MAX_PAGES);
+                return 1;
+            }
+            checkpointWindow = malloc(checkpointPages * sizeof(*checkpointWindow));
+            if(checkpointWindow == NULL)
+            {
+                fprintf(stderr, "Failed to allocate the checkpoint window.\n");
+                return 1;
+            }
+        }
+        else if(strcmp(argv[arg], "--daemon") == 0 && arg + 1 < argc)
+        {
+            daemonDirectory = argv[++arg];
+        }
+        else if(strcmp(argv[arg], "--mount") == 0 && arg + 1 < argc)
+        {
+            mountPoint = argv[++arg];
+        }
+        else if(strcmp(argv[arg], "--trace") == 0 && arg + 1 < argc)
+        {
+            tracePath = argv[++arg];
+        }
+        else if(strcmp(argv[arg], "--record") == 0 && arg + 1 < argc)
+        {
+            recordPath = argv[++arg];
+        }
+        else if(strcmp(argv[arg], "--trace-range") == 0 && arg + 2 < argc)
+        {
+            busTrace.rangeStart = strtoul(argv[arg + 1], NULL, 16);
+            busTrace.rangeLength = strtoul(argv[arg + 2], NULL, 16);
+            arg += 2;
+        }
+        else if(strcmp(argv[arg], "--backend") == 0 && arg + 1 < argc)
+        {
+            bus = FindBusBackend(argv[++arg]);
+            if(bus == NULL)
+            {
+                fprintf(stderr, "Unknown backend %s.\n", argv[arg]);
+                return 1;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [--dat-index <n64.ndi>] [--pins <board.cfg>] [--backend <bitbang|wave|smi>] [--skip-self-test] [--verify-reads] [--majority <reads>] [--adaptive-timing] [--recalibrate <pages>] [--trace <bus.vcd>] [--record <bus.ntr>] [--trace-range <address> <length>] [--access-profile <dir>] [--shared <name>] [--output <rom.z64>] [--save-output <file>]\n"
+                            "       %s [--pins <board.cfg>] --self-test\n"
+                            "       %s [dump options] [--access-profile <dir>] --daemon <dir>\n"
+                            "       %s [--dat-index <n64.ndi>] --verify-against <image.z64> [--exhaustive]\n"
+                            "       %s [--dat-index <n64.ndi>] --mount <dir> [--output <rom.z64>]\n"
+                            "       %s [--pins <board.cfg>] --identify <library.fpi>\n"
+                            "       %s [--dat-index <n64.ndi>] [--pins <board.cfg>] --verify-header\n"
+                            "       %s --build-index <library.fpi> <dump.z64>...\n"
+                            "       %s --compile-dat <n64.ndi> <dat.xml>...\n"
+                            "       %s [--dat-index <n64.ndi>] --dat-lookup <crc32|md5|sha1>\n",
+                    argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+            return 1;
+        }
+    }
+
+    if(LoadDatIndex(datIndexPath, datIndexRequired || lookupHash != NULL) != 0)
     {
-         fprintf(stderr, "Failed to initialize GPIO.")
-         return 1;
+        return 1;
     }
 
-    // Pin setup
-    // Set mode for addressing
-    SetADBusPinsMode(PI_OUTPUT);
-    gpioSetMode(ALE_L, PI_OUTPUT);
-    gpioSetMode(ALE_H, PI_OUTPUT);
-    gpioSetMode(READ, PI_OUTPUT);
-    gpioSetMode(WRITE, PI_OUTPUT);
-    gpioSetMode(RESET, PI_OUTPUT);
+    if(lookupHash != NULL)
+    {
+        return PrintDatLookup(lookupHash);
+    }
 
-    // Setup writes for inactive control signals
-    gpioWrite(ALE_L, INACTIVE(LOW));
-    gpioWrite(ALE_H, INACTIVE(LOW));
-    gpioWrite(READ, INACTIVE(HIGH));
-    gpioWrite(WRITE, INACTIVE(HIGH));
-    gpioWrite(RESET, INACTIVE(LOW));
-    
-    gpioDelay(100);
-
-    // Loop through ROM addresses in 16-bit increments, up to the ROM bank size.
-    uint32_t address = 0;
-    while(address < ROM_BANK_SIZE)
-    {
-        // Set the lower 16 bits of the address on the multiplexed AD_BUS
-        SetAddress(address, LowerAddress);
-        LatchAddress(ALE_L);
-        
-        // Set the upper 8 bits of the address
-        SetAddress(address, UpperAddress);
-        LatchAddress(ALE_H);
-
-        // Configure the AD_BUS for data reading 
-        SetADBusPinsMode(PI_INPUT);
+    if((pinsPath != NULL && LoadPinMap(pinsPath) != 0) || FinishPinMap() != 0)
+    {
+        return 1;
+    }
 
-        // Activate read control signal
-        gpioWrite(READ, ACTIVE(LOW)); 
-        gpioDelay(1); 
+    baseTiming = busTiming;
 
-        // Read data into AD Bus
-        uint16_t data = 0;
-        for(uint bitOffset = 0;
-            bitOffset < 16;
-            bitOffset++)
+    // Quick commands only bit-bang a few pages; pigpio's start-up would dominate them
+    int quickCommand = (identifyPath != NULL || verifyHeader || selfTestOnly) &&
+                       bus == &bitBangBackend && tracePath == NULL && recordPath == NULL;
+
+    if(!quickCommand || GpioFastInit() != 0)
+    {
+        if(bus->configure != NULL)
+        {
+            bus->configure();
+        }
+
+        if(gpioInitialise() < 0)
         {
-            data |= (gpioRead(AD_BUS + bitOffset) << bitOffset);
+             fprintf(stderr, "Failed to initialize GPIO.\n");
+             return 1;
         }
+    }
+
+    if((tracePath != NULL || recordPath != NULL) && OpenBusTrace(tracePath, recordPath) != 0)
+    {
+        gpioTerminate();
+        return 1;
+    }
 
-        gpioWrite(READ, INACTIVE(HIGH));
+    // Pin setup
+    BuildAddressMasks();
 
-        SetADBusPinsMode(PI_OUTPUT);
+    SetupBusPins();
+    BusDelay(100000);
 
-        printf("0x%06X: 0x%04X\n", address, data);
+    // Bit-banged, before a backend takes the pins over
+    // A daemon may start with the slot empty; it self-tests every cart instead
+    if(selfTestOnly || (selfTest && verifyPath == NULL && identifyPath == NULL && !verifyHeader && daemonDirectory == NULL))
+    {
+        uint16_t suspects;
+        int status = SelfTestBus(&suspects);
+        if(status != 0 || selfTestOnly)
+        {
+            ShutdownBus();
+            return status;
+        }
+    }
 
-        // Increment address on 16-bit boundaries
-        address += 2;
+    if(bus->init != NULL && bus->init() != 0)
+    {
+        ShutdownBus();
+        return 1;
     }
 
-    gpioTerminate();
-    return 0;
+    if(daemonDirectory != NULL)
+    {
+        int status = RunDaemon(daemonDirectory, profileDirectory, selfTest);
+        ShutdownBus();
+        return status;
+    }
+
+    if(verifyPath != NULL)
+    {
+        int status = VerifyAgainst(verifyPath, exhaustive);
+        ShutdownBus();
+        return status;
+    }
+
+    if(identifyPath != NULL)
+    {
+        int status = IdentifyCart(identifyPath);
+        ShutdownBus();
+        return status;
+    }
+
+    if(verifyHeader)
+    {
+        int status = VerifyHeader();
+        ShutdownBus();
+        return status;
+    }
+
+    // Read the header page first so the plan covers only the real ROM and its save
+    uint16_t header[PAGE_WORDS];
+    struct DumpPlan plan;
+    if(ReadPage(CART_ROM_BASE, header) != 0)
+    {
+        ShutdownBus();
+        return 1;
+    }
+    PlanDump(header, &plan);
+
+    if(profileDirectory != NULL)
+    {
+        LoadAccessProfile(profileDirectory, header, &plan);
+    }
+
+    if(sharedName != NULL && OpenSharedImage(sharedName, header, plan.romSize) != 0)
+    {
+        ShutdownBus();
+        return 1;
+    }
+
+    int status = (mountPoint != NULL) ? MountCart(mountPoint, &plan, romPath)
+                                      : ExecutePlan(&plan, romPath, savePath);
+    CloseSharedImage(status);
+
+    ShutdownBus();
+    return status;
 }
 
 // Set mode to PI_OUTPUT for address set
 // Set mode to PI_INPUT for data read
 void SetADBusPinsMode(uint mode) 
 {
-  for(uint pin = AD_BUS;
-        pin < AD_BUS + 16;
-        pin++)
+  for(uint bitOffset = 0;
+        bitOffset < 16;
+        bitOffset++)
+  {
+    BusSetMode(AD_PIN(bitOffset), mode);
+  }
+
+  busTrace.adDriven = (mode == PI_OUTPUT);
+  if(__atomic_load_n(&busTrace.enabled, __ATOMIC_RELAXED))
   {
-    gpioSetMode(pin, mode);
+    BusTraceRecord(BusTraceNow(), 0);
   }
 }
 
-// Sets the multiplexed address bus (AD_BUS) for either lower or upper address bits.
-// - address: The 24-bit address to send to the ROM.
-// - addressBoundary: Specifies whether to set the lower (16 bits) or upper (8 bits) address.
-//    * LowerAddress (0): Sets AD_BUS pins 0-15 to the lower 16 bits of the address.
-//    * UpperAddress (1): Sets AD_BUS pins 0-7 to the upper 8 bits of the address.
-void SetAddress(uint64_t address, uint addressBoundary)
+// Drives AD0-AD15 and every control line with the control lines inactive:
+// the latches closed, READ and WRITE high, and the cart out of RESET.
+void SetupBusPins(void)
 {
-  uint bitCount = (addressBoundary == UpperAddress) ? 8 : 16;
-  uint bitShift = (addressBoundary == UpperAddress) ? 16 : 0;
+    // Set mode for addressing
+    SetADBusPinsMode(PI_OUTPUT);
+    BusSetMode(ALE_L, PI_OUTPUT);
+    BusSetMode(ALE_H, PI_OUTPUT);
+    BusSetMode(READ, PI_OUTPUT);
+    BusSetMode(WRITE, PI_OUTPUT);
+    BusSetMode(RESET, PI_OUTPUT);
 
-  for(uint bitOffset = 0;
-      bitOffset < bitCount;
-      bitOffset++)
-  {
-    gpioWrite(AD_BUS + bitOffset, (address >> (bitOffset + bitShift)) & 0x1);
-  }
+    // Setup writes for inactive control signals
+    BusWrite(ALE_L, INACTIVE(LOW));
+    BusWrite(ALE_H, INACTIVE(LOW));
+    BusWrite(READ, INACTIVE(HIGH));
+    BusWrite(WRITE, INACTIVE(HIGH));
+    BusWrite(RESET, INACTIVE(HIGH));
 }
 
-// Pulses the specified latch control signal (ALE_L or ALE_H) to store address bits in the ROM.
-// - controlSignal: The pin controlling the latch signal for either lower or upper address bits.
-void LatchAddress(uint ControlSignal)
+// Reads a board pin map: one "<signal> <gpio>" pair per line, '#' comments.
+// - path: Pin map file.
+// Returns 0 on success, 1 on error (already reported).
+int LoadPinMap(const char* path)
 {
-    gpioWrite(ControlSignal, ACTIVE(HIGH)); // Activate latch
-    gpioDelay(1); // Allow latch signal to stabilize
-    gpioWrite(ControlSignal, INACTIVE(LOW)); // Deactivate latch
-}
\ No newline at end of file
+  FILE* file = fopen(path, "r");
+  if(file == NULL)
+  {
+    perror(path);
+    return 1;
+  }
+
+  char line[256];
+  uint lineNumber = 0;
+  int status = 0;
+
+  while(status == 0 && fgets(line, sizeof(line), file) != NULL)
+  {
+    lineNumber++;
+    line[strcspn(line, "#\r\n")] = '\0';
+
+    char signal[16];
+    uint gpio = 0;
+    int fields = sscanf(line, "%15s %u", signal, &gpio);
+    if(fields <= 0)
+    {
+      continue;
+    }
+
+    uint bit = 0;
+    uint* target = NULL;
+    if(fields == 2 && sscanf(signal, "AD%u", &bit) == 1 && bit < 16)
+    {
+      target = &pinMap.ad[bit];
+    }
+    else if(fields == 2 && strcmp(signal, "ALE_L") == 0)
+    {
+      target = &pinMap.aleLow;
+    }
+    else if(fields == 2 && strcmp(signal, "ALE_H") == 0)
+    {
+      target = &pinMap.aleHigh;
+    }
+    else if(fields == 2 && strcmp(signal, "READ") == 0)
+    {
+      target = &pinMap.read;
+    }
+    else if(fields == 2 && strcmp(signal, "WRITE") == 0)
+    {
+      target = &pinMap.write;
+    }
+    else if(fields == 2 && strcmp(signal, "RESET") == 0)
+    {
+      target = &pinMap.reset;
+    }
+
+    if(target == NULL || gpio > MAX_GPIO)
+    {
+      fprintf(stderr, "%s:%u: expected \"<AD0-AD15|ALE_L|ALE_H|READ|WRITE|RESET> <gpio 0-%d>\".\n",
+              path, lineNumber, MAX_GPIO);
+      status = 1;
+    }
+    else
+    {
+      *target = gpio;
+    }
+  }
+
+  fclose(file);
+  return status;
+}
+
+// Validates the active pin map and derives the AD mask, the contiguous fast
+// path flag and the gather tables used by GatherDataBus.
+// Returns 0 on success, 1 when two signals share a GPIO.
+int FinishPinMap(void)
+{
+  uint32_t used = 0;
+  uint pins[21];
+  memcpy(pins, pinMap.ad, sizeof(pinMap.ad));
+  pins[16] = pinMap.aleLow;
+  pins[17] = pinMap.aleHigh;
+  pins[18] = pinMap.read;
+  pins[19] = pinMap.write;
+  pins[20] = pinMap.reset;
+
+  for(uint pin = 0;
+      pin < 21;
+      pin++)
+  {
+    if(pins[pin] > MAX_GPIO || (used >> pins[pin]) & 0x1)
+    {
+      fprintf(stderr, "Pin map assigns GPIO%u twice or out of range.\n", pins[pin]);
+      return 1;
+    }
+    used |= 1u << pins[pin];
+  }
+
+  pinMap.adMask = 0;
+  pinMap.contiguous = (pinMap.ad[0] + 15 <= MAX_GPIO);
+  memset(pinMap.gather, 0, sizeof(pinMap.gather));
+
+  for(uint bitOffset = 0;
+      bitOffset < 16;
+      bitOffset++)
+  {
+    uint gpio = pinMap.ad[bitOffset];
+    pinMap.adMask |= 1u << gpio;
+    pinMap.contiguous &= (gpio == pinMap.ad[0] + bitOffset);
+
+    // Every level byte value with this GPIO's bit set carries this data bit
+    for(uint value = 0;
+        value < 256;
+        value++)
+    {
+      if((value >> (gpio % 8)) & 0x1)
+      {
+        pinMap.gather[gpio / 8][value] |= 1u << bitOffset;
+      }
+    }
+  }
+  return 0;
+}
+
+// Extracts the 16-bit data word from a GPIO level register snapshot.
+uint16_t GatherDataBus(uint32_t levels)
+{
+  if(pinMap.contiguous)
+  {
+    return (levels >> pinMap.ad[0]) & 0xFFFF;
+  }
+
+  return pinMap.gather[0][levels & 0xFF] |
+         pinMap.gather[1][(levels >> 8) & 0xFF] |
+         pinMap.gather[2][(levels >> 16) & 0xFF] |
+         pinMap.gather[3][levels >> 24];
+}
+
+// Precomputes the AD line masks for every byte value, so putting an address on
+// the bus costs two table lookups and two register writes whatever the pin layout.
+void BuildAddressMasks(void)
+{
+  for(uint lane = 0;
+      lane < 2;
+      lane++)
+  {
+    for(uint value = 0;
+        value < 256;
+        value++)
+    {
+      struct AddressMasks masks = { 0, 0 };
+
+      for(uint bitOffset = 0;
+          bitOffset < 8;
+          bitOffset++)
+      {
+        uint32_t pin = 1u << AD_PIN(lane * 8 + bitOffset);
+        if((value >> bitOffset) & 0x1)
+        {
+          masks.set |= pin;
+        }
+        else
+        {
+          masks.clear |= pin;
+        }
+      }
+
+      addressMasks[lane][value] = masks;
+    }
+  }
+}
+
+// Sets the multiplexed address bus (AD_BUS) for either lower or upper address bits.
+// - address: The 32-bit cart bus address (e.g. CART_ROM_BASE + ROM offset).
+// - addressBoundary: Specifies whether to set the lower or upper 16 bits of the address.
+//    * LowerAddress (0): Sets AD_BUS pins 0-15 to the lower 16 bits of the address.
+//    * UpperAddress (1): Sets AD_BUS pins 0-15 to the upper 16 bits of the address.
+void SetAddress(uint64_t address, uint addressBoundary)
+{
+  uint16_t half = (addressBoundary == UpperAddress) ? (address >> 16) & 0xFFFF : address & 0xFFFF;
+  const struct AddressMasks* low = &addressMasks[0][half & 0xFF];
+  const struct AddressMasks* high = &addressMasks[1][half >> 8];
+
+  BusWriteClear(low->clear | high->clear);
+  BusWriteSet(low->set | high->set);
+}
+
+// Pulses the specified latch control signal (ALE_L or ALE_H) to store address bits in the ROM.
+// - controlSignal: The pin controlling the latch signal for either lower or upper address bits.
+void LatchAddress(uint ControlSignal)
+{
+    BusWrite(ControlSignal, ACTIVE(HIGH)); // Activate latch
+    BusDelay(busTiming.latchNs); // Allow latch signal to stabilize
+    BusWrite(ControlSignal, INACTIVE(LOW)); // Deactivate latch
+}
+
+// Reads one page (ROM_PAGE_SIZE bytes) starting at a page-aligned bus address
+// through the active backend.
+// - address: Page-aligned bus address (CART_ROM_BASE + offset for ROM).
+// - words: Receives PAGE_WORDS 16-bit words in bus order.
+// Returns 0 on success, 1 when the backend never transferred the page whole
+// or failed to take a new timing (already reported); words then must not be used.
+int ReadPage(uint32_t address, uint16_t* words)
+{
+    BusTraceSelect(address);
+    if(adaptiveTiming)
+    {
+        // A page that failed, fell short or was voted at a shortened timing is
+        // read again slower; one that agreed after retries stands and slows its region
+        while(1)
+        {
+            struct TimingRegion* region;
+            if(SelectTimingRegion(address, &region) != 0)
+            {
+                return 1;
+            }
+            uint32_t permille = timingPermille;
+            uint64_t retries = readRetries;
+            uint64_t voted = majorityPages;
+            int failed = ReadPageVerified(address, words);
+
+            if(region != NULL)
+            {
+                AdaptTiming(region, readRetries != retries);
+            }
+            if(region == NULL || permille == 1000 || (failed == 0 && majorityPages == voted))
+            {
+                if(failed == PAGE_UNREAD)
+                {
+                    return 1;
+                }
+                readFailures += failed;
+                return 0;
+            }
+        }
+    }
+    if(verifyReads)
+    {
+        int failed = ReadPageVerified(address, words);
+        if(failed == PAGE_UNREAD)
+        {
+            return 1;
+        }
+        readFailures += failed;
+        return 0;
+    }
+    return ReadBackendPage(address, words);
+}
+
+// Reads a page through the backend, again when a transfer falls short (a wave
+// capture missing samples, an SMI burst that timed out). Each retry counts in
+// readRetries, so --adaptive-timing slows the region down as for a misread.
+// - address: Page-aligned bus address.
+// - words: Receives PAGE_WORDS words.
+// Returns 0 on success, 1 when READ_RETRIES more transfers fell short too.
+int ReadBackendPage(uint32_t address, uint16_t* words)
+{
+    for(uint attempt = 0;
+        ;
+        attempt++)
+    {
+        if(bus->readPage(address, words) == 0)
+        {
+            return 0;
+        }
+        if(attempt == READ_RETRIES)
+        {
+            fprintf(stderr, "The page at 0x%08X fell short on all %u transfers.\n", address, READ_RETRIES + 1);
+            return 1;
+        }
+        readRetries++;
+    }
+}
+
+// Reads a page until two of its reads agree, so a flipped bit, a missed
+// latch or a strobe shorter than the cart's access time costs a retry instead
+// of a bad page. Lines stuck at one level read back consistently; the header
+// checksum catches those. With --majority, a page whose reads never agree is
+// rebuilt by a bitwise vote instead.
+// - address: Page-aligned bus address.
+// - words: Receives the agreed or voted read, or the last one when neither.
+// Returns 0 when two reads agreed or the page was voted, 1 when READ_RETRIES
+// more reads never agreed, PAGE_UNREAD when the backend failed to transfer it.
+int ReadPageVerified(uint32_t address, uint16_t* words)
+{
+    uint16_t reads[MAJORITY_MAX_READS][PAGE_WORDS];
+    if(ReadBackendPage(address, reads[0]) != 0)
+    {
+        return PAGE_UNREAD;
+    }
+
+    for(uint attempt = 1;
+        attempt <= READ_RETRIES;
+        attempt++)
+    {
+        if(ReadBackendPage(address, reads[attempt]) != 0)
+        {
+            return PAGE_UNREAD;
+        }
+
+        for(uint earlier = 0;
+            earlier < attempt;
+            earlier++)
+        {
+            if(memcmp(reads[earlier], reads[attempt], sizeof(reads[attempt])) == 0)
+            {
+                memcpy(words, reads[attempt], sizeof(reads[attempt]));
+                return 0;
+            }
+        }
+        readRetries++;
+    }
+
+    if(majorityReads > 0)
+    {
+        for(uint attempt = READ_RETRIES + 1;
+            attempt < majorityReads;
+            attempt++)
+        {
+            if(ReadBackendPage(address, reads[attempt]) != 0)
+            {
+                return PAGE_UNREAD;
+            }
+        }
+        MajorityVote(reads, majorityReads, words, lineDisagreements);
+        majorityPages++;
+        return 0;
+    }
+
+    memcpy(words, reads[READ_RETRIES], sizeof(reads[READ_RETRIES]));
+    return 1;
+}
+
+// Bitwise majority of an odd number of reads of a page, eight words per
+// vector operation. Every bit has a 5-plane bit-sliced counter, preloaded with
+// 16 minus the votes needed, so the top plane (16) sets exactly for the bits
+// set in more than half the reads.
+// - reads: count reads of the page (count odd, at most MAJORITY_MAX_READS).
+// - words: Receives the voted page.
+// - disagreements: Per AD line, incremented for every read bit that lost.
+void MajorityVote(uint16_t (*reads)[PAGE_WORDS], uint count, uint16_t* words, uint64_t* disagreements)
+{
+    uint bias = 16 - (count / 2 + 1);
+
+    for(uint vector = 0;
+        vector < PAGE_VECTORS;
+        vector++)
+    {
+        PageVector planes[5];
+        for(uint plane = 0;
+            plane < 5;
+            plane++)
+        {
+            planes[plane] = (PageVector){ 0 } - (uint16_t)((bias >> plane) & 0x1);
+        }
+
+        for(uint read = 0;
+            read < count;
+            read++)
+        {
+            PageVector carry;
+            memcpy(&carry, &reads[read][vector * 8], sizeof(carry));
+            for(uint plane = 0;
+                plane < 5;
+                plane++)
+            {
+                PageVector next = planes[plane] & carry;
+                planes[plane] ^= carry;
+                carry = next;
+            }
+        }
+
+        memcpy(&words[vector * 8], &planes[4], sizeof(planes[4]));
+    }
+
+    for(uint read = 0;
+        read < count;
+        read++)
+    {
+        for(uint word = 0;
+            word < PAGE_WORDS;
+            word++)
+        {
+            uint16_t lost = reads[read][word] ^ words[word];
+            while(lost != 0)
+            {
+                disagreements[__builtin_ctz(lost)]++;
+                lost &= lost - 1;
+            }
+        }
+    }
+}
+
+// Prints how often each AD line lost a --majority vote. A line far above the
+// rest is marginal: check its contact, resistor and solder joint.
+void ReportMajority(void)
+{
+    if(majorityPages == 0)
+    {
+        return;
+    }
+
+    uint worst = 0;
+    for(uint line = 1;
+        line < 16;
+        line++)
+    {
+        worst = (lineDisagreements[line] > lineDisagreements[worst]) ? line : worst;
+    }
+
+    fprintf(stderr, "Majority vote rebuilt %llu pages. Read bits that lost the vote:",
+            (unsigned long long)majorityPages);
+    for(uint line = 0;
+        line < 16;
+        line++)
+    {
+        if(lineDisagreements[line] != 0)
+        {
+            fprintf(stderr, " AD%u %llu", line, (unsigned long long)lineDisagreements[line]);
+        }
+    }
+    fprintf(stderr, "\nAD%u (GPIO%u) is the most marginal line.\n", worst, AD_PIN(worst));
+}
+
+// Selects the --adaptive-timing region of a bus address and programs its
+// timing. A region read for the first time starts where the last one
+// settled. Save ranges keep the base timing.
+// - region: Receives the region, or NULL outside the ROM.
+// Returns 0 on success, 1 when the backend failed to take the timing.
+int SelectTimingRegion(uint32_t address, struct TimingRegion** region)
+{
+    uint32_t offset = address - CART_ROM_BASE;
+    if(offset >= MAX_ROM_SIZE)
+    {
+        *region = NULL;
+        return SetTimingScale(1000);
+    }
+
+    *region = &timingRegions[offset / TIMING_REGION_SIZE];
+    if((*region)->permille == 0)
+    {
+        (*region)->permille = timingPermille;
+        (*region)->floorPermille = TIMING_MIN_PERMILLE;
+    }
+    return SetTimingScale((*region)->permille);
+}
+
+// Scales busTiming from the base timing and reprograms the backend.
+// Returns 0 on success, 1 when the backend failed to take the new timing
+// (already reported); it can't read until it does.
+int SetTimingScale(uint32_t permille)
+{
+    if(permille == timingPermille)
+    {
+        return 0;
+    }
+
+    timingPermille = permille;
+    busTiming.latchNs = baseTiming.latchNs * permille / 1000;
+    busTiming.strobeNs = baseTiming.strobeNs * permille / 1000;
+    busTiming.recoveryNs = baseTiming.recoveryNs * permille / 1000;
+    if(bus->retime != NULL && bus->retime() != 0)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+// Steps a region's timing after a page: faster after TIMING_CLEAN_PAGES clean
+// pages, never again as fast as a scale that needed a retry, and
+// TIMING_BACKOFF_STEPS slower at once when a page does.
+// - retried: The page needed more than two reads.
+void AdaptTiming(struct TimingRegion* region, int retried)
+{
+    region->pages++;
+    if(retried)
+    {
+        region->retriedPages++;
+        region->cleanPages = 0;
+        region->floorPermille = region->permille + TIMING_STEP_PERMILLE;
+        region->floorPermille = (region->floorPermille > 1000) ? 1000 : region->floorPermille;
+        region->permille += TIMING_BACKOFF_STEPS * TIMING_STEP_PERMILLE;
+        region->permille = (region->permille > 1000) ? 1000 : region->permille;
+        return;
+    }
+
+    if(++region->cleanPages >= TIMING_CLEAN_PAGES && region->permille > region->floorPermille)
+    {
+        region->cleanPages = 0;
+        region->permille -= TIMING_STEP_PERMILLE;
+        region->permille = (region->permille < region->floorPermille) ? region->floorPermille : region->permille;
+    }
+}
+
+// Prints the strobe time each --adaptive-timing region settled at.
+void ReportAdaptiveTiming(void)
+{
+    if(!adaptiveTiming)
+    {
+        return;
+    }
+
+    uint64_t pages = 0;
+    uint64_t retriedPages = 0;
+    fprintf(stderr, "Adaptive timing, READ strobe ns per 1 Mb region:");
+    for(uint index = 0;
+        index < MAX_ROM_SIZE / TIMING_REGION_SIZE;
+        index++)
+    {
+        const struct TimingRegion* region = &timingRegions[index];
+        if(region->pages != 0)
+        {
+            fprintf(stderr, " %u", baseTiming.strobeNs * region->permille / 1000);
+            pages += region->pages;
+            retriedPages += region->retriedPages;
+        }
+    }
+    fprintf(stderr, "\n%llu of %llu pages needed a retry (base strobe %u ns).\n",
+            (unsigned long long)retriedPages, (unsigned long long)pages, baseTiming.strobeNs);
+}
+
+// Reads a --recalibrate window of ROM pages into checkpointWindow, then
+// re-reads the reference block (header and IPL3) at the timing the last page
+// was read at. Temperature or a contact that shifts mid-dump shows up there
+// first: while the reference no longer matches the copy read before the dump,
+// the timing is recalibrated and the whole window read again.
+// - order: ROM page indices to read from, or NULL for consecutive pages.
+// - first: First page of the window (an index into order when given).
+// - count: Pages, at most checkpointPages.
+// Returns 0 once the reference matched, 1 when it still differed after
+// RECALIBRATE_ATTEMPTS recalibrations or a page failed to read.
+int ReadCheckpointWindow(const uint32_t* order, uint32_t first, uint count)
+{
+    uint16_t words[PAGE_WORDS];
+
+    if(!referenceRead)
+    {
+        for(uint page = 0;
+            page < REFERENCE_PAGES;
+            page++)
+        {
+            if(ReadPage(CART_ROM_BASE + page * ROM_PAGE_SIZE, referenceBlock[page]) != 0)
+            {
+                return 1;
+            }
+        }
+        referenceRead = 1;
+    }
+
+    for(uint attempt = 0;
+        ;
+        attempt++)
+    {
+        for(uint page = 0;
+            page < count;
+            page++)
+        {
+            uint32_t index = (order != NULL) ? order[first + page] : first + page;
+            if(ReadPage(CART_ROM_BASE + index * ROM_PAGE_SIZE, checkpointWindow[page]) != 0)
+            {
+                return 1;
+            }
+        }
+
+        int matched = 1;
+        for(uint page = 0;
+            page < REFERENCE_PAGES && matched;
+            page++)
+        {
+            matched = (ReadBackendPage(CART_ROM_BASE + page * ROM_PAGE_SIZE, words) == 0 &&
+                       memcmp(words, referenceBlock[page], sizeof(words)) == 0);
+        }
+
+        if(matched)
+        {
+            return 0;
+        }
+        if(attempt == RECALIBRATE_ATTEMPTS)
+        {
+            fprintf(stderr, "The header and IPL3 still read differently after %u recalibrations or resets; the cart changed during the dump.\n",
+                    RECALIBRATE_ATTEMPTS);
+            return 1;
+        }
+
+        // A hung cart is reset rather than waited for with ever longer strobes
+        if(BusHung(words))
+        {
+            if(ResetCart() != 0)
+            {
+                return 1;
+            }
+        }
+        else if(Recalibrate() != 0)
+        {
+            return 1;
+        }
+    }
+}
+
+// Lengthens the base timing by RECALIBRATE_PERMILLE for the rest of the dump
+// and reprograms the backend at the scale it runs at now, so --adaptive-timing
+// regions keep their place relative to the new base.
+// Returns 0 on success, 1 when the backend failed to take the new timing.
+int Recalibrate(void)
+{
+    uint32_t permille = timingPermille;
+
+    recalibrations++;
+    baseTiming.latchNs = baseTiming.latchNs * RECALIBRATE_PERMILLE / 1000;
+    baseTiming.strobeNs = baseTiming.strobeNs * RECALIBRATE_PERMILLE / 1000;
+    baseTiming.recoveryNs = baseTiming.recoveryNs * RECALIBRATE_PERMILLE / 1000;
+    timingPermille = 0;
+    if(SetTimingScale(permille) != 0)
+    {
+        return 1;
+    }
+    fprintf(stderr, "Reference block changed, recalibrated to a %u ns base strobe.\n", baseTiming.strobeNs);
+    return 0;
+}
+
+// Prints how often --recalibrate checkpoints lengthened the timing.
+void ReportRecalibration(void)
+{
+    if(checkpointPages == 0)
+    {
+        return;
+    }
+
+    fprintf(stderr, "Checkpoints every %u pages: %llu recalibrations, %llu cart resets, base strobe %u ns.\n",
+            checkpointPages, (unsigned long long)recalibrations, (unsigned long long)cartResets, baseTiming.strobeNs);
+}
+
+// A cart that wedged stops driving the bus, or drives it stuck: every word of
+// a reference page reads all ones or all zeros, which the header and IPL3
+// never do.
+// Returns 1 when the page looks like a hung bus.
+int BusHung(const uint16_t* words)
+{
+    int ones = 1;
+    int zeros = 1;
+    for(uint word = 0;
+        word < PAGE_WORDS;
+        word++)
+    {
+        ones &= (words[word] == 0xFFFF);
+        zeros &= (words[word] == 0x0000);
+    }
+    return ones || zeros;
+}
+
+// Recovers a hung cart: takes the pins back from the backend, holds RESET low
+// for RESET_PULSE_US with the latches closed, waits RESET_SETTLE_US for the
+// cart to come back up and hands the pins to the backend again. The next read
+// latches a fresh address.
+// Returns 0 on success, 1 when the backend fails to come back (already reported).
+int ResetCart(void)
+{
+    cartResets++;
+    fprintf(stderr, "The bus reads stuck, resetting the cart.\n");
+
+    if(bus->terminate != NULL)
+    {
+        bus->terminate();
+    }
+    SetupBusPins();
+
+    BusWrite(RESET, ACTIVE(LOW));
+    gpioDelay(RESET_PULSE_US);
+    BusWrite(RESET, INACTIVE(HIGH));
+    gpioDelay(RESET_SETTLE_US);
+
+    if(bus->init != NULL && bus->init() != 0)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+// Bit-banged page read. The address is latched once; the cart then advances its
+// internal address by one word on every READ strobe, so the page streams out
+// without re-latching.
+int BitBangReadPage(uint32_t address, uint16_t* words)
+{
+    BitBangReadWords(address, words, PAGE_WORDS);
+    return 0;
+}
+
+// Bit-banged read of the first words of a burst.
+// - address: Word-aligned bus address; the burst must not cross a page.
+// - words: Receives count words in bus order.
+void BitBangReadWords(uint32_t address, uint16_t* words, uint count)
+{
+    LatchPageAddress(address);
+
+    for(uint word = 0;
+        word < count;
+        word++)
+    {
+        // Activate read control signal
+        BusWrite(READ, ACTIVE(LOW));
+        BusDelay(busTiming.strobeNs);
+
+        // Read data into AD Bus
+        uint16_t data = GatherDataBus(BusReadLevels());
+
+        // Releasing READ advances the cart to the next word
+        BusWrite(READ, INACTIVE(HIGH));
+        BusDelay(busTiming.recoveryNs);
+
+        words[word] = data;
+    }
+
+    SetADBusPinsMode(PI_OUTPUT);
+}
+
+// Checks the bus before a dump, bit-banged, in a few milliseconds. A line with
+// a bad contact or a missing pull-down corrupts every word of a dump, so:
+// - The header page must read the same twice, not all low (no cart) and not
+//   as open bus (the cart ignored the address: AD12 low, or a line stuck high).
+// - Every AD line must read both levels across it; header and IPL3 vary enough.
+// - Walking a one, then a zero, through AD1-AD8 must read the header page's
+//   own words at those offsets.
+// - Pages one address bit apart must differ: AD9-AD15 walked the same way,
+//   then A16 up to the smallest ROM (AD0-AD3 as the high half). AD0 as the
+//   low half only selects a byte.
+// - The page must start with the .z64 magic.
+// - suspects: Receives the AD lines blamed, 0 when no line is (no cart, no magic).
+// Returns 0 when the bus passed, 1 otherwise (reported, naming the pins).
+int SelfTestBus(uint16_t* suspects)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    *suspects = 0;
+
+    uint16_t header[PAGE_WORDS];
+    uint16_t page[PAGE_WORDS];
+    BitBangReadWords(CART_ROM_BASE, header, PAGE_WORDS);
+    BitBangReadWords(CART_ROM_BASE, page, PAGE_WORDS);
+
+    uint16_t unstable = 0;
+    uint16_t high = 0;
+    uint16_t low = 0xFFFF;
+    for(uint word = 0;
+        word < PAGE_WORDS;
+        word++)
+    {
+        unstable |= header[word] ^ page[word];
+        high |= header[word];
+        low &= header[word];
+    }
+
+    // Open bus counts up with the address; a stuck line only pins its own bit
+    uint16_t stuck = (uint16_t)~high | low;
+    int openBus = 1;
+    for(uint word = 0;
+        word < PAGE_WORDS;
+        word++)
+    {
+        openBus &= (((header[word] ^ (uint16_t)(header[0] + word * 2)) & ~stuck) == 0);
+    }
+
+    if(unstable != 0)
+    {
+        *suspects = unstable;
+        ReportBusLines("reads the header page differently twice on", unstable);
+        return 1;
+    }
+    if(high == 0)
+    {
+        fprintf(stderr, "Bus self-test: every AD line reads low. Is a cart inserted?\n");
+        return 1;
+    }
+    if(openBus && stuck != 0xFFFF)
+    {
+        // The low half latched as 0, so any line set in the first word is stuck high
+        *suspects = (header[0] != 0) ? header[0] : 1u << 12;
+        ReportBusLines("reads open bus at the header, the cart ignored its address; suspect", *suspects);
+        return 1;
+    }
+    if(high != 0xFFFF || low != 0)
+    {
+        *suspects = stuck;
+        if(high != 0xFFFF)
+        {
+            ReportBusLines("never reads high on", ~high);
+        }
+        if(low != 0)
+        {
+            ReportBusLines("never reads low on", low);
+        }
+        return 1;
+    }
+
+    uint16_t walkedOne = 0;
+    uint16_t walkedZero = 0;
+    for(uint line = 1;
+        line < 9;
+        line++)
+    {
+        uint32_t offsets[2] = { 1u << line, (ROM_PAGE_SIZE - 2) & ~(1u << line) };
+        for(uint pattern = 0;
+            pattern < 2;
+            pattern++)
+        {
+            uint16_t word;
+            BitBangReadWords(CART_ROM_BASE + offsets[pattern], &word, 1);
+            if(word != header[offsets[pattern] / 2])
+            {
+                if(pattern == 0)
+                {
+                    walkedOne |= 1u << line;
+                }
+                else
+                {
+                    walkedZero |= 1u << line;
+                }
+            }
+        }
+    }
+
+    uint16_t top[PAGE_WORDS];
+    uint32_t ones = 0x10000 - ROM_PAGE_SIZE;
+    BitBangReadWords(CART_ROM_BASE + ones, top, PAGE_WORDS);
+    for(uint bit = 9;
+        (1u << bit) < PROBE_STEP;
+        bit++)
+    {
+        BitBangReadWords(CART_ROM_BASE + (1u << bit), page, PAGE_WORDS);
+        if(memcmp(page, header, sizeof(page)) == 0)
+        {
+            walkedOne |= 1u << (bit % 16);
+        }
+        if(bit < 16)
+        {
+            BitBangReadWords(CART_ROM_BASE + (ones & ~(1u << bit)), page, PAGE_WORDS);
+            if(memcmp(page, top, sizeof(page)) == 0)
+            {
+                walkedZero |= 1u << bit;
+            }
+        }
+    }
+
+    // A line stuck low fails its own walking one and the other lines' walking
+    // zeros, stuck high the reverse, so the smaller set names it
+    uint16_t aliased = walkedOne;
+    if(walkedOne == 0 || (walkedZero != 0 && __builtin_popcount(walkedZero) < __builtin_popcount(walkedOne)))
+    {
+        aliased = walkedZero;
+    }
+    if(aliased != 0)
+    {
+        *suspects = aliased;
+        ReportBusLines("reads the wrong words when walking the address on", aliased);
+        return 1;
+    }
+
+    uint32_t magic = (uint32_t)header[0] << 16 | header[1];
+    if(magic != Z64_MAGIC)
+    {
+        fprintf(stderr, "Bus self-test: the header starts %08X, not the .z64 magic %08X. Is the cart seated?\n",
+                magic, Z64_MAGIC);
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fprintf(stderr, "Bus self-test passed in %.1f ms.\n",
+            (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    return 0;
+}
+
+// Prints a self-test failure with the GPIO and cart pin of every AD line in it.
+void ReportBusLines(const char* problem, uint16_t lines)
+{
+    fprintf(stderr, "Bus self-test %s", problem);
+    for(uint line = 0;
+        line < 16;
+        line++)
+    {
+        if((lines >> line) & 0x1)
+        {
+            fprintf(stderr, " AD%u (GPIO%u, cart pin %u)", line, AD_PIN(line), adCartPins[line]);
+        }
+    }
+    fprintf(stderr, ".\n");
+}
+
+// Maps an image file read-only into memory.
+// - path: Image file to map.
+// - size: Receives the file size in bytes.
+// Returns the mapping, or NULL on error (already reported). Release with munmap().
+const uint8_t* MapImage(const char* path, size_t* size)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        perror(path);
+        return NULL;
+    }
+
+    struct stat info;
+    if(fstat(fd, &info) < 0 || info.st_size == 0)
+    {
+        fprintf(stderr, "%s: empty or unreadable image.\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    void* image = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(image == MAP_FAILED)
+    {
+        perror(path);
+        return NULL;
+    }
+
+    *size = info.st_size;
+    return image;
+}
+
+// Streams cart pages and compares them in place against a known-good .z64 image.
+// No dump is written. By default the first mismatching word ends the run; in
+// exhaustive mode every mismatching range is reported.
+// - referencePath: Big-endian (.z64) reference image.
+// - exhaustive: Non-zero to scan the whole image and report all mismatching ranges.
+// Returns 0 on match, EXIT_MISMATCH on mismatch, 1 on error.
+int VerifyAgainst(const char* referencePath, int exhaustive)
+{
+    size_t referenceSize = 0;
+    const uint8_t* reference = MapImage(referencePath, &referenceSize);
+    if(reference == NULL)
+    {
+        return 1;
+    }
+
+    if(referenceSize < 4 ||
+       ((uint32_t)reference[0] << 24 | reference[1] << 16 | reference[2] << 8 | reference[3]) != Z64_MAGIC)
+    {
+        fprintf(stderr, "%s: not a big-endian (.z64) image.\n", referencePath);
+        munmap((void*)reference, referenceSize);
+        return 1;
+    }
+
+    if(referenceSize > MAX_ROM_SIZE || referenceSize % ROM_PAGE_SIZE != 0)
+    {
+        fprintf(stderr, "%s: size 0x%zX is not a whole number of pages within the ROM space.\n",
+                referencePath, referenceSize);
+        munmap((void*)reference, referenceSize);
+        return 1;
+    }
+
+    madvise((void*)reference, referenceSize, MADV_SEQUENTIAL);
+
+    uint16_t page[PAGE_WORDS];
+    uint mismatchRanges = 0;
+    uint32_t mismatchStart = 0;
+    int inMismatch = 0;
+
+    for(uint32_t address = 0;
+        address < referenceSize;
+        address += ROM_PAGE_SIZE)
+    {
+        if(ReadPage(CART_ROM_BASE + address, page) != 0)
+        {
+            munmap((void*)reference, referenceSize);
+            return 1;
+        }
+
+        for(uint word = 0;
+            word < PAGE_WORDS;
+            word++)
+        {
+            uint32_t offset = address + word * 2;
+            uint16_t expected = (reference[offset] << 8) | reference[offset + 1];
+
+            if(page[word] != expected)
+            {
+                if(!exhaustive)
+                {
+                    printf("Mismatch at 0x%06X: cart 0x%04X, expected 0x%04X\n", offset, page[word], expected);
+                    munmap((void*)reference, referenceSize);
+                    return EXIT_MISMATCH;
+                }
+
+                if(!inMismatch)
+                {
+                    mismatchStart = offset;
+                    inMismatch = 1;
+                }
+            }
+            else if(inMismatch)
+            {
+                printf("Mismatch 0x%06X-0x%06X\n", mismatchStart, offset - 1);
+                mismatchRanges++;
+                inMismatch = 0;
+            }
+        }
+    }
+
+    if(inMismatch)
+    {
+        printf("Mismatch 0x%06X-0x%06zX\n", mismatchStart, referenceSize - 1);
+        mismatchRanges++;
+    }
+
+    munmap((void*)reference, referenceSize);
+
+    if(mismatchRanges > 0)
+    {
+        printf("%u mismatching range(s).\n", mismatchRanges);
+        return EXIT_MISMATCH;
+    }
+
+    printf("Cart matches %s (0x%zX bytes).\n", referencePath, referenceSize);
+    return 0;
+}
+
+// Returns the cart address of a quick-identify sample page.
+// Sample 0 is the header page; every other sample sits at a fixed pseudo-random
+// page inside its FINGERPRINT_STRIDE slice so samples don't all land on
+// power-of-two boundaries, where padding and mirrored data are most alike.
+// - sample: Sample index, 0 to FINGERPRINT_SAMPLES - 1.
+uint32_t FingerprintSampleAddress(uint sample)
+{
+    if(sample == 0)
+    {
+        return 0;
+    }
+
+    uint32_t pagesPerStride = FINGERPRINT_STRIDE / ROM_PAGE_SIZE;
+    uint32_t page = ((sample * 2654435761u) >> 8) % pagesPerStride;
+
+    return sample * FINGERPRINT_STRIDE + page * ROM_PAGE_SIZE;
+}
+
+// Folds big-endian 16-bit words into a 64-bit FNV-1a fingerprint.
+// - hash: Running fingerprint (start from the FNV offset basis).
+// - words: Words in bus order.
+// - count: Number of words.
+uint64_t FingerprintUpdate(uint64_t hash, const uint16_t* words, uint count)
+{
+    for(uint word = 0;
+        word < count;
+        word++)
+    {
+        hash = (hash ^ (words[word] >> 8)) * 0x100000001B3ULL;
+        hash = (hash ^ (words[word] & 0xFF)) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+// Fingerprints a .z64 image the same way FingerprintCart reads a cart.
+// Images smaller than FINGERPRINT_SPAN wrap around, as a mirrored cart would.
+uint64_t FingerprintImage(const uint8_t* image, size_t size)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    uint16_t page[PAGE_WORDS];
+
+    for(uint sample = 0;
+        sample < FINGERPRINT_SAMPLES;
+        sample++)
+    {
+        size_t address = FingerprintSampleAddress(sample) % size;
+        for(uint word = 0;
+            word < PAGE_WORDS;
+            word++)
+        {
+            size_t offset = (address + word * 2) % size;
+            page[word] = (image[offset] << 8) | image[(offset + 1) % size];
+        }
+        hash = FingerprintUpdate(hash, page, PAGE_WORDS);
+    }
+    return hash;
+}
+
+// Reads the header page plus the sampled pages from the cart and fingerprints them.
+uint64_t FingerprintCart(void)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    uint16_t page[PAGE_WORDS];
+
+    for(uint sample = 0;
+        sample < FINGERPRINT_SAMPLES;
+        sample++)
+    {
+        ReadPage(CART_ROM_BASE + FingerprintSampleAddress(sample), page);
+        hash = FingerprintUpdate(hash, page, PAGE_WORDS);
+    }
+    return hash;
+}
+
+// Writes a library index with one "<fingerprint> <size> <path>" line per dump.
+// - indexPath: Index file to create.
+// - dumpPaths: Existing .z64 dumps; other formats are skipped with a warning.
+// - dumpCount: Number of dumps.
+// Returns 0 on success, 1 on error.
+int BuildFingerprintIndex(const char* indexPath, char** dumpPaths, int dumpCount)
+{
+    FILE* index = fopen(indexPath, "w");
+    if(index == NULL)
+    {
+        perror(indexPath);
+        return 1;
+    }
+
+    uint indexed = 0;
+    for(int dump = 0;
+        dump < dumpCount;
+        dump++)
+    {
+        size_t size = 0;
+        const uint8_t* image = MapImage(dumpPaths[dump], &size);
+        if(image == NULL)
+        {
+            continue;
+        }
+
+        if(size < ROM_PAGE_SIZE ||
+           ((uint32_t)image[0] << 24 | image[1] << 16 | image[2] << 8 | image[3]) != Z64_MAGIC)
+        {
+            fprintf(stderr, "%s: not a big-endian (.z64) dump, skipped.\n", dumpPaths[dump]);
+        }
+        else
+        {
+            fprintf(index, "%016llX %zX %s\n",
+                    (unsigned long long)FingerprintImage(image, size), size, dumpPaths[dump]);
+            indexed++;
+        }
+        munmap((void*)image, size);
+    }
+
+    fclose(index);
+    printf("Indexed %u of %d dump(s) into %s.\n", indexed, dumpCount, indexPath);
+    return 0;
+}
+
+// Fingerprints the inserted cart and looks it up in a library index.
+// - indexPath: Index written by BuildFingerprintIndex.
+// Returns 0 when the cart is already in the library, EXIT_UNKNOWN when not, 1 on error.
+int IdentifyCart(const char* indexPath)
+{
+    FILE* index = fopen(indexPath, "r");
+    if(index == NULL)
+    {
+        perror(indexPath);
+        return 1;
+    }
+
+    uint64_t fingerprint = FingerprintCart();
+
+    char line[4096];
+    while(fgets(line, sizeof(line), index) != NULL)
+    {
+        unsigned long long entryFingerprint = 0;
+        size_t entrySize = 0;
+        int pathOffset = 0;
+
+        if(sscanf(line, "%llx %zx %n", &entryFingerprint, &entrySize, &pathOffset) == 2 &&
+           entryFingerprint == fingerprint)
+        {
+            line[strcspn(line, "\n")] = '\0';
+            printf("Match: %s (0x%zX bytes)\n", line + pathOffset, entrySize);
+            fclose(index);
+            return 0;
+        }
+    }
+
+    fclose(index);
+    printf("Unknown cart (fingerprint %016llX).\n", (unsigned long long)fingerprint);
+    return EXIT_UNKNOWN;
+}
+
+// Reads the header page twice and prints what it names: header name, game
+// code and revision, CRC1/CRC2, and the DAT index entry when there is one.
+// Returns 0 when both reads agree and start with the .z64 magic, 1 otherwise.
+int VerifyHeader(void)
+{
+    uint16_t header[PAGE_WORDS];
+    uint16_t again[PAGE_WORDS];
+    if(ReadPage(CART_ROM_BASE, header) != 0 || ReadPage(CART_ROM_BASE, again) != 0)
+    {
+        return 1;
+    }
+
+    uint32_t magic = (uint32_t)header[0] << 16 | header[1];
+    if(memcmp(header, again, sizeof(header)) != 0)
+    {
+        fprintf(stderr, "The header page read differently twice: reseat the cart or run --self-test.\n");
+        return 1;
+    }
+    if(magic != Z64_MAGIC)
+    {
+        fprintf(stderr, "The header starts with %08X, not the .z64 magic: no cart, or run --self-test.\n", magic);
+        return 1;
+    }
+
+    // Game code at 0x3B-0x3E, revision at 0x3F
+    char name[64];
+    char code[5] = { header[0x3A / 2] & 0xFF, header[0x3C / 2] >> 8, header[0x3C / 2] & 0xFF, header[0x3E / 2] >> 8, '\0' };
+    for(uint byte = 0;
+        byte < 4;
+        byte++)
+    {
+        if(code[byte] < 0x20 || code[byte] > 0x7E)
+        {
+            code[byte] = '?';
+        }
+    }
+    HeaderName(header, name, sizeof(name));
+    printf("Header OK: %s, game code %s rev %u, CRC1 %08X CRC2 %08X\n", name, code, header[0x3E / 2] & 0xFF,
+           (uint32_t)header[8] << 16 | header[9], (uint32_t)header[10] << 16 | header[11]);
+
+    const struct DatEntry* entry = DatLookupHeader(header);
+    if(entry != NULL)
+    {
+        PrintDatEntry(entry);
+    }
+    else if(datIndex.size != 0)
+    {
+        printf("Game code not in the DAT index.\n");
+    }
+    return 0;
+}
+
+// Builds a 32-bit CRC table (reflected polynomial 0xEDB88320) on first use.
+static uint32_t crc32Table[256];
+
+// Continues a standard CRC-32 (as used by No-Intro DATs) over a byte range.
+// - crc: Running value, start from 0.
+// - bytes: Data to add.
+// - length: Number of bytes.
+uint32_t Crc32Update(uint32_t crc, const uint8_t* bytes, size_t length)
+{
+    if(crc32Table[1] == 0)
+    {
+        for(uint32_t value = 0;
+            value < 256;
+            value++)
+        {
+            uint32_t entry = value;
+            for(uint bit = 0;
+                bit < 8;
+                bit++)
+            {
+                entry = (entry & 1) ? (entry >> 1) ^ 0xEDB88320 : entry >> 1;
+            }
+            crc32Table[value] = entry;
+        }
+    }
+
+    crc = ~crc;
+    for(size_t offset = 0;
+        offset < length;
+        offset++)
+    {
+        crc = crc32Table[(crc ^ bytes[offset]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+void Sha1Init(struct Sha1* sha1)
+{
+    static const uint32_t initial[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    memcpy(sha1->state, initial, sizeof(initial));
+    sha1->length = 0;
+}
+
+// Compresses one 64-byte block into the state (FIPS 180-4).
+void Sha1Block(uint32_t* state, const uint8_t* block)
+{
+    uint32_t schedule[80];
+    for(uint word = 0;
+        word < 16;
+        word++)
+    {
+        schedule[word] = (uint32_t)block[word * 4] << 24 | block[word * 4 + 1] << 16 |
+                         block[word * 4 + 2] << 8 | block[word * 4 + 3];
+    }
+    for(uint word = 16;
+        word < 80;
+        word++)
+    {
+        uint32_t mixed = schedule[word - 3] ^ schedule[word - 8] ^ schedule[word - 14] ^ schedule[word - 16];
+        schedule[word] = (mixed << 1) | (mixed >> 31);
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    for(uint round = 0;
+        round < 80;
+        round++)
+    {
+        uint32_t f, k;
+        if(round < 20)
+        {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        }
+        else if(round < 40)
+        {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        }
+        else if(round < 60)
+        {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        }
+        else
+        {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+
+        uint32_t next = ((a << 5) | (a >> 27)) + f + e + k + schedule[round];
+        e = d;
+        d = c;
+        c = (b << 30) | (b >> 2);
+        b = a;
+        a = next;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+// Continues a SHA-1 over a byte range.
+void Sha1Update(struct Sha1* sha1, const uint8_t* bytes, size_t length)
+{
+    size_t used = sha1->length % 64;
+    sha1->length += length;
+
+    if(used != 0)
+    {
+        size_t take = (length < 64 - used) ? length : 64 - used;
+        memcpy(sha1->block + used, bytes, take);
+        bytes += take;
+        length -= take;
+        if(used + take < 64)
+        {
+            return;
+        }
+        Sha1Block(sha1->state, sha1->block);
+    }
+
+    while(length >= 64)
+    {
+        Sha1Block(sha1->state, bytes);
+        bytes += 64;
+        length -= 64;
+    }
+    memcpy(sha1->block, bytes, length);
+}
+
+// Pads the message and writes the SHA1_SIZE byte digest.
+void Sha1Final(struct Sha1* sha1, uint8_t* digest)
+{
+    uint64_t bits = sha1->length * 8;
+    uint8_t padding[72] = { 0x80 };
+    size_t used = sha1->length % 64;
+    size_t padLength = (used < 56) ? 56 - used : 120 - used;
+
+    for(uint byte = 0;
+        byte < 8;
+        byte++)
+    {
+        padding[padLength + byte] = bits >> (56 - byte * 8);
+    }
+    Sha1Update(sha1, padding, padLength + 8);
+
+    for(uint word = 0;
+        word < 5;
+        word++)
+    {
+        digest[word * 4] = sha1->state[word] >> 24;
+        digest[word * 4 + 1] = sha1->state[word] >> 16;
+        digest[word * 4 + 2] = sha1->state[word] >> 8;
+        digest[word * 4 + 3] = sha1->state[word];
+    }
+}
+
+// Hashes a typed key for the perfect-hash index.
+// Seed 0 selects the bucket; the bucket's displacement seed selects the slot.
+uint32_t DatKeyHash(uint8_t type, const uint8_t* bytes, uint length, uint32_t seed)
+{
+    uint32_t hash = 0x811C9DC5 ^ (seed * 0x9E3779B9);
+    hash = (hash ^ type) * 0x01000193;
+    for(uint offset = 0;
+        offset < length;
+        offset++)
+    {
+        hash = (hash ^ bytes[offset]) * 0x01000193;
+    }
+
+    // Final avalanche so low bits depend on every input byte
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6B;
+    hash ^= hash >> 13;
+    hash *= 0xC2B2AE35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// Writes the lookup key of the given type for an entry.
+// Returns the key length in bytes.
+uint DatEntryKey(const struct DatEntry* entry, uint type, uint8_t* key)
+{
+    switch(type)
+    {
+        case DatKeyCrc32:
+            key[0] = entry->crc32 >> 24;
+            key[1] = entry->crc32 >> 16;
+            key[2] = entry->crc32 >> 8;
+            key[3] = entry->crc32;
+            return 4;
+        case DatKeyMd5:
+            memcpy(key, entry->md5, 16);
+            return 16;
+        case DatKeySha1:
+            memcpy(key, entry->sha1, 20);
+            return 20;
+        default:
+            memcpy(key, entry->serial, 4);
+            key[4] = entry->revision;
+            return 5;
+    }
+}
+
+// Looks a key up in the mapped DAT index in O(1).
+// - type: DatKeyCrc32, DatKeyMd5, DatKeySha1 or DatKeySerial.
+// - key: Key bytes as produced by DatEntryKey (CRC32 big-endian, serial + revision).
+// - length: Key length in bytes.
+// Returns the matching entry, or NULL when absent or no index is loaded.
+const struct DatEntry* DatLookup(uint type, const uint8_t* key, uint length)
+{
+    if(datIndex.header == NULL || datIndex.header->entryCount == 0)
+    {
+        return NULL;
+    }
+
+    const struct DatIndexHeader* header = datIndex.header;
+    uint32_t bucket = DatKeyHash(type, key, length, 0) % header->bucketCount;
+    uint32_t slot = DatKeyHash(type, key, length, datIndex.displacements[bucket]) % header->slotCount;
+    uint32_t value = datIndex.slots[slot];
+
+    if(value == DAT_EMPTY_SLOT || (value & 0x3) != type)
+    {
+        return NULL;
+    }
+
+    const struct DatEntry* entry = &datIndex.entries[value >> 2];
+    uint8_t entryKey[20];
+    if(DatEntryKey(entry, type, entryKey) != length || memcmp(entryKey, key, length) != 0)
+    {
+        return NULL;
+    }
+    return entry;
+}
+
+// Looks up the game code and revision from a header page read off the cart.
+// - header: At least the first 0x40 bytes of the ROM as 16-bit bus words.
+const struct DatEntry* DatLookupHeader(const uint16_t* header)
+{
+    // Game code at 0x3B-0x3E, revision at 0x3F
+    uint8_t key[5] = {
+        header[0x3A / 2] & 0xFF,
+        header[0x3C / 2] >> 8,
+        header[0x3C / 2] & 0xFF,
+        header[0x3E / 2] >> 8,
+        header[0x3E / 2] & 0xFF
+    };
+    return DatLookup(DatKeySerial, key, sizeof(key));
+}
+
+// Returns the title string of an index entry.
+const char* DatTitle(const struct DatEntry* entry)
+{
+    return datIndex.strings + entry->titleOffset;
+}
+
+// Maps a compiled DAT index for the lifetime of the process.
+// - path: Index written by CompileDatIndex.
+// - required: Non-zero to report a missing file as an error.
+// Returns 0 when loaded (or silently absent and not required), 1 on error.
+int LoadDatIndex(const char* path, int required)
+{
+    if(!required && access(path, R_OK) != 0)
+    {
+        return 0;
+    }
+
+    size_t size = 0;
+    const uint8_t* image = MapImage(path, &size);
+    if(image == NULL)
+    {
+        return 1;
+    }
+
+    const struct DatIndexHeader* header = (const struct DatIndexHeader*)image;
+    if(size < sizeof(*header) || memcmp(header->magic, DAT_INDEX_MAGIC, 8) != 0 ||
+       header->version != DAT_INDEX_VERSION)
+    {
+        fprintf(stderr, "%s: not a DAT index (rebuild with --compile-dat).\n", path);
+        munmap((void*)image, size);
+        return 1;
+    }
+
+    size_t expected = sizeof(*header) +
+                      (size_t)header->bucketCount * 4 +
+                      (size_t)header->slotCount * 4 +
+                      (size_t)header->entryCount * sizeof(struct DatEntry) +
+                      header->stringsSize;
+    if(expected != size || (header->entryCount > 0 && (header->bucketCount == 0 || header->slotCount == 0)))
+    {
+        fprintf(stderr, "%s: truncated or corrupt DAT index.\n", path);
+        munmap((void*)image, size);
+        return 1;
+    }
+
+    const uint32_t* displacements = (const uint32_t*)(header + 1);
+    const uint32_t* slots = displacements + header->bucketCount;
+    const struct DatEntry* entries = (const struct DatEntry*)(slots + header->slotCount);
+    const char* strings = (const char*)(entries + header->entryCount);
+
+    // DatLookup and DatTitle index straight through these, so check them once here
+    int valid = 1;
+    for(uint32_t slot = 0;
+        slot < header->slotCount && valid;
+        slot++)
+    {
+        valid = (slots[slot] == DAT_EMPTY_SLOT ||
+                 ((slots[slot] >> 2) < header->entryCount && (slots[slot] & 0x3) < DAT_KEY_TYPES));
+    }
+    for(uint32_t entry = 0;
+        entry < header->entryCount && valid;
+        entry++)
+    {
+        uint32_t offset = entries[entry].titleOffset;
+        valid = (offset < header->stringsSize &&
+                 memchr(strings + offset, '\0', header->stringsSize - offset) != NULL);
+    }
+    if(!valid)
+    {
+        fprintf(stderr, "%s: corrupt DAT index (rebuild with --compile-dat).\n", path);
+        munmap((void*)image, size);
+        return 1;
+    }
+
+    datIndex.header = header;
+    datIndex.displacements = displacements;
+    datIndex.slots = slots;
+    datIndex.entries = entries;
+    datIndex.strings = strings;
+    datIndex.size = size;
+    return 0;
+}
+
+// Copies an XML attribute value out of a tag, decoding the five predefined entities.
+// - tag, tagEnd: The tag text, from '<' to '>'.
+// - name: Attribute name.
+// - value, valueSize: Output buffer.
+// Returns 1 when the attribute exists, 0 otherwise.
+int XmlAttribute(const char* tag, const char* tagEnd, const char* name, char* value, size_t valueSize)
+{
+    size_t nameLength = strlen(name);
+
+    for(const char* cursor = tag + 1;
+        cursor + nameLength + 2 < tagEnd;
+        cursor++)
+    {
+        if((cursor[-1] != ' ' && cursor[-1] != '\t' && cursor[-1] != '\n') ||
+           strncmp(cursor, name, nameLength) != 0 || cursor[nameLength] != '=' ||
+           (cursor[nameLength + 1] != '"' && cursor[nameLength + 1] != '\''))
+        {
+            continue;
+        }
+
+        char quote = cursor[nameLength + 1];
+        const char* source = cursor + nameLength + 2;
+        size_t length = 0;
+
+        while(source < tagEnd && *source != quote && length + 1 < valueSize)
+        {
+            static const char* entities[][2] = {
+                { "&amp;", "&" }, { "&lt;", "<" }, { "&gt;", ">" }, { "&quot;", "\"" }, { "&apos;", "'" }
+            };
+            int decoded = 0;
+
+            for(uint entity = 0;
+                entity < sizeof(entities) / sizeof(entities[0]) && *source == '&';
+                entity++)
+            {
+                size_t entityLength = strlen(entities[entity][0]);
+                if(strncmp(source, entities[entity][0], entityLength) == 0)
+                {
+                    value[length++] = entities[entity][1][0];
+                    source += entityLength;
+                    decoded = 1;
+                    break;
+                }
+            }
+
+            if(!decoded)
+            {
+                value[length++] = *source++;
+            }
+        }
+        value[length] = '\0';
+        return 1;
+    }
+    return 0;
+}
+
+// Parses a fixed-length hex string into bytes. Returns 1 on success.
+int ParseHex(const char* text, uint8_t* bytes, uint length)
+{
+    if(strlen(text) != length * 2)
+    {
+        return 0;
+    }
+
+    for(uint offset = 0;
+        offset < length;
+        offset++)
+    {
+        unsigned int value = 0;
+        if(sscanf(text + offset * 2, "%2x", &value) != 1)
+        {
+            return 0;
+        }
+        bytes[offset] = value;
+    }
+    return 1;
+}
+
+// Returns the header revision byte for a No-Intro title: "(Rev 1)"/"(Rev A)" -> 1.
+uint8_t DatTitleRevision(const char* title)
+{
+    const char* revision = strstr(title, "(Rev ");
+    if(revision == NULL)
+    {
+        return 0;
+    }
+
+    char mark = revision[5];
+    if(mark >= '0' && mark <= '9')
+    {
+        return atoi(revision + 5);
+    }
+    if(mark >= 'A' && mark <= 'Z')
+    {
+        return mark - 'A' + 1;
+    }
+    return 0;
+}
+
+// Maps a save type attribute ("eeprom4k", "sram", "flash", ...) onto SaveType.
+uint8_t ParseSaveType(const char* text)
+{
+    for(uint saveType = 0;
+        saveType < SaveTypeCount;
+        saveType++)
+    {
+        if(strcmp(text, saveTypeNames[saveType]) == 0)
+        {
+            return saveType;
+        }
+    }
+    return SaveUnknown;
+}
+
+// One key collected while compiling the perfect-hash table.
+struct DatKey
+{
+    uint32_t bucket;
+    uint32_t entry;
+    uint8_t type;
+    uint8_t length;
+    uint8_t bytes[20];
+};
+
+int CompareDatKeys(const void* left, const void* right)
+{
+    const struct DatKey* a = left;
+    const struct DatKey* b = right;
+
+    if(a->bucket != b->bucket)
+    {
+        return (a->bucket < b->bucket) ? -1 : 1;
+    }
+    if(a->type != b->type)
+    {
+        return a->type - b->type;
+    }
+    int order = memcmp(a->bytes, b->bytes, a->length);
+    if(order != 0)
+    {
+        return order;
+    }
+    // Equal keys keep DAT order so the first entry wins
+    return (a->entry < b->entry) ? -1 : (a->entry > b->entry);
+}
+
+// Bucket ranges into the sorted key array, placed largest first.
+struct DatBucket
+{
+    uint32_t bucket;
+    uint32_t first;
+    uint32_t count;
+};
+
+int CompareDatBuckets(const void* left, const void* right)
+{
+    const struct DatBucket* a = left;
+    const struct DatBucket* b = right;
+    return (a->count != b->count) ? (int)b->count - (int)a->count : (int)a->bucket - (int)b->bucket;
+}
+
+// Builds a hash-and-displace perfect hash: every bucket gets the first seed
+// that sends all of its keys to distinct free slots.
+// - keys: Deduplicated keys sorted by bucket.
+// - keyCount: Number of keys.
+// - bucketCount, slotCount: Table dimensions.
+// - displacements: Receives bucketCount seeds.
+// - slots: Receives slotCount (entry << 2 | type) values, DAT_EMPTY_SLOT when unused.
+// Returns 1 on success, 0 when some bucket could not be placed, -1 when out of memory.
+int BuildPerfectHash(const struct DatKey* keys, uint32_t keyCount, uint32_t bucketCount,
+                     uint32_t slotCount, uint32_t* displacements, uint32_t* slots)
+{
+    struct DatBucket* buckets = calloc(bucketCount, sizeof(*buckets));
+    uint32_t* candidate = malloc(sizeof(uint32_t) * (keyCount + 1));
+    if(buckets == NULL || candidate == NULL)
+    {
+        free(candidate);
+        free(buckets);
+        return -1;
+    }
+
+    for(uint32_t bucket = 0;
+        bucket < bucketCount;
+        bucket++)
+    {
+        buckets[bucket].bucket = bucket;
+        displacements[bucket] = 0;
+    }
+    for(uint32_t key = 0;
+        key < keyCount;
+        key++)
+    {
+        if(buckets[keys[key].bucket].count++ == 0)
+        {
+            buckets[keys[key].bucket].first = key;
+        }
+    }
+    for(uint32_t slot = 0;
+        slot < slotCount;
+        slot++)
+    {
+        slots[slot] = DAT_EMPTY_SLOT;
+    }
+
+    qsort(buckets, bucketCount, sizeof(*buckets), CompareDatBuckets);
+
+    int placed = 1;
+    for(uint32_t bucket = 0;
+        bucket < bucketCount && buckets[bucket].count > 0 && placed;
+        bucket++)
+    {
+        const struct DatKey* bucketKeys = &keys[buckets[bucket].first];
+        placed = 0;
+
+        for(uint32_t seed = 1;
+            seed < DAT_MAX_SEED && !placed;
+            seed++)
+        {
+            placed = 1;
+            for(uint32_t key = 0;
+                key < buckets[bucket].count && placed;
+                key++)
+            {
+                uint32_t slot = DatKeyHash(bucketKeys[key].type, bucketKeys[key].bytes,
+                                           bucketKeys[key].length, seed) % slotCount;
+                placed = (slots[slot] == DAT_EMPTY_SLOT);
+                for(uint32_t previous = 0;
+                    previous < key && placed;
+                    previous++)
+                {
+                    placed = (candidate[previous] != slot);
+                }
+                candidate[key] = slot;
+            }
+
+            if(placed)
+            {
+                displacements[buckets[bucket].bucket] = seed;
+                for(uint32_t key = 0;
+                    key < buckets[bucket].count;
+                    key++)
+                {
+                    slots[candidate[key]] = (bucketKeys[key].entry << 2) | bucketKeys[key].type;
+                }
+            }
+        }
+    }
+
+    free(candidate);
+    free(buckets);
+    return placed;
+}
+
+// Compiles No-Intro DAT files into a perfect-hash index for LoadDatIndex.
+// Each <rom> contributes CRC32, MD5, SHA-1 and (when it has a serial) game code +
+// revision keys. Optional non-standard "savetype" and "cic" attributes are kept.
+// - indexPath: Index file to write.
+// - datPaths: DAT (XML) files.
+// - datCount: Number of DAT files.
+// Returns 0 on success, 1 on error.
+int CompileDatIndex(const char* indexPath, char** datPaths, int datCount)
+{
+    struct DatEntry* entries = NULL;
+    uint32_t entryCount = 0;
+    uint32_t entryCapacity = 0;
+    char* strings = NULL;
+    uint32_t stringsSize = 0;
+    int outOfMemory = 0;
+
+    for(int dat = 0;
+        dat < datCount && !outOfMemory;
+        dat++)
+    {
+        size_t size = 0;
+        const char* text = (const char*)MapImage(datPaths[dat], &size);
+        if(text == NULL)
+        {
+            free(entries);
+            free(strings);
+            return 1;
+        }
+        const char* end = text + size;
+
+        for(const char* game = memmem(text, size, "<game ", 6);
+            game != NULL && !outOfMemory;
+            game = memmem(game + 1, end - game - 1, "<game ", 6))
+        {
+            const char* gameEnd = memchr(game, '>', end - game);
+            const char* gameClose = memmem(game, end - game, "</game>", 7);
+            if(gameEnd == NULL || gameClose == NULL)
+            {
+                break;
+            }
+
+            char title[512];
+            if(!XmlAttribute(game, gameEnd, "name", title, sizeof(title)))
+            {
+                continue;
+            }
+
+            for(const char* rom = memmem(gameEnd, gameClose - gameEnd, "<rom ", 5);
+                rom != NULL;
+                rom = memmem(rom + 1, gameClose - rom - 1, "<rom ", 5))
+            {
+                const char* romEnd = memchr(rom, '>', gameClose - rom);
+                if(romEnd == NULL)
+                {
+                    break;
+                }
+
+                char value[64];
+                struct DatEntry entry;
+                memset(&entry, 0, sizeof(entry));
+
+                if(!XmlAttribute(rom, romEnd, "size", value, sizeof(value)))
+                {
+                    continue;
+                }
+                entry.size = strtoul(value, NULL, 10);
+
+                uint8_t crc[4];
+                if(!XmlAttribute(rom, romEnd, "crc", value, sizeof(value)) || !ParseHex(value, crc, 4))
+                {
+                    continue;
+                }
+                entry.crc32 = ((uint32_t)crc[0] << 24) | (crc[1] << 16) | (crc[2] << 8) | crc[3];
+
+                if(XmlAttribute(rom, romEnd, "md5", value, sizeof(value)))
+                {
+                    ParseHex(value, entry.md5, 16);
+                }
+                if(XmlAttribute(rom, romEnd, "sha1", value, sizeof(value)))
+                {
+                    ParseHex(value, entry.sha1, 20);
+                }
+                if(XmlAttribute(rom, romEnd, "serial", value, sizeof(value)) && strlen(value) >= 4)
+                {
+                    memcpy(entry.serial, value, 4);
+                }
+                if(XmlAttribute(rom, romEnd, "savetype", value, sizeof(value)))
+                {
+                    entry.saveType = ParseSaveType(value);
+                }
+                if(XmlAttribute(rom, romEnd, "cic", value, sizeof(value)))
+                {
+                    entry.cic = strtoul(value, NULL, 10);
+                }
+                entry.revision = DatTitleRevision(title);
+
+                uint32_t titleLength = strlen(title) + 1;
+                char* grownStrings = realloc(strings, stringsSize + titleLength);
+                if(grownStrings == NULL)
+                {
+                    outOfMemory = 1;
+                    break;
+                }
+                strings = grownStrings;
+                memcpy(strings + stringsSize, title, titleLength);
+                entry.titleOffset = stringsSize;
+                stringsSize += titleLength;
+
+                if(entryCount == entryCapacity)
+                {
+                    uint32_t grownCapacity = entryCapacity ? entryCapacity * 2 : 1024;
+                    struct DatEntry* grownEntries = realloc(entries, grownCapacity * sizeof(*entries));
+                    if(grownEntries == NULL)
+                    {
+                        outOfMemory = 1;
+                        break;
+                    }
+                    entries = grownEntries;
+                    entryCapacity = grownCapacity;
+                }
+                entries[entryCount++] = entry;
+            }
+        }
+
+        munmap((void*)text, size);
+    }
+
+    // Collect every key with its bucket, then drop duplicates (first DAT entry wins)
+    uint32_t keyCount = 0;
+    uint32_t bucketCount = entryCount * DAT_KEY_TYPES / 4 + 1;
+    struct DatKey* keys = outOfMemory ? NULL : malloc(sizeof(*keys) * ((size_t)entryCount * DAT_KEY_TYPES + 1));
+    uint32_t* displacements = (keys == NULL) ? NULL : malloc(sizeof(uint32_t) * bucketCount);
+    if(displacements == NULL)
+    {
+        fprintf(stderr, "Failed to allocate the DAT index.\n");
+        free(keys);
+        free(strings);
+        free(entries);
+        return 1;
+    }
+
+    for(uint32_t entry = 0;
+        entry < entryCount;
+        entry++)
+    {
+        for(uint type = 0;
+            type < DAT_KEY_TYPES;
+            type++)
+        {
+            if(type == DatKeySerial && entries[entry].serial[0] == '\0')
+            {
+                continue;
+            }
+
+            struct DatKey* key = &keys[keyCount++];
+            memset(key, 0, sizeof(*key));
+            key->type = type;
+            key->entry = entry;
+            key->length = DatEntryKey(&entries[entry], type, key->bytes);
+            key->bucket = DatKeyHash(type, key->bytes, key->length, 0) % bucketCount;
+        }
+    }
+
+    qsort(keys, keyCount, sizeof(*keys), CompareDatKeys);
+
+    uint32_t uniqueCount = 0;
+    for(uint32_t key = 0;
+        key < keyCount;
+        key++)
+    {
+        if(uniqueCount > 0 &&
+           keys[uniqueCount - 1].bucket == keys[key].bucket &&
+           keys[uniqueCount - 1].type == keys[key].type &&
+           memcmp(keys[uniqueCount - 1].bytes, keys[key].bytes, keys[key].length) == 0)
+        {
+            continue;
+        }
+        keys[uniqueCount++] = keys[key];
+    }
+
+    // Load factor ~0.8 keeps seed searches short; grow the table if a bucket won't fit
+    uint32_t slotCount = uniqueCount + uniqueCount / 4 + 1;
+    uint32_t* slots = NULL;
+    int built = 0;
+
+    for(uint attempt = 0;
+        attempt < 8 && built == 0;
+        attempt++)
+    {
+        if(attempt > 0)
+        {
+            slotCount += slotCount / 4;
+        }
+        uint32_t* grownSlots = realloc(slots, sizeof(uint32_t) * slotCount);
+        if(grownSlots == NULL)
+        {
+            built = -1;
+            break;
+        }
+        slots = grownSlots;
+        built = BuildPerfectHash(keys, uniqueCount, bucketCount, slotCount, displacements, slots);
+    }
+
+    // Only create the file once there is something to write
+    int status = 1;
+    FILE* index = NULL;
+    if(built < 0)
+    {
+        fprintf(stderr, "Failed to allocate the DAT index.\n");
+    }
+    else if(built == 0)
+    {
+        fprintf(stderr, "Failed to build a perfect hash over %u keys.\n", uniqueCount);
+    }
+    else if((index = fopen(indexPath, "wb")) == NULL)
+    {
+        perror(indexPath);
+    }
+    else
+    {
+        struct DatIndexHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, DAT_INDEX_MAGIC, 8);
+        header.version = DAT_INDEX_VERSION;
+        header.entryCount = entryCount;
+        header.bucketCount = bucketCount;
+        header.slotCount = slotCount;
+        header.stringsSize = stringsSize;
+
+        if(fwrite(&header, sizeof(header), 1, index) == 1 &&
+           fwrite(displacements, sizeof(uint32_t), bucketCount, index) == bucketCount &&
+           fwrite(slots, sizeof(uint32_t), slotCount, index) == slotCount &&
+           fwrite(entries, sizeof(*entries), entryCount, index) == entryCount &&
+           fwrite(strings, 1, stringsSize, index) == stringsSize)
+        {
+            printf("Compiled %u DAT entries (%u keys, %u slots) into %s.\n",
+                   entryCount, uniqueCount, slotCount, indexPath);
+            status = 0;
+        }
+        else
+        {
+            perror(indexPath);
+        }
+    }
+
+    if(index != NULL)
+    {
+        fclose(index);
+    }
+    free(slots);
+    free(displacements);
+    free(keys);
+    free(strings);
+    free(entries);
+    return status;
+}
+
+// Looks a CRC32 (8 hex digits), MD5 (32) or SHA-1 (40) up in the loaded DAT index.
+// Returns 0 when found, EXIT_UNKNOWN when not, 1 on a malformed hash.
+int PrintDatLookup(const char* hash)
+{
+    uint8_t key[20];
+    uint type;
+    uint length = strlen(hash) / 2;
+
+    switch(length)
+    {
+        case 4:  type = DatKeyCrc32; break;
+        case 16: type = DatKeyMd5;   break;
+        case 20: type = DatKeySha1;  break;
+        default:
+            fprintf(stderr, "%s: expected a CRC32, MD5 or SHA-1 hex digest.\n", hash);
+            return 1;
+    }
+
+    if(!ParseHex(hash, key, length))
+    {
+        fprintf(stderr, "%s: invalid hex digest.\n", hash);
+        return 1;
+    }
+
+    const struct DatEntry* entry = DatLookup(type, key, length);
+    if(entry == NULL)
+    {
+        printf("No DAT entry for %s.\n", hash);
+        return EXIT_UNKNOWN;
+    }
+
+    PrintDatEntry(entry);
+    return 0;
+}
+
+// Prints an index entry on one line.
+void PrintDatEntry(const struct DatEntry* entry)
+{
+    printf("%s (0x%X bytes, CRC32 %08X, serial %.4s rev %u, save %s, CIC %u)\n",
+           DatTitle(entry), entry->size, entry->crc32,
+           entry->serial[0] ? entry->serial : "----", entry->revision,
+           saveTypeNames[entry->saveType < SaveTypeCount ? entry->saveType : SaveUnknown], entry->cic);
+}
+
+// Finds the ROM size of a cart the DAT index doesn't know by probing 1 Mb
+// boundaries: past the end of the ROM the cart either returns open bus (each
+// word equals the low 16 bits of its address) or mirrors the header.
+// Returns the first boundary that looks unpopulated, or MAX_ROM_SIZE.
+uint32_t ProbeRomSize(void)
+{
+    uint16_t header[PAGE_WORDS];
+    uint16_t page[PAGE_WORDS];
+    ReadPage(CART_ROM_BASE, header);
+
+    for(uint32_t boundary = PROBE_STEP;
+        boundary < MAX_ROM_SIZE;
+        boundary += PROBE_STEP)
+    {
+        ReadPage(CART_ROM_BASE + boundary, page);
+
+        int openBus = 1;
+        for(uint word = 0;
+            word < PAGE_WORDS && openBus;
+            word++)
+        {
+            openBus = (page[word] == ((boundary + word * 2) & 0xFFFF));
+        }
+
+        if(openBus || memcmp(page, header, sizeof(page)) == 0)
+        {
+            return boundary;
+        }
+    }
+    return MAX_ROM_SIZE;
+}
+
+// Computes the header checksum the boot code of a CIC would compute.
+// - rom: Big-endian image, at least CHECKSUM_END bytes.
+// - cic: 6102 (also 6101), 6103, 6105 or 6106.
+// - crc1, crc2: Receive the checksum words.
+void RomChecksum(const uint8_t* rom, uint16_t cic, uint32_t* crc1, uint32_t* crc2)
+{
+    uint32_t seed = cicVariants[0].seed;
+    for(uint variant = 0;
+        variant < sizeof(cicVariants) / sizeof(cicVariants[0]);
+        variant++)
+    {
+        if(cicVariants[variant].cic == cic)
+        {
+            seed = cicVariants[variant].seed;
+        }
+    }
+
+    uint32_t t1 = seed, t2 = seed, t3 = seed, t4 = seed, t5 = seed, t6 = seed;
+    for(uint32_t offset = CHECKSUM_START;
+        offset < CHECKSUM_END;
+        offset += 4)
+    {
+        uint32_t d = (uint32_t)rom[offset] << 24 | rom[offset + 1] << 16 | rom[offset + 2] << 8 | rom[offset + 3];
+        if(t6 + d < t6)
+        {
+            t4++;
+        }
+        t6 += d;
+        t3 ^= d;
+        uint32_t r = (d << (d & 0x1F)) | (d >> ((32 - (d & 0x1F)) & 0x1F));
+        t5 += r;
+        t2 = (t2 > d) ? t2 ^ r : t2 ^ t6 ^ d;
+
+        if(cic == 6105)
+        {
+            // 6105 mixes in words from its boot code
+            const uint8_t* boot = &rom[0x0750 + (offset & 0xFF)];
+            t1 += ((uint32_t)boot[0] << 24 | boot[1] << 16 | boot[2] << 8 | boot[3]) ^ d;
+        }
+        else
+        {
+            t1 += t5 ^ d;
+        }
+    }
+
+    if(cic == 6103)
+    {
+        *crc1 = (t6 ^ t4) + t3;
+        *crc2 = (t5 ^ t2) + t1;
+    }
+    else if(cic == 6106)
+    {
+        *crc1 = t6 * t4 + t3;
+        *crc2 = t5 * t2 + t1;
+    }
+    else
+    {
+        *crc1 = t6 ^ t4 ^ t3;
+        *crc2 = t5 ^ t2 ^ t1;
+    }
+}
+
+// Finds the CIC whose checksum matches the header's CRC1/CRC2.
+// - rom: Big-endian image, at least CHECKSUM_END bytes.
+// Returns the CIC (6102 for 6101 too), or 0 when none matches.
+uint16_t IdentifyCic(const uint8_t* rom)
+{
+    uint32_t headerCrc1 = (uint32_t)rom[0x10] << 24 | rom[0x11] << 16 | rom[0x12] << 8 | rom[0x13];
+    uint32_t headerCrc2 = (uint32_t)rom[0x14] << 24 | rom[0x15] << 16 | rom[0x16] << 8 | rom[0x17];
+
+    for(uint variant = 0;
+        variant < sizeof(cicVariants) / sizeof(cicVariants[0]);
+        variant++)
+    {
+        uint32_t crc1 = 0;
+        uint32_t crc2 = 0;
+        RomChecksum(rom, cicVariants[variant].cic, &crc1, &crc2);
+        if(crc1 == headerCrc1 && crc2 == headerCrc2)
+        {
+            return cicVariants[variant].cic;
+        }
+    }
+    return 0;
+}
+
+// Keeps a dumped ROM page that falls inside the checksummed span.
+// - offset: ROM offset of the page.
+// - bytes: ROM_PAGE_SIZE bytes, big-endian.
+void KeepRomPrefix(uint32_t offset, const uint8_t* bytes)
+{
+    if(offset < CHECKSUM_END)
+    {
+        memcpy(romPrefix + offset, bytes, ROM_PAGE_SIZE);
+        romPrefixLength += ROM_PAGE_SIZE;
+    }
+}
+
+// Checks the dumped header checksum against every CIC variant. A mismatch
+// means a bad read in the first 1 Mb (or a hacked ROM with stale CRCs).
+void ReportHeaderChecksum(const struct DumpPlan* plan)
+{
+    if(plan->romSize < CHECKSUM_END || romPrefixLength < CHECKSUM_END)
+    {
+        return;
+    }
+
+    uint16_t cic = IdentifyCic(romPrefix);
+    uint16_t expected = (plan->entry != NULL && plan->entry->cic != 6101) ? plan->entry->cic : 6102;
+    if(cic == 0)
+    {
+        fprintf(stderr, "Header checksum matches no CIC: the first 1 Mb did not read back correctly.\n");
+    }
+    else if(plan->entry != NULL && plan->entry->cic != 0 && cic != expected)
+    {
+        fprintf(stderr, "Header checksum matches CIC %u, the DAT index lists %u.\n", cic, plan->entry->cic);
+    }
+    else
+    {
+        fprintf(stderr, "Header checksum OK (CIC %u).\n", cic);
+    }
+}
+
+// Plans a dump from the 64-byte header: a DAT index hit supplies the exact ROM
+// size and save type, otherwise the ROM size is probed and no save is read.
+// - header: The header page as read from CART_ROM_BASE.
+// - plan: Receives the ranges to read, ROM first.
+void PlanDump(const uint16_t* header, struct DumpPlan* plan)
+{
+    memset(plan, 0, sizeof(*plan));
+
+    plan->entry = DatLookupHeader(header);
+    if(plan->entry != NULL && plan->entry->size > 0 && plan->entry->size <= MAX_ROM_SIZE &&
+       plan->entry->size % ROM_PAGE_SIZE == 0)
+    {
+        plan->romSize = plan->entry->size;
+        plan->saveType = plan->entry->saveType;
+    }
+    else
+    {
+        plan->entry = NULL;
+        plan->romSize = ProbeRomSize();
+        plan->saveType = SaveUnknown;
+    }
+
+    plan->ranges[plan->rangeCount++] = (struct DumpRange){ CART_ROM_BASE, plan->romSize, RangeRom };
+
+    switch(plan->saveType)
+    {
+        case SaveSram:
+            plan->ranges[plan->rangeCount++] = (struct DumpRange){ CART_SRAM_BASE, SRAM_BANK_SIZE, RangeSave };
+            break;
+        case SaveSram768k:
+            // Three 256 Kbit banks selected by address bits 18-19
+            for(uint bank = 0;
+                bank < 3;
+                bank++)
+            {
+                plan->ranges[plan->rangeCount++] =
+                    (struct DumpRange){ CART_SRAM_BASE + bank * SRAM_BANK_STRIDE, SRAM_BANK_SIZE, RangeSave };
+            }
+            break;
+        case SaveFlash:
+            plan->ranges[plan->rangeCount++] = (struct DumpRange){ CART_SRAM_BASE, FLASH_SIZE, RangeSave };
+            break;
+        default:
+            // EEPROM sits on the serial (joybus) lines, which this wiring doesn't reach
+            break;
+    }
+}
+
+// Orders the ROM pages by a recorded access profile: the profiled runs in the
+// order they were first touched, then every remaining page linearly.
+// A missing or unusable profile is reported and the dump stays linear; lines
+// that don't parse are skipped.
+// - directory: Profile directory.
+// - header: The header page as read from CART_ROM_BASE.
+// - plan: Plan from PlanDump; receives pageOrder and bootPages, or keeps a
+//   NULL pageOrder.
+void LoadAccessProfile(const char* directory, const uint16_t* header, struct DumpPlan* plan)
+{
+    uint32_t crc1 = (uint32_t)header[8] << 16 | header[9];
+    uint32_t crc2 = (uint32_t)header[10] << 16 | header[11];
+    char name[64];
+    char path[PATH_MAX];
+    snprintf(name, sizeof(name), PROFILE_NAME, crc1, crc2);
+    int pathLength = snprintf(path, sizeof(path), "%s/%s", directory, name);
+    if(pathLength < 0 || (size_t)pathLength >= sizeof(path))
+    {
+        fprintf(stderr, "Access profile path in %s too long, dumping linearly.\n", directory);
+        return;
+    }
+
+    FILE* profile = fopen(path, "r");
+    if(profile == NULL)
+    {
+        fprintf(stderr, "No access profile %s, dumping linearly.\n", path);
+        return;
+    }
+
+    uint32_t pageCount = plan->romSize / ROM_PAGE_SIZE;
+    uint32_t* order = malloc(pageCount * sizeof(uint32_t));
+    uint8_t* ordered = calloc(pageCount, 1);
+    if(order == NULL || ordered == NULL)
+    {
+        fprintf(stderr, "Failed to allocate the page order, dumping linearly.\n");
+        free(order);
+        free(ordered);
+        fclose(profile);
+        return;
+    }
+
+    uint32_t count = 0;
+    char line[256];
+    while(fgets(line, sizeof(line), profile) != NULL)
+    {
+        unsigned long long offset = 0;
+        unsigned long long length = 0;
+        if(line[0] == '#' || sscanf(line, "%llx %llx", &offset, &length) != 2)
+        {
+            continue;
+        }
+
+        for(unsigned long long index = offset / ROM_PAGE_SIZE;
+            index * ROM_PAGE_SIZE < offset + length && index < pageCount;
+            index++)
+        {
+            if(!ordered[index])
+            {
+                ordered[index] = 1;
+                order[count++] = index;
+            }
+        }
+    }
+    fclose(profile);
+
+    plan->bootPages = count;
+    for(uint32_t index = 0;
+        index < pageCount;
+        index++)
+    {
+        if(!ordered[index])
+        {
+            order[count++] = index;
+        }
+    }
+    free(ordered);
+
+    plan->pageOrder = order;
+    fprintf(stderr, "Access profile %s puts %u boot pages first.\n", name, plan->bootPages);
+}
+
+// Writes 16-bit words to the cart starting at a bus address, pulsing WRITE for each.
+// The cart auto-increments its address after every WRITE strobe, as it does for READ.
+// - address: Bus address of the first word.
+// - words: Words to write in bus order.
+// - count: Number of words.
+void WriteWords(uint32_t address, const uint16_t* words, uint count)
+{
+    SetAddress(address, LowerAddress);
+    LatchAddress(ALE_L);
+    SetAddress(address, UpperAddress);
+    LatchAddress(ALE_H);
+
+    for(uint word = 0;
+        word < count;
+        word++)
+    {
+        SetAddress(words[word], LowerAddress);
+        BusWrite(WRITE, ACTIVE(LOW));
+        gpioDelay(1);
+        BusWrite(WRITE, INACTIVE(HIGH));
+    }
+}
+
+// Reads the ROM in the plan's page order, writing each page at its own offset
+// so the image fills in out of order. Progress goes to stdout for consumers
+// watching the file: "boot-ready <pages>" once the profiled pages are on disk,
+// and "progress <done> <total>" lines.
+// - plan: Plan with a pageOrder.
+// - output: Binary output opened for update, or NULL when only publishing a
+//   shared image.
+// - crc: Receives the CRC32 of the finished image.
+// Returns 0 on success, 1 on a read or write error.
+int DumpRomOrdered(const struct DumpPlan* plan, FILE* output, uint32_t* crc)
+{
+    uint16_t page[PAGE_WORDS];
+    uint8_t bytes[ROM_PAGE_SIZE];
+    uint32_t pageCount = plan->romSize / ROM_PAGE_SIZE;
+    uint32_t progressStep = (pageCount + PROGRESS_STEPS - 1) / PROGRESS_STEPS;
+
+    for(uint32_t done = 0;
+        done < pageCount;
+        done++)
+    {
+        uint32_t index = plan->pageOrder[done];
+        const uint16_t* words = page;
+        if(checkpointPages != 0)
+        {
+            uint32_t slot = done % checkpointPages;
+            if(slot == 0)
+            {
+                uint32_t count = (pageCount - done < checkpointPages) ? pageCount - done : checkpointPages;
+                if(ReadCheckpointWindow(plan->pageOrder, done, count) != 0)
+                {
+                    return 1;
+                }
+            }
+            words = checkpointWindow[slot];
+        }
+        else if(ReadPage(CART_ROM_BASE + index * ROM_PAGE_SIZE, page) != 0)
+        {
+            return 1;
+        }
+
+        for(uint word = 0;
+            word < PAGE_WORDS;
+            word++)
+        {
+            bytes[word * 2] = words[word] >> 8;
+            bytes[word * 2 + 1] = words[word] & 0xFF;
+        }
+
+        PublishPage(index, bytes);
+        KeepRomPrefix(index * ROM_PAGE_SIZE, bytes);
+        if(output != NULL &&
+           (fseek(output, (long)index * ROM_PAGE_SIZE, SEEK_SET) != 0 ||
+            fwrite(bytes, 1, ROM_PAGE_SIZE, output) != ROM_PAGE_SIZE))
+        {
+            return 1;
+        }
+
+        if(done + 1 == plan->bootPages)
+        {
+            if(output != NULL)
+            {
+                fflush(output);
+            }
+            printf("boot-ready %u\n", plan->bootPages);
+            fflush(stdout);
+        }
+        if((done + 1) % progressStep == 0 || done + 1 == pageCount)
+        {
+            if(output != NULL)
+            {
+                fflush(output);
+            }
+            printf("progress %u %u\n", done + 1, pageCount);
+            fflush(stdout);
+        }
+    }
+
+    // The pages arrived out of order, so the CRC comes from the finished image
+    if(output == NULL)
+    {
+        *crc = Crc32Update(*crc, sharedImage.image, plan->romSize);
+        return 0;
+    }
+    if(fseek(output, 0, SEEK_SET) != 0)
+    {
+        return 1;
+    }
+    for(uint32_t index = 0;
+        index < pageCount;
+        index++)
+    {
+        if(fread(bytes, 1, ROM_PAGE_SIZE, output) != ROM_PAGE_SIZE)
+        {
+            return 1;
+        }
+        *crc = Crc32Update(*crc, bytes, ROM_PAGE_SIZE);
+    }
+    return 0;
+}
+
+// Reads one planned range, writing it as a binary image or, without an output
+// file, as text lines in the default dump format.
+// - range: Range to read.
+// - output: Binary output, or NULL to print text to stdout (unless publishing
+//   a shared image).
+// - crc: Running CRC32 of the bytes read.
+// Returns 0 on success, 1 on a read or write error.
+int DumpRange(const struct DumpRange* range, FILE* output, uint32_t* crc)
+{
+    uint16_t page[PAGE_WORDS];
+    uint8_t bytes[ROM_PAGE_SIZE];
+
+    for(uint32_t offset = 0;
+        offset < range->length;
+        offset += ROM_PAGE_SIZE)
+    {
+        // Checkpointed ROM pages are read a window ahead and only then written out
+        const uint16_t* words = page;
+        if(range->kind == RangeRom && checkpointPages != 0)
+        {
+            uint32_t done = offset / ROM_PAGE_SIZE;
+            uint32_t slot = done % checkpointPages;
+            if(slot == 0)
+            {
+                uint32_t remaining = (range->length - offset) / ROM_PAGE_SIZE;
+                if(ReadCheckpointWindow(NULL, done, (remaining < checkpointPages) ? remaining : checkpointPages) != 0)
+                {
+                    return 1;
+                }
+            }
+            words = checkpointWindow[slot];
+        }
+        else if(ReadPage(range->busAddress + offset, page) != 0)
+        {
+            return 1;
+        }
+
+        for(uint word = 0;
+            word < PAGE_WORDS;
+            word++)
+        {
+            bytes[word * 2] = words[word] >> 8;
+            bytes[word * 2 + 1] = words[word] & 0xFF;
+
+            if(output == NULL && sharedImage.header == NULL)
+            {
+                // ROM offsets keep the original 24-bit format; saves show the bus address
+                if(range->kind == RangeRom)
+                {
+                    printf("0x%06X: 0x%04X\n", offset + word * 2, words[word]);
+                }
+                else
+                {
+                    printf("0x%08X: 0x%04X\n", range->busAddress + offset + word * 2, words[word]);
+                }
+            }
+        }
+
+        *crc = Crc32Update(*crc, bytes, ROM_PAGE_SIZE);
+        if(range->kind == RangeRom)
+        {
+            PublishPage(offset / ROM_PAGE_SIZE, bytes);
+            KeepRomPrefix(offset, bytes);
+        }
+        if(output != NULL && fwrite(bytes, 1, ROM_PAGE_SIZE, output) != ROM_PAGE_SIZE)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Runs a dump plan: the ROM range, then the save ranges.
+// - plan: Plan from PlanDump.
+// - romPath: Binary ROM output, or NULL for text on stdout.
+// - savePath: Binary save output; NULL derives it from romPath (or prints text).
+// Returns 0 on success, 1 on error.
+int ExecutePlan(const struct DumpPlan* plan, const char* romPath, const char* savePath)
+{
+    FILE* romOutput = NULL;
+    FILE* saveOutput = NULL;
+    char derivedSavePath[PATH_MAX];
+
+    if(plan->entry != NULL)
+    {
+        fprintf(stderr, "Header matches %s, dumping 0x%X bytes (save %s).\n",
+                DatTitle(plan->entry), plan->romSize, saveTypeNames[plan->saveType]);
+    }
+    else
+    {
+        fprintf(stderr, "Header not in the DAT index, probed ROM size 0x%X bytes.\n", plan->romSize);
+    }
+
+    if(plan->saveType == SaveEeprom4k || plan->saveType == SaveEeprom16k)
+    {
+        fprintf(stderr, "EEPROM saves are on the serial bus and are not dumped.\n");
+    }
+
+    if(romPath != NULL)
+    {
+        romOutput = fopen(romPath, "w+b");
+        if(romOutput == NULL)
+        {
+            perror(romPath);
+            return 1;
+        }
+
+        if(savePath == NULL)
+        {
+            const char* extension = (plan->saveType == SaveFlash) ? "fla" : "sra";
+            int pathLength = snprintf(derivedSavePath, sizeof(derivedSavePath), "%s.%s", romPath, extension);
+            if(pathLength < 0 || (size_t)pathLength >= sizeof(derivedSavePath))
+            {
+                fprintf(stderr, "Save path for %s too long.\n", romPath);
+                fclose(romOutput);
+                return 1;
+            }
+            savePath = derivedSavePath;
+        }
+    }
+
+    int status = 0;
+    uint32_t romCrc = 0;
+    uint32_t saveCrc = 0;
+
+    for(uint range = 0;
+        range < plan->rangeCount && status == 0;
+        range++)
+    {
+        if(plan->ranges[range].kind == RangeRom)
+        {
+            if(plan->pageOrder != NULL && (romOutput != NULL || sharedImage.header != NULL))
+            {
+                status = DumpRomOrdered(plan, romOutput, &romCrc);
+            }
+            else
+            {
+                status = DumpRange(&plan->ranges[range], romOutput, &romCrc);
+            }
+            continue;
+        }
+
+        if(saveOutput == NULL && savePath != NULL)
+        {
+            saveOutput = fopen(savePath, "wb");
+            if(saveOutput == NULL)
+            {
+                perror(savePath);
+                status = 1;
+                break;
+            }
+        }
+
+        if(plan->saveType == SaveFlash)
+        {
+            // Put the FlashRAM into read-array mode before reading it like SRAM
+            static const uint16_t readArray[2] = { 0xF000, 0x0000 };
+            WriteWords(FLASH_COMMAND_ADDRESS, readArray, 2);
+        }
+
+        status = DumpRange(&plan->ranges[range], saveOutput, &saveCrc);
+    }
+
+    if(romOutput != NULL && fclose(romOutput) != 0)
+    {
+        status = 1;
+    }
+    if(saveOutput != NULL && fclose(saveOutput) != 0)
+    {
+        status = 1;
+    }
+    if(status != 0)
+    {
+        fprintf(stderr, "Failed to read or write the dump.\n");
+        return 1;
+    }
+
+    if(verifyReads)
+    {
+        fprintf(stderr, "Verified reads: %llu retries.\n", (unsigned long long)readRetries);
+    }
+    ReportMajority();
+    ReportAdaptiveTiming();
+    ReportRecalibration();
+    if(readFailures > 0)
+    {
+        fprintf(stderr, "%llu pages never read back the same twice; the dump is not trustworthy.\n",
+                (unsigned long long)readFailures);
+        return 1;
+    }
+
+    // Identify the finished dump by its CRC32
+    uint8_t crcKey[4] = { romCrc >> 24, romCrc >> 16, romCrc >> 8, romCrc };
+    const struct DatEntry* dumped = DatLookup(DatKeyCrc32, crcKey, sizeof(crcKey));
+    if(dumped != NULL)
+    {
+        fprintf(stderr, "CRC32 %08X matches %s.\n", romCrc, DatTitle(dumped));
+    }
+    else if(datIndex.header != NULL)
+    {
+        fprintf(stderr, "CRC32 %08X is not in the DAT index.\n", romCrc);
+    }
+
+    ReportHeaderChecksum(plan);
+    return 0;
+}
+
+// Waits for at least the given number of nanoseconds. Whole microseconds go
+// through gpioDelay; shorter waits, and every wait while pigpio isn't running,
+// spin on the monotonic clock.
+void BusDelay(uint32_t nanoseconds)
+{
+    if(nanoseconds >= 1000 && gpioRegisters == NULL)
+    {
+        gpioDelay((nanoseconds + 999) / 1000);
+        return;
+    }
+
+    if(nanoseconds == 0)
+    {
+        return;
+    }
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+    while((now.tv_sec - start.tv_sec) * 1000000000L + (now.tv_nsec - start.tv_nsec) < (long)nanoseconds);
+}
+
+// Selects a bus backend by name. Returns NULL when there is no such backend.
+const struct BusBackend* FindBusBackend(const char* name)
+{
+    for(uint backend = 0;
+        backend < sizeof(busBackends) / sizeof(busBackends[0]);
+        backend++)
+    {
+        if(strcmp(busBackends[backend]->name, name) == 0)
+        {
+            return busBackends[backend];
+        }
+    }
+    return NULL;
+}
+
+// Releases the active backend, then pigpio (or the mapped GPIO registers),
+// writing out the bus trace if any.
+void ShutdownBus(void)
+{
+    if(bus->terminate != NULL)
+    {
+        bus->terminate();
+    }
+    WriteBusTrace();
+
+    if(gpioRegisters != NULL)
+    {
+        munmap((void*)gpioRegisters, GPIO_MEM_SIZE);
+        gpioRegisters = NULL;
+        return;
+    }
+    gpioTerminate();
+}
+
+// Maps the GPIO registers for a quick command instead of starting pigpio.
+// /dev/gpiomem exposes only the GPIO block and needs no root.
+// Returns 0 on success, 1 when it can't be mapped (the caller falls back to pigpio).
+int GpioFastInit(void)
+{
+    int gpioMemory = open("/dev/gpiomem", O_RDWR | O_SYNC | O_CLOEXEC);
+    if(gpioMemory < 0)
+    {
+        return 1;
+    }
+
+    void* registers = mmap(NULL, GPIO_MEM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, gpioMemory, 0);
+    close(gpioMemory);
+    if(registers == MAP_FAILED)
+    {
+        return 1;
+    }
+    gpioRegisters = registers;
+    return 0;
+}
+
+// Latches a page address with the CPU and leaves the AD bus ready for reading.
+void LatchPageAddress(uint32_t address)
+{
+    SetAddress(address, LowerAddress);
+    LatchAddress(ALE_L);
+    SetAddress(address, UpperAddress);
+    LatchAddress(ALE_H);
+    SetADBusPinsMode(PI_INPUT);
+}
+
+// Sets a pin's function through pigpio or, for a quick command, its function select register.
+void BusSetMode(uint gpio, uint mode)
+{
+    if(gpioRegisters != NULL)
+    {
+        volatile uint32_t* select = &gpioRegisters[GPIO_FSEL / 4 + gpio / 10];
+        uint shift = (gpio % 10) * 3;
+        *select = (*select & ~(0x7u << shift)) | ((mode & 0x7) << shift);
+        return;
+    }
+    gpioSetMode(gpio, mode);
+}
+
+// GPIO choke points of the bus paths. Each keeps busTrace.levels current and
+// records a transition while tracing is enabled, which costs a single
+// predictable branch when it isn't.
+void BusWrite(uint gpio, uint level)
+{
+    if(gpioRegisters != NULL)
+    {
+        gpioRegisters[((level & 0x1) ? GPIO_SET : GPIO_CLR) / 4] = 1u << gpio;
+    }
+    else
+    {
+        gpioWrite(gpio, level);
+    }
+    busTrace.levels = (busTrace.levels & ~(1u << gpio)) | ((uint32_t)(level & 0x1) << gpio);
+    if(__atomic_load_n(&busTrace.enabled, __ATOMIC_RELAXED))
+    {
+        BusTraceRecord(BusTraceNow(), 0);
+    }
+}
+
+void BusWriteSet(uint32_t bits)
+{
+    if(gpioRegisters != NULL)
+    {
+        gpioRegisters[GPIO_SET / 4] = bits;
+    }
+    else
+    {
+        gpioWrite_Bits_0_31_Set(bits);
+    }
+    busTrace.levels |= bits;
+    if(__atomic_load_n(&busTrace.enabled, __ATOMIC_RELAXED))
+    {
+        BusTraceRecord(BusTraceNow(), 0);
+    }
+}
+
+void BusWriteClear(uint32_t bits)
+{
+    if(gpioRegisters != NULL)
+    {
+        gpioRegisters[GPIO_CLR / 4] = bits;
+    }
+    else
+    {
+        gpioWrite_Bits_0_31_Clear(bits);
+    }
+    busTrace.levels &= ~bits;
+    if(__atomic_load_n(&busTrace.enabled, __ATOMIC_RELAXED))
+    {
+        BusTraceRecord(BusTraceNow(), 0);
+    }
+}
+
+// Samples GPIO 0-31; the AD levels are what the cart is driving.
+uint32_t BusReadLevels(void)
+{
+    uint32_t levels = (gpioRegisters != NULL) ? gpioRegisters[GPIO_LEV / 4] : gpioRead_Bits_0_31();
+    busTrace.levels = (busTrace.levels & ~pinMap.adMask) | (levels & pinMap.adMask);
+    if(__atomic_load_n(&busTrace.enabled, __ATOMIC_RELAXED))
+    {
+        BusTraceRecord(BusTraceNow(), 1);
+    }
+    return levels;
+}
+
+// Nanoseconds since OpenBusTrace.
+uint64_t BusTraceNow(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)((now.tv_sec - busTrace.start.tv_sec) * 1000000000LL + (now.tv_nsec - busTrace.start.tv_nsec));
+}
+
+// Claims the next ring slot and stores the current bus state in it.
+// - sampled: The event is the Pi sampling AD rather than driving a line.
+void BusTraceRecord(uint64_t nanoseconds, int sampled)
+{
+    uint64_t slot = __atomic_fetch_add(&busTrace.head, 1, __ATOMIC_RELAXED);
+    struct BusTraceEvent* event = &busTrace.events[slot & (BUS_TRACE_EVENTS - 1)];
+    event->nanoseconds = nanoseconds;
+    event->levels = busTrace.levels;
+    event->adDriven = busTrace.adDriven;
+    event->sampled = sampled;
+}
+
+// Packs an event into BUS_STATE_* bits, independent of the pin map.
+uint32_t BusTracePack(const struct BusTraceEvent* event)
+{
+    const uint gpios[] = { ALE_L, ALE_H, READ, WRITE, RESET };
+    uint32_t state = GatherDataBus(event->levels);
+    for(uint signal = 0;
+        signal < sizeof(gpios) / sizeof(gpios[0]);
+        signal++)
+    {
+        state |= ((event->levels >> gpios[signal]) & 0x1) << (16 + signal);
+    }
+    state |= event->adDriven ? BUS_STATE_DRIVEN : 0;
+    state |= event->sampled ? BUS_STATE_SAMPLE : 0;
+    return state;
+}
+
+// Starts --trace and/or --record. Without --trace-range tracing is on from
+// pin setup onwards.
+// Returns 0 on success, 1 on error (already reported).
+int OpenBusTrace(const char* path, const char* recordPath)
+{
+    busTrace.events = malloc(BUS_TRACE_EVENTS * sizeof(struct BusTraceEvent));
+    if(busTrace.events == NULL)
+    {
+        fprintf(stderr, "Failed to allocate the bus trace.\n");
+        return 1;
+    }
+
+    busTrace.path = path;
+    busTrace.recordPath = recordPath;
+    clock_gettime(CLOCK_MONOTONIC, &busTrace.start);
+    busTrace.startTick = gpioTick();
+    gpioSetSignalFunc(SIGUSR1, BusTraceToggle);
+    BusTraceSelect(0);
+    return 0;
+}
+
+// Enables tracing for a page about to be read when it lies in --trace-range
+// and tracing isn't paused.
+void BusTraceSelect(uint32_t address)
+{
+    if(busTrace.events == NULL)
+    {
+        return;
+    }
+
+    int selected = (address - busTrace.rangeStart < busTrace.rangeLength);
+    __atomic_store_n(&busTrace.enabled, selected && !__atomic_load_n(&busTrace.paused, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+}
+
+// SIGUSR1: pauses or resumes tracing from the next page on.
+void BusTraceToggle(int signalNumber)
+{
+    (void)signalNumber;
+    __atomic_xor_fetch(&busTrace.paused, 1, __ATOMIC_RELAXED);
+}
+
+// Writes the ring out as requested and frees it.
+// Returns 0 on success, 1 on error (already reported).
+int WriteBusTrace(void)
+{
+    if(busTrace.events == NULL)
+    {
+        return 0;
+    }
+    __atomic_store_n(&busTrace.enabled, 0, __ATOMIC_RELAXED);
+
+    uint64_t head = __atomic_load_n(&busTrace.head, __ATOMIC_ACQUIRE);
+    uint64_t first = (head > BUS_TRACE_EVENTS) ? head - BUS_TRACE_EVENTS : 0;
+    int status = 0;
+    if(busTrace.path != NULL)
+    {
+        status |= WriteBusTraceVcd(first, head);
+    }
+    if(busTrace.recordPath != NULL)
+    {
+        status |= WriteBusRecord(first, head);
+    }
+
+    if(status == 0)
+    {
+        fprintf(stderr, "Bus trace: %llu transitions written (%llu older ones overwritten).\n",
+                (unsigned long long)(head - first), (unsigned long long)first);
+    }
+
+    free(busTrace.events);
+    busTrace.events = NULL;
+    return status;
+}
+
+// Writes ring events first to head - 1 as a VCD: the control lines, who
+// drives AD and the AD value, one timestamped change set per transition.
+// Returns 0 on success, 1 on error (already reported).
+int WriteBusTraceVcd(uint64_t first, uint64_t head)
+{
+    FILE* output = fopen(busTrace.path, "w");
+    if(output == NULL)
+    {
+        perror(busTrace.path);
+        return 1;
+    }
+
+    // VCD identifiers are printable characters: '!' + state bit - 16 for the
+    // single lines, then AD
+    const char* names[] = { "ALE_L", "ALE_H", "READ", "WRITE", "RESET", "AD_DRIVEN" };
+    const uint lines = sizeof(names) / sizeof(names[0]);
+    const char data = '!' + lines;
+
+    fprintf(output, "$version ROM_dumper_16MB bus trace $end\n$timescale 1ns $end\n$scope module cart $end\n");
+    for(uint line = 0;
+        line < lines;
+        line++)
+    {
+        fprintf(output, "$var wire 1 %c %s $end\n", '!' + line, names[line]);
+    }
+    fprintf(output, "$var wire 16 %c AD [15:0] $end\n$upscope $end\n$enddefinitions $end\n", data);
+
+    uint64_t time = 0;
+    uint32_t last = 0;
+    for(uint64_t index = first;
+        index < head;
+        index++)
+    {
+        const struct BusTraceEvent* event = &busTrace.events[index & (BUS_TRACE_EVENTS - 1)];
+        uint32_t state = BusTracePack(event) & ~BUS_STATE_SAMPLE;
+        uint32_t changed = (index == first) ? UINT32_MAX : state ^ last;
+        if(changed == 0)
+        {
+            continue;
+        }
+
+        // Wave samples are timed by pigpio's clock, everything else by ours;
+        // keep time from running backwards where the two meet
+        if(index == first || event->nanoseconds > time)
+        {
+            time = event->nanoseconds;
+            fprintf(output, "#%llu\n", (unsigned long long)time);
+        }
+
+        for(uint line = 0;
+            line < lines;
+            line++)
+        {
+            if((changed >> (16 + line)) & 0x1)
+            {
+                fprintf(output, "%u%c\n", (state >> (16 + line)) & 0x1, '!' + line);
+            }
+        }
+        if(changed & BUS_STATE_AD)
+        {
+            char bits[17];
+            for(uint bit = 0;
+                bit < 16;
+                bit++)
+            {
+                bits[bit] = '0' + ((state >> (15 - bit)) & 0x1);
+            }
+            bits[16] = '\0';
+            fprintf(output, "b%s %c\n", bits, data);
+        }
+        last = state;
+    }
+
+    if(fclose(output) != 0)
+    {
+        perror(busTrace.path);
+        return 1;
+    }
+    return 0;
+}
+
+// Writes ring events first to head - 1 as a bus record (ROM_bus_record.h).
+// Returns 0 on success, 1 on error (already reported).
+int WriteBusRecord(uint64_t first, uint64_t head)
+{
+    FILE* output = fopen(busTrace.recordPath, "wb");
+    if(output == NULL)
+    {
+        perror(busTrace.recordPath);
+        return 1;
+    }
+
+    struct BusRecordHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BUS_RECORD_MAGIC, sizeof(header.magic));
+    header.version = BUS_RECORD_VERSION;
+    header.eventCount = head - first;
+    header.firstEvent = first;
+    header.startNanoseconds = (head > first) ? busTrace.events[first & (BUS_TRACE_EVENTS - 1)].nanoseconds : 0;
+    header.latchNs = busTiming.latchNs;
+    header.strobeNs = busTiming.strobeNs;
+    header.recoveryNs = busTiming.recoveryNs;
+    strncpy(header.backend, bus->name, sizeof(header.backend) - 1);
+    int failed = (fwrite(&header, sizeof(header), 1, output) != 1);
+
+    uint64_t time = header.startNanoseconds;
+    for(uint64_t index = first;
+        index < head && !failed;
+        index++)
+    {
+        const struct BusTraceEvent* event = &busTrace.events[index & (BUS_TRACE_EVENTS - 1)];
+        uint8_t encoded[BUS_RECORD_EVENT_MAX];
+        uint64_t delta = (event->nanoseconds > time) ? event->nanoseconds - time : 0;
+        time += delta;
+
+        uint8_t* end = BusRecordPutEvent(encoded, delta, BusTracePack(event));
+        failed = (fwrite(encoded, end - encoded, 1, output) != 1);
+    }
+
+    if(fclose(output) != 0 || failed)
+    {
+        perror(busTrace.recordPath);
+        return 1;
+    }
+    return 0;
+}
+
+// Wave backend: sample rate of pigpio's DMA sampler, configured before gpioInitialise.
+void WaveConfigure(void)
+{
+    gpioCfgClock(WAVE_SAMPLE_US, PI_CLOCK_PCM, 0);
+}
+
+// Folds DMA level samples into words. Each READ-low run yields one word, taken
+// from the run's last sample, when the cart has had longest to drive the bus.
+// pigpio only passes samples in which a watched line changed, so that last
+// sample always carries the settled levels.
+// Runs in pigpio's sampling thread while a strobe wave is being transmitted.
+void WaveSamples(const gpioSample_t* samples, int count)
+{
+    if(!__atomic_load_n(&waveCapture.active, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+
+    for(int sample = 0;
+        sample < count;
+        sample++)
+    {
+        int readActive = ((samples[sample].level >> READ) & 1) == ACTIVE(LOW);
+
+        if(__atomic_load_n(&busTrace.enabled, __ATOMIC_RELAXED))
+        {
+            uint32_t sampled = pinMap.adMask | (1u << READ);
+            busTrace.levels = (busTrace.levels & ~sampled) | (samples[sample].level & sampled);
+            BusTraceRecord((uint64_t)(uint32_t)(samples[sample].tick - busTrace.startTick) * 1000, 1);
+        }
+
+        if(readActive)
+        {
+            waveCapture.lastLevel = samples[sample].level;
+            waveCapture.inStrobe = 1;
+        }
+        else if(waveCapture.inStrobe)
+        {
+            waveCapture.inStrobe = 0;
+            uint captured = __atomic_load_n(&waveCapture.words, __ATOMIC_RELAXED);
+            if(captured < PAGE_WORDS)
+            {
+                waveCapture.page[captured] = GatherDataBus(waveCapture.lastLevel);
+                __atomic_store_n(&waveCapture.words, captured + 1, __ATOMIC_RELEASE);
+            }
+        }
+    }
+}
+
+// Builds the READ strobe train for one page as a single wave. The wave is the
+// same for every page, so it is created once and only retransmitted.
+// Returns 0 on success, 1 on error.
+int WaveInit(void)
+{
+    // Every strobe must span at least two samples so one lands after the data settles
+    uint32_t strobeUs = (busTiming.strobeNs + 999) / 1000;
+    uint32_t recoveryUs = (busTiming.recoveryNs + 999) / 1000;
+    strobeUs = (strobeUs < 2 * WAVE_SAMPLE_US) ? 2 * WAVE_SAMPLE_US : strobeUs;
+    recoveryUs = (recoveryUs < WAVE_SAMPLE_US) ? WAVE_SAMPLE_US : recoveryUs;
+
+    gpioPulse_t pulses[PAGE_WORDS * 2];
+    for(uint word = 0;
+        word < PAGE_WORDS;
+        word++)
+    {
+        pulses[word * 2] = (gpioPulse_t){ 0, 1u << READ, strobeUs };
+        pulses[word * 2 + 1] = (gpioPulse_t){ 1u << READ, 0, recoveryUs };
+    }
+
+    gpioWaveClear();
+    if(gpioWaveAddGeneric(PAGE_WORDS * 2, pulses) < 0 || (waveId = gpioWaveCreate()) < 0)
+    {
+        fprintf(stderr, "Failed to create the READ strobe wave.\n");
+        return 1;
+    }
+
+    gpioSetGetSamplesFunc(WaveSamples, pinMap.adMask | (1u << READ));
+    return 0;
+}
+
+// Reads a page with the CPU latching the address and a DMA-timed wave strobing READ.
+// Pin modes can't be switched from a wave, so the AD bus turnaround stays on the CPU.
+// Returns 0 on success, 1 when the capture fell short (the missing words read 0).
+int WaveReadPage(uint32_t address, uint16_t* words)
+{
+    LatchPageAddress(address);
+
+    waveCapture.inStrobe = 0;
+    __atomic_store_n(&waveCapture.words, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&waveCapture.active, 1, __ATOMIC_RELEASE);
+
+    gpioWaveTxSend(waveId, PI_WAVE_MODE_ONE_SHOT);
+
+    // Samples reach the callback in batches, shortly after the wave finishes
+    uint32_t start = gpioTick();
+    while(__atomic_load_n(&waveCapture.words, __ATOMIC_ACQUIRE) < PAGE_WORDS &&
+          gpioTick() - start < WAVE_TIMEOUT_US)
+    {
+        gpioDelay(100);
+    }
+
+    __atomic_store_n(&waveCapture.active, 0, __ATOMIC_RELEASE);
+
+    uint captured = __atomic_load_n(&waveCapture.words, __ATOMIC_ACQUIRE);
+    memcpy(words, waveCapture.page, sizeof(waveCapture.page));
+    SetADBusPinsMode(PI_OUTPUT);
+
+    if(captured < PAGE_WORDS)
+    {
+        fprintf(stderr, "Wave read at 0x%08X captured %u of %u words.\n", address, captured, PAGE_WORDS);
+        memset(words + captured, 0, (PAGE_WORDS - captured) * sizeof(uint16_t));
+        return 1;
+    }
+    return 0;
+}
+
+void WaveTerminate(void)
+{
+    gpioSetGetSamplesFunc(NULL, 0);
+    if(waveId >= 0)
+    {
+        gpioWaveDelete(waveId);
+        waveId = -1;
+    }
+}
+
+// Rebuilds the strobe wave for the new busTiming. Waves count whole
+// microseconds, so strobes shorter than two samples stay at two.
+// Returns 0 on success, 1 when the wave couldn't be rebuilt.
+int WaveRetime(void)
+{
+    WaveTerminate();
+    return WaveInit();
+}
+
+// Programs the SMI read timing from busTiming and enables the peripheral for
+// 16-bit reads on device 0. Timings are in SMI clock cycles (SMI_CLOCK_NS each).
+// - smi: Register interface (hardware or a software model).
+void SmiSetup(const struct SmiInterface* smi)
+{
+    uint32_t strobe = (busTiming.strobeNs + SMI_CLOCK_NS - 1) / SMI_CLOCK_NS;
+    uint32_t hold = (busTiming.recoveryNs + SMI_CLOCK_NS - 1) / SMI_CLOCK_NS;
+    uint32_t setup = SMI_READ_SETUP;
+
+    strobe = (strobe < 1) ? 1 : (strobe > SMI_DSR_STROBE_MAX) ? SMI_DSR_STROBE_MAX : strobe;
+    hold = (hold < 1) ? 1 : (hold > SMI_DSR_HOLD_MAX) ? SMI_DSR_HOLD_MAX : hold;
+
+    smi->write(SMI_CS, 0);
+    smi->write(SMI_DSR0, (SMI_DSR_WIDTH_16 << SMI_DSR_WIDTH_SHIFT) |
+                         (setup << SMI_DSR_SETUP_SHIFT) |
+                         (hold << SMI_DSR_HOLD_SHIFT) |
+                         (strobe << SMI_DSR_STROBE_SHIFT));
+    smi->write(SMI_DMC, smi->transfer != NULL ?
+                        SMI_DMC_DMAEN | (SMI_DMC_PANICR << 18) | (SMI_DMC_REQR << 6) : 0);
+    smi->write(SMI_CS, SMI_CS_ENABLE | SMI_CS_CLEAR | (smi->transfer != NULL ? SMI_CS_PXLDAT : 0));
+}
+
+// Drains a programmed read from the SMI FIFO, one transfer per data register read.
+// Returns the number of words received before the FIFO ran dry.
+uint SmiFifoTransfer(const struct SmiInterface* smi, uint16_t* words, uint count)
+{
+    uint received = 0;
+    uint idlePolls = 0;
+
+    while(received < count && idlePolls < SMI_POLL_LIMIT)
+    {
+        if(smi->read(SMI_CS) & SMI_CS_RXD)
+        {
+            words[received++] = smi->read(SMI_D) & 0xFFFF;
+            idlePolls = 0;
+        }
+        else
+        {
+            idlePolls++;
+        }
+    }
+    return received;
+}
+
+// Runs one burst of 16-bit SMI read cycles on device 0, address 0.
+// The cart supplies successive words on each strobe after its address was latched.
+// - smi: Register interface.
+// - words: Receives the burst.
+// - count: Number of read cycles.
+// Returns 0 on success, 1 when the burst came up short or never finished.
+int SmiReadBurst(const struct SmiInterface* smi, uint16_t* words, uint count)
+{
+    uint32_t mode = SMI_CS_ENABLE | (smi->transfer != NULL ? SMI_CS_PXLDAT : 0);
+
+    smi->write(SMI_CS, mode | SMI_CS_CLEAR);
+    smi->write(SMI_L, count);
+    smi->write(SMI_A, 0);
+    smi->write(SMI_CS, mode | SMI_CS_START);
+
+    uint received = (smi->transfer != NULL) ? smi->transfer(words, count)
+                                            : SmiFifoTransfer(smi, words, count);
+
+    uint polls = 0;
+    while(!(smi->read(SMI_CS) & SMI_CS_DONE) && polls++ < SMI_POLL_LIMIT)
+    {
+    }
+
+    // Acknowledge completion
+    smi->write(SMI_CS, mode | SMI_CS_DONE);
+    return (received == count && polls < SMI_POLL_LIMIT) ? 0 : 1;
+}
+
+// Hardware register access through the /dev/mem mapping.
+uint32_t SmiHardwareRead(uint reg)
+{
+    __sync_synchronize();
+    return smiHardware.smi[reg / 4];
+}
+
+void SmiHardwareWrite(uint reg, uint32_t value)
+{
+    smiHardware.smi[reg / 4] = value;
+    __sync_synchronize();
+}
+
+// Moves a burst out of the SMI FIFO with a DMA channel into uncached memory,
+// two packed 16-bit transfers per FIFO word.
+// Returns the number of words received.
+uint SmiDmaTransfer(uint16_t* words, uint count)
+{
+    volatile uint32_t* channel = smiHardware.dma + SMI_DMA_CHANNEL * 0x40;
+    volatile struct DmaControlBlock* block = smiHardware.buffer;
+
+    block->transferInfo = DMA_TI_PERMAP(DMA_PERMAP_SMI) | DMA_TI_SRC_DREQ | DMA_TI_DEST_INC | DMA_TI_WAIT_RESP;
+    block->source = smiHardware.peripheralBus + SMI_OFFSET + SMI_D;
+    block->destination = smiHardware.bufferBus + SMI_DMA_DATA_OFFSET;
+    block->length = count * sizeof(uint16_t);
+    block->stride = 0;
+    block->next = 0;
+    __sync_synchronize();
+
+    channel[DMA_CS / 4] = DMA_CS_RESET;
+    channel[DMA_CS / 4] = DMA_CS_END | DMA_CS_INT;
+    channel[DMA_CONBLK_AD / 4] = smiHardware.bufferBus;
+    channel[DMA_CS / 4] = DMA_CS_ACTIVE | DMA_CS_WAIT_WRITES | DMA_CS_PRIORITY(8);
+
+    uint32_t start = gpioTick();
+    while(!(channel[DMA_CS / 4] & DMA_CS_END) && gpioTick() - start < SMI_TIMEOUT_US)
+    {
+    }
+
+    int finished = (channel[DMA_CS / 4] & DMA_CS_END) != 0;
+    channel[DMA_CS / 4] = DMA_CS_RESET;
+    if(!finished)
+    {
+        return 0;
+    }
+
+    __sync_synchronize();
+    memcpy(words, (const uint8_t*)smiHardware.buffer + SMI_DMA_DATA_OFFSET, count * sizeof(uint16_t));
+    return count;
+}
+
+// Sends a VideoCore mailbox property request. Returns the first response word, or 0.
+uint32_t MailboxCall(int mailbox, uint32_t tag, uint32_t* arguments, uint argumentCount)
+{
+    uint32_t message[16] = { 0 };
+    message[0] = (6 + argumentCount) * sizeof(uint32_t);
+    message[2] = tag;
+    message[3] = argumentCount * sizeof(uint32_t);
+    message[4] = argumentCount * sizeof(uint32_t);
+    memcpy(&message[5], arguments, argumentCount * sizeof(uint32_t));
+
+    if(ioctl(mailbox, _IOWR(100, 0, char*), message) < 0 || message[1] != 0x80000000)
+    {
+        return 0;
+    }
+    return message[5];
+}
+
+// Reads the ARM physical base of the peripherals from the device tree.
+uint32_t PeripheralBase(void)
+{
+    uint32_t base = SMI_DEFAULT_PERIPHERAL_BASE;
+    uint8_t ranges[12];
+    FILE* file = fopen("/proc/device-tree/soc/ranges", "rb");
+
+    if(file != NULL)
+    {
+        if(fread(ranges, 1, sizeof(ranges), file) == sizeof(ranges))
+        {
+            // 32-bit parent address at byte 4 (Pi 1-3) or 64-bit at byte 4 (Pi 4)
+            base = (ranges[4] << 24) | (ranges[5] << 16) | (ranges[6] << 8) | ranges[7];
+            if(base == 0)
+            {
+                base = (ranges[8] << 24) | (ranges[9] << 16) | (ranges[10] << 8) | ranges[11];
+            }
+        }
+        fclose(file);
+    }
+    return base;
+}
+
+// Maps the SMI, clock manager and DMA registers, allocates the uncached DMA
+// buffer and switches the AD lines and READ over to the SMI function.
+// The SMI data lines are fixed: SD0-SD15 on GPIO8-23, SOE (READ) on GPIO6.
+// Returns 0 on success, 1 on error.
+int SmiInit(void)
+{
+    int smiPins = (READ == SMI_SOE_GPIO);
+    for(uint bitOffset = 0;
+        bitOffset < 16;
+        bitOffset++)
+    {
+        smiPins &= (AD_PIN(bitOffset) == SMI_SD0_GPIO + bitOffset);
+    }
+
+    if(!smiPins)
+    {
+        fprintf(stderr, "The smi backend needs AD0-AD15 on GPIO%d-%d and READ on GPIO%d.\n",
+                SMI_SD0_GPIO, SMI_SD0_GPIO + 15, SMI_SOE_GPIO);
+        return 1;
+    }
+
+    int memory = open("/dev/mem", O_RDWR | O_SYNC);
+    if(memory < 0)
+    {
+        perror("/dev/mem");
+        return 1;
+    }
+
+    uint32_t base = PeripheralBase();
+    smiHardware.peripheralBus = SMI_PERIPHERAL_BUS_BASE;
+    smiHardware.smi = mmap(NULL, 0x1000, PROT_READ | PROT_WRITE, MAP_SHARED, memory, base + SMI_OFFSET);
+    smiHardware.clock = mmap(NULL, 0x1000, PROT_READ | PROT_WRITE, MAP_SHARED, memory, base + CLOCK_OFFSET);
+    smiHardware.dma = mmap(NULL, 0x1000, PROT_READ | PROT_WRITE, MAP_SHARED, memory, base + DMA_OFFSET);
+
+    if(smiHardware.smi == MAP_FAILED || smiHardware.clock == MAP_FAILED || smiHardware.dma == MAP_FAILED)
+    {
+        perror("Mapping SMI registers");
+        SmiUnmapRegisters();
+        close(memory);
+        return 1;
+    }
+
+    // Uncached buffer for the DMA control block and burst data
+    smiHardware.mailbox = open("/dev/vcio", 0);
+    if(smiHardware.mailbox >= 0)
+    {
+        uint32_t allocate[3] = { SMI_DMA_BUFFER_SIZE, 0x1000, MAILBOX_MEM_DIRECT };
+        smiHardware.bufferHandle = MailboxCall(smiHardware.mailbox, MAILBOX_ALLOCATE, allocate, 3);
+        if(smiHardware.bufferHandle != 0)
+        {
+            smiHardware.bufferBus = MailboxCall(smiHardware.mailbox, MAILBOX_LOCK, &smiHardware.bufferHandle, 1);
+            void* buffer = mmap(NULL, SMI_DMA_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memory,
+                                smiHardware.bufferBus & ~0xC0000000);
+            smiHardware.buffer = (buffer == MAP_FAILED) ? NULL : buffer;
+        }
+    }
+    close(memory);
+
+    // Without DMA memory the FIFO is drained by the CPU instead
+    smiInterface.transfer = (smiHardware.buffer != NULL) ? SmiDmaTransfer : NULL;
+    if(smiInterface.transfer == NULL)
+    {
+        fprintf(stderr, "No DMA buffer, draining the SMI FIFO with the CPU.\n");
+    }
+
+    // SMI clock from PLLD (500 MHz) divided down to SMI_CLOCK_NS per cycle
+    smiHardware.clock[CLOCK_SMI_CTL / 4] = CLOCK_PASSWORD | (1 << 5);
+    usleep(10);
+    while(smiHardware.clock[CLOCK_SMI_CTL / 4] & (1 << 7))
+    {
+    }
+    smiHardware.clock[CLOCK_SMI_DIV / 4] = CLOCK_PASSWORD | ((SMI_CLOCK_NS * 500 / 1000) << 12);
+    smiHardware.clock[CLOCK_SMI_CTL / 4] = CLOCK_PASSWORD | CLOCK_SOURCE_PLLD;
+    smiHardware.clock[CLOCK_SMI_CTL / 4] = CLOCK_PASSWORD | CLOCK_SOURCE_PLLD | (1 << 4);
+
+    gpioSetMode(READ, PI_ALT1);
+    SetADBusPinsMode(PI_ALT1);
+    SmiSetup(&smiInterface);
+    return 0;
+}
+
+// Latches the page address with the CPU (AD lines briefly back to GPIO outputs),
+// then hands the lines to SMI for a full-page burst.
+// Returns 0 on success, 1 when the burst did not complete.
+int SmiReadPage(uint32_t address, uint16_t* words)
+{
+    SetADBusPinsMode(PI_OUTPUT);
+    SetAddress(address, LowerAddress);
+    LatchAddress(ALE_L);
+    SetAddress(address, UpperAddress);
+    LatchAddress(ALE_H);
+    SetADBusPinsMode(PI_ALT1);
+
+    if(SmiReadBurst(&smiInterface, words, PAGE_WORDS) != 0)
+    {
+        fprintf(stderr, "SMI burst at 0x%08X did not complete.\n", address);
+        return 1;
+    }
+    return 0;
+}
+
+// Unmaps whichever SMI, clock and DMA register pages are mapped and clears
+// them, so the next SmiInit (after ResetCart or a daemon self-test) maps fresh ones.
+void SmiUnmapRegisters(void)
+{
+    volatile uint32_t** registers[] = { &smiHardware.smi, &smiHardware.clock, &smiHardware.dma };
+    for(uint block = 0;
+        block < 3;
+        block++)
+    {
+        if(*registers[block] != NULL && *registers[block] != MAP_FAILED)
+        {
+            munmap((void*)*registers[block], 0x1000);
+        }
+        *registers[block] = NULL;
+    }
+}
+
+void SmiTerminate(void)
+{
+    if(smiHardware.smi != NULL && smiHardware.smi != MAP_FAILED)
+    {
+        smiHardware.smi[SMI_CS / 4] = 0;
+    }
+
+    SetADBusPinsMode(PI_OUTPUT);
+    gpioSetMode(READ, PI_OUTPUT);
+    BusWrite(READ, INACTIVE(HIGH));
+
+    if(smiHardware.buffer != NULL)
+    {
+        munmap((void*)smiHardware.buffer, SMI_DMA_BUFFER_SIZE);
+        MailboxCall(smiHardware.mailbox, MAILBOX_UNLOCK, &smiHardware.bufferHandle, 1);
+        MailboxCall(smiHardware.mailbox, MAILBOX_RELEASE, &smiHardware.bufferHandle, 1);
+        smiHardware.buffer = NULL;
+    }
+    if(smiHardware.mailbox >= 0)
+    {
+        close(smiHardware.mailbox);
+        smiHardware.mailbox = -1;
+    }
+    SmiUnmapRegisters();
+}
+
+// Reprograms the SMI strobe and hold times for the new busTiming.
+// Returns 0; the registers always take it.
+int SmiRetime(void)
+{
+    SmiSetup(&smiInterface);
+    return 0;
+}
+
+// Allocates the cart cache for a plan. Every page the FUSE side or the filler
+// reads stays cached: a whole retail image fits in RAM, so there is nothing
+// to evict and the page cache is just the image plus a present map.
+// - plan: Plan from PlanDump.
+// Returns 0 on success, 1 when out of memory.
+int CartCacheOpen(const struct DumpPlan* plan)
+{
+    cartCache.plan = *plan;
+    cartCache.pageCount = plan->romSize / ROM_PAGE_SIZE;
+    cartCache.image = malloc(plan->romSize);
+    cartCache.present = calloc(cartCache.pageCount, 1);
+    cartCache.readAhead = CACHE_READ_AHEAD_MIN;
+
+    for(uint range = 0;
+        range < plan->rangeCount;
+        range++)
+    {
+        if(plan->ranges[range].kind == RangeSave)
+        {
+            cartCache.saveSize += plan->ranges[range].length;
+        }
+    }
+
+    if(cartCache.image == NULL || cartCache.present == NULL)
+    {
+        fprintf(stderr, "Failed to allocate the 0x%X byte cart cache.\n", plan->romSize);
+        return 1;
+    }
+    return 0;
+}
+
+// Reads missing pages into the cache. Pages already present are skipped, so
+// overlapping fetches from the filler and FUSE readers never re-read the bus.
+// - firstPage: First ROM page to fetch.
+// - count: Number of pages, clipped to the ROM.
+// Returns 0 on success, 1 when a page failed to read; it and the pages after
+// it stay missing.
+int CartCacheFetch(uint32_t firstPage, uint32_t count)
+{
+    int status = 0;
+    uint16_t page[PAGE_WORDS];
+
+    pthread_mutex_lock(&cartCache.busLock);
+    for(uint32_t index = firstPage;
+        index < firstPage + count && index < cartCache.pageCount;
+        index++)
+    {
+        if(__atomic_load_n(&cartCache.present[index], __ATOMIC_ACQUIRE))
+        {
+            continue;
+        }
+
+        if(ReadPage(CART_ROM_BASE + index * ROM_PAGE_SIZE, page) != 0)
+        {
+            status = 1;
+            break;
+        }
+
+        uint8_t* bytes = cartCache.image + (size_t)index * ROM_PAGE_SIZE;
+        for(uint word = 0;
+            word < PAGE_WORDS;
+            word++)
+        {
+            bytes[word * 2] = page[word] >> 8;
+            bytes[word * 2 + 1] = page[word] & 0xFF;
+        }
+
+        PublishPage(index, bytes);
+        __atomic_store_n(&cartCache.present[index], 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&cartCache.presentCount, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&cartCache.busLock);
+    return status;
+}
+
+// Copies ROM bytes out of the cache, fetching missing pages first. A read that
+// continues where the last one ended doubles the read-ahead window (up to
+// CACHE_READ_AHEAD_MAX pages); any other read resets it.
+// - buffer: Destination.
+// - size: Bytes wanted.
+// - offset: ROM offset.
+// Returns the number of bytes copied (0 past the end of the ROM), or -EIO
+// when one of the pages failed to read.
+int CartCacheRead(uint8_t* buffer, size_t size, uint64_t offset)
+{
+    if(offset >= cartCache.plan.romSize || size == 0)
+    {
+        return 0;
+    }
+    if(size > cartCache.plan.romSize - offset)
+    {
+        size = cartCache.plan.romSize - offset;
+    }
+
+    uint32_t firstPage = offset / ROM_PAGE_SIZE;
+    uint32_t lastPage = (offset + size - 1) / ROM_PAGE_SIZE;
+
+    pthread_mutex_lock(&cartCache.stateLock);
+    if(firstPage == cartCache.nextPage || firstPage + 1 == cartCache.nextPage)
+    {
+        if(cartCache.readAhead < CACHE_READ_AHEAD_MAX)
+        {
+            cartCache.readAhead *= 2;
+        }
+    }
+    else
+    {
+        cartCache.readAhead = CACHE_READ_AHEAD_MIN;
+    }
+    cartCache.nextPage = lastPage + 1;
+    uint32_t readAhead = cartCache.readAhead;
+    pthread_mutex_unlock(&cartCache.stateLock);
+
+    for(uint32_t index = firstPage;
+        index <= lastPage;
+        index++)
+    {
+        if(!__atomic_load_n(&cartCache.present[index], __ATOMIC_ACQUIRE))
+        {
+            // Hold the filler off the bus until this read has its pages
+            __atomic_add_fetch(&cartCache.waiting, 1, __ATOMIC_ACQ_REL);
+            CartCacheFetch(index, lastPage - index + 1 + readAhead);
+            __atomic_sub_fetch(&cartCache.waiting, 1, __ATOMIC_ACQ_REL);
+            break;
+        }
+    }
+
+    // A page the read-ahead couldn't fetch doesn't fail the read; one it needs does
+    for(uint32_t index = firstPage;
+        index <= lastPage;
+        index++)
+    {
+        if(!__atomic_load_n(&cartCache.present[index], __ATOMIC_ACQUIRE))
+        {
+            return -EIO;
+        }
+    }
+
+    memcpy(buffer, cartCache.image + offset, size);
+    return size;
+}
+
+// Reads the planned save ranges into memory on first use.
+// Returns 0 on success, 1 when out of memory or a page failed to read.
+int CartCacheLoadSave(void)
+{
+    int status = 0;
+
+    pthread_mutex_lock(&cartCache.busLock);
+    if(cartCache.save == NULL && cartCache.saveSize > 0)
+    {
+        uint8_t* save = malloc(cartCache.saveSize);
+        uint32_t saveOffset = 0;
+        uint16_t page[PAGE_WORDS];
+
+        for(uint range = 0;
+            range < cartCache.plan.rangeCount && save != NULL;
+            range++)
+        {
+            const struct DumpRange* dumpRange = &cartCache.plan.ranges[range];
+            if(dumpRange->kind != RangeSave)
+            {
+                continue;
+            }
+
+            if(cartCache.plan.saveType == SaveFlash)
+            {
+                static const uint16_t readArray[2] = { 0xF000, 0x0000 };
+                WriteWords(FLASH_COMMAND_ADDRESS, readArray, 2);
+            }
+
+            for(uint32_t offset = 0;
+                offset < dumpRange->length;
+                offset += ROM_PAGE_SIZE)
+            {
+                if(ReadPage(dumpRange->busAddress + offset, page) != 0)
+                {
+                    free(save);
+                    save = NULL;
+                    break;
+                }
+                for(uint word = 0;
+                    word < PAGE_WORDS;
+                    word++)
+                {
+                    save[saveOffset++] = page[word] >> 8;
+                    save[saveOffset++] = page[word] & 0xFF;
+                }
+            }
+        }
+
+        cartCache.save = save;
+        status = (save == NULL);
+    }
+    pthread_mutex_unlock(&cartCache.busLock);
+    return status;
+}
+
+// Background filler: walks the ROM in batches (or in access-profile order)
+// whenever no reader is waiting for the bus, then writes the finished image if the mount was given --output.
+// A page that fails to read stops it; readers still fetch their pages on demand.
+void* CartCacheFiller(void* unused)
+{
+    (void)unused;
+    uint32_t cursor = 0;
+
+    while(!__atomic_load_n(&cartCache.stop, __ATOMIC_ACQUIRE) && cursor < cartCache.pageCount)
+    {
+        if(__atomic_load_n(&cartCache.waiting, __ATOMIC_ACQUIRE) > 0)
+        {
+            usleep(100);
+            continue;
+        }
+
+        if(cartCache.plan.pageOrder != NULL)
+        {
+            // Profiled boot pages first, one at a time in their recorded order
+            if(CartCacheFetch(cartCache.plan.pageOrder[cursor], 1) != 0)
+            {
+                break;
+            }
+            cursor++;
+            if(cursor == cartCache.plan.bootPages)
+            {
+                fprintf(stderr, "Boot pages cached (%u).\n", cartCache.plan.bootPages);
+            }
+        }
+        else
+        {
+            if(CartCacheFetch(cursor, CACHE_FILL_BATCH) != 0)
+            {
+                break;
+            }
+            cursor += CACHE_FILL_BATCH;
+        }
+    }
+
+    if(cursor < cartCache.pageCount && !__atomic_load_n(&cartCache.stop, __ATOMIC_ACQUIRE))
+    {
+        fprintf(stderr, "Cart cache filler stopped at a page that failed to read.\n");
+    }
+    else if(cursor >= cartCache.pageCount)
+    {
+        fprintf(stderr, "Cart cache complete (0x%X bytes).\n", cartCache.plan.romSize);
+        CloseSharedImage(0);
+
+        if(cartCache.persistPath != NULL)
+        {
+            FILE* output = fopen(cartCache.persistPath, "wb");
+            if(output == NULL ||
+               fwrite(cartCache.image, 1, cartCache.plan.romSize, output) != cartCache.plan.romSize ||
+               fclose(output) != 0)
+            {
+                perror(cartCache.persistPath);
+            }
+        }
+    }
+    return NULL;
+}
+
+#ifdef WITH_FUSE
+// Save file name in the mount, empty when the cart has no bus-readable save
+const char* CartSaveName(void)
+{
+    if(cartCache.saveSize == 0)
+    {
+        return "";
+    }
+    return (cartCache.plan.saveType == SaveFlash) ? "save.fla" : "save.sra";
+}
+
+int CartGetattr(const char* path, struct stat* info, struct fuse_file_info* file)
+{
+    (void)file;
+    memset(info, 0, sizeof(*info));
+
+    if(strcmp(path, "/") == 0)
+    {
+        info->st_mode = S_IFDIR | 0555;
+        info->st_nlink = 2;
+    }
+    else if(strcmp(path, "/" CART_ROM_NAME) == 0)
+    {
+        info->st_mode = S_IFREG | 0444;
+        info->st_nlink = 1;
+        info->st_size = cartCache.plan.romSize;
+    }
+    else if(cartCache.saveSize > 0 && strcmp(path + 1, CartSaveName()) == 0)
+    {
+        info->st_mode = S_IFREG | 0444;
+        info->st_nlink = 1;
+        info->st_size = cartCache.saveSize;
+    }
+    else
+    {
+        return -ENOENT;
+    }
+    return 0;
+}
+
+int CartReaddir(const char* path, void* buffer, fuse_fill_dir_t fill, off_t offset,
+                struct fuse_file_info* file, enum fuse_readdir_flags flags)
+{
+    (void)offset;
+    (void)file;
+    (void)flags;
+
+    if(strcmp(path, "/") != 0)
+    {
+        return -ENOENT;
+    }
+
+    fill(buffer, ".", NULL, 0, 0);
+    fill(buffer, "..", NULL, 0, 0);
+    fill(buffer, CART_ROM_NAME, NULL, 0, 0);
+    if(cartCache.saveSize > 0)
+    {
+        fill(buffer, CartSaveName(), NULL, 0, 0);
+    }
+    return 0;
+}
+
+int CartOpen(const char* path, struct fuse_file_info* file)
+{
+    struct stat info;
+    if(CartGetattr(path, &info, file) != 0 || S_ISDIR(info.st_mode))
+    {
+        return -ENOENT;
+    }
+    if((file->flags & O_ACCMODE) != O_RDONLY)
+    {
+        return -EACCES;
+    }
+
+    // The cart doesn't change under the mount, so the kernel may keep its pages
+    file->keep_cache = 1;
+    return 0;
+}
+
+int CartRead(const char* path, char* buffer, size_t size, off_t offset, struct fuse_file_info* file)
+{
+    (void)file;
+
+    if(strcmp(path, "/" CART_ROM_NAME) == 0)
+    {
+        return CartCacheRead((uint8_t*)buffer, size, offset);
+    }
+
+    if(cartCache.saveSize > 0 && strcmp(path + 1, CartSaveName()) == 0)
+    {
+        if(CartCacheLoadSave() != 0)
+        {
+            return -EIO;
+        }
+        if((uint64_t)offset >= cartCache.saveSize)
+        {
+            return 0;
+        }
+        if(size > cartCache.saveSize - (uint64_t)offset)
+        {
+            size = cartCache.saveSize - offset;
+        }
+        memcpy(buffer, cartCache.save + offset, size);
+        return size;
+    }
+    return -ENOENT;
+}
+#endif
+
+// Serves the cart as a read-only filesystem until it is unmounted.
+// - mountPoint: Directory to mount on.
+// - plan: Plan from PlanDump.
+// - persistPath: Where to write the image once the filler completes it, or NULL.
+// Returns 0 on a clean unmount, 1 on error.
+int MountCart(const char* mountPoint, const struct DumpPlan* plan, const char* persistPath)
+{
+#ifdef WITH_FUSE
+    static const struct fuse_operations operations = {
+        .getattr = CartGetattr,
+        .open = CartOpen,
+        .read = CartRead,
+        .readdir = CartReaddir
+    };
+
+    if(CartCacheOpen(plan) != 0)
+    {
+        return 1;
+    }
+    cartCache.persistPath = persistPath;
+
+    pthread_t filler;
+    if(pthread_create(&filler, NULL, CartCacheFiller, NULL) != 0)
+    {
+        fprintf(stderr, "Failed to start the cache filler.\n");
+        return 1;
+    }
+
+    // Foreground so the bus (and pigpio) stay in this process
+    char* fuseArguments[] = { "ROM_dumper_16MB", "-f", "-o", "ro,fsname=n64cart", (char*)mountPoint, NULL };
+    int status = fuse_main(5, fuseArguments, &operations, NULL);
+
+    __atomic_store_n(&cartCache.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(filler, NULL);
+    return status != 0;
+#else
+    (void)mountPoint;
+    (void)plan;
+    (void)persistPath;
+    fprintf(stderr, "Built without FUSE support (rebuild with -DWITH_FUSE).\n");
+    return 1;
+#endif
+}
+
+// Creates the shared image for a cart, replacing any old object of the same
+// name (consumers still mapping the old one keep it until they unmap).
+// - name: Shared memory object name, with or without the leading '/'.
+// - header: The header page as read from CART_ROM_BASE.
+// - romSize: Planned ROM size.
+// Returns 0 on success, 1 on error (already reported).
+int OpenSharedImage(const char* name, const uint16_t* header, uint32_t romSize)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s%s", (name[0] == '/') ? "" : "/", name);
+
+    uint32_t bitmapOffset = 0;
+    uint32_t imageOffset = 0;
+    size_t size = SharedImageSize(romSize, &bitmapOffset, &imageOffset);
+
+    shm_unlink(path);
+    int fd = shm_open(path, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if(fd < 0 || ftruncate(fd, size) != 0)
+    {
+        perror(path);
+        if(fd >= 0)
+        {
+            close(fd);
+            shm_unlink(path);
+        }
+        return 1;
+    }
+
+    void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mapping == MAP_FAILED)
+    {
+        perror(path);
+        shm_unlink(path);
+        return 1;
+    }
+
+    // ftruncate zero-filled the bitmap; consumers check the magic last
+    struct SharedImageHeader* shared = mapping;
+    shared->version = SHARED_IMAGE_VERSION;
+    shared->romSize = romSize;
+    shared->pageSize = SHARED_IMAGE_PAGE_SIZE;
+    shared->pageCount = romSize / SHARED_IMAGE_PAGE_SIZE;
+    shared->bitmapOffset = bitmapOffset;
+    shared->imageOffset = imageOffset;
+    shared->crc1 = (uint32_t)header[8] << 16 | header[9];
+    shared->crc2 = (uint32_t)header[10] << 16 | header[11];
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(shared->magic, SHARED_IMAGE_MAGIC, sizeof(shared->magic));
+
+    sharedImage.header = shared;
+    sharedImage.image = (uint8_t*)mapping + imageOffset;
+    sharedImage.size = size;
+    fprintf(stderr, "Publishing the image in shared memory %s.\n", path);
+    return 0;
+}
+
+// Copies a ROM page into the shared image and marks it ready. Does nothing
+// when no shared image is open.
+// - index: ROM page (ROM_PAGE_SIZE bytes).
+// - bytes: The page, big-endian.
+void PublishPage(uint32_t index, const uint8_t* bytes)
+{
+    if(sharedImage.header == NULL)
+    {
+        return;
+    }
+
+    memcpy(sharedImage.image + (size_t)index * ROM_PAGE_SIZE, bytes, ROM_PAGE_SIZE);
+    SharedImagePublishPage(sharedImage.header, index);
+}
+
+// Marks the shared image complete (or failed, so waiters give up) and unmaps it.
+// The object stays in /dev/shm for consumers.
+// - status: Dump status, 0 on success.
+void CloseSharedImage(int status)
+{
+    if(sharedImage.header == NULL)
+    {
+        return;
+    }
+
+    int complete = (sharedImage.header->readyCount == sharedImage.header->pageCount);
+    SharedImageFinish(sharedImage.header, (status == 0 && complete) ? SharedImageComplete : SharedImageFailed);
+    munmap(sharedImage.header, sharedImage.size);
+    sharedImage.header = NULL;
+}
+
+// Dumps carts as they are inserted until SIGINT or SIGTERM, keeping the GPIO
+// and the backend set up between carts. Each cart is self-tested, planned from
+// its header (and access profile), dumped with the configured read options
+// into a staging file, then handed to the archiver thread, which hashes and
+// files it while the next cart dumps.
+// - directory: Archive directory.
+// - profileDirectory: Access profile directory, or NULL.
+// - selfTest: Run the bus self-test on every cart.
+// Returns 0 once stopped, 1 on error.
+int RunDaemon(const char* directory, const char* profileDirectory, int selfTest)
+{
+    struct BusTiming timing = baseTiming;
+    uint16_t header[PAGE_WORDS];
+    uint serial = 0;
+    int status = 0;
+
+    archiver.directory = directory;
+    if(pthread_create(&archiver.thread, NULL, ArchiverThread, NULL) != 0)
+    {
+        fprintf(stderr, "Failed to start the archiver.\n");
+        return 1;
+    }
+    gpioSetSignalFunc(SIGINT, DaemonStop);
+    gpioSetSignalFunc(SIGTERM, DaemonStop);
+    fprintf(stderr, "Waiting for carts, archiving to %s.\n", directory);
+
+    while(WaitForCart(header, 1) == 0)
+    {
+        struct ArchiveJob job;
+        struct DumpPlan plan;
+        uint16_t suspects;
+
+        if(ResetDumpState(&timing) != 0)
+        {
+            status = 1;
+            break;
+        }
+        HeaderName(header, job.name, sizeof(job.name));
+        fprintf(stderr, "Cart %s inserted.\n", job.name);
+
+        // Self-testing is bit-banged, so the backend hands the pins over meanwhile
+        int tested = 0;
+        if(selfTest)
+        {
+            if(bus->terminate != NULL)
+            {
+                bus->terminate();
+            }
+            SetupBusPins();
+            tested = SelfTestBus(&suspects);
+            if(bus->init != NULL && bus->init() != 0)
+            {
+                status = 1;
+                break;
+            }
+        }
+
+        // A cart failing its self-test is still logged, as failed with no image
+        job.romPath[0] = '\0';
+        job.savePath[0] = '\0';
+        job.saveExtension = "sra";
+        job.cic = 0;
+        job.status = 1;
+        if(tested == 0)
+        {
+            int romLength = snprintf(job.romPath, sizeof(job.romPath), "%s/.incoming-%u.z64", directory, serial++);
+            if(romLength < 0 || (size_t)romLength >= sizeof(job.romPath))
+            {
+                fprintf(stderr, "Archive directory path %s too long.\n", directory);
+                status = 1;
+                break;
+            }
+
+            PlanDump(header, &plan);
+            if(profileDirectory != NULL)
+            {
+                LoadAccessProfile(profileDirectory, header, &plan);
+            }
+            job.status = ExecutePlan(&plan, job.romPath, NULL);
+            free(plan.pageOrder);
+
+            // ExecutePlan derived the same path and failed the dump if it didn't fit
+            job.saveExtension = (plan.saveType == SaveFlash) ? "fla" : "sra";
+            int saveLength = snprintf(job.savePath, sizeof(job.savePath), "%s.%s", job.romPath, job.saveExtension);
+            if(saveLength < 0 || (size_t)saveLength >= sizeof(job.savePath))
+            {
+                job.savePath[0] = '\0';
+            }
+            job.cic = (romPrefixLength >= CHECKSUM_END) ? IdentifyCic(romPrefix) : 0;
+        }
+        QueueArchive(&job);
+
+        // The removal polls run at the base timing, on a backend rebuilt if a retime failed
+        if(ResetDumpState(&timing) != 0)
+        {
+            status = 1;
+            break;
+        }
+        fprintf(stderr, "Remove the cart.\n");
+        if(WaitForCart(header, 0) != 0)
+        {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&archiver.lock);
+    archiver.stopping = 1;
+    pthread_cond_broadcast(&archiver.changed);
+    pthread_mutex_unlock(&archiver.lock);
+    pthread_join(archiver.thread, NULL);
+    return status;
+}
+
+// SIGINT/SIGTERM: --daemon stops once the cart in the slot is dumped.
+void DaemonStop(int signalNumber)
+{
+    (void)signalNumber;
+    daemonStopping = 1;
+}
+
+// Polls the header page every DAEMON_POLL_US. A cart counts as inserted once
+// its header reads the .z64 magic DAEMON_STABLE_POLLS times in a row, so
+// contacts still sliding into the slot don't start a dump; it counts as
+// removed once the header reads differently as many times in a row.
+// - header: Receives the inserted cart's header page, or holds the cart to
+//   wait out.
+// - inserted: Wait for a cart to be inserted, otherwise for header's to go.
+// Returns 0 when the slot changed, 1 when the daemon is stopping.
+int WaitForCart(uint16_t* header, int inserted)
+{
+    uint16_t words[PAGE_WORDS];
+    uint16_t previous[PAGE_WORDS];
+    uint stable = 0;
+
+    while(!daemonStopping)
+    {
+        // A transfer that fell short says nothing about the slot
+        if(bus->readPage(CART_ROM_BASE, words) != 0)
+        {
+            gpioDelay(DAEMON_POLL_US);
+            continue;
+        }
+        if(inserted)
+        {
+            int valid = (((uint32_t)words[0] << 16 | words[1]) == Z64_MAGIC);
+            stable = !valid ? 0 : (stable > 0 && memcmp(words, previous, sizeof(words)) == 0) ? stable + 1 : 1;
+            memcpy(previous, words, sizeof(words));
+            if(stable >= DAEMON_STABLE_POLLS)
+            {
+                memcpy(header, words, sizeof(words));
+                return 0;
+            }
+        }
+        else
+        {
+            stable = (memcmp(words, header, sizeof(words)) != 0) ? stable + 1 : 0;
+            if(stable >= DAEMON_STABLE_POLLS)
+            {
+                return 0;
+            }
+        }
+        gpioDelay(DAEMON_POLL_US);
+    }
+    return 1;
+}
+
+// Clears what a dump leaves behind, so every cart starts from the configured
+// timing with empty counters.
+// - timing: Base timing the daemon started with.
+// Returns 0 on success, 1 when the backend failed to take the timing.
+int ResetDumpState(const struct BusTiming* timing)
+{
+    romPrefixLength = 0;
+    readRetries = 0;
+    readFailures = 0;
+    majorityPages = 0;
+    memset(lineDisagreements, 0, sizeof(lineDisagreements));
+    memset(timingRegions, 0, sizeof(timingRegions));
+    referenceRead = 0;
+    recalibrations = 0;
+    cartResets = 0;
+
+    baseTiming = *timing;
+    timingPermille = 0;
+    return SetTimingScale(1000);
+}
+
+// Names a cart from its header: the internal name (0x20-0x33) with characters
+// that don't belong in a file name replaced, then CRC1 to tell revisions apart.
+void HeaderName(const uint16_t* header, char* name, size_t size)
+{
+    char title[21];
+    uint length = 0;
+
+    for(uint byte = 0;
+        byte < 20;
+        byte++)
+    {
+        uint16_t word = header[0x20 / 2 + byte / 2];
+        char character = (byte % 2 == 0) ? word >> 8 : word & 0xFF;
+        if(character < 0x20 || character > 0x7E)
+        {
+            character = ' ';
+        }
+        else if(strchr("/\\:*?\"<>|", character) != NULL)
+        {
+            character = '_';
+        }
+        title[length++] = character;
+    }
+    while(length > 0 && title[length - 1] == ' ')
+    {
+        length--;
+    }
+    title[length] = '\0';
+
+    const char* start = title;
+    while(*start == ' ')
+    {
+        start++;
+    }
+    uint32_t crc1 = (uint32_t)header[8] << 16 | header[9];
+    snprintf(name, size, "%s-%08X", (*start != '\0') ? start : "cart", crc1);
+}
+
+// Hands a dump to the archiver thread, first waiting for it to finish the
+// previous one.
+void QueueArchive(const struct ArchiveJob* job)
+{
+    pthread_mutex_lock(&archiver.lock);
+    while(archiver.pending)
+    {
+        pthread_cond_wait(&archiver.changed, &archiver.lock);
+    }
+    archiver.job = *job;
+    archiver.pending = 1;
+    pthread_cond_broadcast(&archiver.changed);
+    pthread_mutex_unlock(&archiver.lock);
+}
+
+// Archives queued dumps until stopped; a queued dump is archived before stopping.
+void* ArchiverThread(void* unused)
+{
+    (void)unused;
+
+    pthread_mutex_lock(&archiver.lock);
+    while(1)
+    {
+        while(!archiver.pending && !archiver.stopping)
+        {
+            pthread_cond_wait(&archiver.changed, &archiver.lock);
+        }
+        if(!archiver.pending)
+        {
+            break;
+        }
+
+        struct ArchiveJob job = archiver.job;
+        pthread_mutex_unlock(&archiver.lock);
+        ArchiveDump(&job);
+        pthread_mutex_lock(&archiver.lock);
+        archiver.pending = 0;
+        pthread_cond_broadcast(&archiver.changed);
+    }
+    pthread_mutex_unlock(&archiver.lock);
+    return NULL;
+}
+
+// Hashes a staged dump and files it, with its save, in the archive directory
+// under its DAT title (looked up by SHA-1) or its header name. An existing
+// file is never replaced; the new one gets a " (2)", " (3)"... suffix. Appends
+// "<sha1> <crc32> <size> <cic> <state> <file>" to the manifest, the state
+// being verified (in the DAT index), unknown, bad-checksum (the header
+// checksum matched no CIC) or failed (the dump itself failed). A dump with no
+// image (the cart failed its self-test, or the dump failed before writing any)
+// is logged as failed with file "-", as is one that couldn't be filed, which
+// stays staged.
+void ArchiveDump(const struct ArchiveJob* job)
+{
+    uint8_t digest[SHA1_SIZE] = { 0 };
+    char digestText[SHA1_SIZE * 2 + 1];
+    uint32_t crc = 0;
+    size_t size = 0;
+
+    const uint8_t* image = (job->romPath[0] != '\0') ? MapImage(job->romPath, &size) : NULL;
+    if(image != NULL)
+    {
+        struct Sha1 sha1;
+        Sha1Init(&sha1);
+        Sha1Update(&sha1, image, size);
+        Sha1Final(&sha1, digest);
+        crc = Crc32Update(0, image, size);
+        munmap((void*)image, size);
+    }
+    for(uint byte = 0;
+        byte < SHA1_SIZE;
+        byte++)
+    {
+        sprintf(digestText + byte * 2, "%02x", digest[byte]);
+    }
+
+    const struct DatEntry* entry = (image != NULL) ? DatLookup(DatKeySha1, digest, SHA1_SIZE) : NULL;
+    int failed = (job->status != 0 || image == NULL);
+    const char* state = failed ? "failed" : (entry != NULL) ? "verified" : (job->cic == 0) ? "bad-checksum" : "unknown";
+
+    char base[256];
+    snprintf(base, sizeof(base), "%s%s", (entry != NULL) ? DatTitle(entry) : job->name, failed ? " (failed)" : "");
+    for(char* character = base;
+        *character != '\0';
+        character++)
+    {
+        *character = (*character == '/') ? '_' : *character;
+    }
+
+    // An empty or missing staging file leaves nothing to file, only the failure to log
+    if(image == NULL && job->romPath[0] != '\0')
+    {
+        unlink(job->romPath);
+        if(job->savePath[0] != '\0')
+        {
+            unlink(job->savePath);
+        }
+    }
+
+    char stem[300] = "-";
+    char file[sizeof(stem) + 4] = "-";
+    char target[PATH_MAX];
+    int filed = 0;
+    for(uint copy = 1;
+        image != NULL && !filed;
+        copy++)
+    {
+        if(copy == 1)
+        {
+            snprintf(stem, sizeof(stem), "%s", base);
+        }
+        else
+        {
+            snprintf(stem, sizeof(stem), "%s (%u)", base, copy);
+        }
+        int targetLength = snprintf(target, sizeof(target), "%s/%s.z64", archiver.directory, stem);
+        if(targetLength < 0 || (size_t)targetLength >= sizeof(target))
+        {
+            fprintf(stderr, "Archive path for %s too long.\n", stem);
+            break;
+        }
+        if(link(job->romPath, target) == 0)
+        {
+            snprintf(file, sizeof(file), "%s.z64", stem);
+            unlink(job->romPath);
+            filed = 1;
+        }
+        else if(errno != EEXIST)
+        {
+            perror(target);
+            break;
+        }
+    }
+
+    if(filed && job->savePath[0] != '\0' && access(job->savePath, F_OK) == 0)
+    {
+        char saveTarget[PATH_MAX];
+        int saveLength = snprintf(saveTarget, sizeof(saveTarget), "%s/%s.%s", archiver.directory, stem, job->saveExtension);
+        if(saveLength < 0 || (size_t)saveLength >= sizeof(saveTarget))
+        {
+            fprintf(stderr, "Archive path for %s.%s too long.\n", stem, job->saveExtension);
+        }
+        else if(link(job->savePath, saveTarget) == 0)
+        {
+            unlink(job->savePath);
+        }
+        else
+        {
+            perror(saveTarget);
+        }
+    }
+
+    char manifestPath[PATH_MAX];
+    int manifestLength = snprintf(manifestPath, sizeof(manifestPath), "%s/%s", archiver.directory, ARCHIVE_MANIFEST);
+    FILE* manifest = NULL;
+    if(manifestLength < 0 || (size_t)manifestLength >= sizeof(manifestPath))
+    {
+        fprintf(stderr, "Manifest path in %s too long.\n", archiver.directory);
+    }
+    else if((manifest = fopen(manifestPath, "a")) == NULL)
+    {
+        perror(manifestPath);
+    }
+    else
+    {
+        int written = fprintf(manifest, "%s %08X %u %u %s %s\n", digestText, crc, (uint)size, job->cic, state, file);
+        if(fclose(manifest) != 0 || written < 0)
+        {
+            perror(manifestPath);
+        }
+    }
+    if(image == NULL)
+    {
+        fprintf(stderr, "Logged %s as failed, nothing dumped.\n", job->name);
+    }
+    else if(!filed)
+    {
+        fprintf(stderr, "Logged %s (%s, SHA-1 %s), left staged as %s.\n", job->name, state, digestText, job->romPath);
+    }
+    else
+    {
+        fprintf(stderr, "Archived %s (%s, SHA-1 %s).\n", file, state, digestText);
+    }
+}
@@ -0,0 +1,423 @@
+/*
+    On-demand cart image mapping for emulators, see ROM_mapping.h.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#include "ROM_mapping.h"
+
+void RomMappingPersist(struct RomMapping* mapping);
+int RomMappingCopy(struct RomMapping* mapping, size_t firstPage, size_t count);
+void RomMappingTouch(struct RomMapping* mapping, size_t page);
+int RomMappingFill(struct RomMapping* mapping);
+void RomMappingRelease(struct RomMapping* mapping);
+void* RomMappingHandler(void* argument);
+
+int RomMappingOpen(struct RomMapping* mapping, const char* sourcePath, const char* persistPath)
+{
+    memset(mapping, 0, sizeof(*mapping));
+    mapping->data = MAP_FAILED;
+    mapping->source = -1;
+    mapping->userfault = -1;
+    mapping->stop[0] = -1;
+    mapping->stop[1] = -1;
+    mapping->readAhead = ROM_MAPPING_READ_AHEAD_MIN;
+
+    struct stat info;
+    mapping->source = open(sourcePath, O_RDONLY | O_CLOEXEC);
+    if(mapping->source < 0 || fstat(mapping->source, &info) != 0 || info.st_size == 0)
+    {
+        perror(sourcePath);
+        RomMappingClose(mapping);
+        return 1;
+    }
+
+    mapping->size = info.st_size;
+    mapping->pageSize = sysconf(_SC_PAGESIZE);
+    mapping->pageCount = (mapping->size + mapping->pageSize - 1) / mapping->pageSize;
+    mapping->present = calloc(mapping->pageCount, 1);
+    mapping->touched = calloc(mapping->pageCount, 1);
+    mapping->bounce = malloc((1 + ROM_MAPPING_READ_AHEAD_MAX) * mapping->pageSize);
+    mapping->touchOrder = malloc(mapping->pageCount * sizeof(uint32_t));
+    mapping->persistPath = (persistPath != NULL) ? strdup(persistPath) : NULL;
+    mapping->data = mmap(NULL, mapping->pageCount * mapping->pageSize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(mapping->present == NULL || mapping->touched == NULL || mapping->bounce == NULL || mapping->touchOrder == NULL ||
+       mapping->data == MAP_FAILED ||
+       (persistPath != NULL && mapping->persistPath == NULL))
+    {
+        fprintf(stderr, "Failed to allocate the 0x%zX byte ROM mapping.\n", mapping->size);
+        RomMappingClose(mapping);
+        return 1;
+    }
+
+    // Missing pages of the mapping now fault to the handler thread
+    struct uffdio_api api = { .api = UFFD_API, .features = 0 };
+    struct uffdio_register registration = {
+        .range = { (uintptr_t)mapping->data, mapping->pageCount * mapping->pageSize },
+        .mode = UFFDIO_REGISTER_MODE_MISSING
+    };
+
+    mapping->userfault = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if(mapping->userfault < 0 ||
+       ioctl(mapping->userfault, UFFDIO_API, &api) != 0 ||
+       ioctl(mapping->userfault, UFFDIO_REGISTER, &registration) != 0)
+    {
+        perror("userfaultfd");
+        RomMappingClose(mapping);
+        return 1;
+    }
+
+    if(pipe2(mapping->stop, O_CLOEXEC) != 0 ||
+       pthread_create(&mapping->handler, NULL, RomMappingHandler, mapping) != 0)
+    {
+        fprintf(stderr, "Failed to start the ROM mapping handler.\n");
+        RomMappingClose(mapping);
+        return 1;
+    }
+    mapping->running = 1;
+    return 0;
+}
+
+void RomMappingClose(struct RomMapping* mapping)
+{
+    if(mapping->running)
+    {
+        char wake = 0;
+        if(write(mapping->stop[1], &wake, 1) != 1)
+        {
+            perror("ROM mapping stop");
+        }
+        pthread_join(mapping->handler, NULL);
+        mapping->running = 0;
+    }
+
+    if(mapping->data != MAP_FAILED)
+    {
+        munmap(mapping->data, mapping->pageCount * mapping->pageSize);
+        mapping->data = MAP_FAILED;
+    }
+
+    int* descriptors[] = { &mapping->source, &mapping->userfault, &mapping->stop[0], &mapping->stop[1] };
+    for(size_t descriptor = 0;
+        descriptor < sizeof(descriptors) / sizeof(descriptors[0]);
+        descriptor++)
+    {
+        if(*descriptors[descriptor] >= 0)
+        {
+            close(*descriptors[descriptor]);
+            *descriptors[descriptor] = -1;
+        }
+    }
+
+    free(mapping->present);
+    free(mapping->touched);
+    free(mapping->bounce);
+    free(mapping->touchOrder);
+    free(mapping->persistPath);
+    mapping->present = NULL;
+    mapping->touched = NULL;
+    mapping->bounce = NULL;
+    mapping->touchOrder = NULL;
+    mapping->persistPath = NULL;
+}
+
+int RomMappingSaveProfile(struct RomMapping* mapping, const char* directory)
+{
+    // Reading the header faults page 0 in if the emulator hasn't yet
+    const uint8_t* header = mapping->data;
+    uint32_t crc1 = (uint32_t)header[0x10] << 24 | header[0x11] << 16 | header[0x12] << 8 | header[0x13];
+    uint32_t crc2 = (uint32_t)header[0x14] << 24 | header[0x15] << 16 | header[0x16] << 8 | header[0x17];
+
+    char name[64];
+    char path[4096];
+    snprintf(name, sizeof(name), ROM_PROFILE_NAME, crc1, crc2);
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+
+    FILE* output = fopen(path, "w");
+    if(output == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+
+    fprintf(output, "# N64 access profile: <offset> <length> per run of pages, first touch first\n");
+
+    size_t count = __atomic_load_n(&mapping->touchCount, __ATOMIC_ACQUIRE);
+    size_t run = 0;
+    while(run < count)
+    {
+        size_t length = 1;
+        while(run + length < count && mapping->touchOrder[run + length] == mapping->touchOrder[run] + length)
+        {
+            length++;
+        }
+
+        size_t offset = mapping->touchOrder[run] * mapping->pageSize;
+        size_t bytes = length * mapping->pageSize;
+        if(offset + bytes > mapping->size)
+        {
+            bytes = mapping->size - offset;
+        }
+        fprintf(output, "%zX %zX\n", offset, bytes);
+        run += length;
+    }
+
+    if(fclose(output) != 0)
+    {
+        perror(path);
+        return 1;
+    }
+    return 0;
+}
+
+// Writes the complete image out. Every page is present, so reading the
+// mapping no longer faults.
+void RomMappingPersist(struct RomMapping* mapping)
+{
+    fprintf(stderr, "ROM mapping complete (0x%zX bytes).\n", mapping->size);
+
+    if(mapping->persistPath == NULL)
+    {
+        return;
+    }
+    if(mapping->failed)
+    {
+        fprintf(stderr, "Not writing %s, some pages failed to read.\n", mapping->persistPath);
+        return;
+    }
+
+    FILE* output = fopen(mapping->persistPath, "wb");
+    if(output == NULL ||
+       fwrite(mapping->data, 1, mapping->size, output) != mapping->size ||
+       fclose(output) != 0)
+    {
+        perror(mapping->persistPath);
+    }
+}
+
+// Copies missing pages in from the source, one UFFDIO_COPY per run of
+// missing pages. Copying wakes any thread faulting on those pages. Pages the
+// source can't supply, or that fail to copy, become zeros, so the emulator
+// never hangs on a fault.
+// - firstPage: First page of the window.
+// - count: Pages in the window, at most 1 + ROM_MAPPING_READ_AHEAD_MAX.
+// Returns 0 on success, 1 when the mapping can't be filled any more.
+int RomMappingCopy(struct RomMapping* mapping, size_t firstPage, size_t count)
+{
+    size_t endPage = firstPage + count;
+    if(endPage > mapping->pageCount)
+    {
+        endPage = mapping->pageCount;
+    }
+
+    size_t page = firstPage;
+    while(page < endPage)
+    {
+        if(mapping->present[page])
+        {
+            page++;
+            continue;
+        }
+
+        size_t run = 1;
+        while(page + run < endPage && !mapping->present[page + run])
+        {
+            run++;
+        }
+
+        size_t length = run * mapping->pageSize;
+        ssize_t got = pread(mapping->source, mapping->bounce, length, page * mapping->pageSize);
+        if(got < 0)
+        {
+            perror("ROM mapping read");
+            mapping->failed = 1;
+            got = 0;
+        }
+        else if((size_t)got < length && page * mapping->pageSize + got < mapping->size)
+        {
+            fprintf(stderr, "ROM mapping source ended early at 0x%zX.\n", page * mapping->pageSize + got);
+            mapping->failed = 1;
+        }
+        memset(mapping->bounce + got, 0, length - got);
+
+        struct uffdio_copy copy = {
+            .dst = (uintptr_t)mapping->data + page * mapping->pageSize,
+            .src = (uintptr_t)mapping->bounce,
+            .len = length,
+            .mode = 0
+        };
+        if(ioctl(mapping->userfault, UFFDIO_COPY, &copy) != 0 && errno != EEXIST)
+        {
+            perror("UFFDIO_COPY");
+            mapping->failed = 1;
+
+            // A partial copy already woke its pages; zero-fill the rest
+            size_t done = (copy.copy > 0) ? (size_t)copy.copy : 0;
+            struct uffdio_zeropage zero = {
+                .range = { copy.dst + done, length - done },
+                .mode = 0
+            };
+            if(ioctl(mapping->userfault, UFFDIO_ZEROPAGE, &zero) != 0 && errno != EEXIST)
+            {
+                perror("UFFDIO_ZEROPAGE");
+                return 1;
+            }
+        }
+
+        memset(mapping->present + page, 1, run);
+        mapping->presentCount += run;
+        page += run;
+
+        if(mapping->presentCount == mapping->pageCount)
+        {
+            RomMappingPersist(mapping);
+        }
+    }
+    return 0;
+}
+
+// Appends a page the emulator read to the access profile, once.
+void RomMappingTouch(struct RomMapping* mapping, size_t page)
+{
+    if(!mapping->touched[page])
+    {
+        mapping->touched[page] = 1;
+        mapping->touchOrder[mapping->touchCount] = page;
+        __atomic_store_n(&mapping->touchCount, mapping->touchCount + 1, __ATOMIC_RELEASE);
+    }
+}
+
+// Copies the next few missing pages while the emulator isn't faulting.
+// Returns 0 on success, 1 when the mapping can't be filled any more.
+int RomMappingFill(struct RomMapping* mapping)
+{
+    while(mapping->fillCursor < mapping->pageCount && mapping->present[mapping->fillCursor])
+    {
+        mapping->fillCursor++;
+    }
+    if(mapping->fillCursor < mapping->pageCount)
+    {
+        return RomMappingCopy(mapping, mapping->fillCursor, ROM_MAPPING_FILL_PAGES);
+    }
+    return 0;
+}
+
+// Hands the mapping back to the kernel when the handler has to give up.
+// Unregistering wakes every blocked fault, and missing pages then fault in as
+// zeros instead of waiting on a handler that is gone.
+void RomMappingRelease(struct RomMapping* mapping)
+{
+    mapping->failed = 1;
+    struct uffdio_range range = { (uintptr_t)mapping->data, mapping->pageCount * mapping->pageSize };
+    if(ioctl(mapping->userfault, UFFDIO_UNREGISTER, &range) != 0)
+    {
+        perror("UFFDIO_UNREGISTER");
+    }
+    fprintf(stderr, "ROM mapping handler stopped; missing pages read as zeros.\n");
+}
+
+// Serves faults until RomMappingClose, or until pages can no longer be copied
+// in (see RomMappingRelease). A fault on the page right after the last window
+// doubles the read-ahead (up to ROM_MAPPING_READ_AHEAD_MAX); any other fault
+// resets it.
+void* RomMappingHandler(void* argument)
+{
+    struct RomMapping* mapping = argument;
+    struct pollfd polls[2] = {
+        { .fd = mapping->userfault, .events = POLLIN },
+        { .fd = mapping->stop[0], .events = POLLIN }
+    };
+
+    while(1)
+    {
+        int timeout = (mapping->presentCount < mapping->pageCount) ? ROM_MAPPING_IDLE_MS : -1;
+        int ready = poll(polls, 2, timeout);
+        if(ready < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(ready < 0)
+        {
+            perror("ROM mapping poll");
+            RomMappingRelease(mapping);
+            break;
+        }
+        if(polls[1].revents != 0)
+        {
+            break;
+        }
+        if(ready == 0)
+        {
+            if(RomMappingFill(mapping) != 0)
+            {
+                RomMappingRelease(mapping);
+                break;
+            }
+            continue;
+        }
+
+        struct uffd_msg message;
+        if(read(mapping->userfault, &message, sizeof(message)) != sizeof(message))
+        {
+            continue;
+        }
+        if(message.event != UFFD_EVENT_PAGEFAULT)
+        {
+            continue;
+        }
+
+        size_t page = (message.arg.pagefault.address - (uintptr_t)mapping->data) / mapping->pageSize;
+
+        if(mapping->present[page])
+        {
+            // Already copied for another thread's fault; just release this one
+            struct uffdio_range range = { (uintptr_t)mapping->data + page * mapping->pageSize, mapping->pageSize };
+            ioctl(mapping->userfault, UFFDIO_WAKE, &range);
+            RomMappingTouch(mapping, page);
+            continue;
+        }
+
+        if(page == mapping->nextPage)
+        {
+            // Faulting just past the window means the emulator read all of it
+            for(size_t windowPage = mapping->lastFault + 1;
+                windowPage < page;
+                windowPage++)
+            {
+                RomMappingTouch(mapping, windowPage);
+            }
+
+            if(mapping->readAhead < ROM_MAPPING_READ_AHEAD_MAX)
+            {
+                mapping->readAhead *= 2;
+            }
+        }
+        else
+        {
+            mapping->readAhead = ROM_MAPPING_READ_AHEAD_MIN;
+        }
+        mapping->nextPage = page + 1 + mapping->readAhead;
+        mapping->lastFault = page;
+        RomMappingTouch(mapping, page);
+
+        if(RomMappingCopy(mapping, page, 1 + mapping->readAhead) != 0)
+        {
+            RomMappingRelease(mapping);
+            break;
+        }
+    }
+    return NULL;
+}
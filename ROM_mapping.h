@@ -0,0 +1,80 @@
+/*
+    Cart image mapping for emulators
+
+    Hands an emulator a memory mapping of a cart image without reading it
+    first. The mapping is registered with userfaultfd: the first touch of a
+    page blocks the emulator thread while a handler thread reads that page
+    (plus a read-ahead window) from the source file and copies it in. The
+    source is normally rom.z64 on a ROM_dumper_16MB --mount, so each fetch
+    becomes a burst read on the cart bus; a plain image file works too.
+
+    While the emulator is idle the handler fills in the remaining pages, and
+    once every page is present it can write the complete image out.
+
+    The handler also records the order in which the emulator first touched
+    pages; RomMappingSaveProfile writes it as an access profile that
+    ROM_dumper_16MB --access-profile uses to dump the boot pages first. Pages
+    copied in as read-ahead only count once a fault just past the window shows
+    the emulator read through them.
+
+    Build: link ROM_mapping.c into the emulator with -pthread.
+    Needs Linux 4.3+; unprivileged use needs vm.unprivileged_userfaultfd=1.
+*/
+
+#ifndef ROM_MAPPING_H
+#define ROM_MAPPING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define ROM_MAPPING_READ_AHEAD_MIN 1 // Pages copied past a random fault
+#define ROM_MAPPING_READ_AHEAD_MAX 64 // Reached after a few sequential faults
+#define ROM_MAPPING_FILL_PAGES 16 // Pages filled per idle poll
+#define ROM_MAPPING_IDLE_MS 2
+
+// Access profile file in a profile directory, keyed by header CRC1 and CRC2
+#define ROM_PROFILE_NAME "%08X-%08X.prof"
+
+struct RomMapping
+{
+  uint8_t* data; // The image; pages appear as they are touched
+  size_t size; // Bytes of image (the mapping is rounded up to whole pages)
+  size_t pageSize;
+  size_t pageCount;
+  size_t presentCount;
+  uint8_t* present; // One flag per page, owned by the handler thread
+  uint8_t* bounce; // Staging buffer for UFFDIO_COPY
+  size_t nextPage; // Page after the last fault, for sequential detection
+  size_t lastFault;
+  size_t readAhead; // Pages
+  size_t fillCursor;
+  uint8_t* touched; // One flag per page, set once it is in touchOrder
+  uint32_t* touchOrder; // Pages the emulator is known to have read, in first-touch order
+  size_t touchCount;
+  int source;
+  int userfault;
+  int stop[2]; // Pipe that wakes the handler for RomMappingClose
+  int running;
+  int failed; // A page couldn't be read; the image is not persisted
+  char* persistPath;
+  pthread_t handler;
+};
+
+// Maps an image for on-demand access.
+// - mapping: Filled in on success.
+// - sourcePath: Image to fetch pages from (e.g. <mount>/rom.z64).
+// - persistPath: Where to write the image once all pages are present, or NULL.
+// Returns 0 on success, 1 on error (already reported).
+int RomMappingOpen(struct RomMapping* mapping, const char* sourcePath, const char* persistPath);
+
+// Writes the pages touched so far as an access profile: one "<offset> <length>"
+// hex line per run of pages, in first-touch order.
+// - directory: Profile directory; the file is named from the image's header CRCs.
+// Returns 0 on success, 1 on error (already reported).
+int RomMappingSaveProfile(struct RomMapping* mapping, const char* directory);
+
+// Stops the handler and unmaps the image. Pages not yet present are lost.
+void RomMappingClose(struct RomMapping* mapping);
+
+#endif
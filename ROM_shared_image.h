@@ -0,0 +1,118 @@
+/*
+    Shared-memory cart image
+
+    ROM_dumper_16MB --shared <name> publishes the image as it is read into a
+    POSIX shared memory object (/dev/shm/<name>), so a hasher, emulator or
+    archiver can consume pages as they land instead of waiting for the dump
+    to finish and rereading the file.
+
+    Layout, all offsets from the start of the object:
+      0                 struct SharedImageHeader
+      bitmapOffset      Ready bitmap, one bit per page, in uint64_t words
+      imageOffset       The big-endian (.z64) ROM image, romSize bytes
+
+    The dumper copies a page into the image, sets its ready bit (release),
+    then bumps readyCount and wakes waiters with a shared futex on it. A page
+    whose bit reads as set (acquire) is complete and never changes again.
+    Consumers map the object read-write (waiting counts itself in the header)
+    and block on pages with SharedImageWaitPage.
+*/
+
+#ifndef ROM_SHARED_IMAGE_H
+#define ROM_SHARED_IMAGE_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define SHARED_IMAGE_MAGIC "N64SHMIM"
+#define SHARED_IMAGE_VERSION 1
+#define SHARED_IMAGE_PAGE_SIZE 0x200 // One cart burst
+#define SHARED_IMAGE_ALIGN 0x1000 // The image starts on a memory page
+
+enum SharedImageState
+{
+  SharedImageFilling = 0,
+  SharedImageComplete = 1,
+  SharedImageFailed = 2 // The dumper stopped early; missing pages will never arrive
+};
+
+struct SharedImageHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t romSize;
+  uint32_t pageSize;
+  uint32_t pageCount;
+  uint32_t bitmapOffset;
+  uint32_t imageOffset;
+  uint32_t crc1; // Header CRC1/CRC2 of the cart, to tell carts apart
+  uint32_t crc2;
+  uint32_t readyCount; // Futex word: pages published so far, plus one once finished
+  uint32_t state; // enum SharedImageState, also wakes readyCount waiters
+  uint32_t waiters; // Consumers blocked in FUTEX_WAIT; the dumper skips the wake when 0
+  uint32_t reserved[3];
+};
+
+// Total object size for a ROM size.
+static inline uint32_t SharedImageSize(uint32_t romSize, uint32_t* bitmapOffset, uint32_t* imageOffset)
+{
+  uint32_t pageCount = romSize / SHARED_IMAGE_PAGE_SIZE;
+  *bitmapOffset = sizeof(struct SharedImageHeader);
+  *imageOffset = (*bitmapOffset + (pageCount + 63) / 64 * 8 + SHARED_IMAGE_ALIGN - 1) & ~(SHARED_IMAGE_ALIGN - 1);
+  return *imageOffset + romSize;
+}
+
+static inline int SharedImagePageReady(const struct SharedImageHeader* header, uint32_t page)
+{
+  const uint64_t* bitmap = (const uint64_t*)((const uint8_t*)header + header->bitmapOffset);
+  return (__atomic_load_n(&bitmap[page / 64], __ATOMIC_ACQUIRE) >> (page % 64)) & 0x1;
+}
+
+// Blocks until a page is published.
+// Returns 1 when the page is ready, 0 when the dump failed without it.
+static inline int SharedImageWaitPage(struct SharedImageHeader* header, uint32_t page)
+{
+  while(!SharedImagePageReady(header, page))
+  {
+    uint32_t seen = __atomic_load_n(&header->readyCount, __ATOMIC_ACQUIRE);
+    if(SharedImagePageReady(header, page))
+    {
+      break;
+    }
+    if(__atomic_load_n(&header->state, __ATOMIC_ACQUIRE) != SharedImageFilling)
+    {
+      return SharedImagePageReady(header, page);
+    }
+
+    __atomic_add_fetch(&header->waiters, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &header->readyCount, FUTEX_WAIT, seen, NULL, NULL, 0);
+    __atomic_sub_fetch(&header->waiters, 1, __ATOMIC_SEQ_CST);
+  }
+  return 1;
+}
+
+// Publishes a page the writer has already copied into the image.
+static inline void SharedImagePublishPage(struct SharedImageHeader* header, uint32_t page)
+{
+  uint64_t* bitmap = (uint64_t*)((uint8_t*)header + header->bitmapOffset);
+  __atomic_or_fetch(&bitmap[page / 64], (uint64_t)1 << (page % 64), __ATOMIC_RELEASE);
+  __atomic_add_fetch(&header->readyCount, 1, __ATOMIC_SEQ_CST);
+
+  if(__atomic_load_n(&header->waiters, __ATOMIC_SEQ_CST) != 0)
+  {
+    syscall(SYS_futex, &header->readyCount, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  }
+}
+
+// Ends publication; waiters see the state and stop waiting for missing pages.
+static inline void SharedImageFinish(struct SharedImageHeader* header, uint32_t state)
+{
+  __atomic_store_n(&header->state, state, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&header->readyCount, 1, __ATOMIC_SEQ_CST);
+  syscall(SYS_futex, &header->readyCount, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+#endif
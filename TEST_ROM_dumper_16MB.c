@@ -1,6 +1,20 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
+#include <limits.h>
 #include <assert.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include "ROM_shared_image.h"
+#include "ROM_bus_record.h"
+#include "ROM_mapping.c"
 
 #define AD_BUS 2 
 #define ALE_L 18 
@@ -11,14 +25,103 @@
 
 #define PI_INPUT 0
 #define PI_OUTPUT 1
+#define PI_ALT1 5
 
 #define LOW 0
 #define HIGH 1
 
+#define MAX_GPIO 27
+
+#define GPIO_MEM_SIZE 0x1000
+#define GPIO_FSEL 0x00
+#define GPIO_SET 0x1C
+#define GPIO_CLR 0x28
+#define GPIO_LEV 0x34
+
+#define CART_ROM_BASE 0x10000000
+#define CART_SRAM_BASE 0x08000000
+#define SRAM_BANK_SIZE 0x8000
+#define SRAM_BANK_STRIDE 0x40000
+#define FLASH_SIZE 0x20000
+#define FLASH_COMMAND_ADDRESS 0x08010000
+#define MAX_ROM_SIZE 0x4000000
+#define PROBE_STEP 0x100000
+#define CHECKSUM_START 0x1000
+#define CHECKSUM_LENGTH 0x100000
+#define CHECKSUM_END (CHECKSUM_START + CHECKSUM_LENGTH)
+#define READ_RETRIES 8
+#define MAJORITY_MAX_READS 15
+#define PAGE_UNREAD 2
+#define TIMING_REGION_SIZE 0x100000
+#define TIMING_CLEAN_PAGES 32
+#define TIMING_STEP_PERMILLE 50
+#define TIMING_BACKOFF_STEPS 4
+#define TIMING_MIN_PERMILLE 100
+#define REFERENCE_PAGES (CHECKSUM_START / ROM_PAGE_SIZE)
+#define RECALIBRATE_PERMILLE 1250
+#define RECALIBRATE_ATTEMPTS 4
+#define RESET_PULSE_US 100000
+#define RESET_SETTLE_US 50000
+#define BUS_TRACE_EVENTS 0x1000 // Small enough for the tests to wrap it
+#define ROM_PAGE_SIZE 0x200
+#define PAGE_WORDS (ROM_PAGE_SIZE / 2)
+#define Z64_MAGIC 0x80371240
+
+#define FINGERPRINT_SPAN 0x400000
+#define FINGERPRINT_SAMPLES 32
+#define FINGERPRINT_STRIDE (FINGERPRINT_SPAN / FINGERPRINT_SAMPLES)
+
+#define SMI_CS 0x00
+#define SMI_L 0x04
+#define SMI_A 0x08
+#define SMI_D 0x0C
+#define SMI_DSR0 0x10
+#define SMI_DMC 0x30
+#define SMI_CS_ENABLE (1 << 0)
+#define SMI_CS_DONE (1 << 1)
+#define SMI_CS_START (1 << 3)
+#define SMI_CS_CLEAR (1 << 4)
+#define SMI_CS_PXLDAT (1 << 14)
+#define SMI_CS_RXD (1u << 29)
+#define SMI_DSR_STROBE_SHIFT 0
+#define SMI_DSR_HOLD_SHIFT 16
+#define SMI_DSR_SETUP_SHIFT 24
+#define SMI_DSR_WIDTH_SHIFT 30
+#define SMI_DSR_WIDTH_16 1
+#define SMI_DSR_STROBE_MAX 127
+#define SMI_DSR_HOLD_MAX 63
+#define SMI_DMC_DMAEN (1 << 28)
+#define SMI_DMC_REQR 2
+#define SMI_DMC_PANICR 8
+#define SMI_CLOCK_NS 10
+#define SMI_READ_SETUP 2
+#define SMI_POLL_LIMIT 1000000
+
+#define CACHE_READ_AHEAD_MIN 4
+#define CACHE_READ_AHEAD_MAX 256
+
+#define DAT_INDEX_MAGIC "N64DATIX"
+#define DAT_INDEX_VERSION 1
+#define DAT_EMPTY_SLOT 0xFFFFFFFF
+#define DAT_KEY_TYPES 4
+
+#define MAX_PLAN_RANGES 4
+#define PROGRESS_STEPS 100
+#define PROFILE_NAME "%08X-%08X.prof"
+#define DAT_MAX_SEED 0x100000
+
+#define DAEMON_POLL_US 250000
+#define DAEMON_STABLE_POLLS 2
+#define ARCHIVE_MANIFEST "manifest.txt"
+
+#define EXIT_MISMATCH 2
+#define EXIT_UNKNOWN 3
+
 #define ACTIVE(signal) (((signal) == HIGH) ? HIGH : LOW)
 #define INACTIVE(signal) (((signal) == LOW) ? LOW : HIGH)
 
 typedef unsigned int uint;
+typedef uint8_t uint8;
 typedef uint16_t uint16;
 typedef uint32_t uint32;
 typedef uint64_t uint64;
@@ -29,178 +132,7139 @@ enum addressBoundary
   UpperAddress = 1
 };
 
-// Mock GPIO variables for assertions
-uint gpio_set_mode[24] = {0};
-uint gpio_write[32] = {0};
+typedef struct { uint32 tick; uint32 level; } gpioSample_t;
 
-// GPIO Mock functions
-void mock_gpioSetMode(uint gpio, uint mode)
+struct PinMap
 {
-    gpio_set_mode[gpio] = mode;
-    printf("gpioSetMode: gpio=%d, mode=%d\n", gpio, mode);
+  uint ad[16];
+  uint aleLow;
+  uint aleHigh;
+  uint read;
+  uint write;
+  uint reset;
+  uint32 adMask;
+  int contiguous;
+  uint16 gather[4][256];
+};
+
+const uint8 adCartPins[16] = { 28, 29, 30, 32, 36, 37, 40, 41, 16, 15, 12, 11, 7, 5, 4, 3 };
+
+struct PinMap pinMap = {
+  .ad = { AD_BUS, AD_BUS + 1, AD_BUS + 2, AD_BUS + 3, AD_BUS + 4, AD_BUS + 5, AD_BUS + 6, AD_BUS + 7,
+          AD_BUS + 8, AD_BUS + 9, AD_BUS + 10, AD_BUS + 11, AD_BUS + 12, AD_BUS + 13, AD_BUS + 14, AD_BUS + 15 },
+  .aleLow = ALE_L,
+  .aleHigh = ALE_H,
+  .read = READ,
+  .write = WRITE,
+  .reset = RESET,
+  .adMask = 0xFFFFu << AD_BUS,
+  .contiguous = 1
+};
+
+#define AD_PIN(bit) (pinMap.ad[bit])
+
+struct WaveCapture
+{
+  int active;
+  int inStrobe;
+  uint32 lastLevel;
+  uint words;
+  uint16 page[PAGE_WORDS];
+};
+
+struct WaveCapture waveCapture;
+
+struct BusTiming
+{
+  uint32 latchNs;
+  uint32 strobeNs;
+  uint32 recoveryNs;
+};
+
+struct BusTiming busTiming = { 1000, 1000, 0 };
+
+struct TimingRegion
+{
+  uint32 permille;
+  uint32 floorPermille;
+  uint32 cleanPages;
+  uint64 pages;
+  uint64 retriedPages;
+};
+
+int adaptiveTiming = 0;
+struct BusTiming baseTiming = { 1000, 1000, 0 };
+uint32 timingPermille = 1000;
+struct TimingRegion timingRegions[MAX_ROM_SIZE / TIMING_REGION_SIZE];
+
+uint32 checkpointPages = 0;
+uint16 (*checkpointWindow)[PAGE_WORDS];
+uint16 referenceBlock[REFERENCE_PAGES][PAGE_WORDS];
+int referenceRead = 0;
+uint64 recalibrations;
+uint64 cartResets;
+
+// Points at plain memory in test_GpioRegisters, NULL otherwise
+volatile uint32* gpioRegisters;
+
+struct SmiInterface
+{
+  uint32 (*read)(uint reg);
+  void (*write)(uint reg, uint32 value);
+  uint (*transfer)(uint16* words, uint count);
+};
+
+// Software model of the SMI registers in front of a cart that returns
+// (address / 2) ^ 0xA5A5 for each word of a burst
+struct SmiModel
+{
+  uint32 registers[0x44 / 4];
+  uint32 pending; // Read cycles still to run
+  uint32 address; // Cart-side word address
+  uint32 limit; // Cycles the model will run before stalling
+  int done;
+};
+
+struct SmiModel smiModel;
+
+uint32 ModelSmiRead(uint reg)
+{
+    if(reg == SMI_CS)
+    {
+        uint32 status = smiModel.registers[SMI_CS / 4] & ~(SMI_CS_RXD | SMI_CS_DONE);
+        status |= (smiModel.pending > 0 && smiModel.limit > 0) ? SMI_CS_RXD : 0;
+        status |= smiModel.done ? SMI_CS_DONE : 0;
+        return status;
+    }
+
+    if(reg == SMI_D && smiModel.pending > 0 && smiModel.limit > 0)
+    {
+        uint32 data = ((smiModel.address / 2) ^ 0xA5A5) & 0xFFFF;
+        smiModel.address += 2;
+        smiModel.limit--;
+        smiModel.done = (--smiModel.pending == 0);
+        return data;
+    }
+
+    return smiModel.registers[reg / 4];
 }
-void mock_gpioWrite(uint gpio, uint level)
+
+void ModelSmiWrite(uint reg, uint32 value)
 {
-    gpio_write[gpio] = level;
-    printf("gpioWrite: gpio=%d, level=%d\n", gpio, level);
+    if(reg == SMI_CS)
+    {
+        if(value & SMI_CS_CLEAR)
+        {
+            smiModel.pending = 0;
+        }
+        if(value & SMI_CS_DONE)
+        {
+            smiModel.done = 0;
+        }
+        if(value & SMI_CS_START)
+        {
+            assert(value & SMI_CS_ENABLE);
+            smiModel.pending = smiModel.registers[SMI_L / 4];
+            smiModel.done = 0;
+        }
+        value &= ~(SMI_CS_CLEAR | SMI_CS_START | SMI_CS_DONE);
+    }
+    smiModel.registers[reg / 4] = value;
 }
-int mock_gpioRead(uint gpio)
+
+// Stands in for the DMA channel: empties the modelled FIFO in one go
+uint ModelSmiTransfer(uint16* words, uint count)
 {
-    printf("gpioRead: gpio=%d\n", gpio);
-    return (gpio % 2); // Simulate alternating 0/1 values
+    uint received = 0;
+    while(received < count && (ModelSmiRead(SMI_CS) & SMI_CS_RXD))
+    {
+        words[received++] = ModelSmiRead(SMI_D);
+    }
+    return received;
 }
-void mock_gpioDelay(uint32 micros)
+
+// Mock GPIO state for assertions
+uint gpio_set_mode[32] = {0};
+uint gpio_write[32] = {0};
+
+// Mock call trace: one compact binary event per call, kept in a ring of the
+// most recent TRACE_EVENTS and printed only when a test fails
+enum TraceType
+{
+  TraceSetMode = 0,
+  TraceWrite,
+  TraceSetBits,
+  TraceClearBits,
+  TraceRead,
+  TraceReadBits,
+  TraceDelay,
+  TraceBurst, // A whole page served by SimBurstReadPage
+  TraceTypeCount
+};
+
+static const char* traceTypeNames[TraceTypeCount] = { "gpioSetMode", "gpioWrite", "gpioWrite_Bits_0_31_Set",
+                                                      "gpioWrite_Bits_0_31_Clear", "gpioRead", "gpioRead_Bits_0_31", "delay",
+                                                      "burst" };
+
+struct TraceEvent
+{
+  uint8 type; // enum TraceType
+  uint8 gpio;
+  uint16 data; // Word the simulated cart was driving
+  uint32 value; // Mode, level, bit mask, levels read, nanoseconds or burst address
+};
+
+#define TRACE_EVENTS 0x10000 // Power of two
+#define TRACE_PRINT_EVENTS 64 // Printed on failure
+
+struct Trace
+{
+  struct TraceEvent events[TRACE_EVENTS];
+  uint64 count; // Events ever recorded
+  uint64 counts[TraceTypeCount];
+};
+
+struct Trace trace;
+
+// Simulated cart behind the mocks. ALE_L and ALE_H latch the address halves
+// from the AD outputs on their falling edge; READ's falling edge makes the cart
+// drive the word at the address and its rising edge advances the address.
+// Without an image the cart is off and every GPIO reads gpio % 2. RESET held
+// low for SIM_RESET_NS restarts a hung cart. A save, when set, sits at
+// CART_SRAM_BASE; WRITE's falling edge takes the word on AD and its rising edge
+// advances the address, and a FlashRAM save reads open bus until it has been
+// put into read-array mode.
+#define SIM_RESET_NS 10000000
+
+struct SimCart
 {
-    printf("gpioDelay: %d µs\n", micros);
+  const uint8* image; // Big-endian ROM at CART_ROM_BASE
+  uint32 imageSize;
+  uint32 address;
+  uint16 data; // Word being driven while READ is low
+  int driving;
+  uint64 latches;
+  uint64 strobes;
+  uint64 violations; // Protocol errors, see SimCartViolation
+  uint64 nanoseconds; // Bus time spent in delays
+  uint64 strobeStart; // nanoseconds when READ last fell
+  uint64 resetStart; // nanoseconds when RESET last fell
+  uint64 resets; // RESET pulses long enough to restart the cart
+  const uint8* save; // Big-endian save at CART_SRAM_BASE
+  uint32 saveSize;
+  int flash;
+  int flashReadArray;
+  uint64 writes;
+};
+
+struct SimCart simCart;
+
+// Faults the simulated cart injects, reproducible from the seed. Rates are
+// parts per million: per sampled word for bit flips, per ALE edge for missed
+// latches. Samples taken less than accessNs after READ falls read garbage.
+struct SimFaults
+{
+  uint64 state; // xorshift64*, seeded by SimFaultsSeed
+  uint32 bitFlipPpm;
+  uint16 bitFlipLines; // AD lines that flip, 0 for any
+  uint32 missedLatchPpm;
+  uint16 stuckMask; // AD lines stuck at stuckLevels, for address and data
+  uint16 stuckLevels;
+  uint16 latchStuckMask; // AD lines stuck at stuckLevels for the latches only
+  uint32 accessNs;
+  uint32 slowStart; // ROM offsets that need slowAccessNs instead
+  uint32 slowLength;
+  uint32 slowAccessNs;
+  uint32 accessDriftNs; // accessNs grows by this per second of bus time
+  uint64 hangNs; // Bus time the cart hangs at, reading all ones until reset; 0 never
+  uint64 injected;
+};
+
+struct SimFaults simFaults;
+
+void SimFaultsSeed(uint32 seed)
+{
+  memset(&simFaults, 0, sizeof(simFaults));
+  simFaults.state = seed ? seed : 1;
 }
 
-// Functions to test
-void SetADBusPinsMode(uint mode) 
+uint32 SimFaultsRandom(void)
 {
-  for(uint pin = AD_BUS;
-        pin < AD_BUS + 16;
-        pin++)
+  simFaults.state ^= simFaults.state >> 12;
+  simFaults.state ^= simFaults.state << 25;
+  simFaults.state ^= simFaults.state >> 27;
+  return (simFaults.state * 0x2545F4914F6CDD1Dull) >> 32;
+}
+
+int SimFaultsRoll(uint32 ppm)
+{
+  if(ppm == 0 || SimFaultsRandom() % 1000000 >= ppm)
   {
-    mock_gpioSetMode(pin, mode);
+    return 0;
   }
+  simFaults.injected++;
+  return 1;
 }
 
-void SetAddress(uint32 address, uint addressBoundary)
+uint16 SimFaultsStuck(uint16 levels)
 {
-  uint bitCount = (addressBoundary == UpperAddress) ? 8 : 16;
-  uint bitShift = (addressBoundary == UpperAddress) ? 16 : 0;
+  return (levels & ~simFaults.stuckMask) | (simFaults.stuckLevels & simFaults.stuckMask);
+}
 
-  for(uint bitOffset = 0;
-      bitOffset < bitCount;
-      bitOffset++)
+// The word the Pi samples from the cart right now
+uint16 SimCartSample(void)
+{
+  if(!simCart.driving)
+  {
+    return 0;
+  }
+
+  uint16 word = simCart.data;
+  uint32 accessNs = simFaults.accessNs;
+  if(simCart.address - CART_ROM_BASE - simFaults.slowStart < simFaults.slowLength)
+  {
+    accessNs = simFaults.slowAccessNs;
+  }
+  accessNs += simCart.nanoseconds * simFaults.accessDriftNs / 1000000000ull;
+  if(simFaults.hangNs != 0 && simCart.nanoseconds >= simFaults.hangNs)
+  {
+    return SimFaultsStuck(0xFFFF);
+  }
+  if(simCart.nanoseconds - simCart.strobeStart < accessNs)
+  {
+    word = SimFaultsRandom(); // Still settling
+    simFaults.injected++;
+  }
+  if(SimFaultsRoll(simFaults.bitFlipPpm))
   {
-    mock_gpioWrite(AD_BUS + bitOffset, (address >> (bitOffset + bitShift)) & 0x1);
+    uint bit = SimFaultsRandom() % 16;
+    while(simFaults.bitFlipLines != 0 && !((simFaults.bitFlipLines >> bit) & 0x1))
+    {
+      bit = (bit + 1) % 16;
+    }
+    word ^= 1u << bit;
   }
+  return SimFaultsStuck(word);
 }
 
-void LatchAddress(uint ControlSignal)
+void TraceRecord(uint type, uint gpio, uint32 value)
 {
-    mock_gpioWrite(ControlSignal, ACTIVE(HIGH)); // Activate latch
-    mock_gpioDelay(1); // Allow latch signal to stabilize
-    mock_gpioWrite(ControlSignal, INACTIVE(LOW)); // Deactivate latch
+  struct TraceEvent* event = &trace.events[trace.count & (TRACE_EVENTS - 1)];
+  event->type = type;
+  event->gpio = gpio;
+  event->data = simCart.data;
+  event->value = value;
+  trace.count++;
+  trace.counts[type]++;
 }
 
-// Unit tests
-void test_SetADBusPinsMode(void)
+void TraceReset(void)
 {
-    printf("Testing SetADBusPinsMode...\n");
+  trace.count = 0;
+  memset(trace.counts, 0, sizeof(trace.counts));
+}
 
-    SetADBusPinsMode(PI_INPUT);
-    for(uint pin = AD_BUS;
-        pin < AD_BUS + 16;
-        pin++)
-    {
-        assert(gpio_set_mode[pin] == PI_INPUT);
-    }
+// Returns a recorded event, or NULL once the ring has overwritten it.
+const struct TraceEvent* TraceEventAt(uint64 index)
+{
+  if(index >= trace.count || trace.count - index > TRACE_EVENTS)
+  {
+    return NULL;
+  }
+  return &trace.events[index & (TRACE_EVENTS - 1)];
+}
 
-    SetADBusPinsMode(PI_OUTPUT);
-    for(uint pin = AD_BUS;
-        pin < AD_BUS + 16;
-        pin++)
+// Returns the index of the next event of a type on a GPIO (any GPIO for
+// gpio >= 32) at or after from, or trace.count when there is none.
+uint64 TraceFind(uint64 from, uint type, uint gpio)
+{
+  for(uint64 index = from;
+      index < trace.count;
+      index++)
+  {
+    const struct TraceEvent* event = TraceEventAt(index);
+    if(event != NULL && event->type == type && (gpio >= 32 || event->gpio == gpio))
     {
-        assert(gpio_set_mode[pin] == PI_OUTPUT);
+      return index;
     }
-    printf("SetADBusPinsMode passed.\n\n");
+  }
+  return trace.count;
 }
 
-void test_SetAddress(void)
+// Checks that a sequence of gpioWrite levels on one GPIO happens in order.
+// Returns the index after the last match; asserts when one is missing.
+uint64 TraceExpectWrites(uint64 from, uint gpio, const uint* levels, uint count)
 {
-    printf("Testing SetAddress...\n");
+  for(uint level = 0;
+      level < count;
+      level++)
+  {
+    from = TraceFind(from, TraceWrite, gpio);
+    assert(from < trace.count && TraceEventAt(from)->value == levels[level]);
+    from++;
+  }
+  return from;
+}
 
-    uint32 address = 0x123456;
+void TracePrint(FILE* output, uint events)
+{
+  uint64 first = (trace.count > events) ? trace.count - events : 0;
+  fprintf(output, "Last %llu of %llu mock calls (cart at 0x%08X, %llu protocol violations):\n",
+          (unsigned long long)(trace.count - first), (unsigned long long)trace.count,
+          simCart.address, (unsigned long long)simCart.violations);
 
-    SetAddress(address, LowerAddress);
-    for(uint bitOffset = 0; 
-        bitOffset < 16; 
-        bitOffset++)
+  for(uint64 index = first;
+      index < trace.count;
+      index++)
+  {
+    const struct TraceEvent* event = TraceEventAt(index);
+    if(event != NULL)
     {
-        uint expectedBit = (address >> bitOffset) & 0x1;
-        assert(gpio_write[AD_BUS + bitOffset] == expectedBit);
+      fprintf(output, "  %10llu %-26s gpio=%-2u value=0x%08X cart=0x%04X\n",
+              (unsigned long long)index, traceTypeNames[event->type], event->gpio, event->value, event->data);
     }
+  }
+}
 
-    SetAddress(address, UpperAddress);
-    for(uint bitOffset = 0;
-        bitOffset < 8;
-        bitOffset++)
-    {
-        uint expectedBit = ((address >> (16 + bitOffset)) & 0x1);
-        assert(gpio_write[AD_BUS + bitOffset] == (expectedBit));
-    }
+// assert() aborts; show what the mocks saw leading up to it
+void TraceOnAbort(int signalNumber)
+{
+  (void)signalNumber;
+  fflush(stdout);
+  TracePrint(stderr, TRACE_PRINT_EVENTS);
+}
 
-    printf("SetAddress passed.\n\n");
+void SimCartLoad(const uint8* image, uint32 imageSize)
+{
+  memset(&simCart, 0, sizeof(simCart));
+  simCart.image = image;
+  simCart.imageSize = imageSize;
+
+  // Bus idle: latches low, strobes high, AD driven by the Pi
+  for(uint bitOffset = 0;
+      bitOffset < 16;
+      bitOffset++)
+  {
+    gpio_set_mode[AD_PIN(bitOffset)] = PI_OUTPUT;
+  }
+  gpio_write[ALE_L] = LOW;
+  gpio_write[ALE_H] = LOW;
+  gpio_write[READ] = HIGH;
+  gpio_write[WRITE] = HIGH;
+  gpio_write[RESET] = HIGH;
+  TraceReset();
 }
 
-void test_LatchAddress(void)
+uint16 SimCartWord(uint32 address)
 {
-    printf("Testing LatchAddress...\n");
+  if(address >= CART_ROM_BASE && address - CART_ROM_BASE < simCart.imageSize)
+  {
+    const uint8* bytes = simCart.image + (address - CART_ROM_BASE);
+    return (bytes[0] << 8) | bytes[1];
+  }
+  if(address >= CART_SRAM_BASE && address - CART_SRAM_BASE < simCart.saveSize &&
+     (!simCart.flash || simCart.flashReadArray))
+  {
+    const uint8* bytes = simCart.save + (address - CART_SRAM_BASE);
+    return (bytes[0] << 8) | bytes[1];
+  }
+  return address & 0xFFFF; // Open bus
+}
 
-    LatchAddress(ALE_L);
-    assert(gpio_write[ALE_L] == INACTIVE(LOW));
+// Counts the error; the trace shows it when the test asserts on violations
+void SimCartViolation(void)
+{
+  simCart.violations++;
+}
 
-    LatchAddress(ALE_H);
-    assert(gpio_write[ALE_H] == INACTIVE(LOW));
+int SimCartAdOutputs(void)
+{
+  uint outputs = 0;
+  for(uint bitOffset = 0;
+      bitOffset < 16;
+      bitOffset++)
+  {
+    outputs += (gpio_set_mode[AD_PIN(bitOffset)] == PI_OUTPUT);
+  }
+  return outputs;
+}
 
-    printf("LatchAddress passed.\n\n");
+uint16 SimCartAdLevels(void)
+{
+  uint16 half = 0;
+  for(uint bitOffset = 0;
+      bitOffset < 16;
+      bitOffset++)
+  {
+    half |= (gpio_write[AD_PIN(bitOffset)] & 0x1) << bitOffset;
+  }
+  return half;
 }
 
-void test_MainLoop(void)
+void SimCartEdge(uint gpio, uint previous, uint level)
 {
-    printf("Testing main ROM dumping loop...\n");
+  if(simCart.image == NULL || previous == level)
+  {
+    return;
+  }
 
-    uint32 address = 0;
-    while(address < 0x10) // Testing first few addresses only
+  if((gpio == ALE_L || gpio == ALE_H) && level == LOW)
+  {
+    // Latching needs the Pi driving the address and the cart off the bus
+    if(simCart.driving || SimCartAdOutputs() != 16)
     {
-        SetAddress(address, LowerAddress);
-        LatchAddress(ALE_L);
-        SetAddress(address, UpperAddress);
-        LatchAddress(ALE_H);
+      SimCartViolation();
+    }
 
-        SetADBusPinsMode(PI_INPUT);
+    if(SimFaultsRoll(simFaults.missedLatchPpm))
+    {
+      return;
+    }
 
-        mock_gpioWrite(READ, ACTIVE(LOW)); 
-        mock_gpioDelay(1); 
+    uint16 half = SimFaultsStuck(SimCartAdLevels());
+    half = (half & ~simFaults.latchStuckMask) | (simFaults.stuckLevels & simFaults.latchStuckMask);
+    simCart.address = (gpio == ALE_L) ? (simCart.address & 0xFFFF0000) | half
+                                      : (simCart.address & 0xFFFF) | ((uint32)half << 16);
+    simCart.latches++;
+  }
+  else if(gpio == READ && level == LOW)
+  {
+    // Both sides driving AD is bus contention
+    if(SimCartAdOutputs() != 0 || gpio_write[ALE_L] == HIGH || gpio_write[ALE_H] == HIGH)
+    {
+      SimCartViolation();
+    }
+    simCart.data = SimCartWord(simCart.address);
+    simCart.driving = 1;
+    simCart.strobeStart = simCart.nanoseconds;
+    simCart.strobes++;
+  }
+  else if(gpio == READ && level == HIGH)
+  {
+    simCart.driving = 0;
+    simCart.address += 2;
+  }
+  else if(gpio == WRITE && level == LOW)
+  {
+    if(simCart.driving || SimCartAdOutputs() != 16)
+    {
+      SimCartViolation();
+    }
+    if(simCart.flash && simCart.address == FLASH_COMMAND_ADDRESS && SimCartAdLevels() == 0xF000)
+    {
+      simCart.flashReadArray = 1;
+    }
+    simCart.writes++;
+  }
+  else if(gpio == WRITE && level == HIGH)
+  {
+    simCart.address += 2;
+  }
+  else if(gpio == RESET && level == LOW)
+  {
+    simCart.resetStart = simCart.nanoseconds;
+  }
+  else if(gpio == RESET && level == HIGH && simCart.nanoseconds - simCart.resetStart >= SIM_RESET_NS)
+  {
+    simCart.resets++;
+    simFaults.hangNs = 0;
+  }
+}
 
-        uint16 data = 0;
-        for(uint bitOffset = 0;
-            bitOffset < 16;
-            bitOffset++)
+// GPIO Mock functions
+void mock_gpioSetMode(uint gpio, uint mode)
+{
+    gpio_set_mode[gpio] = mode;
+    TraceRecord(TraceSetMode, gpio, mode);
+}
+void mock_gpioWrite(uint gpio, uint level)
+{
+    uint previous = gpio_write[gpio];
+    gpio_write[gpio] = level;
+    TraceRecord(TraceWrite, gpio, level);
+    SimCartEdge(gpio, previous, level);
+}
+void mock_gpioWrite_Bits_0_31_Set(uint32 bits)
+{
+    for(uint gpio = 0;
+        gpio < 32;
+        gpio++)
+    {
+        if((bits >> gpio) & 0x1)
         {
-            data |= (mock_gpioRead(AD_BUS + bitOffset) << bitOffset);
+            gpio_write[gpio] = HIGH;
         }
-
-        for(uint bitOffset = 0; 
-            bitOffset < 16; 
-            bitOffset++)
+    }
+    TraceRecord(TraceSetBits, 0, bits);
+}
+void mock_gpioWrite_Bits_0_31_Clear(uint32 bits)
+{
+    for(uint gpio = 0;
+        gpio < 32;
+        gpio++)
+    {
+        if((bits >> gpio) & 0x1)
         {
-            assert(((data >> bitOffset) & 0x1) == (AD_BUS + bitOffset) % 2);
+            gpio_write[gpio] = LOW;
         }
-
-        assert(data <= 0xFFFF); // Assert data is 16-bit value
-
-        mock_gpioWrite(READ, INACTIVE(HIGH));
-
-        SetADBusPinsMode(PI_OUTPUT);
-
-        printf("0x%06X: 0x%04X\n", address, data);
-
-        address += 2;
     }
-
-    printf("Main loop test passed.\n");
+    TraceRecord(TraceClearBits, 0, bits);
 }
-
-int main(void)
+int mock_gpioRead(uint gpio)
 {
+    int level = gpio % 2; // Simulate alternating 0/1 values
+    if(simCart.image != NULL)
+    {
+        uint bit = 0;
+        while(bit < 16 && AD_PIN(bit) != gpio)
+        {
+            bit++;
+        }
+        if(bit < 16 && gpio_set_mode[gpio] == PI_INPUT)
+        {
+            if(!simCart.driving)
+            {
+                SimCartViolation(); // Sampling a bus nobody drives
+            }
+            level = (SimCartSample() >> bit) & 0x1;
+        }
+        else
+        {
+            level = gpio_write[gpio];
+        }
+    }
+    TraceRecord(TraceRead, gpio, level);
+    return level;
+}
+uint32 mock_gpioRead_Bits_0_31(void)
+{
+    uint32 levels = 0xAAAAAAAA; // gpio % 2
+    if(simCart.image != NULL)
+    {
+        levels = 0;
+        for(uint gpio = 0;
+            gpio < 32;
+            gpio++)
+        {
+            levels |= (uint32)(gpio_write[gpio] & 0x1) << gpio;
+        }
+
+        if(SimCartAdOutputs() == 0)
+        {
+            if(!simCart.driving)
+            {
+                SimCartViolation();
+            }
+            uint16 sample = SimCartSample();
+            levels &= ~pinMap.adMask;
+            for(uint bitOffset = 0;
+                bitOffset < 16;
+                bitOffset++)
+            {
+                levels |= (uint32)((sample >> bitOffset) & 0x1) << AD_PIN(bitOffset);
+            }
+        }
+    }
+    TraceRecord(TraceReadBits, 0, levels);
+    return levels;
+}
+void mock_gpioDelay(uint32 micros)
+{
+    simCart.nanoseconds += micros * 1000ull;
+    TraceRecord(TraceDelay, 0, micros * 1000);
+}
+int mock_gpioSetSignalFunc(uint signalNumber, void (*function)(int))
+{
+    (void)signalNumber;
+    (void)function;
+    return 0;
+}
+void mock_BusDelay(uint32 nanoseconds)
+{
+    simCart.nanoseconds += nanoseconds;
+    TraceRecord(TraceDelay, 0, nanoseconds);
+}
+
+int BitBangReadPage(uint32 address, uint16* words);
+
+// Fast path for the simulated cart: serves a whole page burst straight from
+// the image instead of modeling every GPIO call, for full-size regression
+// runs. The bus has to be idle as BitBangReadPage leaves it, and the cart's
+// counters and bus time advance exactly as for the bit-banged burst, which
+// is recorded as one trace event. Faults are modeled per edge and sample, so
+// with any configured the page goes through BitBangReadPage instead.
+int SimBurstReadPage(uint32 address, uint16* words)
+{
+  if(simFaults.bitFlipPpm != 0 || simFaults.missedLatchPpm != 0 || simFaults.stuckMask != 0 ||
+     simFaults.latchStuckMask != 0 || simFaults.accessNs != 0 || simFaults.slowLength != 0 ||
+     simFaults.accessDriftNs != 0 || simFaults.hangNs != 0)
+  {
+    return BitBangReadPage(address, words);
+  }
+
+  if(simCart.driving || SimCartAdOutputs() != 16 || gpio_write[ALE_L] != LOW || gpio_write[ALE_H] != LOW ||
+     gpio_write[READ] != HIGH || gpio_write[WRITE] != HIGH || (address & (ROM_PAGE_SIZE - 1)) != 0)
+  {
+    SimCartViolation();
+  }
+
+  if(address >= CART_ROM_BASE && simCart.imageSize >= ROM_PAGE_SIZE &&
+     address - CART_ROM_BASE <= simCart.imageSize - ROM_PAGE_SIZE)
+  {
+    const uint8* bytes = simCart.image + (address - CART_ROM_BASE);
+    memcpy(words, bytes, ROM_PAGE_SIZE);
+    for(uint word = 0;
+        word < PAGE_WORDS;
+        word++)
+    {
+      words[word] = __builtin_bswap16(words[word]); // The image is big-endian
+    }
+  }
+  else
+  {
+    for(uint word = 0;
+        word < PAGE_WORDS;
+        word++)
+    {
+      words[word] = SimCartWord(address + word * 2);
+    }
+  }
+
+  simCart.data = words[PAGE_WORDS - 1];
+  simCart.address = address + ROM_PAGE_SIZE;
+  simCart.latches += 2;
+  simCart.strobes += PAGE_WORDS;
+  simCart.nanoseconds += 2 * busTiming.latchNs + PAGE_WORDS * (busTiming.strobeNs + busTiming.recoveryNs);
+  TraceRecord(TraceBurst, 0, address);
+  return 0;
+}
+
+// Replay of a bus record (ROM_bus_record.h) from a real rig: the recorded
+// latches and strobes drive the simulated cart at their recorded times, and
+// the word sampled in each strobe is checked against the word the cart
+// holds in the reference image.
+#define REPLAY_REPORT_DIVERGENCES 16
+
+struct BusReplay
+{
+  uint64 events;
+  uint64 strobes; // Strobes with a sample while the cart's address was known
+  uint64 divergences;
+  uint64 firstDivergence; // Event index, valid when divergences > 0
+  uint64 lineErrors[16]; // Diverging strobes per AD line
+};
+
+// Replays a record against the image loaded with SimCartLoad, printing the
+// first REPLAY_REPORT_DIVERGENCES divergences to report (may be NULL).
+// Returns 0 on success, 1 when the record is malformed.
+int ReplayBusRecord(const uint8* record, size_t length, FILE* report, struct BusReplay* replay)
+{
+  const struct BusRecordHeader* header = (const struct BusRecordHeader*)record;
+  memset(replay, 0, sizeof(*replay));
+  if(length < sizeof(*header) || memcmp(header->magic, BUS_RECORD_MAGIC, sizeof(header->magic)) != 0 ||
+     header->version != BUS_RECORD_VERSION)
+  {
+    return 1;
+  }
+
+  static const uint gpios[] = { ALE_L, ALE_H, READ, WRITE, RESET };
+  const uint8* next = record + sizeof(*header);
+  const uint8* end = record + length;
+  uint64 time = header->startNanoseconds;
+  int latched[2] = { 0, 0 }; // The cart's address is only known after both halves
+  int sampled = 0;
+  uint16 observed = 0;
+  uint64 sampleNs = 0;
+
+  for(uint64 index = 0;
+      index < header->eventCount;
+      index++)
+  {
+    uint64 delta;
+    uint32 state;
+    next = BusRecordGetEvent(next, end, &delta, &state);
+    if(next == NULL)
+    {
+      return 1;
+    }
+    time += delta;
+    simCart.nanoseconds = time;
+
+    uint driven = (state & BUS_STATE_DRIVEN) != 0;
+    for(uint bitOffset = 0;
+        bitOffset < 16;
+        bitOffset++)
+    {
+      gpio_set_mode[AD_PIN(bitOffset)] = driven ? PI_OUTPUT : PI_INPUT;
+      if(driven)
+      {
+        gpio_write[AD_PIN(bitOffset)] = (state >> bitOffset) & 0x1;
+      }
+    }
+
+    for(uint line = 0;
+        line < sizeof(gpios) / sizeof(gpios[0]);
+        line++)
+    {
+      uint gpio = gpios[line];
+      uint level = (state >> (16 + line)) & 0x1;
+      uint previous = gpio_write[gpio];
+      gpio_write[gpio] = level;
+      if(index == 0 || level == previous)
+      {
+        continue; // The first event only sets the starting levels
+      }
+
+      if(gpio == READ && level == HIGH && sampled && latched[0] && latched[1])
+      {
+        // The strobe ends: the Pi kept its last sample of the cart's word
+        replay->strobes++;
+        uint16 wrong = observed ^ simCart.data;
+        if(wrong != 0)
+        {
+          if(replay->divergences == 0)
+          {
+            replay->firstDivergence = index;
+          }
+          if(report != NULL && replay->divergences < REPLAY_REPORT_DIVERGENCES)
+          {
+            fprintf(report, "  event %llu at %llu ns: bus 0x%08X read %04X, reference %04X (AD lines %04X), "
+                            "sampled %llu ns after READ fell\n",
+                    (unsigned long long)index, (unsigned long long)time, simCart.address, observed, simCart.data,
+                    wrong, (unsigned long long)sampleNs);
+          }
+          replay->divergences++;
+          for(uint bit = 0;
+              bit < 16;
+              bit++)
+          {
+            replay->lineErrors[bit] += (wrong >> bit) & 0x1;
+          }
+        }
+      }
+      SimCartEdge(gpio, previous, level);
+
+      if((gpio == ALE_L || gpio == ALE_H) && level == LOW)
+      {
+        latched[gpio == ALE_H] = 1;
+      }
+      if(gpio == READ && level == LOW)
+      {
+        sampled = 0;
+      }
+    }
+
+    if((state & BUS_STATE_SAMPLE) && !driven && gpio_write[READ] == LOW)
+    {
+      sampled = 1;
+      observed = state & BUS_STATE_AD;
+      sampleNs = time - simCart.strobeStart;
+    }
+    replay->events++;
+  }
+  return 0;
+}
+
+// Loads a whole file. Returns NULL on error (already reported).
+uint8* LoadFile(const char* path, size_t* length)
+{
+  FILE* input = fopen(path, "rb");
+  uint8* bytes = NULL;
+  long size = -1;
+  if(input != NULL && fseek(input, 0, SEEK_END) == 0 && (size = ftell(input)) > 0 && fseek(input, 0, SEEK_SET) == 0)
+  {
+    bytes = malloc(size);
+    if(bytes != NULL && fread(bytes, 1, size, input) != (size_t)size)
+    {
+      free(bytes);
+      bytes = NULL;
+    }
+  }
+  if(bytes == NULL)
+  {
+    perror(path);
+  }
+  if(input != NULL)
+  {
+    fclose(input);
+  }
+  *length = size;
+  return bytes;
+}
+
+// TEST_ROM_dumper_16MB --replay <bus.ntr> <reference.z64>
+// Exits 0 when every strobe matched the reference, 2 on divergence, 1 on error.
+int ReplayMain(const char* recordPath, const char* imagePath)
+{
+  size_t recordLength;
+  size_t imageLength;
+  uint8* record = LoadFile(recordPath, &recordLength);
+  uint8* image = LoadFile(imagePath, &imageLength);
+  if(record == NULL || image == NULL)
+  {
+    return 1;
+  }
+
+  const struct BusRecordHeader* header = (const struct BusRecordHeader*)record;
+  struct BusReplay replay;
+  SimCartLoad(image, imageLength);
+  if(ReplayBusRecord(record, recordLength, stdout, &replay) != 0)
+  {
+    fprintf(stderr, "%s is not a complete bus record.\n", recordPath);
+    return 1;
+  }
+
+  printf("Replayed %llu events (%.12s backend, latch %u ns, strobe %u ns, recovery %u ns) against %s:\n"
+         "%llu strobes compared, %llu diverged, %llu protocol violations.\n",
+         (unsigned long long)replay.events, header->backend, header->latchNs, header->strobeNs, header->recoveryNs,
+         imagePath, (unsigned long long)replay.strobes, (unsigned long long)replay.divergences,
+         (unsigned long long)simCart.violations);
+  for(uint bit = 0;
+      bit < 16;
+      bit++)
+  {
+    if(replay.lineErrors[bit] != 0)
+    {
+      printf("  AD%u wrong in %llu strobes\n", bit, (unsigned long long)replay.lineErrors[bit]);
+    }
+  }
+
+  free(record);
+  free(image);
+  return (replay.divergences != 0) ? 2 : 0;
+}
+
+// Functions to test
+struct BusTraceEvent
+{
+  uint64 nanoseconds;
+  uint32 levels;
+  uint16 adDriven;
+  uint16 sampled;
+};
+
+struct BusTrace
+{
+  struct BusTraceEvent* events;
+  const char* path;
+  const char* recordPath;
+  uint64 head;
+  int enabled;
+  int paused;
+  uint32 rangeStart;
+  uint32 rangeLength;
+  uint32 levels;
+  uint32 adDriven;
+  uint32 startTick;
+};
+
+struct BusTrace busTrace = { .rangeLength = UINT32_MAX };
+
+uint16 GatherDataBus(uint32 levels);
+
+// The simulated cart's bus time stands in for the monotonic clock
+uint64 BusTraceNow(void)
+{
+    return simCart.nanoseconds;
+}
+
+void BusTraceRecord(uint64 nanoseconds, int sampled)
+{
+    uint64 slot = __atomic_fetch_add(&busTrace.head, 1, __ATOMIC_RELAXED);
+    struct BusTraceEvent* event = &busTrace.events[slot & (BUS_TRACE_EVENTS - 1)];
+    event->nanoseconds = nanoseconds;
+    event->levels = busTrace.levels;
+    event->adDriven = busTrace.adDriven;
+    event->sampled = sampled;
+}
+
+uint32 BusTracePack(const struct BusTraceEvent* event)
+{
+    const uint gpios[] = { ALE_L, ALE_H, READ, WRITE, RESET };
+    uint32 state = GatherDataBus(event->levels);
+    for(uint signal = 0;
+        signal < sizeof(gpios) / sizeof(gpios[0]);
+        signal++)
+    {
+        state |= ((event->levels >> gpios[signal]) & 0x1) << (16 + signal);
+    }
+    state |= event->adDriven ? BUS_STATE_DRIVEN : 0;
+    state |= event->sampled ? BUS_STATE_SAMPLE : 0;
+    return state;
+}
+
+void BusSetMode(uint gpio, uint mode)
+{
+    if(gpioRegisters != NULL)
+    {
+        volatile uint32* select = &gpioRegisters[GPIO_FSEL / 4 + gpio / 10];
+        uint shift = (gpio % 10) * 3;
+        *select = (*select & ~(0x7u << shift)) | ((mode & 0x7) << shift);
+        return;
+    }
+    mock_gpioSetMode(gpio, mode);
+}
+
+void BusWrite(uint gpio, uint level)
+{
+    if(gpioRegisters != NULL)
+    {
+        gpioRegisters[((level & 0x1) ? GPIO_SET : GPIO_CLR) / 4] = 1u << gpio;
+    }
+    else
+    {
+        mock_gpioWrite(gpio, level);
+    }
+    busTrace.levels = (busTrace.levels & ~(1u << gpio)) | ((uint32)(level & 0x1) << gpio);
+    if(__atomic_load_n(&busTrace.enabled, __ATOMIC_RELAXED))
+    {
+        BusTraceRecord(BusTraceNow(), 0);
+    }
+}
+
+void BusWriteSet(uint32 bits)
+{
+    if(gpioRegisters != NULL)
+    {
+        gpioRegisters[GPIO_SET / 4] = bits;
+    }
+    else
+    {
+        mock_gpioWrite_Bits_0_31_Set(bits);
+    }
+    busTrace.levels |= bits;
+    if(__atomic_load_n(&busTrace.enabled, __ATOMIC_RELAXED))
+    {
+        BusTraceRecord(BusTraceNow(), 0);
+    }
+}
+
+void BusWriteClear(uint32 bits)
+{
+    if(gpioRegisters != NULL)
+    {
+        gpioRegisters[GPIO_CLR / 4] = bits;
+    }
+    else
+    {
+        mock_gpioWrite_Bits_0_31_Clear(bits);
+    }
+    busTrace.levels &= ~bits;
+    if(__atomic_load_n(&busTrace.enabled, __ATOMIC_RELAXED))
+    {
+        BusTraceRecord(BusTraceNow(), 0);
+    }
+}
+
+uint32 BusReadLevels(void)
+{
+    uint32 levels = (gpioRegisters != NULL) ? gpioRegisters[GPIO_LEV / 4] : mock_gpioRead_Bits_0_31();
+    busTrace.levels = (busTrace.levels & ~pinMap.adMask) | (levels & pinMap.adMask);
+    if(__atomic_load_n(&busTrace.enabled, __ATOMIC_RELAXED))
+    {
+        BusTraceRecord(BusTraceNow(), 1);
+    }
+    return levels;
+}
+
+void BusTraceSelect(uint32 address)
+{
+    if(busTrace.events == NULL)
+    {
+        return;
+    }
+
+    int selected = (address - busTrace.rangeStart < busTrace.rangeLength);
+    __atomic_store_n(&busTrace.enabled, selected && !__atomic_load_n(&busTrace.paused, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+}
+
+void BusTraceToggle(int signalNumber)
+{
+    (void)signalNumber;
+    __atomic_xor_fetch(&busTrace.paused, 1, __ATOMIC_RELAXED);
+}
+
+int WriteBusTraceVcd(uint64 first, uint64 head);
+int WriteBusRecord(uint64 first, uint64 head);
+
+int WriteBusTrace(void)
+{
+    if(busTrace.events == NULL)
+    {
+        return 0;
+    }
+    __atomic_store_n(&busTrace.enabled, 0, __ATOMIC_RELAXED);
+
+    uint64 head = __atomic_load_n(&busTrace.head, __ATOMIC_ACQUIRE);
+    uint64 first = (head > BUS_TRACE_EVENTS) ? head - BUS_TRACE_EVENTS : 0;
+    int status = 0;
+    if(busTrace.path != NULL)
+    {
+        status |= WriteBusTraceVcd(first, head);
+    }
+    if(busTrace.recordPath != NULL)
+    {
+        status |= WriteBusRecord(first, head);
+    }
+
+    free(busTrace.events);
+    busTrace.events = NULL;
+    return status;
+}
+
+int WriteBusTraceVcd(uint64 first, uint64 head)
+{
+    FILE* output = fopen(busTrace.path, "w");
+    if(output == NULL)
+    {
+        perror(busTrace.path);
+        return 1;
+    }
+
+    // VCD identifiers are printable characters: '!' + state bit - 16 for the
+    // single lines, then AD
+    const char* names[] = { "ALE_L", "ALE_H", "READ", "WRITE", "RESET", "AD_DRIVEN" };
+    const uint lines = sizeof(names) / sizeof(names[0]);
+    const char data = '!' + lines;
+
+    fprintf(output, "$version ROM_dumper_16MB bus trace $end\n$timescale 1ns $end\n$scope module cart $end\n");
+    for(uint line = 0;
+        line < lines;
+        line++)
+    {
+        fprintf(output, "$var wire 1 %c %s $end\n", '!' + line, names[line]);
+    }
+    fprintf(output, "$var wire 16 %c AD [15:0] $end\n$upscope $end\n$enddefinitions $end\n", data);
+
+    uint64 time = 0;
+    uint32 last = 0;
+    for(uint64 index = first;
+        index < head;
+        index++)
+    {
+        const struct BusTraceEvent* event = &busTrace.events[index & (BUS_TRACE_EVENTS - 1)];
+        uint32 state = BusTracePack(event) & ~BUS_STATE_SAMPLE;
+        uint32 changed = (index == first) ? UINT32_MAX : state ^ last;
+        if(changed == 0)
+        {
+            continue;
+        }
+
+        // Wave samples are timed by pigpio's clock, everything else by ours;
+        // keep time from running backwards where the two meet
+        if(index == first || event->nanoseconds > time)
+        {
+            time = event->nanoseconds;
+            fprintf(output, "#%llu\n", (unsigned long long)time);
+        }
+
+        for(uint line = 0;
+            line < lines;
+            line++)
+        {
+            if((changed >> (16 + line)) & 0x1)
+            {
+                fprintf(output, "%u%c\n", (state >> (16 + line)) & 0x1, '!' + line);
+            }
+        }
+        if(changed & BUS_STATE_AD)
+        {
+            char bits[17];
+            for(uint bit = 0;
+                bit < 16;
+                bit++)
+            {
+                bits[bit] = '0' + ((state >> (15 - bit)) & 0x1);
+            }
+            bits[16] = '\0';
+            fprintf(output, "b%s %c\n", bits, data);
+        }
+        last = state;
+    }
+
+    if(fclose(output) != 0)
+    {
+        perror(busTrace.path);
+        return 1;
+    }
+    return 0;
+}
+
+int WriteBusRecord(uint64 first, uint64 head)
+{
+    FILE* output = fopen(busTrace.recordPath, "wb");
+    if(output == NULL)
+    {
+        perror(busTrace.recordPath);
+        return 1;
+    }
+
+    struct BusRecordHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BUS_RECORD_MAGIC, sizeof(header.magic));
+    header.version = BUS_RECORD_VERSION;
+    header.eventCount = head - first;
+    header.firstEvent = first;
+    header.startNanoseconds = (head > first) ? busTrace.events[first & (BUS_TRACE_EVENTS - 1)].nanoseconds : 0;
+    header.latchNs = busTiming.latchNs;
+    header.strobeNs = busTiming.strobeNs;
+    header.recoveryNs = busTiming.recoveryNs;
+    strncpy(header.backend, "sim", sizeof(header.backend) - 1);
+    int failed = (fwrite(&header, sizeof(header), 1, output) != 1);
+
+    uint64 time = header.startNanoseconds;
+    for(uint64 index = first;
+        index < head && !failed;
+        index++)
+    {
+        const struct BusTraceEvent* event = &busTrace.events[index & (BUS_TRACE_EVENTS - 1)];
+        uint8 encoded[BUS_RECORD_EVENT_MAX];
+        uint64 delta = (event->nanoseconds > time) ? event->nanoseconds - time : 0;
+        time += delta;
+
+        uint8* end = BusRecordPutEvent(encoded, delta, BusTracePack(event));
+        failed = (fwrite(encoded, end - encoded, 1, output) != 1);
+    }
+
+    if(fclose(output) != 0 || failed)
+    {
+        perror(busTrace.recordPath);
+        return 1;
+    }
+    return 0;
+}
+
+void SetADBusPinsMode(uint mode) 
+{
+  for(uint bitOffset = 0;
+        bitOffset < 16;
+        bitOffset++)
+  {
+    BusSetMode(AD_PIN(bitOffset), mode);
+  }
+
+  busTrace.adDriven = (mode == PI_OUTPUT);
+  if(__atomic_load_n(&busTrace.enabled, __ATOMIC_RELAXED))
+  {
+    BusTraceRecord(BusTraceNow(), 0);
+  }
+}
+
+struct AddressMasks
+{
+  uint32 set;
+  uint32 clear;
+};
+
+struct AddressMasks addressMasks[2][256];
+
+void BuildAddressMasks(void)
+{
+  for(uint lane = 0;
+      lane < 2;
+      lane++)
+  {
+    for(uint value = 0;
+        value < 256;
+        value++)
+    {
+      struct AddressMasks masks = { 0, 0 };
+
+      for(uint bitOffset = 0;
+          bitOffset < 8;
+          bitOffset++)
+      {
+        uint32 pin = 1u << AD_PIN(lane * 8 + bitOffset);
+        if((value >> bitOffset) & 0x1)
+        {
+          masks.set |= pin;
+        }
+        else
+        {
+          masks.clear |= pin;
+        }
+      }
+
+      addressMasks[lane][value] = masks;
+    }
+  }
+}
+
+void SetAddress(uint32 address, uint addressBoundary)
+{
+  uint16 half = (addressBoundary == UpperAddress) ? (address >> 16) & 0xFFFF : address & 0xFFFF;
+  const struct AddressMasks* low = &addressMasks[0][half & 0xFF];
+  const struct AddressMasks* high = &addressMasks[1][half >> 8];
+
+  BusWriteClear(low->clear | high->clear);
+  BusWriteSet(low->set | high->set);
+}
+
+void LatchAddress(uint ControlSignal)
+{
+    BusWrite(ControlSignal, ACTIVE(HIGH)); // Activate latch
+    mock_BusDelay(busTiming.latchNs); // Allow latch signal to stabilize
+    BusWrite(ControlSignal, INACTIVE(LOW)); // Deactivate latch
+}
+
+void LatchPageAddress(uint32 address)
+{
+    SetAddress(address, LowerAddress);
+    LatchAddress(ALE_L);
+    SetAddress(address, UpperAddress);
+    LatchAddress(ALE_H);
+    SetADBusPinsMode(PI_INPUT);
+}
+
+void BitBangReadWords(uint32 address, uint16* words, uint count)
+{
+    LatchPageAddress(address);
+
+    for(uint word = 0;
+        word < count;
+        word++)
+    {
+        // Activate read control signal
+        BusWrite(READ, ACTIVE(LOW));
+        mock_BusDelay(busTiming.strobeNs);
+
+        // Read data into AD Bus
+        uint16 data = GatherDataBus(BusReadLevels());
+
+        // Releasing READ advances the cart to the next word
+        BusWrite(READ, INACTIVE(HIGH));
+        mock_BusDelay(busTiming.recoveryNs);
+
+        words[word] = data;
+    }
+
+    SetADBusPinsMode(PI_OUTPUT);
+}
+
+int BitBangReadPage(uint32 address, uint16* words)
+{
+    BitBangReadWords(address, words, PAGE_WORDS);
+    return 0;
+}
+
+// bus->readPage in the dumper; tests switch it to SimBurstReadPage for speed
+int (*busReadPage)(uint32 address, uint16* words) = BitBangReadPage;
+int (*busRetime)(void) = NULL; // bus->retime
+int (*busInit)(void) = NULL; // bus->init
+void (*busTerminate)(void) = NULL; // bus->terminate
+
+int verifyReads = 0;
+uint64 readRetries;
+uint64 readFailures;
+uint majorityReads = 0;
+uint64 majorityPages;
+uint64 lineDisagreements[16];
+
+typedef uint16 PageVector __attribute__((vector_size(16)));
+#define PAGE_VECTORS (ROM_PAGE_SIZE / sizeof(PageVector))
+
+void ReportBusLines(const char* problem, uint16 lines)
+{
+    fprintf(stderr, "Bus self-test %s", problem);
+    for(uint line = 0;
+        line < 16;
+        line++)
+    {
+        if((lines >> line) & 0x1)
+        {
+            fprintf(stderr, " AD%u (GPIO%u, cart pin %u)", line, pinMap.ad[line], adCartPins[line]);
+        }
+    }
+    fprintf(stderr, ".\n");
+}
+
+int SelfTestBus(uint16* suspects)
+{
+    *suspects = 0;
+
+    uint16 header[PAGE_WORDS];
+    uint16 page[PAGE_WORDS];
+    BitBangReadWords(CART_ROM_BASE, header, PAGE_WORDS);
+    BitBangReadWords(CART_ROM_BASE, page, PAGE_WORDS);
+
+    uint16 unstable = 0;
+    uint16 high = 0;
+    uint16 low = 0xFFFF;
+    for(uint word = 0;
+        word < PAGE_WORDS;
+        word++)
+    {
+        unstable |= header[word] ^ page[word];
+        high |= header[word];
+        low &= header[word];
+    }
+
+    // Open bus counts up with the address; a stuck line only pins its own bit
+    uint16 stuck = (uint16)~high | low;
+    int openBus = 1;
+    for(uint word = 0;
+        word < PAGE_WORDS;
+        word++)
+    {
+        openBus &= (((header[word] ^ (uint16)(header[0] + word * 2)) & ~stuck) == 0);
+    }
+
+    if(unstable != 0)
+    {
+        *suspects = unstable;
+        ReportBusLines("reads the header page differently twice on", unstable);
+        return 1;
+    }
+    if(high == 0)
+    {
+        fprintf(stderr, "Bus self-test: every AD line reads low. Is a cart inserted?\n");
+        return 1;
+    }
+    if(openBus && stuck != 0xFFFF)
+    {
+        *suspects = (header[0] != 0) ? header[0] : 1u << 12;
+        ReportBusLines("reads open bus at the header, the cart ignored its address; suspect", *suspects);
+        return 1;
+    }
+    if(high != 0xFFFF || low != 0)
+    {
+        *suspects = stuck;
+        if(high != 0xFFFF)
+        {
+            ReportBusLines("never reads high on", ~high);
+        }
+        if(low != 0)
+        {
+            ReportBusLines("never reads low on", low);
+        }
+        return 1;
+    }
+
+    uint16 walkedOne = 0;
+    uint16 walkedZero = 0;
+    for(uint line = 1;
+        line < 9;
+        line++)
+    {
+        uint32 offsets[2] = { 1u << line, (ROM_PAGE_SIZE - 2) & ~(1u << line) };
+        for(uint pattern = 0;
+            pattern < 2;
+            pattern++)
+        {
+            uint16 word;
+            BitBangReadWords(CART_ROM_BASE + offsets[pattern], &word, 1);
+            if(word != header[offsets[pattern] / 2])
+            {
+                if(pattern == 0)
+                {
+                    walkedOne |= 1u << line;
+                }
+                else
+                {
+                    walkedZero |= 1u << line;
+                }
+            }
+        }
+    }
+
+    uint16 top[PAGE_WORDS];
+    uint32 ones = 0x10000 - ROM_PAGE_SIZE;
+    BitBangReadWords(CART_ROM_BASE + ones, top, PAGE_WORDS);
+    for(uint bit = 9;
+        (1u << bit) < PROBE_STEP;
+        bit++)
+    {
+        BitBangReadWords(CART_ROM_BASE + (1u << bit), page, PAGE_WORDS);
+        if(memcmp(page, header, sizeof(page)) == 0)
+        {
+            walkedOne |= 1u << (bit % 16);
+        }
+        if(bit < 16)
+        {
+            BitBangReadWords(CART_ROM_BASE + (ones & ~(1u << bit)), page, PAGE_WORDS);
+            if(memcmp(page, top, sizeof(page)) == 0)
+            {
+                walkedZero |= 1u << bit;
+            }
+        }
+    }
+
+    // A line stuck low fails its own walking one and the other lines' walking
+    // zeros, stuck high the reverse, so the smaller set names it
+    uint16 aliased = walkedOne;
+    if(walkedOne == 0 || (walkedZero != 0 && __builtin_popcount(walkedZero) < __builtin_popcount(walkedOne)))
+    {
+        aliased = walkedZero;
+    }
+    if(aliased != 0)
+    {
+        *suspects = aliased;
+        ReportBusLines("reads the wrong words when walking the address on", aliased);
+        return 1;
+    }
+
+    uint32 magic = (uint32)header[0] << 16 | header[1];
+    if(magic != Z64_MAGIC)
+    {
+        fprintf(stderr, "Bus self-test: the header starts %08X, not the .z64 magic %08X. Is the cart seated?\n",
+                magic, Z64_MAGIC);
+        return 1;
+    }
+    return 0;
+}
+
+void MajorityVote(uint16 (*reads)[PAGE_WORDS], uint count, uint16* words, uint64* disagreements)
+{
+    uint bias = 16 - (count / 2 + 1);
+
+    for(uint vector = 0;
+        vector < PAGE_VECTORS;
+        vector++)
+    {
+        PageVector planes[5];
+        for(uint plane = 0;
+            plane < 5;
+            plane++)
+        {
+            planes[plane] = (PageVector){ 0 } - (uint16)((bias >> plane) & 0x1);
+        }
+
+        for(uint read = 0;
+            read < count;
+            read++)
+        {
+            PageVector carry;
+            memcpy(&carry, &reads[read][vector * 8], sizeof(carry));
+            for(uint plane = 0;
+                plane < 5;
+                plane++)
+            {
+                PageVector next = planes[plane] & carry;
+                planes[plane] ^= carry;
+                carry = next;
+            }
+        }
+
+        memcpy(&words[vector * 8], &planes[4], sizeof(planes[4]));
+    }
+
+    for(uint read = 0;
+        read < count;
+        read++)
+    {
+        for(uint word = 0;
+            word < PAGE_WORDS;
+            word++)
+        {
+            uint16 lost = reads[read][word] ^ words[word];
+            while(lost != 0)
+            {
+                disagreements[__builtin_ctz(lost)]++;
+                lost &= lost - 1;
+            }
+        }
+    }
+}
+
+int ReadBackendPage(uint32 address, uint16* words)
+{
+    for(uint attempt = 0;
+        ;
+        attempt++)
+    {
+        if(busReadPage(address, words) == 0)
+        {
+            return 0;
+        }
+        if(attempt == READ_RETRIES)
+        {
+            fprintf(stderr, "The page at 0x%08X fell short on all %u transfers.\n", address, READ_RETRIES + 1);
+            return 1;
+        }
+        readRetries++;
+    }
+}
+
+int ReadPageVerified(uint32 address, uint16* words)
+{
+    uint16 reads[MAJORITY_MAX_READS][PAGE_WORDS];
+    if(ReadBackendPage(address, reads[0]) != 0)
+    {
+        return PAGE_UNREAD;
+    }
+
+    for(uint attempt = 1;
+        attempt <= READ_RETRIES;
+        attempt++)
+    {
+        if(ReadBackendPage(address, reads[attempt]) != 0)
+        {
+            return PAGE_UNREAD;
+        }
+
+        for(uint earlier = 0;
+            earlier < attempt;
+            earlier++)
+        {
+            if(memcmp(reads[earlier], reads[attempt], sizeof(reads[attempt])) == 0)
+            {
+                memcpy(words, reads[attempt], sizeof(reads[attempt]));
+                return 0;
+            }
+        }
+        readRetries++;
+    }
+
+    if(majorityReads > 0)
+    {
+        for(uint attempt = READ_RETRIES + 1;
+            attempt < majorityReads;
+            attempt++)
+        {
+            if(ReadBackendPage(address, reads[attempt]) != 0)
+            {
+                return PAGE_UNREAD;
+            }
+        }
+        MajorityVote(reads, majorityReads, words, lineDisagreements);
+        majorityPages++;
+        return 0;
+    }
+
+    memcpy(words, reads[READ_RETRIES], sizeof(reads[READ_RETRIES]));
+    return 1;
+}
+
+int SetTimingScale(uint32 permille)
+{
+    if(permille == timingPermille)
+    {
+        return 0;
+    }
+
+    timingPermille = permille;
+    busTiming.latchNs = baseTiming.latchNs * permille / 1000;
+    busTiming.strobeNs = baseTiming.strobeNs * permille / 1000;
+    busTiming.recoveryNs = baseTiming.recoveryNs * permille / 1000;
+    if(busRetime != NULL && busRetime() != 0)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+int SelectTimingRegion(uint32 address, struct TimingRegion** region)
+{
+    uint32 offset = address - CART_ROM_BASE;
+    if(offset >= MAX_ROM_SIZE)
+    {
+        *region = NULL;
+        return SetTimingScale(1000);
+    }
+
+    *region = &timingRegions[offset / TIMING_REGION_SIZE];
+    if((*region)->permille == 0)
+    {
+        (*region)->permille = timingPermille;
+        (*region)->floorPermille = TIMING_MIN_PERMILLE;
+    }
+    return SetTimingScale((*region)->permille);
+}
+
+void AdaptTiming(struct TimingRegion* region, int retried)
+{
+    region->pages++;
+    if(retried)
+    {
+        region->retriedPages++;
+        region->cleanPages = 0;
+        region->floorPermille = region->permille + TIMING_STEP_PERMILLE;
+        region->floorPermille = (region->floorPermille > 1000) ? 1000 : region->floorPermille;
+        region->permille += TIMING_BACKOFF_STEPS * TIMING_STEP_PERMILLE;
+        region->permille = (region->permille > 1000) ? 1000 : region->permille;
+        return;
+    }
+
+    if(++region->cleanPages >= TIMING_CLEAN_PAGES && region->permille > region->floorPermille)
+    {
+        region->cleanPages = 0;
+        region->permille -= TIMING_STEP_PERMILLE;
+        region->permille = (region->permille < region->floorPermille) ? region->floorPermille : region->permille;
+    }
+}
+
+int ReadPage(uint32 address, uint16* words)
+{
+    BusTraceSelect(address);
+    if(adaptiveTiming)
+    {
+        while(1)
+        {
+            struct TimingRegion* region;
+            if(SelectTimingRegion(address, &region) != 0)
+            {
+                return 1;
+            }
+            uint32 permille = timingPermille;
+            uint64 retries = readRetries;
+            uint64 voted = majorityPages;
+            int failed = ReadPageVerified(address, words);
+
+            if(region != NULL)
+            {
+                AdaptTiming(region, readRetries != retries);
+            }
+            if(region == NULL || permille == 1000 || (failed == 0 && majorityPages == voted))
+            {
+                if(failed == PAGE_UNREAD)
+                {
+                    return 1;
+                }
+                readFailures += failed;
+                return 0;
+            }
+        }
+    }
+    if(verifyReads)
+    {
+        int failed = ReadPageVerified(address, words);
+        if(failed == PAGE_UNREAD)
+        {
+            return 1;
+        }
+        readFailures += failed;
+        return 0;
+    }
+    return ReadBackendPage(address, words);
+}
+
+void SetupBusPins(void)
+{
+    SetADBusPinsMode(PI_OUTPUT);
+    BusSetMode(ALE_L, PI_OUTPUT);
+    BusSetMode(ALE_H, PI_OUTPUT);
+    BusSetMode(READ, PI_OUTPUT);
+    BusSetMode(WRITE, PI_OUTPUT);
+    BusSetMode(RESET, PI_OUTPUT);
+
+    BusWrite(ALE_L, INACTIVE(LOW));
+    BusWrite(ALE_H, INACTIVE(LOW));
+    BusWrite(READ, INACTIVE(HIGH));
+    BusWrite(WRITE, INACTIVE(HIGH));
+    BusWrite(RESET, INACTIVE(HIGH));
+}
+
+int BusHung(const uint16* words)
+{
+    int ones = 1;
+    int zeros = 1;
+    for(uint word = 0;
+        word < PAGE_WORDS;
+        word++)
+    {
+        ones &= (words[word] == 0xFFFF);
+        zeros &= (words[word] == 0x0000);
+    }
+    return ones || zeros;
+}
+
+// The tests have no backend to hand the pins to and back
+int ResetCart(void)
+{
+    cartResets++;
+    SetupBusPins();
+
+    BusWrite(RESET, ACTIVE(LOW));
+    mock_gpioDelay(RESET_PULSE_US);
+    BusWrite(RESET, INACTIVE(HIGH));
+    mock_gpioDelay(RESET_SETTLE_US);
+    return 0;
+}
+
+int Recalibrate(void)
+{
+    uint32 permille = timingPermille;
+
+    recalibrations++;
+    baseTiming.latchNs = baseTiming.latchNs * RECALIBRATE_PERMILLE / 1000;
+    baseTiming.strobeNs = baseTiming.strobeNs * RECALIBRATE_PERMILLE / 1000;
+    baseTiming.recoveryNs = baseTiming.recoveryNs * RECALIBRATE_PERMILLE / 1000;
+    timingPermille = 0;
+    return SetTimingScale(permille);
+}
+
+int ReadCheckpointWindow(const uint32* order, uint32 first, uint count)
+{
+    uint16 words[PAGE_WORDS];
+
+    if(!referenceRead)
+    {
+        for(uint page = 0;
+            page < REFERENCE_PAGES;
+            page++)
+        {
+            if(ReadPage(CART_ROM_BASE + page * ROM_PAGE_SIZE, referenceBlock[page]) != 0)
+            {
+                return 1;
+            }
+        }
+        referenceRead = 1;
+    }
+
+    for(uint attempt = 0;
+        ;
+        attempt++)
+    {
+        for(uint page = 0;
+            page < count;
+            page++)
+        {
+            uint32 index = (order != NULL) ? order[first + page] : first + page;
+            if(ReadPage(CART_ROM_BASE + index * ROM_PAGE_SIZE, checkpointWindow[page]) != 0)
+            {
+                return 1;
+            }
+        }
+
+        int matched = 1;
+        for(uint page = 0;
+            page < REFERENCE_PAGES && matched;
+            page++)
+        {
+            matched = (ReadBackendPage(CART_ROM_BASE + page * ROM_PAGE_SIZE, words) == 0 &&
+                       memcmp(words, referenceBlock[page], sizeof(words)) == 0);
+        }
+
+        if(matched)
+        {
+            return 0;
+        }
+        if(attempt == RECALIBRATE_ATTEMPTS)
+        {
+            return 1;
+        }
+
+        if(BusHung(words))
+        {
+            if(ResetCart() != 0)
+            {
+                return 1;
+            }
+        }
+        else if(Recalibrate() != 0)
+        {
+            return 1;
+        }
+    }
+}
+
+static uint32 crc32Table[256];
+
+uint32 Crc32Update(uint32 crc, const uint8* bytes, size_t length)
+{
+    if(crc32Table[1] == 0)
+    {
+        for(uint32 value = 0;
+            value < 256;
+            value++)
+        {
+            uint32 entry = value;
+            for(uint bit = 0;
+                bit < 8;
+                bit++)
+            {
+                entry = (entry & 1) ? (entry >> 1) ^ 0xEDB88320 : entry >> 1;
+            }
+            crc32Table[value] = entry;
+        }
+    }
+
+    crc = ~crc;
+    for(size_t offset = 0;
+        offset < length;
+        offset++)
+    {
+        crc = crc32Table[(crc ^ bytes[offset]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#define SHA1_SIZE 20
+
+struct Sha1
+{
+  uint32 state[5];
+  uint64 length;
+  uint8 block[64];
+};
+
+void Sha1Init(struct Sha1* sha1)
+{
+    static const uint32 initial[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    memcpy(sha1->state, initial, sizeof(initial));
+    sha1->length = 0;
+}
+
+void Sha1Block(uint32* state, const uint8* block)
+{
+    uint32 schedule[80];
+    for(uint word = 0;
+        word < 16;
+        word++)
+    {
+        schedule[word] = (uint32)block[word * 4] << 24 | block[word * 4 + 1] << 16 |
+                         block[word * 4 + 2] << 8 | block[word * 4 + 3];
+    }
+    for(uint word = 16;
+        word < 80;
+        word++)
+    {
+        uint32 mixed = schedule[word - 3] ^ schedule[word - 8] ^ schedule[word - 14] ^ schedule[word - 16];
+        schedule[word] = (mixed << 1) | (mixed >> 31);
+    }
+
+    uint32 a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    for(uint round = 0;
+        round < 80;
+        round++)
+    {
+        uint32 f, k;
+        if(round < 20)
+        {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        }
+        else if(round < 40)
+        {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        }
+        else if(round < 60)
+        {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        }
+        else
+        {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+
+        uint32 next = ((a << 5) | (a >> 27)) + f + e + k + schedule[round];
+        e = d;
+        d = c;
+        c = (b << 30) | (b >> 2);
+        b = a;
+        a = next;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+void Sha1Update(struct Sha1* sha1, const uint8* bytes, size_t length)
+{
+    size_t used = sha1->length % 64;
+    sha1->length += length;
+
+    if(used != 0)
+    {
+        size_t take = (length < 64 - used) ? length : 64 - used;
+        memcpy(sha1->block + used, bytes, take);
+        bytes += take;
+        length -= take;
+        if(used + take < 64)
+        {
+            return;
+        }
+        Sha1Block(sha1->state, sha1->block);
+    }
+
+    while(length >= 64)
+    {
+        Sha1Block(sha1->state, bytes);
+        bytes += 64;
+        length -= 64;
+    }
+    memcpy(sha1->block, bytes, length);
+}
+
+void Sha1Final(struct Sha1* sha1, uint8* digest)
+{
+    uint64 bits = sha1->length * 8;
+    uint8 padding[72] = { 0x80 };
+    size_t used = sha1->length % 64;
+    size_t padLength = (used < 56) ? 56 - used : 120 - used;
+
+    for(uint byte = 0;
+        byte < 8;
+        byte++)
+    {
+        padding[padLength + byte] = bits >> (56 - byte * 8);
+    }
+    Sha1Update(sha1, padding, padLength + 8);
+
+    for(uint word = 0;
+        word < 5;
+        word++)
+    {
+        digest[word * 4] = sha1->state[word] >> 24;
+        digest[word * 4 + 1] = sha1->state[word] >> 16;
+        digest[word * 4 + 2] = sha1->state[word] >> 8;
+        digest[word * 4 + 3] = sha1->state[word];
+    }
+}
+
+void HeaderName(const uint16* header, char* name, size_t size)
+{
+    char title[21];
+    uint length = 0;
+
+    for(uint byte = 0;
+        byte < 20;
+        byte++)
+    {
+        uint16 word = header[0x20 / 2 + byte / 2];
+        char character = (byte % 2 == 0) ? word >> 8 : word & 0xFF;
+        if(character < 0x20 || character > 0x7E)
+        {
+            character = ' ';
+        }
+        else if(strchr("/\\:*?\"<>|", character) != NULL)
+        {
+            character = '_';
+        }
+        title[length++] = character;
+    }
+    while(length > 0 && title[length - 1] == ' ')
+    {
+        length--;
+    }
+    title[length] = '\0';
+
+    const char* start = title;
+    while(*start == ' ')
+    {
+        start++;
+    }
+    uint32 crc1 = (uint32)header[8] << 16 | header[9];
+    snprintf(name, size, "%s-%08X", (*start != '\0') ? start : "cart", crc1);
+}
+
+uint32 ProbeRomSize(void)
+{
+    uint16 header[PAGE_WORDS];
+    uint16 page[PAGE_WORDS];
+    ReadPage(CART_ROM_BASE, header);
+
+    for(uint32 boundary = PROBE_STEP;
+        boundary < MAX_ROM_SIZE;
+        boundary += PROBE_STEP)
+    {
+        ReadPage(CART_ROM_BASE + boundary, page);
+
+        int openBus = 1;
+        for(uint word = 0;
+            word < PAGE_WORDS && openBus;
+            word++)
+        {
+            openBus = (page[word] == ((boundary + word * 2) & 0xFFFF));
+        }
+
+        if(openBus || memcmp(page, header, sizeof(page)) == 0)
+        {
+            return boundary;
+        }
+    }
+    return MAX_ROM_SIZE;
+}
+
+struct CicVariant
+{
+  uint16 cic;
+  uint32 seed;
+};
+
+static const struct CicVariant cicVariants[] = { { 6102, 0xF8CA4DDC }, { 6103, 0xA3886759 },
+                                                 { 6105, 0xDF26F436 }, { 6106, 0x1FEA617A } };
+
+void RomChecksum(const uint8* rom, uint16 cic, uint32* crc1, uint32* crc2)
+{
+    uint32 seed = cicVariants[0].seed;
+    for(uint variant = 0;
+        variant < sizeof(cicVariants) / sizeof(cicVariants[0]);
+        variant++)
+    {
+        if(cicVariants[variant].cic == cic)
+        {
+            seed = cicVariants[variant].seed;
+        }
+    }
+
+    uint32 t1 = seed, t2 = seed, t3 = seed, t4 = seed, t5 = seed, t6 = seed;
+    for(uint32 offset = CHECKSUM_START;
+        offset < CHECKSUM_END;
+        offset += 4)
+    {
+        uint32 d = (uint32)rom[offset] << 24 | rom[offset + 1] << 16 | rom[offset + 2] << 8 | rom[offset + 3];
+        if(t6 + d < t6)
+        {
+            t4++;
+        }
+        t6 += d;
+        t3 ^= d;
+        uint32 r = (d << (d & 0x1F)) | (d >> ((32 - (d & 0x1F)) & 0x1F));
+        t5 += r;
+        t2 = (t2 > d) ? t2 ^ r : t2 ^ t6 ^ d;
+
+        if(cic == 6105)
+        {
+            // 6105 mixes in words from its boot code
+            const uint8* boot = &rom[0x0750 + (offset & 0xFF)];
+            t1 += ((uint32)boot[0] << 24 | boot[1] << 16 | boot[2] << 8 | boot[3]) ^ d;
+        }
+        else
+        {
+            t1 += t5 ^ d;
+        }
+    }
+
+    if(cic == 6103)
+    {
+        *crc1 = (t6 ^ t4) + t3;
+        *crc2 = (t5 ^ t2) + t1;
+    }
+    else if(cic == 6106)
+    {
+        *crc1 = t6 * t4 + t3;
+        *crc2 = t5 * t2 + t1;
+    }
+    else
+    {
+        *crc1 = t6 ^ t4 ^ t3;
+        *crc2 = t5 ^ t2 ^ t1;
+    }
+}
+
+uint16 IdentifyCic(const uint8* rom)
+{
+    uint32 headerCrc1 = (uint32)rom[0x10] << 24 | rom[0x11] << 16 | rom[0x12] << 8 | rom[0x13];
+    uint32 headerCrc2 = (uint32)rom[0x14] << 24 | rom[0x15] << 16 | rom[0x16] << 8 | rom[0x17];
+
+    for(uint variant = 0;
+        variant < sizeof(cicVariants) / sizeof(cicVariants[0]);
+        variant++)
+    {
+        uint32 crc1 = 0;
+        uint32 crc2 = 0;
+        RomChecksum(rom, cicVariants[variant].cic, &crc1, &crc2);
+        if(crc1 == headerCrc1 && crc2 == headerCrc2)
+        {
+            return cicVariants[variant].cic;
+        }
+    }
+    return 0;
+}
+
+const uint8* MapImage(const char* path, size_t* size)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        perror(path);
+        return NULL;
+    }
+
+    struct stat info;
+    if(fstat(fd, &info) < 0 || info.st_size == 0)
+    {
+        fprintf(stderr, "%s: empty or unreadable image.\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    void* image = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(image == MAP_FAILED)
+    {
+        perror(path);
+        return NULL;
+    }
+
+    *size = info.st_size;
+    return image;
+}
+
+int VerifyAgainst(const char* referencePath, int exhaustive)
+{
+    size_t referenceSize = 0;
+    const uint8* reference = MapImage(referencePath, &referenceSize);
+    if(reference == NULL)
+    {
+        return 1;
+    }
+
+    if(referenceSize < 4 ||
+       ((uint32)reference[0] << 24 | reference[1] << 16 | reference[2] << 8 | reference[3]) != Z64_MAGIC)
+    {
+        fprintf(stderr, "%s: not a big-endian (.z64) image.\n", referencePath);
+        munmap((void*)reference, referenceSize);
+        return 1;
+    }
+
+    if(referenceSize > MAX_ROM_SIZE || referenceSize % ROM_PAGE_SIZE != 0)
+    {
+        fprintf(stderr, "%s: size 0x%zX is not a whole number of pages within the ROM space.\n",
+                referencePath, referenceSize);
+        munmap((void*)reference, referenceSize);
+        return 1;
+    }
+
+    madvise((void*)reference, referenceSize, MADV_SEQUENTIAL);
+
+    uint16 page[PAGE_WORDS];
+    uint mismatchRanges = 0;
+    uint32 mismatchStart = 0;
+    int inMismatch = 0;
+
+    for(uint32 address = 0;
+        address < referenceSize;
+        address += ROM_PAGE_SIZE)
+    {
+        if(ReadPage(CART_ROM_BASE + address, page) != 0)
+        {
+            munmap((void*)reference, referenceSize);
+            return 1;
+        }
+
+        for(uint word = 0;
+            word < PAGE_WORDS;
+            word++)
+        {
+            uint32 offset = address + word * 2;
+            uint16 expected = (reference[offset] << 8) | reference[offset + 1];
+
+            if(page[word] != expected)
+            {
+                if(!exhaustive)
+                {
+                    printf("Mismatch at 0x%06X: cart 0x%04X, expected 0x%04X\n", offset, page[word], expected);
+                    munmap((void*)reference, referenceSize);
+                    return EXIT_MISMATCH;
+                }
+
+                if(!inMismatch)
+                {
+                    mismatchStart = offset;
+                    inMismatch = 1;
+                }
+            }
+            else if(inMismatch)
+            {
+                printf("Mismatch 0x%06X-0x%06X\n", mismatchStart, offset - 1);
+                mismatchRanges++;
+                inMismatch = 0;
+            }
+        }
+    }
+
+    if(inMismatch)
+    {
+        printf("Mismatch 0x%06X-0x%06zX\n", mismatchStart, referenceSize - 1);
+        mismatchRanges++;
+    }
+
+    munmap((void*)reference, referenceSize);
+
+    if(mismatchRanges > 0)
+    {
+        printf("%u mismatching range(s).\n", mismatchRanges);
+        return EXIT_MISMATCH;
+    }
+
+    printf("Cart matches %s (0x%zX bytes).\n", referencePath, referenceSize);
+    return 0;
+}
+
+uint32 FingerprintSampleAddress(uint sample)
+{
+    if(sample == 0)
+    {
+        return 0;
+    }
+
+    uint32 pagesPerStride = FINGERPRINT_STRIDE / ROM_PAGE_SIZE;
+    uint32 page = ((sample * 2654435761u) >> 8) % pagesPerStride;
+
+    return sample * FINGERPRINT_STRIDE + page * ROM_PAGE_SIZE;
+}
+
+uint64 FingerprintUpdate(uint64 hash, const uint16* words, uint count)
+{
+    for(uint word = 0;
+        word < count;
+        word++)
+    {
+        hash = (hash ^ (words[word] >> 8)) * 0x100000001B3ULL;
+        hash = (hash ^ (words[word] & 0xFF)) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+uint64 FingerprintImage(const uint8* image, size_t size)
+{
+    uint64 hash = 0xCBF29CE484222325ULL;
+    uint16 page[PAGE_WORDS];
+
+    for(uint sample = 0;
+        sample < FINGERPRINT_SAMPLES;
+        sample++)
+    {
+        size_t address = FingerprintSampleAddress(sample) % size;
+        for(uint word = 0;
+            word < PAGE_WORDS;
+            word++)
+        {
+            size_t offset = (address + word * 2) % size;
+            page[word] = (image[offset] << 8) | image[(offset + 1) % size];
+        }
+        hash = FingerprintUpdate(hash, page, PAGE_WORDS);
+    }
+    return hash;
+}
+
+uint64 FingerprintCart(void)
+{
+    uint64 hash = 0xCBF29CE484222325ULL;
+    uint16 page[PAGE_WORDS];
+
+    for(uint sample = 0;
+        sample < FINGERPRINT_SAMPLES;
+        sample++)
+    {
+        ReadPage(CART_ROM_BASE + FingerprintSampleAddress(sample), page);
+        hash = FingerprintUpdate(hash, page, PAGE_WORDS);
+    }
+    return hash;
+}
+
+int BuildFingerprintIndex(const char* indexPath, char** dumpPaths, int dumpCount)
+{
+    FILE* index = fopen(indexPath, "w");
+    if(index == NULL)
+    {
+        perror(indexPath);
+        return 1;
+    }
+
+    uint indexed = 0;
+    for(int dump = 0;
+        dump < dumpCount;
+        dump++)
+    {
+        size_t size = 0;
+        const uint8* image = MapImage(dumpPaths[dump], &size);
+        if(image == NULL)
+        {
+            continue;
+        }
+
+        if(size < ROM_PAGE_SIZE ||
+           ((uint32)image[0] << 24 | image[1] << 16 | image[2] << 8 | image[3]) != Z64_MAGIC)
+        {
+            fprintf(stderr, "%s: not a big-endian (.z64) dump, skipped.\n", dumpPaths[dump]);
+        }
+        else
+        {
+            fprintf(index, "%016llX %zX %s\n",
+                    (unsigned long long)FingerprintImage(image, size), size, dumpPaths[dump]);
+            indexed++;
+        }
+        munmap((void*)image, size);
+    }
+
+    fclose(index);
+    printf("Indexed %u of %d dump(s) into %s.\n", indexed, dumpCount, indexPath);
+    return 0;
+}
+
+int IdentifyCart(const char* indexPath)
+{
+    FILE* index = fopen(indexPath, "r");
+    if(index == NULL)
+    {
+        perror(indexPath);
+        return 1;
+    }
+
+    uint64 fingerprint = FingerprintCart();
+
+    char line[4096];
+    while(fgets(line, sizeof(line), index) != NULL)
+    {
+        unsigned long long entryFingerprint = 0;
+        size_t entrySize = 0;
+        int pathOffset = 0;
+
+        if(sscanf(line, "%llx %zx %n", &entryFingerprint, &entrySize, &pathOffset) == 2 &&
+           entryFingerprint == fingerprint)
+        {
+            line[strcspn(line, "\n")] = '\0';
+            printf("Match: %s (0x%zX bytes)\n", line + pathOffset, entrySize);
+            fclose(index);
+            return 0;
+        }
+    }
+
+    fclose(index);
+    printf("Unknown cart (fingerprint %016llX).\n", (unsigned long long)fingerprint);
+    return EXIT_UNKNOWN;
+}
+
+uint32 DatKeyHash(uint8 type, const uint8* bytes, uint length, uint32 seed)
+{
+    uint32 hash = 0x811C9DC5 ^ (seed * 0x9E3779B9);
+    hash = (hash ^ type) * 0x01000193;
+    for(uint offset = 0;
+        offset < length;
+        offset++)
+    {
+        hash = (hash ^ bytes[offset]) * 0x01000193;
+    }
+
+    // Final avalanche so low bits depend on every input byte
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6B;
+    hash ^= hash >> 13;
+    hash *= 0xC2B2AE35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+uint8 DatTitleRevision(const char* title)
+{
+    const char* revision = strstr(title, "(Rev ");
+    if(revision == NULL)
+    {
+        return 0;
+    }
+
+    char mark = revision[5];
+    if(mark >= '0' && mark <= '9')
+    {
+        return atoi(revision + 5);
+    }
+    if(mark >= 'A' && mark <= 'Z')
+    {
+        return mark - 'A' + 1;
+    }
+    return 0;
+}
+
+struct DatKey
+{
+    uint32 bucket;
+    uint32 entry;
+    uint8 type;
+    uint8 length;
+    uint8 bytes[20];
+};
+
+struct DatBucket
+{
+    uint32 bucket;
+    uint32 first;
+    uint32 count;
+};
+
+int CompareDatBuckets(const void* left, const void* right)
+{
+    const struct DatBucket* a = left;
+    const struct DatBucket* b = right;
+    return (a->count != b->count) ? (int)b->count - (int)a->count : (int)a->bucket - (int)b->bucket;
+}
+
+int BuildPerfectHash(const struct DatKey* keys, uint32 keyCount, uint32 bucketCount,
+                     uint32 slotCount, uint32* displacements, uint32* slots)
+{
+    struct DatBucket* buckets = calloc(bucketCount, sizeof(*buckets));
+    uint32* candidate = malloc(sizeof(uint32) * (keyCount + 1));
+    if(buckets == NULL || candidate == NULL)
+    {
+        free(candidate);
+        free(buckets);
+        return -1;
+    }
+
+    for(uint32 bucket = 0;
+        bucket < bucketCount;
+        bucket++)
+    {
+        buckets[bucket].bucket = bucket;
+        displacements[bucket] = 0;
+    }
+    for(uint32 key = 0;
+        key < keyCount;
+        key++)
+    {
+        if(buckets[keys[key].bucket].count++ == 0)
+        {
+            buckets[keys[key].bucket].first = key;
+        }
+    }
+    for(uint32 slot = 0;
+        slot < slotCount;
+        slot++)
+    {
+        slots[slot] = DAT_EMPTY_SLOT;
+    }
+
+    qsort(buckets, bucketCount, sizeof(*buckets), CompareDatBuckets);
+
+    int placed = 1;
+    for(uint32 bucket = 0;
+        bucket < bucketCount && buckets[bucket].count > 0 && placed;
+        bucket++)
+    {
+        const struct DatKey* bucketKeys = &keys[buckets[bucket].first];
+        placed = 0;
+
+        for(uint32 seed = 1;
+            seed < DAT_MAX_SEED && !placed;
+            seed++)
+        {
+            placed = 1;
+            for(uint32 key = 0;
+                key < buckets[bucket].count && placed;
+                key++)
+            {
+                uint32 slot = DatKeyHash(bucketKeys[key].type, bucketKeys[key].bytes,
+                                           bucketKeys[key].length, seed) % slotCount;
+                placed = (slots[slot] == DAT_EMPTY_SLOT);
+                for(uint32 previous = 0;
+                    previous < key && placed;
+                    previous++)
+                {
+                    placed = (candidate[previous] != slot);
+                }
+                candidate[key] = slot;
+            }
+
+            if(placed)
+            {
+                displacements[buckets[bucket].bucket] = seed;
+                for(uint32 key = 0;
+                    key < buckets[bucket].count;
+                    key++)
+                {
+                    slots[candidate[key]] = (bucketKeys[key].entry << 2) | bucketKeys[key].type;
+                }
+            }
+        }
+    }
+
+    free(candidate);
+    free(buckets);
+    return placed;
+}
+
+enum DatKeyType
+{
+    DatKeyCrc32 = 0,
+    DatKeyMd5 = 1,
+    DatKeySha1 = 2,
+    DatKeySerial = 3
+};
+
+enum SaveType
+{
+    SaveUnknown = 0,
+    SaveNone,
+    SaveEeprom4k,
+    SaveEeprom16k,
+    SaveSram,
+    SaveSram768k,
+    SaveFlash,
+    SaveTypeCount
+};
+
+static const char* saveTypeNames[SaveTypeCount] = { "unknown", "none", "eeprom4k", "eeprom16k", "sram", "sram768k", "flash" };
+
+struct DatIndexHeader
+{
+    char magic[8];
+    uint32 version;
+    uint32 entryCount;
+    uint32 bucketCount;
+    uint32 slotCount;
+    uint32 stringsSize;
+    uint32 reserved;
+};
+
+struct DatEntry
+{
+    uint32 crc32;
+    uint32 size;
+    uint8 md5[16];
+    uint8 sha1[20];
+    char serial[4];
+    uint8 revision;
+    uint8 saveType;
+    uint16 cic;
+    uint32 titleOffset;
+};
+
+struct DatIndex
+{
+    const struct DatIndexHeader* header;
+    const uint32* displacements;
+    const uint32* slots;
+    const struct DatEntry* entries;
+    const char* strings;
+    size_t size;
+};
+
+struct DatIndex datIndex;
+
+int XmlAttribute(const char* tag, const char* tagEnd, const char* name, char* value, size_t valueSize)
+{
+    size_t nameLength = strlen(name);
+
+    for(const char* cursor = tag + 1;
+        cursor + nameLength + 2 < tagEnd;
+        cursor++)
+    {
+        if((cursor[-1] != ' ' && cursor[-1] != '\t' && cursor[-1] != '\n') ||
+           strncmp(cursor, name, nameLength) != 0 || cursor[nameLength] != '=' ||
+           (cursor[nameLength + 1] != '"' && cursor[nameLength + 1] != '\''))
+        {
+            continue;
+        }
+
+        char quote = cursor[nameLength + 1];
+        const char* source = cursor + nameLength + 2;
+        size_t length = 0;
+
+        while(source < tagEnd && *source != quote && length + 1 < valueSize)
+        {
+            static const char* entities[][2] = {
+                { "&amp;", "&" }, { "&lt;", "<" }, { "&gt;", ">" }, { "&quot;", "\"" }, { "&apos;", "'" }
+            };
+            int decoded = 0;
+
+            for(uint entity = 0;
+                entity < sizeof(entities) / sizeof(entities[0]) && *source == '&';
+                entity++)
+            {
+                size_t entityLength = strlen(entities[entity][0]);
+                if(strncmp(source, entities[entity][0], entityLength) == 0)
+                {
+                    value[length++] = entities[entity][1][0];
+                    source += entityLength;
+                    decoded = 1;
+                    break;
+                }
+            }
+
+            if(!decoded)
+            {
+                value[length++] = *source++;
+            }
+        }
+        value[length] = '\0';
+        return 1;
+    }
+    return 0;
+}
+
+int ParseHex(const char* text, uint8* bytes, uint length)
+{
+    if(strlen(text) != length * 2)
+    {
+        return 0;
+    }
+
+    for(uint offset = 0;
+        offset < length;
+        offset++)
+    {
+        unsigned int value = 0;
+        if(sscanf(text + offset * 2, "%2x", &value) != 1)
+        {
+            return 0;
+        }
+        bytes[offset] = value;
+    }
+    return 1;
+}
+
+uint8 ParseSaveType(const char* text)
+{
+    for(uint saveType = 0;
+        saveType < SaveTypeCount;
+        saveType++)
+    {
+        if(strcmp(text, saveTypeNames[saveType]) == 0)
+        {
+            return saveType;
+        }
+    }
+    return SaveUnknown;
+}
+
+int CompareDatKeys(const void* left, const void* right)
+{
+    const struct DatKey* a = left;
+    const struct DatKey* b = right;
+
+    if(a->bucket != b->bucket)
+    {
+        return (a->bucket < b->bucket) ? -1 : 1;
+    }
+    if(a->type != b->type)
+    {
+        return a->type - b->type;
+    }
+    int order = memcmp(a->bytes, b->bytes, a->length);
+    if(order != 0)
+    {
+        return order;
+    }
+    // Equal keys keep DAT order so the first entry wins
+    return (a->entry < b->entry) ? -1 : (a->entry > b->entry);
+}
+
+uint DatEntryKey(const struct DatEntry* entry, uint type, uint8* key)
+{
+    switch(type)
+    {
+        case DatKeyCrc32:
+            key[0] = entry->crc32 >> 24;
+            key[1] = entry->crc32 >> 16;
+            key[2] = entry->crc32 >> 8;
+            key[3] = entry->crc32;
+            return 4;
+        case DatKeyMd5:
+            memcpy(key, entry->md5, 16);
+            return 16;
+        case DatKeySha1:
+            memcpy(key, entry->sha1, 20);
+            return 20;
+        default:
+            memcpy(key, entry->serial, 4);
+            key[4] = entry->revision;
+            return 5;
+    }
+}
+
+const struct DatEntry* DatLookup(uint type, const uint8* key, uint length)
+{
+    if(datIndex.header == NULL || datIndex.header->entryCount == 0)
+    {
+        return NULL;
+    }
+
+    const struct DatIndexHeader* header = datIndex.header;
+    uint32 bucket = DatKeyHash(type, key, length, 0) % header->bucketCount;
+    uint32 slot = DatKeyHash(type, key, length, datIndex.displacements[bucket]) % header->slotCount;
+    uint32 value = datIndex.slots[slot];
+
+    if(value == DAT_EMPTY_SLOT || (value & 0x3) != type)
+    {
+        return NULL;
+    }
+
+    const struct DatEntry* entry = &datIndex.entries[value >> 2];
+    uint8 entryKey[20];
+    if(DatEntryKey(entry, type, entryKey) != length || memcmp(entryKey, key, length) != 0)
+    {
+        return NULL;
+    }
+    return entry;
+}
+
+const struct DatEntry* DatLookupHeader(const uint16* header)
+{
+    // Game code at 0x3B-0x3E, revision at 0x3F
+    uint8 key[5] = {
+        header[0x3A / 2] & 0xFF,
+        header[0x3C / 2] >> 8,
+        header[0x3C / 2] & 0xFF,
+        header[0x3E / 2] >> 8,
+        header[0x3E / 2] & 0xFF
+    };
+    return DatLookup(DatKeySerial, key, sizeof(key));
+}
+
+const char* DatTitle(const struct DatEntry* entry)
+{
+    return datIndex.strings + entry->titleOffset;
+}
+
+int LoadDatIndex(const char* path, int required)
+{
+    if(!required && access(path, R_OK) != 0)
+    {
+        return 0;
+    }
+
+    size_t size = 0;
+    const uint8* image = MapImage(path, &size);
+    if(image == NULL)
+    {
+        return 1;
+    }
+
+    const struct DatIndexHeader* header = (const struct DatIndexHeader*)image;
+    if(size < sizeof(*header) || memcmp(header->magic, DAT_INDEX_MAGIC, 8) != 0 ||
+       header->version != DAT_INDEX_VERSION)
+    {
+        fprintf(stderr, "%s: not a DAT index (rebuild with --compile-dat).\n", path);
+        munmap((void*)image, size);
+        return 1;
+    }
+
+    size_t expected = sizeof(*header) +
+                      (size_t)header->bucketCount * 4 +
+                      (size_t)header->slotCount * 4 +
+                      (size_t)header->entryCount * sizeof(struct DatEntry) +
+                      header->stringsSize;
+    if(expected != size || (header->entryCount > 0 && (header->bucketCount == 0 || header->slotCount == 0)))
+    {
+        fprintf(stderr, "%s: truncated or corrupt DAT index.\n", path);
+        munmap((void*)image, size);
+        return 1;
+    }
+
+    const uint32* displacements = (const uint32*)(header + 1);
+    const uint32* slots = displacements + header->bucketCount;
+    const struct DatEntry* entries = (const struct DatEntry*)(slots + header->slotCount);
+    const char* strings = (const char*)(entries + header->entryCount);
+
+    // DatLookup and DatTitle index straight through these, so check them once here
+    int valid = 1;
+    for(uint32 slot = 0;
+        slot < header->slotCount && valid;
+        slot++)
+    {
+        valid = (slots[slot] == DAT_EMPTY_SLOT ||
+                 ((slots[slot] >> 2) < header->entryCount && (slots[slot] & 0x3) < DAT_KEY_TYPES));
+    }
+    for(uint32 entry = 0;
+        entry < header->entryCount && valid;
+        entry++)
+    {
+        uint32 offset = entries[entry].titleOffset;
+        valid = (offset < header->stringsSize &&
+                 memchr(strings + offset, '\0', header->stringsSize - offset) != NULL);
+    }
+    if(!valid)
+    {
+        fprintf(stderr, "%s: corrupt DAT index (rebuild with --compile-dat).\n", path);
+        munmap((void*)image, size);
+        return 1;
+    }
+
+    datIndex.header = header;
+    datIndex.displacements = displacements;
+    datIndex.slots = slots;
+    datIndex.entries = entries;
+    datIndex.strings = strings;
+    datIndex.size = size;
+    return 0;
+}
+
+int CompileDatIndex(const char* indexPath, char** datPaths, int datCount)
+{
+    struct DatEntry* entries = NULL;
+    uint32 entryCount = 0;
+    uint32 entryCapacity = 0;
+    char* strings = NULL;
+    uint32 stringsSize = 0;
+    int outOfMemory = 0;
+
+    for(int dat = 0;
+        dat < datCount && !outOfMemory;
+        dat++)
+    {
+        size_t size = 0;
+        const char* text = (const char*)MapImage(datPaths[dat], &size);
+        if(text == NULL)
+        {
+            free(entries);
+            free(strings);
+            return 1;
+        }
+        const char* end = text + size;
+
+        for(const char* game = memmem(text, size, "<game ", 6);
+            game != NULL && !outOfMemory;
+            game = memmem(game + 1, end - game - 1, "<game ", 6))
+        {
+            const char* gameEnd = memchr(game, '>', end - game);
+            const char* gameClose = memmem(game, end - game, "</game>", 7);
+            if(gameEnd == NULL || gameClose == NULL)
+            {
+                break;
+            }
+
+            char title[512];
+            if(!XmlAttribute(game, gameEnd, "name", title, sizeof(title)))
+            {
+                continue;
+            }
+
+            for(const char* rom = memmem(gameEnd, gameClose - gameEnd, "<rom ", 5);
+                rom != NULL;
+                rom = memmem(rom + 1, gameClose - rom - 1, "<rom ", 5))
+            {
+                const char* romEnd = memchr(rom, '>', gameClose - rom);
+                if(romEnd == NULL)
+                {
+                    break;
+                }
+
+                char value[64];
+                struct DatEntry entry;
+                memset(&entry, 0, sizeof(entry));
+
+                if(!XmlAttribute(rom, romEnd, "size", value, sizeof(value)))
+                {
+                    continue;
+                }
+                entry.size = strtoul(value, NULL, 10);
+
+                uint8 crc[4];
+                if(!XmlAttribute(rom, romEnd, "crc", value, sizeof(value)) || !ParseHex(value, crc, 4))
+                {
+                    continue;
+                }
+                entry.crc32 = ((uint32)crc[0] << 24) | (crc[1] << 16) | (crc[2] << 8) | crc[3];
+
+                if(XmlAttribute(rom, romEnd, "md5", value, sizeof(value)))
+                {
+                    ParseHex(value, entry.md5, 16);
+                }
+                if(XmlAttribute(rom, romEnd, "sha1", value, sizeof(value)))
+                {
+                    ParseHex(value, entry.sha1, 20);
+                }
+                if(XmlAttribute(rom, romEnd, "serial", value, sizeof(value)) && strlen(value) >= 4)
+                {
+                    memcpy(entry.serial, value, 4);
+                }
+                if(XmlAttribute(rom, romEnd, "savetype", value, sizeof(value)))
+                {
+                    entry.saveType = ParseSaveType(value);
+                }
+                if(XmlAttribute(rom, romEnd, "cic", value, sizeof(value)))
+                {
+                    entry.cic = strtoul(value, NULL, 10);
+                }
+                entry.revision = DatTitleRevision(title);
+
+                uint32 titleLength = strlen(title) + 1;
+                char* grownStrings = realloc(strings, stringsSize + titleLength);
+                if(grownStrings == NULL)
+                {
+                    outOfMemory = 1;
+                    break;
+                }
+                strings = grownStrings;
+                memcpy(strings + stringsSize, title, titleLength);
+                entry.titleOffset = stringsSize;
+                stringsSize += titleLength;
+
+                if(entryCount == entryCapacity)
+                {
+                    uint32 grownCapacity = entryCapacity ? entryCapacity * 2 : 1024;
+                    struct DatEntry* grownEntries = realloc(entries, grownCapacity * sizeof(*entries));
+                    if(grownEntries == NULL)
+                    {
+                        outOfMemory = 1;
+                        break;
+                    }
+                    entries = grownEntries;
+                    entryCapacity = grownCapacity;
+                }
+                entries[entryCount++] = entry;
+            }
+        }
+
+        munmap((void*)text, size);
+    }
+
+    // Collect every key with its bucket, then drop duplicates (first DAT entry wins)
+    uint32 keyCount = 0;
+    uint32 bucketCount = entryCount * DAT_KEY_TYPES / 4 + 1;
+    struct DatKey* keys = outOfMemory ? NULL : malloc(sizeof(*keys) * ((size_t)entryCount * DAT_KEY_TYPES + 1));
+    uint32* displacements = (keys == NULL) ? NULL : malloc(sizeof(uint32) * bucketCount);
+    if(displacements == NULL)
+    {
+        fprintf(stderr, "Failed to allocate the DAT index.\n");
+        free(keys);
+        free(strings);
+        free(entries);
+        return 1;
+    }
+
+    for(uint32 entry = 0;
+        entry < entryCount;
+        entry++)
+    {
+        for(uint type = 0;
+            type < DAT_KEY_TYPES;
+            type++)
+        {
+            if(type == DatKeySerial && entries[entry].serial[0] == '\0')
+            {
+                continue;
+            }
+
+            struct DatKey* key = &keys[keyCount++];
+            memset(key, 0, sizeof(*key));
+            key->type = type;
+            key->entry = entry;
+            key->length = DatEntryKey(&entries[entry], type, key->bytes);
+            key->bucket = DatKeyHash(type, key->bytes, key->length, 0) % bucketCount;
+        }
+    }
+
+    qsort(keys, keyCount, sizeof(*keys), CompareDatKeys);
+
+    uint32 uniqueCount = 0;
+    for(uint32 key = 0;
+        key < keyCount;
+        key++)
+    {
+        if(uniqueCount > 0 &&
+           keys[uniqueCount - 1].bucket == keys[key].bucket &&
+           keys[uniqueCount - 1].type == keys[key].type &&
+           memcmp(keys[uniqueCount - 1].bytes, keys[key].bytes, keys[key].length) == 0)
+        {
+            continue;
+        }
+        keys[uniqueCount++] = keys[key];
+    }
+
+    // Load factor ~0.8 keeps seed searches short; grow the table if a bucket won't fit
+    uint32 slotCount = uniqueCount + uniqueCount / 4 + 1;
+    uint32* slots = NULL;
+    int built = 0;
+
+    for(uint attempt = 0;
+        attempt < 8 && built == 0;
+        attempt++)
+    {
+        if(attempt > 0)
+        {
+            slotCount += slotCount / 4;
+        }
+        uint32* grownSlots = realloc(slots, sizeof(uint32) * slotCount);
+        if(grownSlots == NULL)
+        {
+            built = -1;
+            break;
+        }
+        slots = grownSlots;
+        built = BuildPerfectHash(keys, uniqueCount, bucketCount, slotCount, displacements, slots);
+    }
+
+    // Only create the file once there is something to write
+    int status = 1;
+    FILE* index = NULL;
+    if(built < 0)
+    {
+        fprintf(stderr, "Failed to allocate the DAT index.\n");
+    }
+    else if(built == 0)
+    {
+        fprintf(stderr, "Failed to build a perfect hash over %u keys.\n", uniqueCount);
+    }
+    else if((index = fopen(indexPath, "wb")) == NULL)
+    {
+        perror(indexPath);
+    }
+    else
+    {
+        struct DatIndexHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, DAT_INDEX_MAGIC, 8);
+        header.version = DAT_INDEX_VERSION;
+        header.entryCount = entryCount;
+        header.bucketCount = bucketCount;
+        header.slotCount = slotCount;
+        header.stringsSize = stringsSize;
+
+        if(fwrite(&header, sizeof(header), 1, index) == 1 &&
+           fwrite(displacements, sizeof(uint32), bucketCount, index) == bucketCount &&
+           fwrite(slots, sizeof(uint32), slotCount, index) == slotCount &&
+           fwrite(entries, sizeof(*entries), entryCount, index) == entryCount &&
+           fwrite(strings, 1, stringsSize, index) == stringsSize)
+        {
+            printf("Compiled %u DAT entries (%u keys, %u slots) into %s.\n",
+                   entryCount, uniqueCount, slotCount, indexPath);
+            status = 0;
+        }
+        else
+        {
+            perror(indexPath);
+        }
+    }
+
+    if(index != NULL)
+    {
+        fclose(index);
+    }
+    free(slots);
+    free(displacements);
+    free(keys);
+    free(strings);
+    free(entries);
+    return status;
+}
+
+enum RangeKind
+{
+    RangeRom = 0,
+    RangeSave = 1
+};
+
+struct DumpRange
+{
+    uint32 busAddress;
+    uint32 length;
+    uint kind;
+};
+
+struct DumpPlan
+{
+    const struct DatEntry* entry;
+    uint32 romSize;
+    uint saveType;
+    uint rangeCount;
+    struct DumpRange ranges[MAX_PLAN_RANGES];
+    uint32* pageOrder;
+    uint32 bootPages;
+};
+
+struct SharedImage
+{
+    struct SharedImageHeader* header;
+    uint8* image;
+    size_t size;
+};
+
+struct SharedImage sharedImage;
+
+uint8 romPrefix[CHECKSUM_END];
+uint32 romPrefixLength;
+
+void ReportMajority(void)
+{
+    if(majorityPages == 0)
+    {
+        return;
+    }
+
+    uint worst = 0;
+    for(uint line = 1;
+        line < 16;
+        line++)
+    {
+        worst = (lineDisagreements[line] > lineDisagreements[worst]) ? line : worst;
+    }
+
+    fprintf(stderr, "Majority vote rebuilt %llu pages. Read bits that lost the vote:",
+            (unsigned long long)majorityPages);
+    for(uint line = 0;
+        line < 16;
+        line++)
+    {
+        if(lineDisagreements[line] != 0)
+        {
+            fprintf(stderr, " AD%u %llu", line, (unsigned long long)lineDisagreements[line]);
+        }
+    }
+    fprintf(stderr, "\nAD%u (GPIO%u) is the most marginal line.\n", worst, AD_PIN(worst));
+}
+
+void ReportAdaptiveTiming(void)
+{
+    if(!adaptiveTiming)
+    {
+        return;
+    }
+
+    uint64 pages = 0;
+    uint64 retriedPages = 0;
+    fprintf(stderr, "Adaptive timing, READ strobe ns per 1 Mb region:");
+    for(uint index = 0;
+        index < MAX_ROM_SIZE / TIMING_REGION_SIZE;
+        index++)
+    {
+        const struct TimingRegion* region = &timingRegions[index];
+        if(region->pages != 0)
+        {
+            fprintf(stderr, " %u", baseTiming.strobeNs * region->permille / 1000);
+            pages += region->pages;
+            retriedPages += region->retriedPages;
+        }
+    }
+    fprintf(stderr, "\n%llu of %llu pages needed a retry (base strobe %u ns).\n",
+            (unsigned long long)retriedPages, (unsigned long long)pages, baseTiming.strobeNs);
+}
+
+void ReportRecalibration(void)
+{
+    if(checkpointPages == 0)
+    {
+        return;
+    }
+
+    fprintf(stderr, "Checkpoints every %u pages: %llu recalibrations, %llu cart resets, base strobe %u ns.\n",
+            checkpointPages, (unsigned long long)recalibrations, (unsigned long long)cartResets, baseTiming.strobeNs);
+}
+
+void KeepRomPrefix(uint32 offset, const uint8* bytes)
+{
+    if(offset < CHECKSUM_END)
+    {
+        memcpy(romPrefix + offset, bytes, ROM_PAGE_SIZE);
+        romPrefixLength += ROM_PAGE_SIZE;
+    }
+}
+
+void ReportHeaderChecksum(const struct DumpPlan* plan)
+{
+    if(plan->romSize < CHECKSUM_END || romPrefixLength < CHECKSUM_END)
+    {
+        return;
+    }
+
+    uint16 cic = IdentifyCic(romPrefix);
+    uint16 expected = (plan->entry != NULL && plan->entry->cic != 6101) ? plan->entry->cic : 6102;
+    if(cic == 0)
+    {
+        fprintf(stderr, "Header checksum matches no CIC: the first 1 Mb did not read back correctly.\n");
+    }
+    else if(plan->entry != NULL && plan->entry->cic != 0 && cic != expected)
+    {
+        fprintf(stderr, "Header checksum matches CIC %u, the DAT index lists %u.\n", cic, plan->entry->cic);
+    }
+    else
+    {
+        fprintf(stderr, "Header checksum OK (CIC %u).\n", cic);
+    }
+}
+
+void PlanDump(const uint16* header, struct DumpPlan* plan)
+{
+    memset(plan, 0, sizeof(*plan));
+
+    plan->entry = DatLookupHeader(header);
+    if(plan->entry != NULL && plan->entry->size > 0 && plan->entry->size <= MAX_ROM_SIZE &&
+       plan->entry->size % ROM_PAGE_SIZE == 0)
+    {
+        plan->romSize = plan->entry->size;
+        plan->saveType = plan->entry->saveType;
+    }
+    else
+    {
+        plan->entry = NULL;
+        plan->romSize = ProbeRomSize();
+        plan->saveType = SaveUnknown;
+    }
+
+    plan->ranges[plan->rangeCount++] = (struct DumpRange){ CART_ROM_BASE, plan->romSize, RangeRom };
+
+    switch(plan->saveType)
+    {
+        case SaveSram:
+            plan->ranges[plan->rangeCount++] = (struct DumpRange){ CART_SRAM_BASE, SRAM_BANK_SIZE, RangeSave };
+            break;
+        case SaveSram768k:
+            // Three 256 Kbit banks selected by address bits 18-19
+            for(uint bank = 0;
+                bank < 3;
+                bank++)
+            {
+                plan->ranges[plan->rangeCount++] =
+                    (struct DumpRange){ CART_SRAM_BASE + bank * SRAM_BANK_STRIDE, SRAM_BANK_SIZE, RangeSave };
+            }
+            break;
+        case SaveFlash:
+            plan->ranges[plan->rangeCount++] = (struct DumpRange){ CART_SRAM_BASE, FLASH_SIZE, RangeSave };
+            break;
+        default:
+            // EEPROM sits on the serial (joybus) lines, which this wiring doesn't reach
+            break;
+    }
+}
+
+void LoadAccessProfile(const char* directory, const uint16* header, struct DumpPlan* plan)
+{
+    uint32 crc1 = (uint32)header[8] << 16 | header[9];
+    uint32 crc2 = (uint32)header[10] << 16 | header[11];
+    char name[64];
+    char path[PATH_MAX];
+    snprintf(name, sizeof(name), PROFILE_NAME, crc1, crc2);
+    int pathLength = snprintf(path, sizeof(path), "%s/%s", directory, name);
+    if(pathLength < 0 || (size_t)pathLength >= sizeof(path))
+    {
+        fprintf(stderr, "Access profile path in %s too long, dumping linearly.\n", directory);
+        return;
+    }
+
+    FILE* profile = fopen(path, "r");
+    if(profile == NULL)
+    {
+        fprintf(stderr, "No access profile %s, dumping linearly.\n", path);
+        return;
+    }
+
+    uint32 pageCount = plan->romSize / ROM_PAGE_SIZE;
+    uint32* order = malloc(pageCount * sizeof(uint32));
+    uint8* ordered = calloc(pageCount, 1);
+    if(order == NULL || ordered == NULL)
+    {
+        fprintf(stderr, "Failed to allocate the page order, dumping linearly.\n");
+        free(order);
+        free(ordered);
+        fclose(profile);
+        return;
+    }
+
+    uint32 count = 0;
+    char line[256];
+    while(fgets(line, sizeof(line), profile) != NULL)
+    {
+        unsigned long long offset = 0;
+        unsigned long long length = 0;
+        if(line[0] == '#' || sscanf(line, "%llx %llx", &offset, &length) != 2)
+        {
+            continue;
+        }
+
+        for(unsigned long long index = offset / ROM_PAGE_SIZE;
+            index * ROM_PAGE_SIZE < offset + length && index < pageCount;
+            index++)
+        {
+            if(!ordered[index])
+            {
+                ordered[index] = 1;
+                order[count++] = index;
+            }
+        }
+    }
+    fclose(profile);
+
+    plan->bootPages = count;
+    for(uint32 index = 0;
+        index < pageCount;
+        index++)
+    {
+        if(!ordered[index])
+        {
+            order[count++] = index;
+        }
+    }
+    free(ordered);
+
+    plan->pageOrder = order;
+    fprintf(stderr, "Access profile %s puts %u boot pages first.\n", name, plan->bootPages);
+}
+
+void WriteWords(uint32 address, const uint16* words, uint count)
+{
+    SetAddress(address, LowerAddress);
+    LatchAddress(ALE_L);
+    SetAddress(address, UpperAddress);
+    LatchAddress(ALE_H);
+
+    for(uint word = 0;
+        word < count;
+        word++)
+    {
+        SetAddress(words[word], LowerAddress);
+        BusWrite(WRITE, ACTIVE(LOW));
+        mock_gpioDelay(1);
+        BusWrite(WRITE, INACTIVE(HIGH));
+    }
+}
+
+void PublishPage(uint32 index, const uint8* bytes)
+{
+    if(sharedImage.header == NULL)
+    {
+        return;
+    }
+
+    memcpy(sharedImage.image + (size_t)index * ROM_PAGE_SIZE, bytes, ROM_PAGE_SIZE);
+    SharedImagePublishPage(sharedImage.header, index);
+}
+
+int DumpRomOrdered(const struct DumpPlan* plan, FILE* output, uint32* crc)
+{
+    uint16 page[PAGE_WORDS];
+    uint8 bytes[ROM_PAGE_SIZE];
+    uint32 pageCount = plan->romSize / ROM_PAGE_SIZE;
+    uint32 progressStep = (pageCount + PROGRESS_STEPS - 1) / PROGRESS_STEPS;
+
+    for(uint32 done = 0;
+        done < pageCount;
+        done++)
+    {
+        uint32 index = plan->pageOrder[done];
+        const uint16* words = page;
+        if(checkpointPages != 0)
+        {
+            uint32 slot = done % checkpointPages;
+            if(slot == 0)
+            {
+                uint32 count = (pageCount - done < checkpointPages) ? pageCount - done : checkpointPages;
+                if(ReadCheckpointWindow(plan->pageOrder, done, count) != 0)
+                {
+                    return 1;
+                }
+            }
+            words = checkpointWindow[slot];
+        }
+        else if(ReadPage(CART_ROM_BASE + index * ROM_PAGE_SIZE, page) != 0)
+        {
+            return 1;
+        }
+
+        for(uint word = 0;
+            word < PAGE_WORDS;
+            word++)
+        {
+            bytes[word * 2] = words[word] >> 8;
+            bytes[word * 2 + 1] = words[word] & 0xFF;
+        }
+
+        PublishPage(index, bytes);
+        KeepRomPrefix(index * ROM_PAGE_SIZE, bytes);
+        if(output != NULL &&
+           (fseek(output, (long)index * ROM_PAGE_SIZE, SEEK_SET) != 0 ||
+            fwrite(bytes, 1, ROM_PAGE_SIZE, output) != ROM_PAGE_SIZE))
+        {
+            return 1;
+        }
+
+        if(done + 1 == plan->bootPages)
+        {
+            if(output != NULL)
+            {
+                fflush(output);
+            }
+            printf("boot-ready %u\n", plan->bootPages);
+            fflush(stdout);
+        }
+        if((done + 1) % progressStep == 0 || done + 1 == pageCount)
+        {
+            if(output != NULL)
+            {
+                fflush(output);
+            }
+            printf("progress %u %u\n", done + 1, pageCount);
+            fflush(stdout);
+        }
+    }
+
+    // The pages arrived out of order, so the CRC comes from the finished image
+    if(output == NULL)
+    {
+        *crc = Crc32Update(*crc, sharedImage.image, plan->romSize);
+        return 0;
+    }
+    if(fseek(output, 0, SEEK_SET) != 0)
+    {
+        return 1;
+    }
+    for(uint32 index = 0;
+        index < pageCount;
+        index++)
+    {
+        if(fread(bytes, 1, ROM_PAGE_SIZE, output) != ROM_PAGE_SIZE)
+        {
+            return 1;
+        }
+        *crc = Crc32Update(*crc, bytes, ROM_PAGE_SIZE);
+    }
+    return 0;
+}
+
+int DumpRange(const struct DumpRange* range, FILE* output, uint32* crc)
+{
+    uint16 page[PAGE_WORDS];
+    uint8 bytes[ROM_PAGE_SIZE];
+
+    for(uint32 offset = 0;
+        offset < range->length;
+        offset += ROM_PAGE_SIZE)
+    {
+        // Checkpointed ROM pages are read a window ahead and only then written out
+        const uint16* words = page;
+        if(range->kind == RangeRom && checkpointPages != 0)
+        {
+            uint32 done = offset / ROM_PAGE_SIZE;
+            uint32 slot = done % checkpointPages;
+            if(slot == 0)
+            {
+                uint32 remaining = (range->length - offset) / ROM_PAGE_SIZE;
+                if(ReadCheckpointWindow(NULL, done, (remaining < checkpointPages) ? remaining : checkpointPages) != 0)
+                {
+                    return 1;
+                }
+            }
+            words = checkpointWindow[slot];
+        }
+        else if(ReadPage(range->busAddress + offset, page) != 0)
+        {
+            return 1;
+        }
+
+        for(uint word = 0;
+            word < PAGE_WORDS;
+            word++)
+        {
+            bytes[word * 2] = words[word] >> 8;
+            bytes[word * 2 + 1] = words[word] & 0xFF;
+
+            if(output == NULL && sharedImage.header == NULL)
+            {
+                // ROM offsets keep the original 24-bit format; saves show the bus address
+                if(range->kind == RangeRom)
+                {
+                    printf("0x%06X: 0x%04X\n", offset + word * 2, words[word]);
+                }
+                else
+                {
+                    printf("0x%08X: 0x%04X\n", range->busAddress + offset + word * 2, words[word]);
+                }
+            }
+        }
+
+        *crc = Crc32Update(*crc, bytes, ROM_PAGE_SIZE);
+        if(range->kind == RangeRom)
+        {
+            PublishPage(offset / ROM_PAGE_SIZE, bytes);
+            KeepRomPrefix(offset, bytes);
+        }
+        if(output != NULL && fwrite(bytes, 1, ROM_PAGE_SIZE, output) != ROM_PAGE_SIZE)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int ExecutePlan(const struct DumpPlan* plan, const char* romPath, const char* savePath)
+{
+    FILE* romOutput = NULL;
+    FILE* saveOutput = NULL;
+    char derivedSavePath[PATH_MAX];
+
+    if(plan->entry != NULL)
+    {
+        fprintf(stderr, "Header matches %s, dumping 0x%X bytes (save %s).\n",
+                DatTitle(plan->entry), plan->romSize, saveTypeNames[plan->saveType]);
+    }
+    else
+    {
+        fprintf(stderr, "Header not in the DAT index, probed ROM size 0x%X bytes.\n", plan->romSize);
+    }
+
+    if(plan->saveType == SaveEeprom4k || plan->saveType == SaveEeprom16k)
+    {
+        fprintf(stderr, "EEPROM saves are on the serial bus and are not dumped.\n");
+    }
+
+    if(romPath != NULL)
+    {
+        romOutput = fopen(romPath, "w+b");
+        if(romOutput == NULL)
+        {
+            perror(romPath);
+            return 1;
+        }
+
+        if(savePath == NULL)
+        {
+            const char* extension = (plan->saveType == SaveFlash) ? "fla" : "sra";
+            int pathLength = snprintf(derivedSavePath, sizeof(derivedSavePath), "%s.%s", romPath, extension);
+            if(pathLength < 0 || (size_t)pathLength >= sizeof(derivedSavePath))
+            {
+                fprintf(stderr, "Save path for %s too long.\n", romPath);
+                fclose(romOutput);
+                return 1;
+            }
+            savePath = derivedSavePath;
+        }
+    }
+
+    int status = 0;
+    uint32 romCrc = 0;
+    uint32 saveCrc = 0;
+
+    for(uint range = 0;
+        range < plan->rangeCount && status == 0;
+        range++)
+    {
+        if(plan->ranges[range].kind == RangeRom)
+        {
+            if(plan->pageOrder != NULL && (romOutput != NULL || sharedImage.header != NULL))
+            {
+                status = DumpRomOrdered(plan, romOutput, &romCrc);
+            }
+            else
+            {
+                status = DumpRange(&plan->ranges[range], romOutput, &romCrc);
+            }
+            continue;
+        }
+
+        if(saveOutput == NULL && savePath != NULL)
+        {
+            saveOutput = fopen(savePath, "wb");
+            if(saveOutput == NULL)
+            {
+                perror(savePath);
+                status = 1;
+                break;
+            }
+        }
+
+        if(plan->saveType == SaveFlash)
+        {
+            // Put the FlashRAM into read-array mode before reading it like SRAM
+            static const uint16 readArray[2] = { 0xF000, 0x0000 };
+            WriteWords(FLASH_COMMAND_ADDRESS, readArray, 2);
+        }
+
+        status = DumpRange(&plan->ranges[range], saveOutput, &saveCrc);
+    }
+
+    if(romOutput != NULL && fclose(romOutput) != 0)
+    {
+        status = 1;
+    }
+    if(saveOutput != NULL && fclose(saveOutput) != 0)
+    {
+        status = 1;
+    }
+    if(status != 0)
+    {
+        fprintf(stderr, "Failed to read or write the dump.\n");
+        return 1;
+    }
+
+    if(verifyReads)
+    {
+        fprintf(stderr, "Verified reads: %llu retries.\n", (unsigned long long)readRetries);
+    }
+    ReportMajority();
+    ReportAdaptiveTiming();
+    ReportRecalibration();
+    if(readFailures > 0)
+    {
+        fprintf(stderr, "%llu pages never read back the same twice; the dump is not trustworthy.\n",
+                (unsigned long long)readFailures);
+        return 1;
+    }
+
+    // Identify the finished dump by its CRC32
+    uint8 crcKey[4] = { romCrc >> 24, romCrc >> 16, romCrc >> 8, romCrc };
+    const struct DatEntry* dumped = DatLookup(DatKeyCrc32, crcKey, sizeof(crcKey));
+    if(dumped != NULL)
+    {
+        fprintf(stderr, "CRC32 %08X matches %s.\n", romCrc, DatTitle(dumped));
+    }
+    else if(datIndex.header != NULL)
+    {
+        fprintf(stderr, "CRC32 %08X is not in the DAT index.\n", romCrc);
+    }
+
+    ReportHeaderChecksum(plan);
+    return 0;
+}
+
+void WaveSamples(const gpioSample_t* samples, int count)
+{
+    if(!__atomic_load_n(&waveCapture.active, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+
+    for(int sample = 0;
+        sample < count;
+        sample++)
+    {
+        int readActive = ((samples[sample].level >> READ) & 1) == ACTIVE(LOW);
+
+        if(__atomic_load_n(&busTrace.enabled, __ATOMIC_RELAXED))
+        {
+            uint32 sampled = pinMap.adMask | (1u << READ);
+            busTrace.levels = (busTrace.levels & ~sampled) | (samples[sample].level & sampled);
+            BusTraceRecord((uint64)(uint32)(samples[sample].tick - busTrace.startTick) * 1000, 1);
+        }
+
+        if(readActive)
+        {
+            waveCapture.lastLevel = samples[sample].level;
+            waveCapture.inStrobe = 1;
+        }
+        else if(waveCapture.inStrobe)
+        {
+            waveCapture.inStrobe = 0;
+            uint captured = __atomic_load_n(&waveCapture.words, __ATOMIC_RELAXED);
+            if(captured < PAGE_WORDS)
+            {
+                waveCapture.page[captured] = GatherDataBus(waveCapture.lastLevel);
+                __atomic_store_n(&waveCapture.words, captured + 1, __ATOMIC_RELEASE);
+            }
+        }
+    }
+}
+
+void SmiSetup(const struct SmiInterface* smi)
+{
+    uint32 strobe = (busTiming.strobeNs + SMI_CLOCK_NS - 1) / SMI_CLOCK_NS;
+    uint32 hold = (busTiming.recoveryNs + SMI_CLOCK_NS - 1) / SMI_CLOCK_NS;
+    uint32 setup = SMI_READ_SETUP;
+
+    strobe = (strobe < 1) ? 1 : (strobe > SMI_DSR_STROBE_MAX) ? SMI_DSR_STROBE_MAX : strobe;
+    hold = (hold < 1) ? 1 : (hold > SMI_DSR_HOLD_MAX) ? SMI_DSR_HOLD_MAX : hold;
+
+    smi->write(SMI_CS, 0);
+    smi->write(SMI_DSR0, (SMI_DSR_WIDTH_16 << SMI_DSR_WIDTH_SHIFT) |
+                         (setup << SMI_DSR_SETUP_SHIFT) |
+                         (hold << SMI_DSR_HOLD_SHIFT) |
+                         (strobe << SMI_DSR_STROBE_SHIFT));
+    smi->write(SMI_DMC, smi->transfer != NULL ?
+                        SMI_DMC_DMAEN | (SMI_DMC_PANICR << 18) | (SMI_DMC_REQR << 6) : 0);
+    smi->write(SMI_CS, SMI_CS_ENABLE | SMI_CS_CLEAR | (smi->transfer != NULL ? SMI_CS_PXLDAT : 0));
+}
+
+uint SmiFifoTransfer(const struct SmiInterface* smi, uint16* words, uint count)
+{
+    uint received = 0;
+    uint idlePolls = 0;
+
+    while(received < count && idlePolls < SMI_POLL_LIMIT)
+    {
+        if(smi->read(SMI_CS) & SMI_CS_RXD)
+        {
+            words[received++] = smi->read(SMI_D) & 0xFFFF;
+            idlePolls = 0;
+        }
+        else
+        {
+            idlePolls++;
+        }
+    }
+    return received;
+}
+
+int SmiReadBurst(const struct SmiInterface* smi, uint16* words, uint count)
+{
+    uint32 mode = SMI_CS_ENABLE | (smi->transfer != NULL ? SMI_CS_PXLDAT : 0);
+
+    smi->write(SMI_CS, mode | SMI_CS_CLEAR);
+    smi->write(SMI_L, count);
+    smi->write(SMI_A, 0);
+    smi->write(SMI_CS, mode | SMI_CS_START);
+
+    uint received = (smi->transfer != NULL) ? smi->transfer(words, count)
+                                            : SmiFifoTransfer(smi, words, count);
+
+    uint polls = 0;
+    while(!(smi->read(SMI_CS) & SMI_CS_DONE) && polls++ < SMI_POLL_LIMIT)
+    {
+    }
+
+    // Acknowledge completion
+    smi->write(SMI_CS, mode | SMI_CS_DONE);
+    return (received == count && polls < SMI_POLL_LIMIT) ? 0 : 1;
+}
+
+struct SmiInterface smiInterface = { ModelSmiRead, ModelSmiWrite, NULL };
+
+int SmiReadPage(uint32 address, uint16* words)
+{
+    SetADBusPinsMode(PI_OUTPUT);
+    SetAddress(address, LowerAddress);
+    LatchAddress(ALE_L);
+    SetAddress(address, UpperAddress);
+    LatchAddress(ALE_H);
+    SetADBusPinsMode(PI_ALT1);
+
+    if(SmiReadBurst(&smiInterface, words, PAGE_WORDS) != 0)
+    {
+        fprintf(stderr, "SMI burst at 0x%08X did not complete.\n", address);
+        return 1;
+    }
+    return 0;
+}
+
+int LoadPinMap(const char* path)
+{
+  FILE* file = fopen(path, "r");
+  if(file == NULL)
+  {
+    perror(path);
+    return 1;
+  }
+
+  char line[256];
+  uint lineNumber = 0;
+  int status = 0;
+
+  while(status == 0 && fgets(line, sizeof(line), file) != NULL)
+  {
+    lineNumber++;
+    line[strcspn(line, "#\r\n")] = '\0';
+
+    char signal[16];
+    uint gpio = 0;
+    int fields = sscanf(line, "%15s %u", signal, &gpio);
+    if(fields <= 0)
+    {
+      continue;
+    }
+
+    uint bit = 0;
+    uint* target = NULL;
+    if(fields == 2 && sscanf(signal, "AD%u", &bit) == 1 && bit < 16)
+    {
+      target = &pinMap.ad[bit];
+    }
+    else if(fields == 2 && strcmp(signal, "ALE_L") == 0)
+    {
+      target = &pinMap.aleLow;
+    }
+    else if(fields == 2 && strcmp(signal, "ALE_H") == 0)
+    {
+      target = &pinMap.aleHigh;
+    }
+    else if(fields == 2 && strcmp(signal, "READ") == 0)
+    {
+      target = &pinMap.read;
+    }
+    else if(fields == 2 && strcmp(signal, "WRITE") == 0)
+    {
+      target = &pinMap.write;
+    }
+    else if(fields == 2 && strcmp(signal, "RESET") == 0)
+    {
+      target = &pinMap.reset;
+    }
+
+    if(target == NULL || gpio > MAX_GPIO)
+    {
+      fprintf(stderr, "%s:%u: expected \"<AD0-AD15|ALE_L|ALE_H|READ|WRITE|RESET> <gpio 0-%d>\".\n",
+              path, lineNumber, MAX_GPIO);
+      status = 1;
+    }
+    else
+    {
+      *target = gpio;
+    }
+  }
+
+  fclose(file);
+  return status;
+}
+
+int FinishPinMap(void)
+{
+  uint32 used = 0;
+  uint pins[21];
+  memcpy(pins, pinMap.ad, sizeof(pinMap.ad));
+  pins[16] = pinMap.aleLow;
+  pins[17] = pinMap.aleHigh;
+  pins[18] = pinMap.read;
+  pins[19] = pinMap.write;
+  pins[20] = pinMap.reset;
+
+  for(uint pin = 0;
+      pin < 21;
+      pin++)
+  {
+    if(pins[pin] > MAX_GPIO || (used >> pins[pin]) & 0x1)
+    {
+      fprintf(stderr, "Pin map assigns GPIO%u twice or out of range.\n", pins[pin]);
+      return 1;
+    }
+    used |= 1u << pins[pin];
+  }
+
+  pinMap.adMask = 0;
+  pinMap.contiguous = (pinMap.ad[0] + 15 <= MAX_GPIO);
+  memset(pinMap.gather, 0, sizeof(pinMap.gather));
+
+  for(uint bitOffset = 0;
+      bitOffset < 16;
+      bitOffset++)
+  {
+    uint gpio = pinMap.ad[bitOffset];
+    pinMap.adMask |= 1u << gpio;
+    pinMap.contiguous &= (gpio == pinMap.ad[0] + bitOffset);
+
+    // Every level byte value with this GPIO's bit set carries this data bit
+    for(uint value = 0;
+        value < 256;
+        value++)
+    {
+      if((value >> (gpio % 8)) & 0x1)
+      {
+        pinMap.gather[gpio / 8][value] |= 1u << bitOffset;
+      }
+    }
+  }
+  return 0;
+}
+
+uint16 GatherDataBus(uint32 levels)
+{
+  if(pinMap.contiguous)
+  {
+    return (levels >> pinMap.ad[0]) & 0xFFFF;
+  }
+
+  return pinMap.gather[0][levels & 0xFF] |
+         pinMap.gather[1][(levels >> 8) & 0xFF] |
+         pinMap.gather[2][(levels >> 16) & 0xFF] |
+         pinMap.gather[3][levels >> 24];
+}
+
+struct CartCache
+{
+  struct { uint32 romSize; } plan;
+  uint8* image;
+  uint8* present;
+  uint32 pageCount;
+  uint32 presentCount;
+  pthread_mutex_t busLock;
+  pthread_mutex_t stateLock;
+  uint32 nextPage;
+  uint32 readAhead;
+  int waiting;
+};
+
+struct CartCache cartCache = {
+  .busLock = PTHREAD_MUTEX_INITIALIZER,
+  .stateLock = PTHREAD_MUTEX_INITIALIZER
+};
+
+int CartCacheFetch(uint32 firstPage, uint32 count)
+{
+    int status = 0;
+    uint16 page[PAGE_WORDS];
+
+    pthread_mutex_lock(&cartCache.busLock);
+    for(uint32 index = firstPage;
+        index < firstPage + count && index < cartCache.pageCount;
+        index++)
+    {
+        if(__atomic_load_n(&cartCache.present[index], __ATOMIC_ACQUIRE))
+        {
+            continue;
+        }
+
+        if(ReadPage(CART_ROM_BASE + index * ROM_PAGE_SIZE, page) != 0)
+        {
+            status = 1;
+            break;
+        }
+
+        uint8* bytes = cartCache.image + (size_t)index * ROM_PAGE_SIZE;
+        for(uint word = 0;
+            word < PAGE_WORDS;
+            word++)
+        {
+            bytes[word * 2] = page[word] >> 8;
+            bytes[word * 2 + 1] = page[word] & 0xFF;
+        }
+
+        __atomic_store_n(&cartCache.present[index], 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&cartCache.presentCount, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&cartCache.busLock);
+    return status;
+}
+
+int CartCacheRead(uint8* buffer, size_t size, uint64 offset)
+{
+    if(offset >= cartCache.plan.romSize || size == 0)
+    {
+        return 0;
+    }
+    if(size > cartCache.plan.romSize - offset)
+    {
+        size = cartCache.plan.romSize - offset;
+    }
+
+    uint32 firstPage = offset / ROM_PAGE_SIZE;
+    uint32 lastPage = (offset + size - 1) / ROM_PAGE_SIZE;
+
+    pthread_mutex_lock(&cartCache.stateLock);
+    if(firstPage == cartCache.nextPage || firstPage + 1 == cartCache.nextPage)
+    {
+        if(cartCache.readAhead < CACHE_READ_AHEAD_MAX)
+        {
+            cartCache.readAhead *= 2;
+        }
+    }
+    else
+    {
+        cartCache.readAhead = CACHE_READ_AHEAD_MIN;
+    }
+    cartCache.nextPage = lastPage + 1;
+    uint32 readAhead = cartCache.readAhead;
+    pthread_mutex_unlock(&cartCache.stateLock);
+
+    for(uint32 index = firstPage;
+        index <= lastPage;
+        index++)
+    {
+        if(!__atomic_load_n(&cartCache.present[index], __ATOMIC_ACQUIRE))
+        {
+            // Hold the filler off the bus until this read has its pages
+            __atomic_add_fetch(&cartCache.waiting, 1, __ATOMIC_ACQ_REL);
+            CartCacheFetch(index, lastPage - index + 1 + readAhead);
+            __atomic_sub_fetch(&cartCache.waiting, 1, __ATOMIC_ACQ_REL);
+            break;
+        }
+    }
+
+    for(uint32 index = firstPage;
+        index <= lastPage;
+        index++)
+    {
+        if(!__atomic_load_n(&cartCache.present[index], __ATOMIC_ACQUIRE))
+        {
+            return -EIO;
+        }
+    }
+
+    memcpy(buffer, cartCache.image + offset, size);
+    return size;
+}
+
+struct ArchiveJob
+{
+  char romPath[PATH_MAX];
+  char savePath[PATH_MAX];
+  const char* saveExtension;
+  char name[64];
+  uint16 cic;
+  int status;
+};
+
+struct Archiver
+{
+  const char* directory;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  struct ArchiveJob job;
+  int pending;
+  int stopping;
+};
+
+struct Archiver archiver = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .changed = PTHREAD_COND_INITIALIZER
+};
+volatile sig_atomic_t daemonStopping = 0;
+
+void DaemonStop(int signalNumber)
+{
+    (void)signalNumber;
+    daemonStopping = 1;
+}
+
+int WaitForCart(uint16* header, int inserted)
+{
+    uint16 words[PAGE_WORDS];
+    uint16 previous[PAGE_WORDS];
+    uint stable = 0;
+
+    while(!daemonStopping)
+    {
+        // A transfer that fell short says nothing about the slot
+        if(busReadPage(CART_ROM_BASE, words) != 0)
+        {
+            mock_gpioDelay(DAEMON_POLL_US);
+            continue;
+        }
+        if(inserted)
+        {
+            int valid = (((uint32)words[0] << 16 | words[1]) == Z64_MAGIC);
+            stable = !valid ? 0 : (stable > 0 && memcmp(words, previous, sizeof(words)) == 0) ? stable + 1 : 1;
+            memcpy(previous, words, sizeof(words));
+            if(stable >= DAEMON_STABLE_POLLS)
+            {
+                memcpy(header, words, sizeof(words));
+                return 0;
+            }
+        }
+        else
+        {
+            stable = (memcmp(words, header, sizeof(words)) != 0) ? stable + 1 : 0;
+            if(stable >= DAEMON_STABLE_POLLS)
+            {
+                return 0;
+            }
+        }
+        mock_gpioDelay(DAEMON_POLL_US);
+    }
+    return 1;
+}
+
+int ResetDumpState(const struct BusTiming* timing)
+{
+    romPrefixLength = 0;
+    readRetries = 0;
+    readFailures = 0;
+    majorityPages = 0;
+    memset(lineDisagreements, 0, sizeof(lineDisagreements));
+    memset(timingRegions, 0, sizeof(timingRegions));
+    referenceRead = 0;
+    recalibrations = 0;
+    cartResets = 0;
+
+    baseTiming = *timing;
+    timingPermille = 0;
+    return SetTimingScale(1000);
+}
+
+void QueueArchive(const struct ArchiveJob* job)
+{
+    pthread_mutex_lock(&archiver.lock);
+    while(archiver.pending)
+    {
+        pthread_cond_wait(&archiver.changed, &archiver.lock);
+    }
+    archiver.job = *job;
+    archiver.pending = 1;
+    pthread_cond_broadcast(&archiver.changed);
+    pthread_mutex_unlock(&archiver.lock);
+}
+
+void ArchiveDump(const struct ArchiveJob* job)
+{
+    uint8 digest[SHA1_SIZE] = { 0 };
+    char digestText[SHA1_SIZE * 2 + 1];
+    uint32 crc = 0;
+    size_t size = 0;
+
+    const uint8* image = (job->romPath[0] != '\0') ? MapImage(job->romPath, &size) : NULL;
+    if(image != NULL)
+    {
+        struct Sha1 sha1;
+        Sha1Init(&sha1);
+        Sha1Update(&sha1, image, size);
+        Sha1Final(&sha1, digest);
+        crc = Crc32Update(0, image, size);
+        munmap((void*)image, size);
+    }
+    for(uint byte = 0;
+        byte < SHA1_SIZE;
+        byte++)
+    {
+        sprintf(digestText + byte * 2, "%02x", digest[byte]);
+    }
+
+    const struct DatEntry* entry = (image != NULL) ? DatLookup(DatKeySha1, digest, SHA1_SIZE) : NULL;
+    int failed = (job->status != 0 || image == NULL);
+    const char* state = failed ? "failed" : (entry != NULL) ? "verified" : (job->cic == 0) ? "bad-checksum" : "unknown";
+
+    char base[256];
+    snprintf(base, sizeof(base), "%s%s", (entry != NULL) ? DatTitle(entry) : job->name, failed ? " (failed)" : "");
+    for(char* character = base;
+        *character != '\0';
+        character++)
+    {
+        *character = (*character == '/') ? '_' : *character;
+    }
+
+    // An empty or missing staging file leaves nothing to file, only the failure to log
+    if(image == NULL && job->romPath[0] != '\0')
+    {
+        unlink(job->romPath);
+        if(job->savePath[0] != '\0')
+        {
+            unlink(job->savePath);
+        }
+    }
+
+    char stem[300] = "-";
+    char file[sizeof(stem) + 4] = "-";
+    char target[PATH_MAX];
+    int filed = 0;
+    for(uint copy = 1;
+        image != NULL && !filed;
+        copy++)
+    {
+        if(copy == 1)
+        {
+            snprintf(stem, sizeof(stem), "%s", base);
+        }
+        else
+        {
+            snprintf(stem, sizeof(stem), "%s (%u)", base, copy);
+        }
+        int targetLength = snprintf(target, sizeof(target), "%s/%s.z64", archiver.directory, stem);
+        if(targetLength < 0 || (size_t)targetLength >= sizeof(target))
+        {
+            fprintf(stderr, "Archive path for %s too long.\n", stem);
+            break;
+        }
+        if(link(job->romPath, target) == 0)
+        {
+            snprintf(file, sizeof(file), "%s.z64", stem);
+            unlink(job->romPath);
+            filed = 1;
+        }
+        else if(errno != EEXIST)
+        {
+            perror(target);
+            break;
+        }
+    }
+
+    if(filed && job->savePath[0] != '\0' && access(job->savePath, F_OK) == 0)
+    {
+        char saveTarget[PATH_MAX];
+        int saveLength = snprintf(saveTarget, sizeof(saveTarget), "%s/%s.%s", archiver.directory, stem, job->saveExtension);
+        if(saveLength < 0 || (size_t)saveLength >= sizeof(saveTarget))
+        {
+            fprintf(stderr, "Archive path for %s.%s too long.\n", stem, job->saveExtension);
+        }
+        else if(link(job->savePath, saveTarget) == 0)
+        {
+            unlink(job->savePath);
+        }
+        else
+        {
+            perror(saveTarget);
+        }
+    }
+
+    char manifestPath[PATH_MAX];
+    int manifestLength = snprintf(manifestPath, sizeof(manifestPath), "%s/%s", archiver.directory, ARCHIVE_MANIFEST);
+    FILE* manifest = NULL;
+    if(manifestLength < 0 || (size_t)manifestLength >= sizeof(manifestPath))
+    {
+        fprintf(stderr, "Manifest path in %s too long.\n", archiver.directory);
+    }
+    else if((manifest = fopen(manifestPath, "a")) == NULL)
+    {
+        perror(manifestPath);
+    }
+    else
+    {
+        int written = fprintf(manifest, "%s %08X %u %u %s %s\n", digestText, crc, (uint)size, job->cic, state, file);
+        if(fclose(manifest) != 0 || written < 0)
+        {
+            perror(manifestPath);
+        }
+    }
+    if(image == NULL)
+    {
+        fprintf(stderr, "Logged %s as failed, nothing dumped.\n", job->name);
+    }
+    else if(!filed)
+    {
+        fprintf(stderr, "Logged %s (%s, SHA-1 %s), left staged as %s.\n", job->name, state, digestText, job->romPath);
+    }
+    else
+    {
+        fprintf(stderr, "Archived %s (%s, SHA-1 %s).\n", file, state, digestText);
+    }
+}
+
+void* ArchiverThread(void* unused)
+{
+    (void)unused;
+
+    pthread_mutex_lock(&archiver.lock);
+    while(1)
+    {
+        while(!archiver.pending && !archiver.stopping)
+        {
+            pthread_cond_wait(&archiver.changed, &archiver.lock);
+        }
+        if(!archiver.pending)
+        {
+            break;
+        }
+
+        struct ArchiveJob job = archiver.job;
+        pthread_mutex_unlock(&archiver.lock);
+        ArchiveDump(&job);
+        pthread_mutex_lock(&archiver.lock);
+        archiver.pending = 0;
+        pthread_cond_broadcast(&archiver.changed);
+    }
+    pthread_mutex_unlock(&archiver.lock);
+    return NULL;
+}
+
+int RunDaemon(const char* directory, const char* profileDirectory, int selfTest)
+{
+    struct BusTiming timing = baseTiming;
+    uint16 header[PAGE_WORDS];
+    uint serial = 0;
+    int status = 0;
+
+    archiver.directory = directory;
+    if(pthread_create(&archiver.thread, NULL, ArchiverThread, NULL) != 0)
+    {
+        fprintf(stderr, "Failed to start the archiver.\n");
+        return 1;
+    }
+    mock_gpioSetSignalFunc(SIGINT, DaemonStop);
+    mock_gpioSetSignalFunc(SIGTERM, DaemonStop);
+    fprintf(stderr, "Waiting for carts, archiving to %s.\n", directory);
+
+    while(WaitForCart(header, 1) == 0)
+    {
+        struct ArchiveJob job;
+        struct DumpPlan plan;
+        uint16 suspects;
+
+        if(ResetDumpState(&timing) != 0)
+        {
+            status = 1;
+            break;
+        }
+        HeaderName(header, job.name, sizeof(job.name));
+        fprintf(stderr, "Cart %s inserted.\n", job.name);
+
+        // Self-testing is bit-banged, so the backend hands the pins over meanwhile
+        int tested = 0;
+        if(selfTest)
+        {
+            if(busTerminate != NULL)
+            {
+                busTerminate();
+            }
+            SetupBusPins();
+            tested = SelfTestBus(&suspects);
+            if(busInit != NULL && busInit() != 0)
+            {
+                status = 1;
+                break;
+            }
+        }
+
+        // A cart failing its self-test is still logged, as failed with no image
+        job.romPath[0] = '\0';
+        job.savePath[0] = '\0';
+        job.saveExtension = "sra";
+        job.cic = 0;
+        job.status = 1;
+        if(tested == 0)
+        {
+            int romLength = snprintf(job.romPath, sizeof(job.romPath), "%s/.incoming-%u.z64", directory, serial++);
+            if(romLength < 0 || (size_t)romLength >= sizeof(job.romPath))
+            {
+                fprintf(stderr, "Archive directory path %s too long.\n", directory);
+                status = 1;
+                break;
+            }
+
+            PlanDump(header, &plan);
+            if(profileDirectory != NULL)
+            {
+                LoadAccessProfile(profileDirectory, header, &plan);
+            }
+            job.status = ExecutePlan(&plan, job.romPath, NULL);
+            free(plan.pageOrder);
+
+            // ExecutePlan derived the same path and failed the dump if it didn't fit
+            job.saveExtension = (plan.saveType == SaveFlash) ? "fla" : "sra";
+            int saveLength = snprintf(job.savePath, sizeof(job.savePath), "%s.%s", job.romPath, job.saveExtension);
+            if(saveLength < 0 || (size_t)saveLength >= sizeof(job.savePath))
+            {
+                job.savePath[0] = '\0';
+            }
+            job.cic = (romPrefixLength >= CHECKSUM_END) ? IdentifyCic(romPrefix) : 0;
+        }
+        QueueArchive(&job);
+
+        // The removal polls run at the base timing, on a backend rebuilt if a retime failed
+        if(ResetDumpState(&timing) != 0)
+        {
+            status = 1;
+            break;
+        }
+        fprintf(stderr, "Remove the cart.\n");
+        if(WaitForCart(header, 0) != 0)
+        {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&archiver.lock);
+    archiver.stopping = 1;
+    pthread_cond_broadcast(&archiver.changed);
+    pthread_mutex_unlock(&archiver.lock);
+    pthread_join(archiver.thread, NULL);
+    return status;
+}
+
+// Unit tests
+void test_SetADBusPinsMode(void)
+{
+    printf("Testing SetADBusPinsMode...\n");
+
+    SetADBusPinsMode(PI_INPUT);
+    for(uint pin = AD_BUS;
+        pin < AD_BUS + 16;
+        pin++)
+    {
+        assert(gpio_set_mode[pin] == PI_INPUT);
+    }
+
+    SetADBusPinsMode(PI_OUTPUT);
+    for(uint pin = AD_BUS;
+        pin < AD_BUS + 16;
+        pin++)
+    {
+        assert(gpio_set_mode[pin] == PI_OUTPUT);
+    }
+
+    // Only the mapped AD lines turn around
+    struct PinMap saved = pinMap;
+    static const uint scattered[16] = { 27, 26, 4, 7, 6, 3, 8, 5, 10, 11, 12, 13, 14, 15, 16, 17 };
+    memcpy(pinMap.ad, scattered, sizeof(scattered));
+    SetADBusPinsMode(PI_INPUT);
+    for(uint bitOffset = 0;
+        bitOffset < 16;
+        bitOffset++)
+    {
+        assert(gpio_set_mode[scattered[bitOffset]] == PI_INPUT);
+    }
+    assert(gpio_set_mode[AD_BUS] == PI_OUTPUT && gpio_set_mode[AD_BUS + 7] == PI_OUTPUT);
+    SetADBusPinsMode(PI_OUTPUT);
+    pinMap = saved;
+    printf("SetADBusPinsMode passed.\n\n");
+}
+
+void test_GpioRegisters(void)
+{
+    printf("Testing GpioRegisters...\n");
+
+    uint32 registers[GPIO_MEM_SIZE / 4];
+    uint modes[sizeof(gpio_set_mode) / sizeof(gpio_set_mode[0])];
+    uint levels[sizeof(gpio_write) / sizeof(gpio_write[0])];
+    memcpy(modes, gpio_set_mode, sizeof(modes));
+    memcpy(levels, gpio_write, sizeof(levels));
+    memset(registers, 0, sizeof(registers));
+    registers[GPIO_FSEL / 4 + 2] = 0xFFFFFFFF;
+    gpioRegisters = registers;
+
+    // Function selects: 3 bits per GPIO, neighbours untouched
+    SetupBusPins();
+    assert(registers[GPIO_FSEL / 4] == 0x09249240); // GPIO2-9 output
+    assert(registers[GPIO_FSEL / 4 + 1] == 0x09249249); // GPIO10-19 output
+    assert(registers[GPIO_FSEL / 4 + 2] == 0xFFFFFE49); // GPIO20-22 output, GPIO23+ as they were
+    SetADBusPinsMode(PI_INPUT);
+    assert(registers[GPIO_FSEL / 4] == 0x00000000);
+    assert(registers[GPIO_FSEL / 4 + 1] == 0x09000000); // ALE_L, ALE_H stay outputs
+    assert(registers[GPIO_FSEL / 4 + 2] == 0xFFFFFE49);
+
+    // Set and clear registers take only the bits to change
+    BusWrite(READ, LOW);
+    assert(registers[GPIO_CLR / 4] == 1u << READ);
+    BusWrite(RESET, HIGH);
+    assert(registers[GPIO_SET / 4] == 1u << RESET);
+    BusWriteSet(0x0000F00C);
+    assert(registers[GPIO_SET / 4] == 0x0000F00C);
+    BusWriteClear(0x00030000);
+    assert(registers[GPIO_CLR / 4] == 0x00030000);
+
+    registers[GPIO_LEV / 4] = 0x0012345C;
+    assert(BusReadLevels() == 0x0012345C);
+    assert(GatherDataBus(BusReadLevels()) == 0x8D17);
+
+    // Nothing reached pigpio
+    assert(memcmp(modes, gpio_set_mode, sizeof(modes)) == 0);
+    assert(memcmp(levels, gpio_write, sizeof(levels)) == 0);
+
+    gpioRegisters = NULL;
+    SetupBusPins();
+    printf("GpioRegisters passed.\n\n");
+}
+
+void test_BuildAddressMasks(void)
+{
+    printf("Testing BuildAddressMasks...\n");
+
+    BuildAddressMasks();
+
+    uint32 adPins = 0xFFFFu << AD_BUS;
+    for(uint lane = 0;
+        lane < 2;
+        lane++)
+    {
+        uint32 lanePins = 0xFFu << (AD_BUS + lane * 8);
+        for(uint value = 0;
+            value < 256;
+            value++)
+        {
+            const struct AddressMasks* masks = &addressMasks[lane][value];
+            assert((masks->set & masks->clear) == 0);
+            assert((masks->set | masks->clear) == lanePins);
+            assert((masks->set & ~adPins) == 0);
+            assert(masks->set == ((uint32)value << (AD_BUS + lane * 8)));
+        }
+    }
+
+    // A --pins board can route the AD lines to any GPIOs, in any order
+    struct PinMap saved = pinMap;
+    static const uint scattered[16] = { 27, 3, 26, 4, 25, 5, 24, 6, 23, 7, 17, 8, 16, 9, 15, 10 };
+    memcpy(pinMap.ad, scattered, sizeof(scattered));
+    BuildAddressMasks();
+
+    for(uint lane = 0;
+        lane < 2;
+        lane++)
+    {
+        uint32 lanePins = 0;
+        for(uint bitOffset = 0;
+            bitOffset < 8;
+            bitOffset++)
+        {
+            lanePins |= 1u << scattered[lane * 8 + bitOffset];
+        }
+        for(uint value = 0;
+            value < 256;
+            value++)
+        {
+            uint32 set = 0;
+            for(uint bitOffset = 0;
+                bitOffset < 8;
+                bitOffset++)
+            {
+                set |= ((value >> bitOffset) & 0x1) ? 1u << scattered[lane * 8 + bitOffset] : 0;
+            }
+            assert(addressMasks[lane][value].set == set);
+            assert(addressMasks[lane][value].clear == (lanePins & ~set));
+        }
+    }
+    assert(addressMasks[0][0x05].set == ((1u << 27) | (1u << 26)));
+    assert(addressMasks[0][0x05].clear == ((1u << 3) | (1u << 4) | (1u << 25) | (1u << 5) | (1u << 24) | (1u << 6)));
+    assert(addressMasks[1][0x80].set == (1u << 10));
+    assert(addressMasks[1][0x80].clear == ((1u << 23) | (1u << 7) | (1u << 17) | (1u << 8) | (1u << 16) | (1u << 9) | (1u << 15)));
+
+    pinMap = saved;
+    BuildAddressMasks();
+
+    printf("BuildAddressMasks passed.\n\n");
+}
+
+void test_SetAddress(void)
+{
+    printf("Testing SetAddress...\n");
+
+    uint32 address = 0x10123456;
+
+    SetAddress(address, LowerAddress);
+    for(uint bitOffset = 0; 
+        bitOffset < 16; 
+        bitOffset++)
+    {
+        uint expectedBit = (address >> bitOffset) & 0x1;
+        assert(gpio_write[AD_BUS + bitOffset] == expectedBit);
+    }
+
+    SetAddress(address, UpperAddress);
+    for(uint bitOffset = 0;
+        bitOffset < 16;
+        bitOffset++)
+    {
+        uint expectedBit = ((address >> (16 + bitOffset)) & 0x1);
+        assert(gpio_write[AD_BUS + bitOffset] == (expectedBit));
+    }
+
+    printf("SetAddress passed.\n\n");
+}
+
+void test_LatchAddress(void)
+{
+    printf("Testing LatchAddress...\n");
+
+    LatchAddress(ALE_L);
+    assert(gpio_write[ALE_L] == INACTIVE(LOW));
+
+    LatchAddress(ALE_H);
+    assert(gpio_write[ALE_H] == INACTIVE(LOW));
+
+    printf("LatchAddress passed.\n\n");
+}
+
+void test_ReadPage(void)
+{
+    printf("Testing ReadPage...\n");
+
+    uint16 page[PAGE_WORDS];
+    ReadPage(0x000200, page);
+
+    for(uint word = 0;
+        word < PAGE_WORDS;
+        word++)
+    {
+        for(uint bitOffset = 0;
+            bitOffset < 16;
+            bitOffset++)
+        {
+            assert(((page[word] >> bitOffset) & 0x1) == (AD_BUS + bitOffset) % 2);
+        }
+    }
+
+    assert(gpio_write[READ] == INACTIVE(HIGH));
+    assert(gpio_set_mode[AD_BUS] == PI_OUTPUT);
+
+    printf("ReadPage passed.\n\n");
+}
+
+void test_FingerprintSampleAddress(void)
+{
+    printf("Testing FingerprintSampleAddress...\n");
+
+    assert(FingerprintSampleAddress(0) == 0);
+
+    for(uint sample = 0;
+        sample < FINGERPRINT_SAMPLES;
+        sample++)
+    {
+        uint32 address = FingerprintSampleAddress(sample);
+        assert(address % ROM_PAGE_SIZE == 0);
+        assert(address / FINGERPRINT_STRIDE == sample); // One sample per stride
+        assert(address == FingerprintSampleAddress(sample)); // Deterministic
+        printf("sample %u: 0x%06X\n", sample, address);
+    }
+
+    printf("FingerprintSampleAddress passed.\n\n");
+}
+
+void test_DatTitleRevision(void)
+{
+    printf("Testing DatTitleRevision...\n");
+
+    assert(DatTitleRevision("Super Mario 64 (USA)") == 0);
+    assert(DatTitleRevision("Super Mario 64 (Japan) (Rev 3)") == 3);
+    assert(DatTitleRevision("GoldenEye 007 (Europe) (Rev A)") == 1);
+    assert(DatTitleRevision("Zelda (USA) (Rev B) (Beta)") == 2);
+
+    printf("DatTitleRevision passed.\n\n");
+}
+
+void test_Sha1(void)
+{
+    printf("Testing Sha1...\n");
+
+    static const struct
+    {
+        const char* message;
+        const char* digest;
+    } vectors[] = {
+        { "", "da39a3ee5e6b4b0d3255bfef95601890afd80709" },
+        { "abc", "a9993e364706816aba3e25717850c26c9cd0d89d" },
+        { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", "84983e441c3bd26ebaae4aa1f95129e5e54670f1" }
+    };
+
+    for(uint vector = 0;
+        vector < sizeof(vectors) / sizeof(vectors[0]);
+        vector++)
+    {
+        // Fed whole and a byte at a time, across the block boundaries
+        for(uint split = 0;
+            split < 2;
+            split++)
+        {
+            struct Sha1 sha1;
+            uint8 digest[SHA1_SIZE];
+            char text[SHA1_SIZE * 2 + 1];
+            size_t length = strlen(vectors[vector].message);
+
+            Sha1Init(&sha1);
+            for(size_t offset = 0;
+                offset < length;
+                offset += split ? 1 : length)
+            {
+                Sha1Update(&sha1, (const uint8*)vectors[vector].message + offset, split ? 1 : length);
+            }
+            Sha1Final(&sha1, digest);
+            for(uint byte = 0;
+                byte < SHA1_SIZE;
+                byte++)
+            {
+                sprintf(text + byte * 2, "%02x", digest[byte]);
+            }
+            assert(strcmp(text, vectors[vector].digest) == 0);
+        }
+    }
+
+    // A million 'a's, in uneven chunks
+    static uint8 million[1000000];
+    struct Sha1 sha1;
+    uint8 digest[SHA1_SIZE];
+    static const uint8 expected[SHA1_SIZE] = {
+        0x34, 0xaa, 0x97, 0x3c, 0xd4, 0xc4, 0xda, 0xa4, 0xf6, 0x1e,
+        0xeb, 0x2b, 0xdb, 0xad, 0x27, 0x31, 0x65, 0x34, 0x01, 0x6f
+    };
+    memset(million, 'a', sizeof(million));
+    Sha1Init(&sha1);
+    Sha1Update(&sha1, million, 37);
+    Sha1Update(&sha1, million + 37, sizeof(million) - 37);
+    Sha1Final(&sha1, digest);
+    assert(memcmp(digest, expected, SHA1_SIZE) == 0);
+
+    printf("Sha1 passed.\n\n");
+}
+
+void test_HeaderName(void)
+{
+    printf("Testing HeaderName...\n");
+
+    uint16 header[PAGE_WORDS];
+    char name[64];
+    memset(header, 0, sizeof(header));
+    header[8] = 0x635A;
+    header[9] = 0x2BFF;
+
+    const char* title = "SUPER MARIO 64      ";
+    for(uint byte = 0;
+        byte < 20;
+        byte++)
+    {
+        header[0x10 + byte / 2] |= (uint16)title[byte] << ((byte % 2 == 0) ? 8 : 0);
+    }
+    HeaderName(header, name, sizeof(name));
+    assert(strcmp(name, "SUPER MARIO 64-635A2BFF") == 0);
+
+    // Path separators can't escape the archive directory
+    header[0x10] = ('.' << 8) | '.';
+    header[0x11] = ('/' << 8) | 'X';
+    HeaderName(header, name, sizeof(name));
+    assert(strcmp(name, ".._XR MARIO 64-635A2BFF") == 0);
+
+    // Nothing printable falls back to a generic name
+    memset(&header[0x10], 0, 20);
+    HeaderName(header, name, sizeof(name));
+    assert(strcmp(name, "cart-635A2BFF") == 0);
+
+    printf("HeaderName passed.\n\n");
+}
+
+void test_BuildPerfectHash(void)
+{
+    printf("Testing BuildPerfectHash...\n");
+
+    uint32 keyCount = 4000;
+    uint32 bucketCount = keyCount / 4 + 1;
+    uint32 slotCount = keyCount + keyCount / 4 + 1;
+    struct DatKey* keys = calloc(keyCount, sizeof(*keys));
+
+    for(uint32 key = 0;
+        key < keyCount;
+        key++)
+    {
+        uint32 value = key * 0x9E3779B9;
+        keys[key].type = key % 4;
+        keys[key].entry = key;
+        keys[key].length = 4;
+        memcpy(keys[key].bytes, &value, 4);
+        keys[key].bucket = DatKeyHash(keys[key].type, keys[key].bytes, 4, 0) % bucketCount;
+    }
+
+    // Builder expects keys grouped by bucket
+    for(uint32 key = 1;
+        key < keyCount;
+        key++)
+    {
+        struct DatKey moving = keys[key];
+        uint32 position = key;
+        while(position > 0 && keys[position - 1].bucket > moving.bucket)
+        {
+            keys[position] = keys[position - 1];
+            position--;
+        }
+        keys[position] = moving;
+    }
+
+    uint32* displacements = malloc(sizeof(uint32) * bucketCount);
+    uint32* slots = malloc(sizeof(uint32) * slotCount);
+    assert(BuildPerfectHash(keys, keyCount, bucketCount, slotCount, displacements, slots));
+
+    // Every key resolves to the slot holding its own entry
+    for(uint32 key = 0;
+        key < keyCount;
+        key++)
+    {
+        uint32 seed = displacements[keys[key].bucket];
+        uint32 slot = DatKeyHash(keys[key].type, keys[key].bytes, 4, seed) % slotCount;
+        assert(slots[slot] == ((keys[key].entry << 2) | keys[key].type));
+    }
+
+    free(slots);
+    free(displacements);
+    free(keys);
+
+    printf("BuildPerfectHash passed.\n\n");
+}
+
+void test_WaveSamples(void)
+{
+    printf("Testing WaveSamples...\n");
+
+    uint32 idle = 1u << READ;
+    gpioSample_t samples[] = {
+        { 0, idle },
+        { 1, 0 }, // READ low, data not yet driven
+        { 2, 0x1234u << AD_BUS }, // Settled word 0
+        { 3, idle },
+        { 4, 0xBEEFu << AD_BUS }, // Word 1, single sample
+        { 5, idle | (0xBEEFu << AD_BUS) },
+        { 6, idle },
+    };
+
+    memset(&waveCapture, 0, sizeof(waveCapture));
+    WaveSamples(samples, 2); // Inactive capture ignores samples
+    assert(waveCapture.words == 0);
+
+    waveCapture.active = 1;
+    WaveSamples(samples, 3); // Batches may split a strobe
+    WaveSamples(samples + 3, 4);
+
+    assert(waveCapture.words == 2);
+    assert(waveCapture.page[0] == 0x1234);
+    assert(waveCapture.page[1] == 0xBEEF);
+
+    printf("WaveSamples passed.\n\n");
+}
+
+void test_SmiReadBurst(void)
+{
+    printf("Testing SmiReadBurst...\n");
+
+    struct SmiInterface fifo = { ModelSmiRead, ModelSmiWrite, NULL };
+    struct SmiInterface dma = { ModelSmiRead, ModelSmiWrite, ModelSmiTransfer };
+    uint16 page[PAGE_WORDS];
+
+    memset(&smiModel, 0, sizeof(smiModel));
+    SmiSetup(&fifo);
+    uint32 settings = smiModel.registers[SMI_DSR0 / 4];
+    assert((settings >> SMI_DSR_WIDTH_SHIFT) == SMI_DSR_WIDTH_16);
+    assert(((settings >> SMI_DSR_STROBE_SHIFT) & 0x7F) == busTiming.strobeNs / SMI_CLOCK_NS);
+    assert(((settings >> SMI_DSR_SETUP_SHIFT) & 0x3F) == SMI_READ_SETUP);
+    assert(smiModel.registers[SMI_DMC / 4] == 0); // CPU drains the FIFO
+
+    // Programmed I/O: every cycle of the burst lands in order
+    smiModel.limit = PAGE_WORDS;
+    assert(SmiReadBurst(&fifo, page, PAGE_WORDS) == 0);
+    for(uint word = 0;
+        word < PAGE_WORDS;
+        word++)
+    {
+        assert(page[word] == (word ^ 0xA5A5));
+    }
+
+    // DMA transfers enable the DMA request and pack the FIFO
+    SmiSetup(&dma);
+    assert(smiModel.registers[SMI_DMC / 4] & SMI_DMC_DMAEN);
+    assert(smiModel.registers[SMI_CS / 4] & SMI_CS_PXLDAT);
+    smiModel.address = 0;
+    smiModel.limit = PAGE_WORDS;
+    assert(SmiReadBurst(&dma, page, PAGE_WORDS) == 0);
+    assert(page[PAGE_WORDS - 1] == ((PAGE_WORDS - 1) ^ 0xA5A5));
+
+    // A stalled bus reports a short burst instead of hanging
+    smiModel.limit = 10;
+    assert(SmiReadBurst(&fifo, page, PAGE_WORDS) != 0);
+
+    // and fails the page, so ReadPage reads it again or gives up on it
+    SmiSetup(&smiInterface);
+    smiModel.address = 0;
+    smiModel.limit = 10;
+    assert(SmiReadPage(CART_ROM_BASE, page) == 1);
+    assert(gpio_set_mode[AD_PIN(0)] == PI_ALT1);
+    smiModel.limit = PAGE_WORDS;
+    assert(SmiReadPage(CART_ROM_BASE, page) == 0);
+    busReadPage = SmiReadPage;
+    readRetries = 0;
+    smiModel.limit = 0;
+    assert(ReadPage(CART_ROM_BASE, page) == 1);
+    assert(readRetries == READ_RETRIES);
+    smiModel.limit = PAGE_WORDS;
+    assert(ReadPage(CART_ROM_BASE, page) == 0);
+    assert(page[PAGE_WORDS - 1] == ((smiModel.address / 2 - 1) ^ 0xA5A5));
+    busReadPage = BitBangReadPage;
+    readRetries = 0;
+    SetADBusPinsMode(PI_OUTPUT);
+
+    printf("SmiReadBurst passed.\n\n");
+}
+
+void test_GatherDataBus(void)
+{
+    printf("Testing GatherDataBus...\n");
+
+    // Default layout: AD0-AD15 on GPIO2-17 takes the shift fast path
+    for(uint bitOffset = 0;
+        bitOffset < 16;
+        bitOffset++)
+    {
+        pinMap.ad[bitOffset] = AD_BUS + bitOffset;
+    }
+    pinMap.aleLow = ALE_L;
+    pinMap.aleHigh = ALE_H;
+    pinMap.read = READ;
+    pinMap.write = WRITE;
+    pinMap.reset = RESET;
+    assert(FinishPinMap() == 0);
+    assert(pinMap.contiguous);
+    assert(pinMap.adMask == (0xFFFFu << AD_BUS));
+    assert(GatherDataBus((0x8037u << AD_BUS) | (1u << READ)) == 0x8037);
+
+    // Scattered layout: swapped and reversed lines go through the gather tables
+    uint scattered[16] = { 27, 26, 4, 7, 6, 3, 8, 5, 10, 11, 12, 13, 14, 15, 16, 17 };
+    memcpy(pinMap.ad, scattered, sizeof(scattered));
+    assert(FinishPinMap() == 0);
+    assert(!pinMap.contiguous);
+
+    for(uint32 data = 0;
+        data < 0x10000;
+        data += 0x1357)
+    {
+        uint32 levels = (1u << READ) | (1u << ALE_L);
+        for(uint bitOffset = 0;
+            bitOffset < 16;
+            bitOffset++)
+        {
+            levels |= ((data >> bitOffset) & 0x1) << scattered[bitOffset];
+        }
+        assert(GatherDataBus(levels) == data);
+    }
+
+    // Two signals on one GPIO are rejected
+    pinMap.ad[3] = READ;
+    assert(FinishPinMap() != 0);
+
+    for(uint bitOffset = 0;
+        bitOffset < 16;
+        bitOffset++)
+    {
+        pinMap.ad[bitOffset] = AD_BUS + bitOffset;
+    }
+    assert(FinishPinMap() == 0);
+
+    printf("GatherDataBus passed.\n\n");
+}
+
+void test_CartCacheRead(void)
+{
+    printf("Testing CartCacheRead...\n");
+
+    cartCache.plan.romSize = 0x10000;
+    cartCache.pageCount = cartCache.plan.romSize / ROM_PAGE_SIZE;
+    cartCache.image = malloc(cartCache.plan.romSize);
+    cartCache.present = calloc(cartCache.pageCount, 1);
+    cartCache.readAhead = CACHE_READ_AHEAD_MIN;
+    cartCache.nextPage = 0xFFFFFFFF;
+
+    // A random read fetches its page plus the minimum window
+    uint8 buffer[ROM_PAGE_SIZE * 2];
+    assert(CartCacheRead(buffer, 16, 10 * ROM_PAGE_SIZE + 4) == 16);
+    assert(cartCache.presentCount == 1 + CACHE_READ_AHEAD_MIN);
+    assert(cartCache.present[10] && cartCache.present[14] && !cartCache.present[15]);
+
+    // Staying sequential doubles the window
+    assert(CartCacheRead(buffer, ROM_PAGE_SIZE, 11 * ROM_PAGE_SIZE) == ROM_PAGE_SIZE);
+    assert(cartCache.readAhead == CACHE_READ_AHEAD_MIN * 2);
+    assert(cartCache.presentCount == 1 + CACHE_READ_AHEAD_MIN);
+    assert(CartCacheRead(buffer, ROM_PAGE_SIZE, 12 * ROM_PAGE_SIZE) == ROM_PAGE_SIZE);
+    assert(CartCacheRead(buffer, ROM_PAGE_SIZE * 2, 13 * ROM_PAGE_SIZE) == ROM_PAGE_SIZE * 2);
+    assert(cartCache.readAhead == CACHE_READ_AHEAD_MIN * 8);
+    assert(cartCache.presentCount == 1 + CACHE_READ_AHEAD_MIN);
+
+    // The next miss fetches the grown window in one go
+    assert(CartCacheRead(buffer, ROM_PAGE_SIZE, 15 * ROM_PAGE_SIZE) == ROM_PAGE_SIZE);
+    assert(cartCache.presentCount == 1 + CACHE_READ_AHEAD_MIN + 1 + CACHE_READ_AHEAD_MIN * 16);
+
+    // Cached bytes are the big-endian words the bus returned
+    uint16 page[PAGE_WORDS];
+    ReadPage(CART_ROM_BASE + 15 * ROM_PAGE_SIZE, page);
+    assert(buffer[0] == (page[0] >> 8) && buffer[1] == (page[0] & 0xFF));
+
+    // A jump resets the window; reads are clipped to the ROM
+    assert(CartCacheRead(buffer, ROM_PAGE_SIZE * 2, cartCache.plan.romSize - ROM_PAGE_SIZE) == ROM_PAGE_SIZE);
+    assert(cartCache.readAhead == CACHE_READ_AHEAD_MIN);
+    assert(cartCache.present[cartCache.pageCount - 1]);
+    assert(CartCacheRead(buffer, 16, cartCache.plan.romSize) == 0);
+
+    free(cartCache.image);
+    free(cartCache.present);
+
+    printf("CartCacheRead passed.\n\n");
+}
+
+void test_SharedImage(void)
+{
+    printf("Testing SharedImage...\n");
+
+    // 8 Mb: 16384 pages, a 2 Kb bitmap, image on the next 4 Kb boundary
+    uint32 bitmapOffset = 0;
+    uint32 imageOffset = 0;
+    uint32 size = SharedImageSize(0x800000, &bitmapOffset, &imageOffset);
+    assert(bitmapOffset == sizeof(struct SharedImageHeader));
+    assert(imageOffset == 0x1000);
+    assert(size == 0x801000);
+
+    struct SharedImageHeader* header = calloc(1, imageOffset);
+    header->pageCount = 0x800000 / SHARED_IMAGE_PAGE_SIZE;
+    header->bitmapOffset = bitmapOffset;
+    header->imageOffset = imageOffset;
+
+    SharedImagePublishPage(header, 0);
+    SharedImagePublishPage(header, 63);
+    SharedImagePublishPage(header, 64);
+    SharedImagePublishPage(header, header->pageCount - 1);
+    assert(header->readyCount == 4);
+    assert(SharedImagePageReady(header, 0) && SharedImagePageReady(header, 63));
+    assert(SharedImagePageReady(header, 64) && SharedImagePageReady(header, header->pageCount - 1));
+    assert(!SharedImagePageReady(header, 1) && !SharedImagePageReady(header, 65));
+
+    // Ready pages never block; after a failed dump missing pages stop waiting
+    assert(SharedImageWaitPage(header, 63) == 1);
+    SharedImageFinish(header, SharedImageFailed);
+    assert(SharedImageWaitPage(header, 1) == 0);
+    assert(header->waiters == 0);
+
+    free(header);
+
+    printf("SharedImage passed.\n\n");
+}
+
+// Writes bytes to a new temporary file, named in path (at least 32 bytes).
+void TempFile(const void* bytes, size_t length, char* path)
+{
+    strcpy(path, "/tmp/n64testXXXXXX");
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    assert(write(fd, bytes, length) == (ssize_t)length);
+    close(fd);
+}
+
+// stdout goes to the test report; checks on what a function printed
+// redirect it into a temporary file between StdoutCapture and StdoutRelease.
+struct StdoutCapture
+{
+  int saved;
+  FILE* file;
+  char text[4096];
+};
+
+void StdoutCapture(struct StdoutCapture* capture)
+{
+    fflush(stdout);
+    capture->saved = dup(STDOUT_FILENO);
+    capture->file = tmpfile();
+    assert(capture->saved >= 0 && capture->file != NULL);
+    dup2(fileno(capture->file), STDOUT_FILENO);
+}
+
+// Restores stdout, echoes the capture into the report and returns it.
+const char* StdoutRelease(struct StdoutCapture* capture)
+{
+    fflush(stdout);
+    dup2(capture->saved, STDOUT_FILENO);
+    close(capture->saved);
+
+    rewind(capture->file);
+    size_t length = fread(capture->text, 1, sizeof(capture->text) - 1, capture->file);
+    capture->text[length] = '\0';
+    fclose(capture->file);
+    fputs(capture->text, stdout);
+    return capture->text;
+}
+
+// Synthetic golden image: xorshift contents seeded by size and CIC, a .z64
+// header, and header CRCs for the CIC. Corrupt images get one bit flipped in
+// the checksummed span after the CRCs were set, like a bad read would.
+uint8* GoldenImage(uint32 size, uint16 cic, int corrupt)
+{
+    uint8* image = malloc(size);
+    uint32 state = size ^ cic;
+    for(uint32 offset = 0;
+        offset < size;
+        offset += 4)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        image[offset] = state >> 24;
+        image[offset + 1] = state >> 16;
+        image[offset + 2] = state >> 8;
+        image[offset + 3] = state;
+    }
+
+    static const uint8 magic[4] = { 0x80, 0x37, 0x12, 0x40 };
+    memcpy(image, magic, sizeof(magic));
+
+    uint32 crc1 = 0;
+    uint32 crc2 = 0;
+    RomChecksum(image, cic, &crc1, &crc2);
+    for(uint byte = 0;
+        byte < 4;
+        byte++)
+    {
+        image[0x10 + byte] = crc1 >> (24 - byte * 8);
+        image[0x14 + byte] = crc2 >> (24 - byte * 8);
+    }
+
+    if(corrupt)
+    {
+        image[CHECKSUM_START + 0x1234] ^= 0x01;
+    }
+    return image;
+}
+
+struct GoldenRom
+{
+  uint32 size;
+  uint16 cic;
+  int corrupt;
+  uint32 crc32; // Of the whole image
+};
+
+// Every retail size, every CIC, valid and corrupt header checksums
+static const struct GoldenRom goldenRoms[] = {
+  { 0x0400000, 6102, 0, 0x201D50DD },
+  { 0x0800000, 6103, 0, 0x3589EDFD },
+  { 0x0C00000, 6105, 0, 0x8B3B55CB },
+  { 0x1000000, 6106, 0, 0xF47A00AE },
+  { 0x2000000, 6102, 1, 0x2DF9F749 },
+  { 0x4000000, 6105, 1, 0xC8EB133E }
+};
+
+void test_GoldenImages(void)
+{
+    printf("Testing golden images...\n");
+
+    static uint8 prefix[CHECKSUM_END];
+    uint16 page[PAGE_WORDS];
+    uint8 bytes[ROM_PAGE_SIZE];
+
+    // The burst fast path must read and account for pages exactly as the
+    // bit-banged path does, including the open bus past the end
+    uint8* image = GoldenImage(0x400000, 6102, 0);
+    SimCartLoad(image, 0x400000);
+    static const uint32 checkAddresses[] = { 0, 0x1000, 0x3FFE00, 0x400000, 0x1234400 };
+    for(uint check = 0;
+        check < sizeof(checkAddresses) / sizeof(checkAddresses[0]);
+        check++)
+    {
+        uint16 burst[PAGE_WORDS];
+        struct SimCart before = simCart;
+        BitBangReadPage(CART_ROM_BASE + checkAddresses[check], page);
+        struct SimCart banged = simCart;
+
+        simCart = before;
+        SimBurstReadPage(CART_ROM_BASE + checkAddresses[check], burst);
+        assert(memcmp(page, burst, sizeof(page)) == 0);
+        assert(simCart.address == banged.address && simCart.data == banged.data);
+        assert(simCart.latches == banged.latches && simCart.strobes == banged.strobes);
+        assert(simCart.nanoseconds == banged.nanoseconds);
+    }
+    assert(simCart.violations == 0);
+
+    // A burst started on a busy bus is a violation, as each GPIO call would be
+    mock_gpioWrite(READ, ACTIVE(LOW));
+    SimBurstReadPage(CART_ROM_BASE, page);
+    assert(simCart.violations > 0);
+    mock_gpioWrite(READ, INACTIVE(HIGH));
+    simCart.image = NULL;
+    free(image);
+
+    busReadPage = SimBurstReadPage;
+    for(uint golden = 0;
+        golden < sizeof(goldenRoms) / sizeof(goldenRoms[0]);
+        golden++)
+    {
+        const struct GoldenRom* rom = &goldenRoms[golden];
+        uint8* image = GoldenImage(rom->size, rom->cic, rom->corrupt);
+        SimCartLoad(image, rom->size);
+
+        // The size comes from the open bus past the end, as for carts not in the DAT
+        assert(ProbeRomSize() == rom->size);
+
+        uint32 crc = 0;
+        for(uint32 address = 0;
+            address < rom->size;
+            address += ROM_PAGE_SIZE)
+        {
+            ReadPage(CART_ROM_BASE + address, page);
+            for(uint word = 0;
+                word < PAGE_WORDS;
+                word++)
+            {
+                bytes[word * 2] = page[word] >> 8;
+                bytes[word * 2 + 1] = page[word] & 0xFF;
+            }
+
+            crc = Crc32Update(crc, bytes, ROM_PAGE_SIZE);
+            if(address < CHECKSUM_END)
+            {
+                memcpy(prefix + address, bytes, ROM_PAGE_SIZE);
+            }
+        }
+
+        printf("0x%07X bytes, CIC %u%s: CRC32 %08X\n", rom->size, rom->cic, rom->corrupt ? " (corrupt)" : "", crc);
+        assert(crc == rom->crc32);
+        assert(IdentifyCic(prefix) == (rom->corrupt ? 0 : rom->cic));
+        assert(simCart.violations == 0);
+        assert(trace.counts[TraceBurst] == simCart.latches / 2);
+
+        simCart.image = NULL;
+        free(image);
+    }
+    busReadPage = BitBangReadPage;
+
+    // Checksum variants the dumped sizes didn't cover
+    for(uint variant = 0;
+        variant < sizeof(cicVariants) / sizeof(cicVariants[0]);
+        variant++)
+    {
+        uint16 cic = cicVariants[variant].cic;
+        uint8* valid = GoldenImage(0x400000, cic, 0);
+        uint8* corrupt = GoldenImage(0x400000, cic, 1);
+        assert(IdentifyCic(valid) == cic);
+        assert(IdentifyCic(corrupt) == 0);
+        free(valid);
+        free(corrupt);
+    }
+
+    printf("Golden images passed.\n\n");
+}
+
+void test_VerifyAgainst(void)
+{
+    printf("Testing VerifyAgainst...\n");
+
+    struct StdoutCapture capture;
+    char path[32];
+    uint32 size = 0x400000;
+    uint8* image = GoldenImage(size, 6102, 0);
+    uint8* cart = malloc(size);
+    memcpy(cart, image, size);
+    TempFile(image, size, path);
+    SimCartLoad(cart, size);
+    busReadPage = SimBurstReadPage;
+
+    assert(VerifyAgainst(path, 0) == 0);
+    assert(VerifyAgainst(path, 1) == 0);
+
+    // Two bad spans: the default run stops at the first word, exhaustive reports both
+    cart[0x1235] ^= 0x40;
+    memset(cart + 0x200FFC, 0, 0x10);
+    StdoutCapture(&capture);
+    assert(VerifyAgainst(path, 0) == EXIT_MISMATCH);
+    assert(strncmp(StdoutRelease(&capture), "Mismatch at 0x001234: cart ", 27) == 0);
+    assert(strchr(capture.text, '\n') == capture.text + strlen(capture.text) - 1);
+
+    uint64 strobes = simCart.strobes;
+    StdoutCapture(&capture);
+    assert(VerifyAgainst(path, 1) == EXIT_MISMATCH);
+    assert(strcmp(StdoutRelease(&capture), "Mismatch 0x001234-0x001235\n"
+                                           "Mismatch 0x200FFC-0x20100B\n"
+                                           "2 mismatching range(s).\n") == 0);
+    assert(simCart.strobes - strobes == size / 2); // Read to the end
+
+    // A mismatch in the last word is closed at the end of the image
+    cart[size - 1] ^= 0x01;
+    StdoutCapture(&capture);
+    assert(VerifyAgainst(path, 1) == EXIT_MISMATCH);
+    assert(strstr(StdoutRelease(&capture), "Mismatch 0x3FFFFE-0x3FFFFF\n3 mismatching") != NULL);
+    unlink(path);
+
+    // Short, foreign and ragged references are rejected before the cart is read
+    static const uint8 magic[4] = { 0x80, 0x37, 0x12, 0x40 };
+    uint32 pages = simCart.latches;
+    for(size_t length = 1;
+        length <= 4;
+        length++)
+    {
+        TempFile(magic, length, path);
+        assert(VerifyAgainst(path, 0) == 1);
+        unlink(path);
+    }
+    image[0] = 0x37;
+    TempFile(image, ROM_PAGE_SIZE, path);
+    assert(VerifyAgainst(path, 0) == 1);
+    unlink(path);
+    image[0] = 0x80;
+    TempFile(image, ROM_PAGE_SIZE + 2, path);
+    assert(VerifyAgainst(path, 0) == 1);
+    unlink(path);
+    assert(simCart.latches == pages);
+
+    busReadPage = BitBangReadPage;
+    simCart.image = NULL;
+    free(cart);
+    free(image);
+
+    printf("VerifyAgainst passed.\n\n");
+}
+
+void test_IdentifyCart(void)
+{
+    printf("Testing IdentifyCart...\n");
+
+    struct StdoutCapture capture;
+    char known[32];
+    char other[32];
+    char foreign[32];
+    char tiny[32];
+    char indexPath[32];
+    uint8* image = GoldenImage(0x400000, 6102, 0);
+    uint8* unknown = GoldenImage(0x400000, 6105, 0);
+    TempFile(image, 0x400000, known);
+    TempFile(unknown, 0x200000, other);
+    TempFile(image + 1, ROM_PAGE_SIZE, foreign); // Byte-swapped: no .z64 magic
+    TempFile(image, 2, tiny); // Too short to hold the magic
+    TempFile("", 0, indexPath);
+
+    // Only big-endian dumps are indexed, one line each
+    char* dumps[] = { known, foreign, tiny, other };
+    assert(BuildFingerprintIndex(indexPath, dumps, 4) == 0);
+    size_t length;
+    char* index = (char*)LoadFile(indexPath, &length);
+    index = realloc(index, length + 1);
+    index[length] = '\0';
+    char line[128];
+    snprintf(line, sizeof(line), "%016llX 400000 %s\n", (unsigned long long)FingerprintImage(image, 0x400000), known);
+    assert(strncmp(index, line, strlen(line)) == 0);
+    assert(strchr(index + strlen(line), '\n') == index + length - 1);
+    free(index);
+
+    // The cart samples the same pages the index hashed
+    busReadPage = SimBurstReadPage;
+    SimCartLoad(image, 0x400000);
+    assert(FingerprintCart() == FingerprintImage(image, 0x400000));
+    StdoutCapture(&capture);
+    assert(IdentifyCart(indexPath) == 0);
+    snprintf(line, sizeof(line), "Match: %s (0x400000 bytes)\n", known);
+    assert(strcmp(StdoutRelease(&capture), line) == 0);
+
+    // A cart whose dump was indexed at another size doesn't match, nor does one never dumped
+    SimCartLoad(unknown, 0x400000);
+    StdoutCapture(&capture);
+    assert(IdentifyCart(indexPath) == EXIT_UNKNOWN);
+    assert(strncmp(StdoutRelease(&capture), "Unknown cart (fingerprint ", 26) == 0);
+    image[FingerprintSampleAddress(FINGERPRINT_SAMPLES - 1) + 2] ^= 0x80;
+    SimCartLoad(image, 0x400000);
+    assert(IdentifyCart(indexPath) == EXIT_UNKNOWN);
+    assert(IdentifyCart("/nonexistent/library.fpi") == 1);
+    busReadPage = BitBangReadPage;
+    simCart.image = NULL;
+
+    unlink(known);
+    unlink(other);
+    unlink(foreign);
+    unlink(tiny);
+    unlink(indexPath);
+    free(image);
+    free(unknown);
+
+    printf("IdentifyCart passed.\n\n");
+}
+
+void test_DatIndex(void)
+{
+    printf("Testing DatIndex...\n");
+
+    static const char dat[] =
+        "<?xml version=\"1.0\"?>\n"
+        "<datafile>\n"
+        "\t<game name=\"Super Mario 64 (USA)\">\n"
+        "\t\t<rom name=\"Super Mario 64 (USA).z64\" size=\"8388608\" crc=\"3CE60709\" "
+        "md5=\"20b854b239203baf6c961b850a4a51a2\" sha1=\"9bef1128717f958171a4afac3ed78ee2bb4e86ce\" "
+        "serial=\"NSME\" savetype=\"eeprom4k\" cic=\"6102\"/>\n"
+        "\t</game>\n"
+        "\t<game name=\"Tom &amp; Jerry &quot;Fists&quot; (Europe) (Rev A)\">\n"
+        "\t\t<rom name=\"t.z64\" size=\"12582912\" crc=\"0123ABCD\" "
+        "md5=\"00112233445566778899aabbccddeeff\" sha1=\"0123456789abcdef0123456789abcdef01234567\" "
+        "serial=\"NTJP\" savetype=\"sram\" cic=\"6105\"/>\n"
+        "\t</game>\n"
+        "\t<game name=\"Homebrew Demo (World)\">\n"
+        "\t\t<rom name=\"demo.z64\" size=\"1048576\" crc=\"DEADBEEF\" "
+        "md5=\"ffeeddccbbaa99887766554433221100\" sha1=\"fedcba9876543210fedcba9876543210fedcba98\"/>\n"
+        "\t</game>\n"
+        "</datafile>\n";
+
+    struct StdoutCapture capture;
+    char datPath[32];
+    char indexPath[32];
+    TempFile(dat, sizeof(dat) - 1, datPath);
+    TempFile("", 0, indexPath);
+
+    // Two full rom entries and one without a serial: 4 + 4 + 3 keys
+    char* dats[] = { datPath };
+    StdoutCapture(&capture);
+    assert(CompileDatIndex(indexPath, dats, 1) == 0);
+    assert(strncmp(StdoutRelease(&capture), "Compiled 3 DAT entries (11 keys, ", 33) == 0);
+    assert(LoadDatIndex(indexPath, 1) == 0);
+    assert(datIndex.header->entryCount == 3);
+
+    // CRC32 keys are the big-endian digits as written in the DAT
+    uint8 crc[4] = { 0x3C, 0xE6, 0x07, 0x09 };
+    const struct DatEntry* entry = DatLookup(DatKeyCrc32, crc, 4);
+    assert(entry != NULL);
+    assert(strcmp(DatTitle(entry), "Super Mario 64 (USA)") == 0);
+    assert(entry->size == 0x800000 && entry->cic == 6102 && entry->saveType == SaveEeprom4k);
+    assert(entry->revision == 0 && memcmp(entry->serial, "NSME", 4) == 0);
+
+    uint8 md5[16];
+    assert(ParseHex("00112233445566778899aabbccddeeff", md5, 16));
+    entry = DatLookup(DatKeyMd5, md5, 16);
+    assert(entry != NULL);
+    assert(strcmp(DatTitle(entry), "Tom & Jerry \"Fists\" (Europe) (Rev A)") == 0);
+    assert(entry->revision == 1 && entry->saveType == SaveSram && entry->cic == 6105);
+
+    uint8 sha1[20];
+    assert(ParseHex("fedcba9876543210fedcba9876543210fedcba98", sha1, 20));
+    entry = DatLookup(DatKeySha1, sha1, 20);
+    assert(entry != NULL);
+    assert(strcmp(DatTitle(entry), "Homebrew Demo (World)") == 0);
+    assert(entry->serial[0] == '\0' && entry->saveType == SaveUnknown && entry->cic == 0);
+
+    // Header serial keys take the game code at 0x3B and the revision at 0x3F
+    uint16 header[0x20];
+    memset(header, 0, sizeof(header));
+    header[0x3A / 2] = 'N';
+    header[0x3C / 2] = ('T' << 8) | 'J';
+    header[0x3E / 2] = ('P' << 8) | 1;
+    entry = DatLookupHeader(header);
+    assert(entry != NULL && entry->crc32 == 0x0123ABCD);
+    header[0x3E / 2] = ('P' << 8) | 0;
+    assert(DatLookupHeader(header) == NULL);
+
+    // Misses, and real keys asked for as another type
+    uint8 missing[4] = { 0x11, 0x22, 0x33, 0x44 };
+    assert(DatLookup(DatKeyCrc32, missing, 4) == NULL);
+    assert(DatLookup(DatKeyMd5, crc, 4) == NULL);
+    assert(DatLookup(DatKeySerial, crc, 4) == NULL);
+    assert(DatLookup(DatKeyCrc32, md5, 4) == NULL);
+    assert(DatLookup(DatKeySha1, md5, 16) == NULL);
+
+    size_t length;
+    uint8* index = LoadFile(indexPath, &length);
+    uint32 bucketCount = datIndex.header->bucketCount;
+    uint32 slotCount = datIndex.header->slotCount;
+    uint32 stringsSize = datIndex.header->stringsSize;
+    munmap((void*)datIndex.header, datIndex.size);
+    memset(&datIndex, 0, sizeof(datIndex));
+
+    // Slots pointing past the entries, titles outside or unterminated in the pool are rejected
+    size_t slotsOffset = sizeof(struct DatIndexHeader) + bucketCount * 4;
+    size_t entriesOffset = slotsOffset + slotCount * 4;
+    uint32 slot = 0;
+    while(((uint32*)(index + slotsOffset))[slot] == DAT_EMPTY_SLOT)
+    {
+        slot++;
+    }
+    uint32* slotValue = (uint32*)(index + slotsOffset) + slot;
+    uint32* titleOffset = &((struct DatEntry*)(index + entriesOffset))[0].titleOffset;
+    char corruptPath[32];
+
+    uint32 saved = *slotValue;
+    *slotValue = (3 << 2) | (saved & 0x3);
+    TempFile(index, length, corruptPath);
+    assert(LoadDatIndex(corruptPath, 1) == 1);
+    unlink(corruptPath);
+    *slotValue = saved;
+
+    saved = *titleOffset;
+    *titleOffset = stringsSize;
+    TempFile(index, length, corruptPath);
+    assert(LoadDatIndex(corruptPath, 1) == 1);
+    unlink(corruptPath);
+    *titleOffset = saved;
+
+    index[length - 1] = 'x';
+    TempFile(index, length, corruptPath);
+    assert(LoadDatIndex(corruptPath, 1) == 1);
+    unlink(corruptPath);
+    index[length - 1] = '\0';
+
+    TempFile(index, length - 1, corruptPath);
+    assert(LoadDatIndex(corruptPath, 1) == 1);
+    unlink(corruptPath);
+    assert(datIndex.header == NULL);
+
+    // The untouched bytes still load
+    TempFile(index, length, corruptPath);
+    assert(LoadDatIndex(corruptPath, 1) == 0);
+    assert(DatLookup(DatKeyCrc32, crc, 4) != NULL);
+    munmap((void*)datIndex.header, datIndex.size);
+    memset(&datIndex, 0, sizeof(datIndex));
+    unlink(corruptPath);
+
+    assert(LoadDatIndex("/nonexistent/n64.ndi", 0) == 0);
+    assert(datIndex.header == NULL);
+
+    free(index);
+    unlink(datPath);
+    unlink(indexPath);
+
+    printf("DatIndex passed.\n\n");
+}
+
+// Returns 1 when the file holds exactly the given bytes
+int FileMatches(const char* path, const uint8* bytes, size_t length)
+{
+    size_t fileLength = 0;
+    uint8* file = LoadFile(path, &fileLength);
+    int matches = (file != NULL && fileLength == length && memcmp(file, bytes, length) == 0);
+    free(file);
+    return matches;
+}
+
+// Plans the dump of the sim cart after giving its header a game code
+void SimPlan(uint8* image, const char* serial, struct DumpPlan* plan)
+{
+    uint16 header[PAGE_WORDS];
+    memcpy(image + 0x3B, serial, 4);
+    image[0x3F] = 0;
+    ReadPage(CART_ROM_BASE, header);
+    PlanDump(header, plan);
+}
+
+void test_DumpPlan(void)
+{
+    printf("Testing DumpPlan...\n");
+
+    static const char dat[] =
+        "<datafile>\n"
+        "<game name=\"Odd Size (USA)\"><rom name=\"a\" size=\"1572864\" crc=\"00000001\" serial=\"NODD\" savetype=\"none\"/></game>\n"
+        "<game name=\"Sram (USA)\"><rom name=\"b\" size=\"2097152\" crc=\"00000002\" serial=\"NSRA\" savetype=\"sram\"/></game>\n"
+        "<game name=\"Banked (Japan)\"><rom name=\"c\" size=\"2097152\" crc=\"00000003\" serial=\"NBNK\" savetype=\"sram768k\"/></game>\n"
+        "<game name=\"Flash (Europe)\"><rom name=\"d\" size=\"2097152\" crc=\"00000004\" serial=\"NFLA\" savetype=\"flash\"/></game>\n"
+        "<game name=\"Eeprom (USA)\"><rom name=\"e\" size=\"2097152\" crc=\"00000005\" serial=\"NEEP\" savetype=\"eeprom4k\"/></game>\n"
+        "</datafile>\n";
+
+    struct StdoutCapture capture;
+    char datPath[32];
+    char indexPath[32];
+    char romPath[32];
+    char savePath[40];
+    TempFile(dat, sizeof(dat) - 1, datPath);
+    TempFile("", 0, indexPath);
+    TempFile("", 0, romPath);
+    char* dats[] = { datPath };
+    StdoutCapture(&capture);
+    assert(CompileDatIndex(indexPath, dats, 1) == 0);
+    StdoutRelease(&capture);
+    assert(LoadDatIndex(indexPath, 1) == 0);
+
+    uint32 size = 0x200000;
+    uint8* image = GoldenImage(size, 6102, 0);
+    uint8* save = GoldenImage(3 * SRAM_BANK_STRIDE, 6105, 0);
+    struct DumpPlan plan;
+    busReadPage = SimBurstReadPage;
+    SimCartLoad(image, size);
+    simCart.save = save;
+    simCart.saveSize = 3 * SRAM_BANK_STRIDE;
+    readFailures = 0;
+
+    // A DAT hit sets the exact size, even one the probe would round up
+    SimPlan(image, "NODD", &plan);
+    assert(plan.entry != NULL && strcmp(DatTitle(plan.entry), "Odd Size (USA)") == 0);
+    assert(plan.romSize == 0x180000 && plan.saveType == SaveNone && plan.rangeCount == 1);
+    assert(plan.ranges[0].busAddress == CART_ROM_BASE && plan.ranges[0].length == 0x180000 &&
+           plan.ranges[0].kind == RangeRom);
+    assert(ExecutePlan(&plan, romPath, NULL) == 0);
+    assert(FileMatches(romPath, image, 0x180000));
+    snprintf(savePath, sizeof(savePath), "%s.sra", romPath);
+    assert(access(savePath, F_OK) != 0);
+
+    // A miss probes the size and reads no save
+    SimPlan(image, "NZZZ", &plan);
+    assert(plan.entry == NULL && plan.romSize == size && plan.saveType == SaveUnknown);
+    assert(plan.rangeCount == 1 && plan.ranges[0].length == size);
+
+    SimPlan(image, "NSRA", &plan);
+    assert(plan.saveType == SaveSram && plan.rangeCount == 2);
+    assert(plan.ranges[1].busAddress == CART_SRAM_BASE && plan.ranges[1].length == SRAM_BANK_SIZE &&
+           plan.ranges[1].kind == RangeSave);
+    assert(ExecutePlan(&plan, romPath, NULL) == 0);
+    assert(FileMatches(romPath, image, size));
+    assert(FileMatches(savePath, save, SRAM_BANK_SIZE));
+    unlink(savePath);
+
+    // 768 Kbit SRAM is three banks a stride apart, saved back to back
+    SimPlan(image, "NBNK", &plan);
+    assert(plan.saveType == SaveSram768k && plan.rangeCount == 4);
+    uint8* banks = malloc(3 * SRAM_BANK_SIZE);
+    for(uint bank = 0;
+        bank < 3;
+        bank++)
+    {
+        assert(plan.ranges[1 + bank].busAddress == CART_SRAM_BASE + bank * SRAM_BANK_STRIDE);
+        assert(plan.ranges[1 + bank].length == SRAM_BANK_SIZE && plan.ranges[1 + bank].kind == RangeSave);
+        memcpy(banks + bank * SRAM_BANK_SIZE, save + bank * SRAM_BANK_STRIDE, SRAM_BANK_SIZE);
+    }
+    assert(ExecutePlan(&plan, romPath, NULL) == 0);
+    assert(FileMatches(savePath, banks, 3 * SRAM_BANK_SIZE));
+    unlink(savePath);
+    free(banks);
+
+    // FlashRAM only reads back after the read-array command
+    SimPlan(image, "NFLA", &plan);
+    assert(plan.saveType == SaveFlash && plan.rangeCount == 2);
+    assert(plan.ranges[1].busAddress == CART_SRAM_BASE && plan.ranges[1].length == FLASH_SIZE);
+    simCart.flash = 1;
+    assert(ExecutePlan(&plan, romPath, NULL) == 0);
+    assert(simCart.flashReadArray && simCart.writes == 2);
+    snprintf(savePath, sizeof(savePath), "%s.fla", romPath);
+    assert(FileMatches(savePath, save, FLASH_SIZE));
+    unlink(savePath);
+    simCart.flash = 0;
+
+    // EEPROM is out of reach: the ROM is dumped and no save file appears
+    SimPlan(image, "NEEP", &plan);
+    assert(plan.entry != NULL && plan.saveType == SaveEeprom4k && plan.rangeCount == 1);
+    assert(ExecutePlan(&plan, romPath, NULL) == 0);
+    assert(FileMatches(romPath, image, size));
+    snprintf(savePath, sizeof(savePath), "%s.sra", romPath);
+    assert(access(savePath, F_OK) != 0);
+    assert(simCart.violations == 0);
+
+    busReadPage = BitBangReadPage;
+    simCart.image = NULL;
+    simCart.save = NULL;
+    munmap((void*)datIndex.header, datIndex.size);
+    memset(&datIndex, 0, sizeof(datIndex));
+    unlink(datPath);
+    unlink(indexPath);
+    unlink(romPath);
+    free(image);
+    free(save);
+
+    printf("DumpPlan passed.\n\n");
+}
+
+void test_LoadPinMap(void)
+{
+    printf("Testing LoadPinMap...\n");
+
+    // AD lines scattered over the header, control lines where the default wiring has them
+    static const char board[] =
+        "# Scattered AD wiring\n"
+        "AD0 27\nAD1 26\nAD2 4\nAD3 7\nAD4 6\nAD5 3\nAD6 8\nAD7 5\n"
+        "\n"
+        "AD8 10 # High byte in order\n"
+        "AD9 11\nAD10 12\nAD11 13\nAD12 14\nAD13 15\nAD14 16\nAD15 17\n"
+        "ALE_L 18\nALE_H 19\nREAD 20\nWRITE 21\nRESET 22\n";
+    static const uint scattered[16] = { 27, 26, 4, 7, 6, 3, 8, 5, 10, 11, 12, 13, 14, 15, 16, 17 };
+
+    struct PinMap saved = pinMap;
+    char path[32];
+    TempFile(board, sizeof(board) - 1, path);
+    assert(LoadPinMap(path) == 0);
+    assert(FinishPinMap() == 0);
+    unlink(path);
+    assert(memcmp(pinMap.ad, scattered, sizeof(scattered)) == 0);
+    assert(!pinMap.contiguous);
+    BuildAddressMasks();
+
+    // A page read goes through the gather tables and leaves the scattered lines driven
+    uint8* image = GoldenImage(0x100000, 6102, 0);
+    uint16 page[PAGE_WORDS];
+    SimCartLoad(image, 0x100000);
+    BitBangReadPage(CART_ROM_BASE + 0x1000, page);
+    for(uint word = 0;
+        word < PAGE_WORDS;
+        word++)
+    {
+        assert(page[word] == ((image[0x1000 + word * 2] << 8) | image[0x1000 + word * 2 + 1]));
+    }
+    for(uint bitOffset = 0;
+        bitOffset < 16;
+        bitOffset++)
+    {
+        assert(gpio_set_mode[scattered[bitOffset]] == PI_OUTPUT);
+    }
+    assert(simCart.latches == 2 && simCart.violations == 0);
+
+    // The wave backend samples the same scattered lines
+    uint32 idle = 1u << READ;
+    uint32 word = 0;
+    for(uint bitOffset = 0;
+        bitOffset < 16;
+        bitOffset++)
+    {
+        word |= ((0x8037u >> bitOffset) & 0x1) << scattered[bitOffset];
+    }
+    gpioSample_t samples[] = { { 0, idle }, { 1, word }, { 2, idle | word } };
+    memset(&waveCapture, 0, sizeof(waveCapture));
+    waveCapture.active = 1;
+    WaveSamples(samples, 3);
+    assert(waveCapture.words == 1 && waveCapture.page[0] == 0x8037);
+    memset(&waveCapture, 0, sizeof(waveCapture));
+
+    // The default wiring reads the same page through the contiguous shift
+    pinMap = saved;
+    assert(FinishPinMap() == 0 && pinMap.contiguous);
+    BuildAddressMasks();
+    uint16 shifted[PAGE_WORDS];
+    SimCartLoad(image, 0x100000);
+    BitBangReadPage(CART_ROM_BASE + 0x1000, shifted);
+    assert(memcmp(shifted, page, sizeof(page)) == 0);
+    assert(simCart.violations == 0);
+
+    // An AD line on READ's GPIO loads but doesn't pass FinishPinMap
+    TempFile("AD3 20\n", 7, path);
+    assert(LoadPinMap(path) == 0);
+    assert(FinishPinMap() != 0);
+    unlink(path);
+    pinMap = saved;
+
+    // Unknown signals and GPIOs past MAX_GPIO are rejected while loading
+    TempFile("AD16 5\n", 7, path);
+    assert(LoadPinMap(path) != 0);
+    unlink(path);
+    TempFile("READ 28\n", 8, path);
+    assert(LoadPinMap(path) != 0);
+    unlink(path);
+    assert(LoadPinMap("/nonexistent/board.cfg") != 0);
+
+    pinMap = saved;
+    assert(FinishPinMap() == 0);
+    BuildAddressMasks();
+    simCart.image = NULL;
+    free(image);
+
+    printf("LoadPinMap passed.\n\n");
+}
+
+// Emulator stand-in for the ROM mapping: touches pages in order from its own
+// thread and notes the read-ahead each fault left behind
+struct MappingReader
+{
+    struct RomMapping* mapping;
+    const uint8* source;
+    const size_t* pages;
+    size_t count;
+    size_t readAhead[8];
+    int matched;
+};
+
+void* MappingReaderThread(void* argument)
+{
+    struct MappingReader* reader = argument;
+    reader->matched = 1;
+    for(size_t touch = 0;
+        touch < reader->count;
+        touch++)
+    {
+        size_t offset = reader->pages[touch] * reader->mapping->pageSize + 0x123;
+        reader->matched &= (reader->mapping->data[offset] == reader->source[offset]);
+        reader->readAhead[touch] = __atomic_load_n(&reader->mapping->readAhead, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+void test_RomMapping(void)
+{
+    printf("Testing RomMapping...\n");
+
+    uint32 size = 0x1000000;
+    uint8* image = GoldenImage(size, 6102, 0);
+    char sourcePath[32];
+    char persistPath[32];
+    TempFile(image, size, sourcePath);
+    TempFile("", 0, persistPath);
+
+    struct RomMapping mapping;
+    assert(RomMappingOpen(&mapping, sourcePath, persistPath) == 0);
+    assert(mapping.size == size && mapping.readAhead == ROM_MAPPING_READ_AHEAD_MIN);
+
+    // Far above where the idle filler gets to: each fault right after the last
+    // window doubles the read-ahead, a jump elsewhere resets it
+    size_t first = mapping.pageCount * 3 / 4;
+    size_t pages[] = { first, first + 2, first + 5, first + 10, mapping.pageCount / 2 };
+    size_t expected[] = { 1, 2, 4, 8, 1 };
+    struct MappingReader reader = { &mapping, image, pages, 5, { 0 }, 0 };
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, MappingReaderThread, &reader) == 0);
+    pthread_join(thread, NULL);
+    assert(reader.matched);
+    assert(memcmp(reader.readAhead, expected, sizeof(expected)) == 0);
+
+    // Touching everything completes the image, which is persisted by the time the handler stops
+    assert(memcmp(mapping.data, image, size) == 0);
+    RomMappingClose(&mapping);
+    assert(FileMatches(persistPath, image, size));
+    unlink(persistPath);
+
+    // A window that can't be copied in hands the range back to the kernel:
+    // the faulting reader wakes to zeros instead of hanging, and nothing is persisted
+    assert(RomMappingOpen(&mapping, sourcePath, persistPath) == 0);
+    size_t hole = mapping.pageCount - 8;
+    assert(munmap(mapping.data + (hole + 1) * mapping.pageSize, mapping.pageSize) == 0);
+    size_t broken[] = { hole };
+    struct MappingReader stranded = { &mapping, image, broken, 1, { 0 }, 0 };
+    assert(pthread_create(&thread, NULL, MappingReaderThread, &stranded) == 0);
+    pthread_join(thread, NULL);
+    assert(mapping.data[hole * mapping.pageSize + 0x123] == 0);
+    assert(mapping.data[(hole - 2) * mapping.pageSize] == 0);
+    assert(mapping.failed);
+    RomMappingClose(&mapping);
+    assert(access(persistPath, F_OK) != 0);
+
+    unlink(sourcePath);
+    free(image);
+
+    printf("RomMapping passed.\n\n");
+}
+
+void test_AccessProfile(void)
+{
+    printf("Testing AccessProfile...\n");
+
+    uint32 size = 0x1000000;
+    uint8* image = GoldenImage(size, 6102, 0);
+    char sourcePath[32];
+    char directory[32] = "/tmp/n64profileXXXXXX";
+    TempFile(image, size, sourcePath);
+    assert(mkdtemp(directory) != NULL);
+
+    // Two faults in a row, then two jumps. Only the second fault shows the
+    // first window was read through; the later windows stay unrecorded.
+    struct RomMapping mapping;
+    assert(RomMappingOpen(&mapping, sourcePath, NULL) == 0);
+    size_t first = mapping.pageCount * 3 / 4;
+    size_t pages[] = { 0, first, first + 2, mapping.pageCount / 2, mapping.pageCount * 5 / 8 };
+    struct MappingReader reader = { &mapping, image, pages, 5, { 0 }, 0 };
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, MappingReaderThread, &reader) == 0);
+    pthread_join(thread, NULL);
+    assert(reader.matched);
+
+    // The idle filler may have had the header in before the reader got to it
+    size_t header = (mapping.touchCount == 6);
+    size_t expected[] = { first, first + 1, first + 2, mapping.pageCount / 2, mapping.pageCount * 5 / 8 };
+    assert(mapping.touchCount == 5 + header && (!header || mapping.touchOrder[0] == 0));
+    for(size_t touch = 0;
+        touch < 5;
+        touch++)
+    {
+        assert(mapping.touchOrder[header + touch] == expected[touch]);
+    }
+    assert(RomMappingSaveProfile(&mapping, directory) == 0);
+    RomMappingClose(&mapping);
+
+    // The dumper reads the profile as ROM pages, runs first, each page exactly once
+    uint16 words[PAGE_WORDS];
+    struct DumpPlan plan;
+    memset(&plan, 0, sizeof(plan));
+    plan.romSize = size;
+    busReadPage = SimBurstReadPage;
+    SimCartLoad(image, size);
+    ReadPage(CART_ROM_BASE, words);
+    LoadAccessProfile(directory, words, &plan);
+
+    uint32 pageCount = size / ROM_PAGE_SIZE;
+    uint32 perMapping = mapping.pageSize / ROM_PAGE_SIZE;
+    assert(plan.pageOrder != NULL && plan.bootPages == (header + 5) * perMapping);
+    uint32 boot = 0;
+    for(size_t touch = 0;
+        touch < header + 5;
+        touch++)
+    {
+        uint32 firstPage = (touch < header) ? 0 : expected[touch - header] * perMapping;
+        for(uint32 page = 0;
+            page < perMapping;
+            page++)
+        {
+            assert(plan.pageOrder[boot++] == firstPage + page);
+        }
+    }
+
+    uint8* seen = calloc(pageCount, 1);
+    for(uint32 done = 0;
+        done < pageCount;
+        done++)
+    {
+        assert(plan.pageOrder[done] < pageCount && !seen[plan.pageOrder[done]]);
+        seen[plan.pageOrder[done]] = 1;
+        assert(done <= plan.bootPages || plan.pageOrder[done] > plan.pageOrder[done - 1]);
+    }
+    free(seen);
+
+    // Dumped in that order, the image still comes out whole
+    struct StdoutCapture capture;
+    char romPath[32];
+    char line[32];
+    TempFile("", 0, romPath);
+    FILE* output = fopen(romPath, "w+b");
+    uint32 crc = 0;
+    romPrefixLength = 0;
+    StdoutCapture(&capture);
+    assert(DumpRomOrdered(&plan, output, &crc) == 0);
+    const char* text = StdoutRelease(&capture);
+    fclose(output);
+    snprintf(line, sizeof(line), "boot-ready %u\n", plan.bootPages);
+    assert(strstr(text, line) != NULL);
+    snprintf(line, sizeof(line), "progress %u %u\n", pageCount, pageCount);
+    assert(strcmp(text + strlen(text) - strlen(line), line) == 0);
+    assert(FileMatches(romPath, image, size));
+    assert(crc == Crc32Update(0, image, size));
+    assert(simCart.violations == 0);
+
+    char profilePath[96];
+    snprintf(profilePath, sizeof(profilePath), "%s/" PROFILE_NAME, directory,
+             (uint32)words[8] << 16 | words[9], (uint32)words[10] << 16 | words[11]);
+    assert(unlink(profilePath) == 0);
+    rmdir(directory);
+    unlink(romPath);
+    unlink(sourcePath);
+    busReadPage = BitBangReadPage;
+    simCart.image = NULL;
+    free(plan.pageOrder);
+    free(image);
+
+    printf("AccessProfile passed.\n\n");
+}
+
+// Backend whose transfers of one page fall short a given number of times,
+// zero-filling the words as the wave backend does
+uint32 shortPageAddress;
+uint shortTransfers;
+
+int ShortReadPage(uint32 address, uint16* words)
+{
+    if(address == shortPageAddress && shortTransfers > 0)
+    {
+        shortTransfers--;
+        memset(words, 0, PAGE_WORDS * sizeof(uint16));
+        return 1;
+    }
+    return SimBurstReadPage(address, words);
+}
+
+void test_ShortTransfers(void)
+{
+    printf("Testing ShortTransfers...\n");
+
+    uint32 size = 0x100000;
+    uint8* image = GoldenImage(size, 6102, 0);
+    uint16 expected[PAGE_WORDS];
+    uint16 page[PAGE_WORDS];
+    char romPath[32];
+    TempFile("", 0, romPath);
+    busReadPage = ShortReadPage;
+    SimCartLoad(image, size);
+    readRetries = 0;
+    readFailures = 0;
+
+    // A short transfer is read again, each time counting as a retry
+    shortPageAddress = CART_ROM_BASE + 0x1000;
+    SimBurstReadPage(shortPageAddress, expected);
+    shortTransfers = READ_RETRIES;
+    assert(ReadPage(shortPageAddress, page) == 0);
+    assert(shortTransfers == 0 && readRetries == READ_RETRIES);
+    assert(memcmp(page, expected, sizeof(page)) == 0);
+
+    // One more and the page fails, plain or verified, without counting as a misread
+    shortTransfers = READ_RETRIES + 1;
+    assert(ReadPage(shortPageAddress, page) == 1);
+    assert(shortTransfers == 0);
+    verifyReads = 1;
+    shortTransfers = READ_RETRIES + 1;
+    assert(ReadPage(shortPageAddress, page) == 1);
+    shortTransfers = 1;
+    assert(ReadPage(shortPageAddress, page) == 0);
+    assert(memcmp(page, expected, sizeof(page)) == 0);
+    verifyReads = 0;
+    assert(readFailures == 0);
+
+    // The dump stops at the page instead of writing it
+    struct DumpPlan plan;
+    SimPlan(image, "NZZZ", &plan);
+    shortTransfers = READ_RETRIES + 1;
+    assert(ExecutePlan(&plan, romPath, NULL) == 1);
+    assert(FileMatches(romPath, image, 0x1000));
+
+    // The mount leaves it missing: a read needing it fails, one only reading ahead into it doesn't
+    cartCache.plan.romSize = size;
+    cartCache.pageCount = size / ROM_PAGE_SIZE;
+    cartCache.image = malloc(size);
+    cartCache.present = calloc(cartCache.pageCount, 1);
+    cartCache.presentCount = 0;
+    cartCache.readAhead = CACHE_READ_AHEAD_MIN;
+    cartCache.nextPage = 0xFFFFFFFF;
+    uint8 buffer[ROM_PAGE_SIZE];
+    shortTransfers = READ_RETRIES + 1;
+    assert(CartCacheRead(buffer, ROM_PAGE_SIZE, 0x1000 - ROM_PAGE_SIZE) == ROM_PAGE_SIZE);
+    assert(!cartCache.present[0x1000 / ROM_PAGE_SIZE]);
+    assert(memcmp(buffer, image + 0x1000 - ROM_PAGE_SIZE, ROM_PAGE_SIZE) == 0);
+    shortTransfers = READ_RETRIES + 1;
+    assert(CartCacheRead(buffer, ROM_PAGE_SIZE, 0x1000) == -EIO);
+    assert(CartCacheRead(buffer, ROM_PAGE_SIZE, 0x1000) == ROM_PAGE_SIZE);
+    assert(memcmp(buffer, image + 0x1000, ROM_PAGE_SIZE) == 0);
+    free(cartCache.image);
+    free(cartCache.present);
+    assert(simCart.violations == 0);
+
+    busReadPage = BitBangReadPage;
+    simCart.image = NULL;
+    readRetries = 0;
+    unlink(romPath);
+    free(image);
+
+    printf("ShortTransfers passed.\n\n");
+}
+
+// Dumps the image loaded in the simulated cart, visiting pages stride apart
+// (odd, 1 for a sequential dump; the page count is a power of two).
+// Returns the number of pages that differ from it; failed counts verified
+// reads that gave up (NULL for plain reads).
+uint32 SimDump(uint32 size, uint32 stride, uint8* prefix, uint32* failed)
+{
+    uint16 page[PAGE_WORDS];
+    uint32 wrong = 0;
+    uint32 pages = size / ROM_PAGE_SIZE;
+
+    for(uint32 visit = 0;
+        visit < pages;
+        visit++)
+    {
+        uint32 address = (visit * stride & (pages - 1)) * ROM_PAGE_SIZE;
+        if(failed != NULL)
+        {
+            *failed += ReadPageVerified(CART_ROM_BASE + address, page);
+        }
+        else
+        {
+            ReadPage(CART_ROM_BASE + address, page);
+        }
+
+        int same = 1;
+        for(uint word = 0;
+            word < PAGE_WORDS;
+            word++)
+        {
+            same &= (page[word] == SimCartWord(CART_ROM_BASE + address + word * 2));
+            if(prefix != NULL && address < CHECKSUM_END)
+            {
+                prefix[address + word * 2] = page[word] >> 8;
+                prefix[address + word * 2 + 1] = page[word] & 0xFF;
+            }
+        }
+        wrong += !same;
+    }
+    return wrong;
+}
+
+void test_FaultInjection(void)
+{
+    printf("Testing fault injection...\n");
+
+    uint32 size = 0x200000;
+    uint8* image = GoldenImage(size, 6102, 0);
+    static uint8 prefix[CHECKSUM_END];
+    uint32 failed = 0;
+
+    // Random bit flips corrupt plain reads; verified reads retry them away
+    SimCartLoad(image, size);
+    SimFaultsSeed(1);
+    simFaults.bitFlipPpm = 200;
+    uint32 wrong = SimDump(size, 1, NULL, NULL);
+    uint64 injected = simFaults.injected;
+    assert(wrong > 0);
+
+    SimFaultsSeed(1); // Same seed, same faults
+    simFaults.bitFlipPpm = 200;
+    assert(SimDump(size, 1, NULL, NULL) == wrong && simFaults.injected == injected);
+
+    readRetries = 0;
+    assert(SimDump(size, 1, prefix, &failed) == 0 && failed == 0);
+    assert(readRetries > 0);
+    assert(IdentifyCic(prefix) == 6102);
+
+    // A missed latch leaves the cart where the last page ended, which only
+    // shows when pages aren't read in order; verified reads catch it either way
+    SimFaultsSeed(2);
+    simFaults.missedLatchPpm = 5000;
+    assert(SimDump(size, 1, NULL, NULL) == 0);
+    assert(SimDump(size, 129, NULL, NULL) > 0);
+    assert(SimDump(size, 129, NULL, &failed) == 0 && failed == 0);
+
+    // A strobe shorter than the access time never reads the same twice, so
+    // every page fails instead of dumping garbage
+    SimFaultsSeed(3);
+    simFaults.accessNs = busTiming.strobeNs + 500;
+    assert(SimDump(0x4000, 1, NULL, &failed) == 0x4000 / ROM_PAGE_SIZE && failed == 0x4000 / ROM_PAGE_SIZE);
+    failed = 0;
+    simFaults.accessNs = busTiming.strobeNs - 100;
+    assert(SimDump(size, 1, NULL, &failed) == 0 && failed == 0);
+
+    // A stuck AD line reads back consistently: verified reads pass it, the
+    // header checksum doesn't
+    SimFaultsSeed(4);
+    simFaults.stuckMask = 1u << 5;
+    assert(SimDump(size, 1, prefix, &failed) > 0 && failed == 0);
+    assert(IdentifyCic(prefix) == 0);
+
+    // None of it breaks the bus protocol itself
+    assert(simCart.violations == 0);
+
+    SimFaultsSeed(1);
+    simCart.image = NULL;
+    free(image);
+
+    printf("Fault injection passed.\n\n");
+}
+
+// bus->retime of a backend that can't be reprogrammed
+uint retimeFailures;
+
+int FailingRetime(void)
+{
+    retimeFailures++;
+    return 1;
+}
+
+void test_AdaptiveTiming(void)
+{
+    printf("Testing adaptive timing...\n");
+
+    // The cart's second megabyte needs 700 ns strobes, the rest 250 ns
+    uint32 size = 0x400000;
+    uint8* image = GoldenImage(size, 6102, 0);
+    SimCartLoad(image, size);
+    SimFaultsSeed(9);
+    simFaults.accessNs = 250;
+    simFaults.slowStart = 0x100000;
+    simFaults.slowLength = 0x100000;
+    simFaults.slowAccessNs = 700;
+
+    verifyReads = 1;
+    readFailures = 0;
+    assert(SimDump(size, 1, NULL, NULL) == 0 && readFailures == 0);
+    uint64 fixedNanoseconds = simCart.nanoseconds;
+
+    // Every region settles just above its access time, and every page still
+    // reads right, including the ones that needed a retry on the way
+    simCart.nanoseconds = 0;
+    adaptiveTiming = 1;
+    readRetries = 0;
+    assert(SimDump(size, 1, NULL, NULL) == 0 && readFailures == 0);
+    assert(readRetries > 0);
+
+    uint32 strobes[3];
+    for(uint index = 0;
+        index < 3;
+        index++)
+    {
+        strobes[index] = baseTiming.strobeNs * timingRegions[index].permille / 1000;
+        assert(timingRegions[index].pages >= TIMING_REGION_SIZE / ROM_PAGE_SIZE);
+    }
+    assert(strobes[0] >= 250 && strobes[0] <= 350);
+    assert(strobes[1] >= 700 && strobes[1] <= 800);
+    assert(strobes[2] >= 250 && strobes[2] <= 350);
+    assert(simCart.nanoseconds < fixedNanoseconds * 3 / 4);
+    printf("Settled at %u/%u/%u ns strobes, %.0f%% of the fixed timing's bus time.\n",
+           strobes[0], strobes[1], strobes[2], simCart.nanoseconds * 100.0 / fixedNanoseconds);
+
+    // A backend that can't take a region's timing fails the page instead of reading at a stale one
+    uint16 page[PAGE_WORDS];
+    busRetime = FailingRetime;
+    retimeFailures = 0;
+    timingPermille = 0;
+    assert(ReadPage(CART_ROM_BASE, page) == 1 && retimeFailures == 1);
+    busRetime = NULL;
+
+    adaptiveTiming = 0;
+    verifyReads = 0;
+    SetTimingScale(1000);
+    memset(timingRegions, 0, sizeof(timingRegions));
+    SimFaultsSeed(1);
+    simCart.image = NULL;
+    free(image);
+
+    printf("Adaptive timing passed.\n\n");
+}
+
+void test_Recalibration(void)
+{
+    printf("Testing checkpoint recalibration...\n");
+
+    // The cart's access time creeps up from 500 ns by 1 us per second of bus
+    // time, past the 1000 ns strobe halfway through a plain dump
+    uint32 size = 0x200000;
+    uint32 pages = size / ROM_PAGE_SIZE;
+    uint8* image = GoldenImage(size, 6102, 0);
+    SimCartLoad(image, size);
+    SimFaultsSeed(10);
+    simFaults.accessNs = 500;
+    simFaults.accessDriftNs = 1000;
+    assert(SimDump(size, 1, NULL, NULL) > 0);
+
+    // Checkpointed, every page comes out right; the windows after the drift
+    // passes each strobe are read again slower. Stride 129 stands in for an
+    // access-profile order.
+    uint32* order = malloc(pages * sizeof(uint32));
+    for(uint32 done = 0;
+        done < pages;
+        done++)
+    {
+        order[done] = done * 129 & (pages - 1);
+    }
+    checkpointPages = 64;
+    checkpointWindow = malloc(checkpointPages * sizeof(*checkpointWindow));
+
+    for(uint ordered = 0;
+        ordered < 2;
+        ordered++)
+    {
+        SimCartLoad(image, size);
+        SimFaultsSeed(10);
+        simFaults.accessNs = 500;
+        simFaults.accessDriftNs = 1000;
+        referenceRead = 0;
+        recalibrations = 0;
+
+        uint32 wrong = 0;
+        for(uint32 first = 0;
+            first < pages;
+            first += checkpointPages)
+        {
+            assert(ReadCheckpointWindow(ordered ? order : NULL, first, checkpointPages) == 0);
+            for(uint page = 0;
+                page < checkpointPages;
+                page++)
+            {
+                uint32 index = ordered ? order[first + page] : first + page;
+                for(uint word = 0;
+                    word < PAGE_WORDS;
+                    word++)
+                {
+                    wrong += (checkpointWindow[page][word] != SimCartWord(CART_ROM_BASE + index * ROM_PAGE_SIZE + word * 2));
+                }
+            }
+        }
+
+        assert(wrong == 0 && recalibrations > 0);
+        assert(busTiming.strobeNs > simFaults.accessNs + simCart.nanoseconds * simFaults.accessDriftNs / 1000000000ull);
+        printf("%s: %llu recalibrations, strobe now %u ns.\n", ordered ? "Ordered" : "Linear",
+               (unsigned long long)recalibrations, busTiming.strobeNs);
+
+        baseTiming = (struct BusTiming){ 1000, 1000, 0 };
+        busTiming = baseTiming;
+    }
+
+    // A cart that hangs mid-dump reads all ones; it is reset instead of
+    // slowed down, and the dump resumes at the window it hung in
+    for(uint ordered = 0;
+        ordered < 2;
+        ordered++)
+    {
+        SimCartLoad(image, size);
+        SimFaultsSeed(11);
+        simFaults.hangNs = 300000000;
+        referenceRead = 0;
+        recalibrations = 0;
+        cartResets = 0;
+
+        uint32 wrong = 0;
+        for(uint32 first = 0;
+            first < pages;
+            first += checkpointPages)
+        {
+            assert(ReadCheckpointWindow(ordered ? order : NULL, first, checkpointPages) == 0);
+            for(uint page = 0;
+                page < checkpointPages;
+                page++)
+            {
+                uint32 index = ordered ? order[first + page] : first + page;
+                for(uint word = 0;
+                    word < PAGE_WORDS;
+                    word++)
+                {
+                    wrong += (checkpointWindow[page][word] != SimCartWord(CART_ROM_BASE + index * ROM_PAGE_SIZE + word * 2));
+                }
+            }
+        }
+
+        assert(wrong == 0 && cartResets == 1 && simCart.resets == 1 && recalibrations == 0);
+        assert(simFaults.hangNs == 0 && simCart.violations == 0 && gpio_write[RESET] == HIGH);
+    }
+
+    // A cart that stops answering fails the checkpoint instead of looping
+    SimCartLoad(image, size);
+    SimFaultsSeed(10);
+    referenceRead = 0;
+    assert(ReadCheckpointWindow(NULL, 0, checkpointPages) == 0);
+    simFaults.accessNs = 100000;
+    assert(ReadCheckpointWindow(NULL, checkpointPages, checkpointPages) == 1);
+
+    // So does a backend that can't take the recalibrated timing
+    baseTiming = (struct BusTiming){ 1000, 1000, 0 };
+    busTiming = baseTiming;
+    SimCartLoad(image, size);
+    SimFaultsSeed(10);
+    simFaults.accessNs = 500;
+    simFaults.accessDriftNs = 1000;
+    referenceRead = 0;
+    recalibrations = 0;
+    busRetime = FailingRetime;
+    retimeFailures = 0;
+    uint32 failedAt = 0;
+    while(failedAt < pages && ReadCheckpointWindow(NULL, failedAt, checkpointPages) == 0)
+    {
+        failedAt += checkpointPages;
+    }
+    assert(failedAt < pages && recalibrations == 1 && retimeFailures == 1);
+    busRetime = NULL;
+
+    baseTiming = (struct BusTiming){ 1000, 1000, 0 };
+    busTiming = baseTiming;
+    free(checkpointWindow);
+    checkpointWindow = NULL;
+    checkpointPages = 0;
+    referenceRead = 0;
+    free(order);
+    SimFaultsSeed(1);
+    simCart.image = NULL;
+    free(image);
+
+    printf("Checkpoint recalibration passed.\n\n");
+}
+
+void test_SelfTestBus(void)
+{
+    printf("Testing bus self-test...\n");
+
+    uint32 size = PROBE_STEP;
+    uint8* image = GoldenImage(size, 6102, 0);
+    uint16 suspects;
+
+    // A good cart passes well inside a second of bus time
+    SimCartLoad(image, size);
+    SimFaultsSeed(8);
+    assert(SelfTestBus(&suspects) == 0 && suspects == 0);
+    assert(simCart.nanoseconds < 1000000000ull && simCart.violations == 0);
+    printf("Self-test took %.1f ms of bus time.\n", simCart.nanoseconds / 1e6);
+
+    // Every AD line stuck either way, for address and data or for the
+    // latches alone, fails and is named
+    for(uint line = 0;
+        line < 16;
+        line++)
+    {
+        for(uint level = 0;
+            level < 2;
+            level++)
+        {
+            for(uint latchOnly = 0;
+                latchOnly < 2;
+                latchOnly++)
+            {
+                SimCartLoad(image, size);
+                SimFaultsSeed(8);
+                simFaults.stuckLevels = level ? 0xFFFF : 0;
+                if(latchOnly)
+                {
+                    simFaults.latchStuckMask = 1u << line;
+                }
+                else
+                {
+                    simFaults.stuckMask = 1u << line;
+                }
+                assert(SelfTestBus(&suspects) == 1);
+                assert(suspects == 1u << line);
+            }
+        }
+    }
+
+    // Nothing on the bus
+    SimCartLoad(image, 0);
+    SimFaultsSeed(8);
+    simFaults.stuckMask = 0xFFFF;
+    assert(SelfTestBus(&suspects) == 1 && suspects == 0);
+
+    SimFaultsSeed(1);
+    simCart.image = NULL;
+    free(image);
+
+    printf("Bus self-test passed.\n\n");
+}
+
+// Slot for the daemon tests: the cart in it changes at scheduled bus times,
+// which the header polls and dumps advance
+struct SlotEvent
+{
+  uint64 nanoseconds;
+  const uint8* image; // NULL empties the slot
+  uint16 stuckMask; // AD lines the cart's contacts leave stuck low
+  int fallsShort; // Transfers fall short until the next event
+  int stop; // SIGTERM
+};
+
+const struct SlotEvent* slotEvents;
+uint slotEventCount;
+uint slotEvent;
+uint32 slotImageSize;
+uint slotReads;
+
+int SlotReadPage(uint32 address, uint16* words)
+{
+    while(slotEvent < slotEventCount && simCart.nanoseconds >= slotEvents[slotEvent].nanoseconds)
+    {
+        const struct SlotEvent* event = &slotEvents[slotEvent++];
+        simCart.image = event->image;
+        simCart.imageSize = (event->image != NULL) ? slotImageSize : 0;
+        simFaults.stuckMask = event->stuckMask;
+        daemonStopping |= event->stop;
+    }
+
+    slotReads++;
+    if(slotEvent > 0 && slotEvents[slotEvent - 1].fallsShort)
+    {
+        memset(words, 0, PAGE_WORDS * sizeof(uint16));
+        return 1;
+    }
+    return SimBurstReadPage(address, words);
+}
+
+void SlotLoad(const struct SlotEvent* events, uint count, uint32 imageSize)
+{
+    SimCartLoad(NULL, 0);
+    SimFaultsSeed(1);
+    slotEvents = events;
+    slotEventCount = count;
+    slotEvent = 0;
+    slotImageSize = imageSize;
+    slotReads = 0;
+    busReadPage = SlotReadPage;
+}
+
+// Formats the manifest line ArchiveDump should write for an image (NULL for none)
+void ManifestLine(char* line, size_t size, const uint8* image, uint32 imageSize, uint16 cic, const char* state,
+                  const char* file)
+{
+    uint8 digest[SHA1_SIZE] = { 0 };
+    char text[SHA1_SIZE * 2 + 1];
+    uint32 crc = 0;
+    if(image != NULL)
+    {
+        struct Sha1 sha1;
+        Sha1Init(&sha1);
+        Sha1Update(&sha1, image, imageSize);
+        Sha1Final(&sha1, digest);
+        crc = Crc32Update(0, image, imageSize);
+    }
+    else
+    {
+        imageSize = 0;
+    }
+    for(uint byte = 0;
+        byte < SHA1_SIZE;
+        byte++)
+    {
+        sprintf(text + byte * 2, "%02x", digest[byte]);
+    }
+    snprintf(line, size, "%s %08X %u %u %s %s\n", text, crc, imageSize, cic, state, file);
+}
+
+// Checks the archive directory's manifest, then removes it
+void ExpectManifest(const char* directory, const char* expected)
+{
+    char path[PATH_MAX];
+    size_t length = 0;
+    snprintf(path, sizeof(path), "%s/%s", directory, ARCHIVE_MANIFEST);
+    uint8* manifest = LoadFile(path, &length);
+    assert(manifest != NULL && length == strlen(expected) && memcmp(manifest, expected, length) == 0);
+    free(manifest);
+    unlink(path);
+}
+
+// Checks an archived file's contents, then removes it
+void ExpectArchived(const char* directory, const char* file, const uint8* bytes, size_t length)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", directory, file);
+    assert(FileMatches(path, bytes, length));
+    unlink(path);
+}
+
+void WriteFile(const char* path, const uint8* bytes, size_t length)
+{
+    FILE* file = fopen(path, "wb");
+    assert(file != NULL && fwrite(bytes, 1, length, file) == length);
+    fclose(file);
+}
+
+// Stages an image the way the daemon's dump leaves it (bytes NULL for a
+// dump that never created its file)
+void StageJob(struct ArchiveJob* job, const char* directory, uint serial, const uint8* bytes, uint32 size,
+              const char* name, uint16 cic, int status)
+{
+    memset(job, 0, sizeof(*job));
+    snprintf(job->romPath, sizeof(job->romPath), "%s/.incoming-%u.z64", directory, serial);
+    int saveLength = snprintf(job->savePath, sizeof(job->savePath), "%s.sra", job->romPath);
+    assert(saveLength > 0 && (size_t)saveLength < sizeof(job->savePath));
+    job->saveExtension = "sra";
+    snprintf(job->name, sizeof(job->name), "%s", name);
+    job->cic = cic;
+    job->status = status;
+    if(bytes != NULL)
+    {
+        WriteFile(job->romPath, bytes, size);
+    }
+}
+
+void test_WaitForCart(void)
+{
+    printf("Testing WaitForCart...\n");
+
+    uint32 size = PROBE_STEP;
+    uint8* cart = GoldenImage(size, 6102, 0);
+    uint8* other = GoldenImage(size, 6105, 0);
+    uint64 poll = DAEMON_POLL_US * 1000ull;
+    uint16 expected[PAGE_WORDS];
+    uint16 header[PAGE_WORDS];
+    for(uint word = 0;
+        word < PAGE_WORDS;
+        word++)
+    {
+        expected[word] = (cart[word * 2] << 8) | cart[word * 2 + 1];
+    }
+
+    // A cart sliding in reads another header, then a transfer falls short;
+    // it counts as inserted once its header reads the same twice in a row
+    struct SlotEvent insertion[] = {
+        { 0, NULL, 0, 0, 0 },
+        { 1 * poll, cart, 0, 0, 0 },
+        { 2 * poll, other, 0, 0, 0 },
+        { 3 * poll, cart, 0, 1, 0 },
+        { 4 * poll, cart, 0, 0, 0 }
+    };
+    SlotLoad(insertion, 5, size);
+    assert(WaitForCart(header, 1) == 0);
+    assert(slotReads == 6 && memcmp(header, expected, sizeof(header)) == 0);
+
+    // Removal takes as many reads without the header in a row; a contact
+    // bounce back to it starts over
+    struct SlotEvent removal[] = {
+        { 0, cart, 0, 0, 0 },
+        { 1 * poll, NULL, 0, 0, 0 },
+        { 2 * poll, cart, 0, 0, 0 },
+        { 3 * poll, NULL, 0, 0, 0 }
+    };
+    SlotLoad(removal, 4, size);
+    assert(WaitForCart(header, 0) == 0 && slotReads == 5);
+
+    // Another cart in its place counts as a removal too
+    struct SlotEvent swap[] = {
+        { 0, other, 0, 0, 0 }
+    };
+    SlotLoad(swap, 1, size);
+    assert(WaitForCart(header, 0) == 0 && slotReads == 2);
+
+    // SIGTERM ends either wait
+    struct SlotEvent stop[] = {
+        { 0, cart, 0, 0, 0 },
+        { 1 * poll, cart, 0, 0, 1 }
+    };
+    SlotLoad(stop, 2, size);
+    assert(WaitForCart(header, 0) == 1 && slotReads == 2);
+    assert(WaitForCart(header, 1) == 1 && slotReads == 2);
+
+    daemonStopping = 0;
+    busReadPage = BitBangReadPage;
+    simCart.image = NULL;
+    free(cart);
+    free(other);
+
+    printf("WaitForCart passed.\n\n");
+}
+
+void test_ArchiveDump(void)
+{
+    printf("Testing ArchiveDump...\n");
+
+    uint32 size = PROBE_STEP;
+    uint8* known = GoldenImage(size, 6102, 0);
+    uint8* unknown = GoldenImage(size, 6105, 0);
+    uint8* save = GoldenImage(SRAM_BANK_SIZE, 6102, 0);
+    char directory[] = "/tmp/n64archiveXXXXXX";
+    assert(mkdtemp(directory) != NULL);
+
+    // The DAT knows one of the images by its SHA-1
+    char dat[512];
+    char line[256];
+    ManifestLine(line, sizeof(line), known, size, 6102, "", "");
+    snprintf(dat, sizeof(dat),
+             "<datafile>\n"
+             "<game name=\"Archive/Test (World)\"><rom name=\"a\" size=\"%u\" crc=\"%.8s\" sha1=\"%.40s\"/></game>\n"
+             "</datafile>\n",
+             size, line + SHA1_SIZE * 2 + 1, line);
+    struct StdoutCapture capture;
+    char datPath[32];
+    char indexPath[32];
+    TempFile(dat, strlen(dat), datPath);
+    TempFile("", 0, indexPath);
+    char* dats[] = { datPath };
+    StdoutCapture(&capture);
+    assert(CompileDatIndex(indexPath, dats, 1) == 0);
+    StdoutRelease(&capture);
+    assert(LoadDatIndex(indexPath, 1) == 0);
+
+    archiver.directory = directory;
+    archiver.stopping = 0;
+    assert(pthread_create(&archiver.thread, NULL, ArchiverThread, NULL) == 0);
+
+    // One job per manifest state, queued while the previous one archives. The
+    // same dump twice gets a suffix; '/' can't be in a file name
+    struct ArchiveJob job;
+    StageJob(&job, directory, 0, known, size, "KNOWN-00000000", 6102, 0);
+    WriteFile(job.savePath, save, SRAM_BANK_SIZE);
+    QueueArchive(&job);
+    StageJob(&job, directory, 1, known, size, "KNOWN-00000000", 6102, 0);
+    QueueArchive(&job);
+    StageJob(&job, directory, 2, unknown, size, "UNKNOWN-12345678", 6105, 0);
+    QueueArchive(&job);
+    StageJob(&job, directory, 3, unknown, size, "CORRUPT-12345678", 0, 0);
+    QueueArchive(&job);
+    StageJob(&job, directory, 4, unknown, size, "SHORT-12345678", 6105, 1);
+    QueueArchive(&job);
+
+    // A cart that failed its self-test has nothing staged; a dump that failed
+    // before creating its file is logged the same way
+    StageJob(&job, directory, 5, NULL, 0, "UNTESTED-12345678", 0, 1);
+    job.romPath[0] = '\0';
+    job.savePath[0] = '\0';
+    QueueArchive(&job);
+    StageJob(&job, directory, 6, NULL, 0, "UNOPENED-12345678", 6102, 1);
+    QueueArchive(&job);
+
+    // The last job queued is still archived on stopping
+    pthread_mutex_lock(&archiver.lock);
+    archiver.stopping = 1;
+    pthread_cond_broadcast(&archiver.changed);
+    pthread_mutex_unlock(&archiver.lock);
+    assert(pthread_join(archiver.thread, NULL) == 0);
+    assert(!archiver.pending);
+
+    char expected[2048] = "";
+    static const struct
+    {
+        int known;
+        uint16 cic;
+        const char* state;
+        const char* file;
+    } lines[] = {
+        { 1, 6102, "verified", "Archive_Test (World).z64" },
+        { 1, 6102, "verified", "Archive_Test (World) (2).z64" },
+        { 0, 6105, "unknown", "UNKNOWN-12345678.z64" },
+        { 0, 0, "bad-checksum", "CORRUPT-12345678.z64" },
+        { 0, 6105, "failed", "SHORT-12345678 (failed).z64" },
+        { -1, 0, "failed", "-" },
+        { -1, 6102, "failed", "-" }
+    };
+    for(uint index = 0;
+        index < sizeof(lines) / sizeof(lines[0]);
+        index++)
+    {
+        const uint8* image = (lines[index].known < 0) ? NULL : lines[index].known ? known : unknown;
+        ManifestLine(line, sizeof(line), image, size, lines[index].cic, lines[index].state, lines[index].file);
+        strcat(expected, line);
+        if(image != NULL)
+        {
+            ExpectArchived(directory, lines[index].file, image, size);
+        }
+    }
+    ExpectManifest(directory, expected);
+
+    // The save went with the first copy; nothing is left staged
+    ExpectArchived(directory, "Archive_Test (World).sra", save, SRAM_BANK_SIZE);
+    assert(rmdir(directory) == 0);
+
+    munmap((void*)datIndex.header, datIndex.size);
+    memset(&datIndex, 0, sizeof(datIndex));
+    unlink(datPath);
+    unlink(indexPath);
+    free(known);
+    free(unknown);
+    free(save);
+
+    printf("ArchiveDump passed.\n\n");
+}
+
+void test_Daemon(void)
+{
+    printf("Testing Daemon...\n");
+
+    uint32 size = 0x200000;
+    uint8* image = GoldenImage(size, 6102, 0);
+    uint64 second = 1000000000ull;
+    char directory[] = "/tmp/n64daemonXXXXXX";
+    assert(mkdtemp(directory) != NULL);
+
+    uint16 header[PAGE_WORDS];
+    char name[64];
+    for(uint word = 0;
+        word < PAGE_WORDS;
+        word++)
+    {
+        header[word] = (image[word * 2] << 8) | image[word * 2 + 1];
+    }
+    HeaderName(header, name, sizeof(name));
+
+    // The same cart twice, then with AD3 stuck low, which fails its
+    // self-test; each stays in well past its dump and SIGTERM comes with the
+    // slot empty
+    struct SlotEvent events[] = {
+        { 0, NULL, 0, 0, 0 },
+        { 1 * second, image, 0, 0, 0 },
+        { 10 * second, NULL, 0, 0, 0 },
+        { 12 * second, image, 0, 0, 0 },
+        { 20 * second, NULL, 0, 0, 0 },
+        { 22 * second, image, 1u << 3, 0, 0 },
+        { 30 * second, NULL, 0, 0, 0 },
+        { 32 * second, NULL, 0, 0, 1 }
+    };
+    SlotLoad(events, sizeof(events) / sizeof(events[0]), size);
+    archiver.stopping = 0;
+    assert(RunDaemon(directory, NULL, 1) == 0);
+    assert(slotEvent == sizeof(events) / sizeof(events[0]));
+
+    // Both dumps are filed under the header name, the second with a suffix,
+    // and the cart that failed its self-test is logged with no file
+    char expected[512];
+    char line[256];
+    char file[80];
+    snprintf(file, sizeof(file), "%s.z64", name);
+    ManifestLine(expected, sizeof(expected), image, size, 6102, "unknown", file);
+    ExpectArchived(directory, file, image, size);
+    snprintf(file, sizeof(file), "%s (2).z64", name);
+    ManifestLine(line, sizeof(line), image, size, 6102, "unknown", file);
+    strcat(expected, line);
+    ExpectArchived(directory, file, image, size);
+    ManifestLine(line, sizeof(line), NULL, 0, 0, "failed", "-");
+    strcat(expected, line);
+    ExpectManifest(directory, expected);
+    assert(rmdir(directory) == 0);
+
+    daemonStopping = 0;
+    busReadPage = BitBangReadPage;
+    simCart.image = NULL;
+    SimFaultsSeed(1);
+    free(image);
+
+    printf("Daemon passed.\n\n");
+}
+
+void test_MajorityVote(void)
+{
+    printf("Testing majority vote...\n");
+
+    // Against a plain per-bit count, for every odd number of reads
+    static uint16 reads[MAJORITY_MAX_READS][PAGE_WORDS];
+    uint16 voted[PAGE_WORDS];
+    uint64 disagreements[16];
+    SimFaultsSeed(6);
+    for(uint read = 0;
+        read < MAJORITY_MAX_READS;
+        read++)
+    {
+        for(uint word = 0;
+            word < PAGE_WORDS;
+            word++)
+        {
+            reads[read][word] = SimFaultsRandom();
+        }
+    }
+    for(uint count = 1;
+        count <= MAJORITY_MAX_READS;
+        count += 2)
+    {
+        memset(disagreements, 0, sizeof(disagreements));
+        MajorityVote(reads, count, voted, disagreements);
+
+        uint64 lost = 0;
+        for(uint word = 0;
+            word < PAGE_WORDS;
+            word++)
+        {
+            for(uint bit = 0;
+                bit < 16;
+                bit++)
+            {
+                uint set = 0;
+                for(uint read = 0;
+                    read < count;
+                    read++)
+                {
+                    set += (reads[read][word] >> bit) & 0x1;
+                }
+                assert(((voted[word] >> bit) & 0x1) == (set > count / 2));
+                lost += (set > count / 2) ? count - set : set;
+            }
+        }
+
+        uint64 counted = 0;
+        for(uint line = 0;
+            line < 16;
+            line++)
+        {
+            counted += disagreements[line];
+        }
+        assert(counted == lost);
+    }
+
+    // A cart with a marginal AD11: single-bit errors so frequent that no two
+    // reads of a page agree. Verified reads give up, the vote recovers every
+    // page and blames AD11 alone.
+    uint32 size = 0x40000;
+    uint8* image = GoldenImage(size, 6102, 0);
+    uint32 failed = 0;
+    SimCartLoad(image, size);
+    SimFaultsSeed(7);
+    simFaults.bitFlipPpm = 30000;
+    simFaults.bitFlipLines = 1u << 11;
+    assert(SimDump(size, 1, NULL, &failed) > 0 && failed > 0);
+
+    failed = 0;
+    majorityReads = MAJORITY_MAX_READS;
+    majorityPages = 0;
+    memset(lineDisagreements, 0, sizeof(lineDisagreements));
+    assert(SimDump(size, 1, NULL, &failed) == 0 && failed == 0);
+    assert(majorityPages > 0);
+    for(uint line = 0;
+        line < 16;
+        line++)
+    {
+        assert((lineDisagreements[line] != 0) == (line == 11));
+    }
+    printf("Voted %llu pages, AD11 lost %llu votes.\n", (unsigned long long)majorityPages,
+           (unsigned long long)lineDisagreements[11]);
+
+    majorityReads = 0;
+    SimFaultsSeed(1);
+    simCart.image = NULL;
+    free(image);
+
+    printf("Majority vote passed.\n\n");
+}
+
+void test_BusTrace(void)
+{
+    printf("Testing bus trace...\n");
+
+    uint32 size = 0x400000;
+    uint8* image = GoldenImage(size, 6102, 0);
+    uint16 page[PAGE_WORDS];
+    SimCartLoad(image, size);
+
+    // Only the page in range is traced: latches, turnaround, three events per word, turnaround
+    uint64 perPage = 4 + 4 + 1 + 3 * PAGE_WORDS + 1;
+    busTrace.events = calloc(BUS_TRACE_EVENTS, sizeof(struct BusTraceEvent));
+    busTrace.path = "TRACE_ROM_dumper_16MB.vcd";
+    busTrace.rangeStart = CART_ROM_BASE + 0x400;
+    busTrace.rangeLength = ROM_PAGE_SIZE;
+    ReadPage(CART_ROM_BASE, page);
+    assert(busTrace.head == 0);
+    ReadPage(CART_ROM_BASE + 0x400, page);
+    assert(busTrace.head == perPage);
+    ReadPage(CART_ROM_BASE + 0x600, page);
+    assert(busTrace.head == perPage);
+
+    // Paused (SIGUSR1) from the next page on
+    BusTraceToggle(0);
+    ReadPage(CART_ROM_BASE + 0x400, page);
+    assert(busTrace.head == perPage);
+    BusTraceToggle(0);
+    assert(WriteBusTrace() == 0 && busTrace.events == NULL);
+
+    // Replaying the VCD: READ strobes the page's words out in order, with AD
+    // driven by the cart, and time never runs backwards
+    FILE* vcd = fopen("TRACE_ROM_dumper_16MB.vcd", "r");
+    assert(vcd != NULL);
+    char line[64];
+    uint64 time = 0;
+    uint16 ad = 0;
+    uint adDriven = 1;
+    uint strobes = 0;
+    int strobing = 0;
+    while(fgets(line, sizeof(line), vcd) != NULL)
+    {
+        unsigned long long stamp;
+        char bits[17];
+        if(sscanf(line, "#%llu", &stamp) == 1)
+        {
+            assert(stamp >= time);
+            time = stamp;
+        }
+        else if(sscanf(line, "b%16s '", bits) == 1)
+        {
+            ad = strtoul(bits, NULL, 2);
+        }
+        else if(strcmp(line, "0&\n") == 0 || strcmp(line, "1&\n") == 0)
+        {
+            adDriven = line[0] - '0';
+        }
+        else if(strcmp(line, "0#\n") == 0)
+        {
+            strobing = 1;
+        }
+        else if(strcmp(line, "1#\n") == 0 && strobing)
+        {
+            assert(!adDriven && ad == SimCartWord(CART_ROM_BASE + 0x400 + strobes * 2));
+            strobes++;
+        }
+    }
+    fclose(vcd);
+    remove("TRACE_ROM_dumper_16MB.vcd");
+    assert(strobes == PAGE_WORDS);
+
+    // A full ring keeps the most recent events
+    busTrace.events = calloc(BUS_TRACE_EVENTS, sizeof(struct BusTraceEvent));
+    busTrace.head = 0;
+    busTrace.rangeStart = 0;
+    busTrace.rangeLength = UINT32_MAX;
+    for(uint32 address = 0;
+        address < 6 * ROM_PAGE_SIZE;
+        address += ROM_PAGE_SIZE)
+    {
+        ReadPage(CART_ROM_BASE + address, page);
+    }
+    assert(busTrace.head == 6 * perPage && busTrace.head > BUS_TRACE_EVENTS);
+    uint64 oldest = busTrace.events[(busTrace.head - BUS_TRACE_EVENTS) & (BUS_TRACE_EVENTS - 1)].nanoseconds;
+    assert(WriteBusTrace() == 0);
+
+    vcd = fopen("TRACE_ROM_dumper_16MB.vcd", "r");
+    unsigned long long stamp = 0;
+    while(fgets(line, sizeof(line), vcd) != NULL && sscanf(line, "#%llu", &stamp) != 1)
+    {
+    }
+    fclose(vcd);
+    remove("TRACE_ROM_dumper_16MB.vcd");
+    assert(stamp == oldest);
+    assert(simCart.violations == 0);
+
+    busTrace.head = 0;
+    simCart.image = NULL;
+    free(image);
+
+    printf("Bus trace passed.\n\n");
+}
+
+// Records reads of a few pages of the loaded image as a bus record and loads it back.
+uint8* RecordPages(const uint32* addresses, uint count, size_t* length)
+{
+    uint16 page[PAGE_WORDS];
+    busTrace.events = calloc(BUS_TRACE_EVENTS, sizeof(struct BusTraceEvent));
+    busTrace.head = 0;
+    busTrace.path = NULL;
+    busTrace.recordPath = "RECORD_ROM_dumper_16MB.ntr";
+    busTrace.rangeStart = 0;
+    busTrace.rangeLength = UINT32_MAX;
+    for(uint address = 0;
+        address < count;
+        address++)
+    {
+        ReadPage(CART_ROM_BASE + addresses[address], page);
+    }
+    assert(WriteBusTrace() == 0);
+    busTrace.recordPath = NULL;
+
+    uint8* record = LoadFile("RECORD_ROM_dumper_16MB.ntr", length);
+    remove("RECORD_ROM_dumper_16MB.ntr");
+    assert(record != NULL);
+    return record;
+}
+
+void test_BusReplay(void)
+{
+    printf("Testing bus replay...\n");
+
+    uint32 size = 0x400000;
+    uint8* image = GoldenImage(size, 6102, 0);
+    static const uint32 addresses[] = { 0x0, 0x200, 0x10000 };
+    uint pages = sizeof(addresses) / sizeof(addresses[0]);
+    uint64 perPage = 4 + 4 + 1 + 3 * PAGE_WORDS + 1;
+    struct BusReplay replay;
+    size_t length;
+
+    // A clean recording replays without a single divergence, in about 4 bytes an event
+    SimCartLoad(image, size);
+    uint8* record = RecordPages(addresses, pages, &length);
+    assert(length < sizeof(struct BusRecordHeader) + pages * perPage * 5);
+    SimCartLoad(image, size);
+    assert(ReplayBusRecord(record, length, NULL, &replay) == 0);
+    assert(replay.events == pages * perPage && replay.strobes == pages * PAGE_WORDS);
+    assert(replay.divergences == 0 && simCart.violations == 0);
+
+    // Against a reference that differs in one word, exactly that strobe diverges
+    image[0x10000 + 0x42] ^= 0x81;
+    SimCartLoad(image, size);
+    assert(ReplayBusRecord(record, length, stdout, &replay) == 0);
+    assert(replay.divergences == 1);
+    assert(replay.lineErrors[8] == 1 && replay.lineErrors[15] == 1 && replay.lineErrors[0] == 0);
+    image[0x10000 + 0x42] ^= 0x81;
+    free(record);
+
+    // Bit flips on the rig show up as one divergence per flipped sample
+    SimCartLoad(image, size);
+    SimFaultsSeed(5);
+    simFaults.bitFlipPpm = 20000;
+    record = RecordPages(addresses, pages, &length);
+    uint64 injected = simFaults.injected;
+    SimFaultsSeed(1);
+    SimCartLoad(image, size);
+    assert(ReplayBusRecord(record, length, NULL, &replay) == 0);
+    assert(injected > 0 && replay.divergences == injected);
+
+    // A truncated record is rejected
+    assert(ReplayBusRecord(record, length - 2, NULL, &replay) == 1);
+    free(record);
+
+    simCart.image = NULL;
+    free(image);
+
+    printf("Bus replay passed.\n\n");
+}
+
+void test_MainLoop(void)
+{
+    printf("Testing main ROM dumping loop...\n");
+
+    // A complete simulated 16 Mb dump through the bit-banged read path
+    uint32 romSize = 0x1000000;
+    uint8* image = malloc(romSize);
+    for(uint32 offset = 0;
+        offset < romSize;
+        offset++)
+    {
+        image[offset] = (offset * 2654435761u) >> 24 ^ (offset >> 9);
+    }
+    SimCartLoad(image, romSize);
+
+    uint16 page[PAGE_WORDS];
+    uint64 lastPageStart = 0;
+    for(uint32 address = 0;
+        address < romSize;
+        address += ROM_PAGE_SIZE)
+    {
+        lastPageStart = trace.count;
+        ReadPage(CART_ROM_BASE + address, page);
+
+        for(uint word = 0;
+            word < PAGE_WORDS;
+            word++)
+        {
+            assert(page[word] == ((image[address + word * 2] << 8) | image[address + word * 2 + 1]));
+        }
+    }
+
+    // Whole-run protocol: two latches per page, one strobe and one sample per word
+    uint64 pages = romSize / ROM_PAGE_SIZE;
+    uint64 words = romSize / 2;
+    assert(simCart.violations == 0);
+    assert(simCart.latches == 2 * pages);
+    assert(simCart.strobes == words);
+    assert(trace.counts[TraceReadBits] == words);
+    assert(trace.counts[TraceWrite] == 4 * pages + 2 * words);
+    assert(trace.counts[TraceSetMode] == 32 * pages);
+    assert(simCart.nanoseconds == 2 * pages * busTiming.latchNs + words * (busTiming.strobeNs + busTiming.recoveryNs));
+
+    // Last page in detail: both latches pulse before AD turns around, then READ strobes
+    static const uint pulse[2] = { HIGH, LOW };
+    static const uint strobe[2] = { LOW, HIGH };
+    uint64 index = TraceExpectWrites(lastPageStart, ALE_L, pulse, 2);
+    index = TraceExpectWrites(index, ALE_H, pulse, 2);
+    uint64 turnaround = TraceFind(index, TraceSetMode, AD_BUS + 15);
+    assert(TraceEventAt(turnaround)->value == PI_INPUT);
+    assert(TraceFind(lastPageStart, TraceWrite, READ) > turnaround);
+    for(uint word = 0;
+        word < PAGE_WORDS;
+        word++)
+    {
+        index = TraceExpectWrites(index, READ, strobe, 2);
+    }
+    assert(TraceFind(index, TraceWrite, READ) == trace.count);
+    assert(TraceEventAt(trace.count - 1)->type == TraceSetMode && TraceEventAt(trace.count - 1)->value == PI_OUTPUT);
+
+    printf("Dumped 0x%X bytes in %llu mock calls.\n", romSize, (unsigned long long)trace.count);
+
+    simCart.image = NULL;
+    free(image);
+
+    printf("Main loop test passed.\n");
+}
+
+int main(int argc, char** argv)
+{
+    if(argc == 4 && strcmp(argv[1], "--replay") == 0)
+    {
+        return ReplayMain(argv[2], argv[3]);
+    }
+
     freopen("OUTPUT_ROM_dumper_16MB.txt", "w", stdout);
+    signal(SIGABRT, TraceOnAbort);
 
     test_SetADBusPinsMode();
+    test_GpioRegisters();
+    test_BuildAddressMasks();
     test_SetAddress();
     test_LatchAddress();
+    test_ReadPage();
+    test_FingerprintSampleAddress();
+    test_DatTitleRevision();
+    test_Sha1();
+    test_HeaderName();
+    test_BuildPerfectHash();
+    test_WaveSamples();
+    test_SmiReadBurst();
+    test_GatherDataBus();
+    test_LoadPinMap();
+    test_CartCacheRead();
+    test_SharedImage();
+    test_GoldenImages();
+    test_VerifyAgainst();
+    test_IdentifyCart();
+    test_DatIndex();
+    test_DumpPlan();
+    test_ShortTransfers();
+    test_RomMapping();
+    test_AccessProfile();
+    test_FaultInjection();
+    test_SelfTestBus();
+    test_WaitForCart();
+    test_ArchiveDump();
+    test_Daemon();
+    test_MajorityVote();
+    test_AdaptiveTiming();
+    test_Recalibration();
+    test_BusTrace();
+    test_BusReplay();
     test_MainLoop();
 
     printf("All tests passed.\n");